@@ -0,0 +1,169 @@
+#!/usr/bin/env python3
+"""clib's git clone strategies against a file:// repository.
+
+Builds a fixture repository with uploadpack.allowFilter on (as GitHub has it):
+declared src/ and include/ files, undeclared docs/ and examples/ trees and a
+history that rewrote the docs several times. A library json pointing at it is
+served by the registry stand-in, and clib's libmanager installs it once per
+strategy (KPM_CLONE_STRATEGY) into an empty git cache, recording the objects
+that came over and the files checked out. The sparse checkout must hold the
+top-level files and the declared paths and nothing else.
+
+Then, with the sparse strategy's cache warm, it reinstalls with nothing new
+upstream (no objects should come over) and after one commit that changed one
+declared file (only that commit, its trees and the one blob should).
+"""
+import argparse
+import json
+import os
+import shutil
+import subprocess
+import sys
+import tempfile
+import time
+
+import e2e
+
+STRATEGIES = ["full", "shallow", "partial", "sparse"]
+DECLARED = 8
+UNDECLARED = 40
+HISTORY = 8
+
+
+def git(repo, *args):
+    return subprocess.run(["git", "-C", repo] + list(args), check=True, capture_output=True, text=True).stdout
+
+
+def commit(repo, message):
+    git(repo, "add", "-A")
+    git(repo, "-c", "user.name=bench", "-c", "user.email=bench@example.com", "commit", "-q", "-m", message)
+
+
+def make_upstream(path):
+    os.makedirs(path)
+    git(path, "init", "-q", "-b", "main")
+    git(path, "config", "uploadpack.allowFilter", "true")
+    for name in ("README.md", "LICENSE", "makefile"):
+        e2e.fill(os.path.join(path, name), lambda n: "%s line %d\n" % (name, n), 512)
+    declared = []
+    for i in range(DECLARED):
+        src = "src/lib_%d.c" % i
+        header = "include/lib_%d.h" % i
+        e2e.fill(os.path.join(path, src), lambda n: "int lib_%d_value%d = %d;\n" % (i, n, n), 2048)
+        e2e.fill(os.path.join(path, header), lambda n: "extern int lib_%d_value%d;\n" % (i, n), 1024)
+        declared += [src, header]
+    for revision in range(HISTORY):
+        for i in range(UNDECLARED):
+            e2e.fill(os.path.join(path, "docs", "page_%d.md" % i),
+                     lambda n: "revision %d of page %d, line %d\n" % (revision, i, n), 16 * 1024)
+            e2e.fill(os.path.join(path, "examples", "example_%d.c" % i),
+                     lambda n: "int example_%d_%d_%d;\n" % (revision, i, n), 8 * 1024)
+        commit(path, "revision %d" % revision)
+    return declared
+
+
+# Every object the repository has, each once however many packs hold it
+def objects(repo):
+    return set(git(repo, "cat-file", "--batch-all-objects", "--batch-check=%(objecttype) %(objectname)").splitlines())
+
+
+def cached_repo(cache_dir):
+    git_dir = os.path.join(cache_dir, "git")
+    repos = [name for name in os.listdir(git_dir) if name.endswith(".git")] if os.path.isdir(git_dir) else []
+    if len(repos) != 1:
+        raise SystemExit("Expected one cached repository in %s, found %s" % (git_dir, repos))
+    return os.path.join(git_dir, repos[0])
+
+
+def checked_out(clone_dir):
+    found = set()
+    for root, dirs, files in os.walk(clone_dir):
+        dirs[:] = [d for d in dirs if d != ".git"]
+        for name in files:
+            if name != ".git":
+                found.add(os.path.relpath(os.path.join(root, name), clone_dir))
+    return found
+
+
+def install(libmanager, name, env, work_dir, strategy, cache_dir):
+    run_dir = tempfile.mkdtemp(dir=work_dir)
+    env = dict(env, KPM_CLONE_STRATEGY=strategy, KPM_CACHE_DIR=cache_dir)
+    before = objects(cached_repo(cache_dir)) if os.path.isdir(os.path.join(cache_dir, "git")) else set()
+    start = time.perf_counter()
+    result = subprocess.run([libmanager, name], cwd=run_dir, env=env, capture_output=True, text=True)
+    elapsed = (time.perf_counter() - start) * 1000
+    if result.returncode != 0 or "Cloning failed" in result.stdout or "failed" in result.stderr:
+        sys.stderr.write(result.stdout + result.stderr)
+        raise SystemExit("libmanager %s failed (%s)" % (name, strategy))
+    fetched = objects(cached_repo(cache_dir)) - before
+    return elapsed, len(fetched)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("--libmanager", default=os.path.join(e2e.BENCH_DIR, "libmanager"))
+    args = parser.parse_args()
+    libmanager = os.path.abspath(args.libmanager)
+    # libmanager always clones into /tmp/libmanager/<name>, a name of our own keeps other runs out of the way
+    name = "kpm-clone-bench-%d" % os.getpid()
+    clone_dir = os.path.join("/tmp/libmanager", name)
+
+    with tempfile.TemporaryDirectory(prefix="kpm-clone-") as work_dir:
+        upstream = os.path.join(work_dir, "upstream")
+        declared = make_upstream(upstream)
+        total = len(git(upstream, "rev-list", "--objects", "--all").splitlines())
+        root = os.path.join(work_dir, "registry")
+        os.makedirs(os.path.join(root, "libs"))
+        with open(os.path.join(root, "libs", "%s.json" % name), "w") as f:
+            json.dump({"name": name, "git_url": "file://" + upstream, "src_paths": declared[0::2],
+                       "header_paths": declared[1::2]}, f, indent=4)
+        registry = e2e.Registry(root)
+        runs = []
+        try:
+            env = dict(os.environ, KPM_REGISTRY_URL=registry.url)
+            env.pop("KPM_REGISTRY_MIRRORS", None)
+            env.pop("KPM_PROXY", None)
+            env.pop("KPM_GIT_CACHE", None)
+            for strategy in STRATEGIES:
+                elapsed, fetched = install(libmanager, name, env, work_dir, strategy,
+                                           os.path.join(work_dir, "cache-%s" % strategy))
+                runs.append(("cold " + strategy, elapsed, fetched, len(checked_out(clone_dir))))
+            sparse_files = checked_out(clone_dir)
+
+            sparse_cache = os.path.join(work_dir, "cache-sparse")
+            elapsed, fetched = install(libmanager, name, env, work_dir, "sparse", sparse_cache)
+            runs.append(("warm sparse", elapsed, fetched, len(checked_out(clone_dir))))
+
+            changed = os.path.join(upstream, declared[0])
+            with open(changed, "a") as f:
+                f.write("int changed_upstream = 1;\n")
+            commit(upstream, "one declared file changed")
+            elapsed, fetched = install(libmanager, name, env, work_dir, "sparse", sparse_cache)
+            runs.append(("one-commit", elapsed, fetched, len(checked_out(clone_dir))))
+            with open(os.path.join(clone_dir, declared[0])) as f:
+                updated = "changed_upstream" in f.read()
+        finally:
+            registry.close()
+            # Worktrees of the caches, which went with work_dir
+            shutil.rmtree(clone_dir, ignore_errors=True)
+
+    print("upstream: %d objects, %d declared files" % (total, len(declared)))
+    print("%-14s %10s %9s %7s" % ("run", "ms", "objects", "files"))
+    for label, elapsed, fetched, files in runs:
+        print("%-14s %10.2f %9d %7d" % (label, elapsed, fetched, files))
+    expected = set(declared) | {"README.md", "LICENSE", "makefile"}
+    if sparse_files != expected:
+        raise SystemExit("Sparse checkout differs, extra: %s, missing: %s"
+                         % (sorted(sparse_files - expected), sorted(expected - sparse_files)))
+    cold = dict((label, fetched) for label, _, fetched, _ in runs)
+    if not cold["cold sparse"] < cold["cold partial"] < cold["cold full"]:
+        raise SystemExit("Expected sparse to fetch less than partial and partial less than full")
+    if runs[-2][2] != 0:
+        raise SystemExit("Expected the warm reinstall to fetch nothing")
+    # The commit, the root, src/ trees and the one changed blob
+    if runs[-1][2] > 4 or not updated:
+        raise SystemExit("Expected the reinstall after one commit to fetch only that commit's objects")
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,333 @@
+#!/usr/bin/env python3
+"""End-to-end kpm benchmarks against a local registry stand-in.
+
+Runs `kpm init` for every fixture language and `kpm install` for small,
+medium and large libraries, non-interactively, and reports p50/p95 wall time,
+p50 CPU time (recorded, not compared), request counts and bytes transferred
+per scenario. One extra run per scenario
+under KPM_ALLOC_PROFILE=1 records heap bytes allocated and peak live heap.
+Results are compared with baseline.json; request and byte counts must match,
+timings may drift by --tolerance and memory by --memory-tolerance before the
+run fails.
+
+With --local kpm reads the registry directory itself (file://), skipping HTTP
+entirely; request and byte counts then come from kpm --stats and results are
+compared with baseline-local.json.
+
+With --proxy kpm goes through a `kpm proxy` in front of the stand-in; request
+and byte counts are what reached the stand-in, so once the proxy is warm they
+drop to zero. Compared with baseline-proxy.json.
+"""
+import argparse
+import json
+import os
+import re
+import resource
+import shutil
+import subprocess
+import sys
+import tempfile
+import time
+import urllib.request
+
+BENCH_DIR = os.path.dirname(os.path.abspath(__file__))
+
+# name, number of source files, bytes per file
+LIBRARIES = [("small", 2, 1024), ("medium", 20, 8 * 1024), ("large", 200, 16 * 1024)]
+
+INIT_LANGUAGES = ["c", "py", "go"]
+
+ALLOC_SUMMARY = re.compile(r"^alloc-profile: allocations=(\d+) bytes=(\d+) peak=(\d+)$", re.M)
+STATS_SAMPLE = re.compile(r"^(kpm_\w+)_total\{[^}]*\} (\d+)$", re.M)
+
+
+def init_answers(lang):
+    answers = [
+        "bench_project",  # name
+        "Benchmark project",  # description
+        "bench",  # author
+        "",  # license (MIT)
+        "",  # version
+        lang,
+        "",  # dependencies
+        "yes",  # README
+        "no",  # git
+        "yes",  # LICENSE
+    ]
+    if lang == "c":
+        answers.append("0")  # first build system
+    return "\n".join(answers) + "\n"
+
+
+def fill(path, line, size):
+    os.makedirs(os.path.dirname(path), exist_ok=True)
+    with open(path, "w") as f:
+        written = 0
+        n = 0
+        while written < size:
+            text = line(n)
+            f.write(text)
+            written += len(text)
+            n += 1
+
+
+def make_registry(work_dir, local=False, kpm=None):
+    registry = os.path.join(work_dir, "registry")
+    # The HTTP stand-in fills in ${registry} itself, a directory registry has to be written with it
+    base_url = "file://" + registry if local else "${registry}"
+    shutil.copytree(os.path.join(BENCH_DIR, "registry"), registry)
+    for name, file_count, file_size in LIBRARIES:
+        lib_dir = os.path.join(registry, "libs", name)
+        src_paths = []
+        header_paths = []
+        for i in range(file_count):
+            src = "src/%s_%d.c" % (name, i)
+            header = "include/%s_%d.h" % (name, i)
+            fill(os.path.join(lib_dir, "files", src), lambda n: "int %s_%d_value%d = %d;\n" % (name, i, n, n), file_size)
+            fill(os.path.join(lib_dir, "files", header), lambda n: "extern int %s_%d_value%d;\n" % (name, i, n), file_size // 2)
+            src_paths.append(src)
+            header_paths.append(header)
+        lib_json = {
+            "name": name,
+            "git_url": "https://example.com/%s.git" % name,
+            "raw_path": "%s/libs/%s/files/" % (base_url, name),
+            "has_headers": True,
+            "is_prebuilt": False,
+            "description": "%s benchmark library" % name,
+            "author": "bench",
+            "license": "MIT",
+            "added_by": "bench",
+            "src_paths": src_paths,
+            "header_paths": header_paths,
+            "keywords": ["bench"],
+        }
+        with open(os.path.join(lib_dir, "%s.json" % name), "w") as f:
+            json.dump(lib_json, f, indent=4)
+    # Pack each template the way a registry would publish it, so init is index + bundle
+    if kpm is not None:
+        for lang in INIT_LANGUAGES:
+            subprocess.run([kpm, "template", "bundle", os.path.join(registry, "langs"), lang, "--index"],
+                           check=True, stdout=subprocess.DEVNULL)
+    return registry
+
+
+class Registry:
+    def __init__(self, root):
+        self.proc = subprocess.Popen([sys.executable, os.path.join(BENCH_DIR, "registry_server.py"), root],
+                                     stdout=subprocess.PIPE, text=True)
+        self.port = int(self.proc.stdout.readline())
+        self.url = "http://127.0.0.1:%d" % self.port
+
+    def call(self, path):
+        with urllib.request.urlopen(self.url + path) as response:
+            return json.loads(response.read())
+
+    def stats_args(self, run_dir):
+        return []
+
+    def reset(self):
+        self.call("/__reset")
+
+    def snapshot(self, run_dir):
+        return self.call("/__stats")
+
+    def close(self):
+        self.proc.terminate()
+        self.proc.wait()
+
+
+class Proxy:
+    """kpm proxy in front of the registry stand-in, with its store in the work directory."""
+
+    def __init__(self, kpm, work_dir):
+        self.proc = subprocess.Popen([kpm, "proxy", "--port", "0", "--dir", os.path.join(work_dir, "proxy")],
+                                     stdout=subprocess.PIPE, text=True)
+        line = ""
+        while " on http://" not in line:
+            line = self.proc.stdout.readline()
+            if not line:
+                raise SystemExit("kpm proxy did not start")
+        self.url = line.strip().rsplit(" on ", 1)[1]
+
+    def close(self):
+        self.proc.terminate()
+        self.proc.wait()
+
+
+class LocalRegistry:
+    """The registry directory read directly by kpm, counted by kpm --stats."""
+
+    def __init__(self, root):
+        self.url = "file://" + root
+
+    def stats_args(self, run_dir):
+        return ["--stats=%s" % os.path.join(run_dir, "stats.prom")]
+
+    def reset(self):
+        pass
+
+    def snapshot(self, run_dir):
+        with open(os.path.join(run_dir, "stats.prom")) as f:
+            samples = dict((name, int(value)) for name, value in STATS_SAMPLE.findall(f.read()))
+        return {"requests": samples["kpm_requests"], "bytes": samples["kpm_downloaded_bytes"]}
+
+    def close(self):
+        pass
+
+
+def percentile(values, pct):
+    ordered = sorted(values)
+    rank = max(1, int(round(pct / 100.0 * len(ordered) + 0.5)))
+    return ordered[min(rank, len(ordered)) - 1]
+
+
+def run_scenario(kpm, registry, env, work_dir, name, args, stdin, setup, iterations):
+    times = []
+    cpu_times = []
+    stats = None
+    for i in range(iterations):
+        run_dir = os.path.join(work_dir, "runs", "%s-%d" % (name, i))
+        os.makedirs(run_dir)
+        setup(run_dir)
+        registry.reset()
+        start = time.perf_counter()
+        usage = resource.getrusage(resource.RUSAGE_CHILDREN)
+        result = subprocess.run([kpm] + registry.stats_args(run_dir) + args, cwd=run_dir, env=env, input=stdin, text=True,
+                                stdout=subprocess.PIPE, stderr=subprocess.STDOUT)
+        elapsed = (time.perf_counter() - start) * 1000
+        # Only kpm is reaped in between, the stand-in and proxy are waited for at the end
+        after = resource.getrusage(resource.RUSAGE_CHILDREN)
+        cpu_times.append((after.ru_utime - usage.ru_utime + after.ru_stime - usage.ru_stime) * 1000)
+        if result.returncode != 0:
+            sys.stderr.write(result.stdout)
+            raise SystemExit("%s failed with exit code %d" % (name, result.returncode))
+        times.append(elapsed)
+        stats = registry.snapshot(run_dir)
+    result = {
+        "p50_ms": round(percentile(times, 50), 2),
+        "p95_ms": round(percentile(times, 95), 2),
+        "cpu_ms": round(percentile(cpu_times, 50), 2),
+        "requests": stats["requests"],
+        "bytes": stats["bytes"],
+    }
+
+    # The profiler slows every malloc down, so it gets a run of its own
+    run_dir = os.path.join(work_dir, "runs", "%s-alloc" % name)
+    os.makedirs(run_dir)
+    setup(run_dir)
+    profiled = subprocess.run([kpm] + args, cwd=run_dir, env=dict(env, KPM_ALLOC_PROFILE="1"), input=stdin,
+                              text=True, stdout=subprocess.PIPE, stderr=subprocess.STDOUT)
+    if profiled.returncode != 0:
+        sys.stderr.write(profiled.stdout)
+        raise SystemExit("%s failed under KPM_ALLOC_PROFILE with exit code %d" % (name, profiled.returncode))
+    match = ALLOC_SUMMARY.search(profiled.stdout)
+    if match:
+        result["alloc_count"] = int(match.group(1))
+        result["alloc_bytes"] = int(match.group(2))
+        result["peak_heap_bytes"] = int(match.group(3))
+    return result
+
+
+def write_project_json(run_dir):
+    with open(os.path.join(run_dir, "project.json"), "w") as f:
+        json.dump({"name": "bench_project", "language": "c", "install_cmd": "(null)"}, f)
+
+
+def compare(results, baseline, tolerance, memory_tolerance):
+    failures = []
+    for name, result in results.items():
+        expected = baseline.get(name)
+        if expected is None:
+            print("  %s: no baseline" % name)
+            continue
+        for key in ("requests", "bytes"):
+            if result[key] != expected[key]:
+                failures.append("%s: %s changed from %d to %d" % (name, key, expected[key], result[key]))
+        for key in ("alloc_bytes", "peak_heap_bytes"):
+            if key in result and key in expected and result[key] > expected[key] * (1 + memory_tolerance):
+                failures.append("%s: %s %d exceeds baseline %d by more than %d%%"
+                                % (name, key, result[key], expected[key], memory_tolerance * 100))
+        limit = expected["p50_ms"] * (1 + tolerance)
+        if result["p50_ms"] > limit:
+            failures.append("%s: p50 %.2f ms exceeds baseline %.2f ms by more than %d%%"
+                            % (name, result["p50_ms"], expected["p50_ms"], tolerance * 100))
+    return failures
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("--kpm", default=os.path.join(BENCH_DIR, "..", "kpm"))
+    parser.add_argument("--iterations", type=int, default=5)
+    parser.add_argument("--baseline", help="defaults to baseline.json, or baseline-local.json with --local")
+    parser.add_argument("--local", action="store_true", help="use the registry directory directly instead of HTTP")
+    parser.add_argument("--proxy", action="store_true", help="go through kpm proxy in front of the stand-in")
+    parser.add_argument("--update-baseline", action="store_true")
+    parser.add_argument("--tolerance", type=float, default=0.5, help="allowed p50 slowdown, 0.5 = 50%%")
+    parser.add_argument("--memory-tolerance", type=float, default=0.15,
+                        help="allowed growth in allocated and peak heap bytes, 0.15 = 15%%")
+    parser.add_argument("--output", help="also write the results as JSON here")
+    parser.add_argument("--only", help="comma-separated scenario names to run")
+    args = parser.parse_args()
+
+    kpm = os.path.abspath(args.kpm)
+    if args.baseline is None:
+        name = "baseline-local.json" if args.local else ("baseline-proxy.json" if args.proxy else "baseline.json")
+        args.baseline = os.path.join(BENCH_DIR, name)
+    work_dir = tempfile.mkdtemp(prefix="kpm-bench-")
+    root = make_registry(work_dir, args.local, kpm)
+    registry = LocalRegistry(root) if args.local else Registry(root)
+    env = dict(os.environ, KPM_REGISTRY_URL=registry.url, KPM_CACHE_DIR=os.path.join(work_dir, "cache"))
+    proxy = Proxy(kpm, work_dir) if args.proxy and not args.local else None
+    if proxy:
+        env["KPM_PROXY"] = proxy.url
+
+    scenarios = []
+    for lang in INIT_LANGUAGES:
+        scenarios.append(("init-%s" % lang, ["init"], init_answers(lang), lambda d: None))
+    for name, _, _ in LIBRARIES:
+        scenarios.append(("install-%s" % name, ["install", name], "", write_project_json))
+    if args.only:
+        wanted = args.only.split(",")
+        scenarios = [s for s in scenarios if s[0] in wanted]
+
+    results = {}
+    try:
+        print("%-16s %10s %10s %9s %12s %12s %12s"
+              % ("scenario", "p50 ms", "p95 ms", "requests", "bytes", "alloc bytes", "peak heap"))
+        for name, kpm_args, stdin, setup in scenarios:
+            result = run_scenario(kpm, registry, env, work_dir, name, kpm_args, stdin, setup, args.iterations)
+            results[name] = result
+            print("%-16s %10.2f %10.2f %9d %12d %12s %12s"
+                  % (name, result["p50_ms"], result["p95_ms"], result["requests"], result["bytes"],
+                     result.get("alloc_bytes", "-"), result.get("peak_heap_bytes", "-")))
+    finally:
+        if proxy:
+            proxy.close()
+        registry.close()
+        shutil.rmtree(work_dir, ignore_errors=True)
+
+    if args.output:
+        with open(args.output, "w") as f:
+            json.dump(results, f, indent=4, sort_keys=True)
+    if args.update_baseline:
+        with open(args.baseline, "w") as f:
+            json.dump(results, f, indent=4, sort_keys=True)
+            f.write("\n")
+        print("Baseline written to %s" % args.baseline)
+        return 0
+
+    if not os.path.exists(args.baseline):
+        print("No baseline at %s, run with --update-baseline to create one" % args.baseline)
+        return 0
+    with open(args.baseline) as f:
+        baseline = json.load(f)
+    failures = compare(results, baseline, args.tolerance, args.memory_tolerance)
+    for failure in failures:
+        print("REGRESSION %s" % failure)
+    if not failures:
+        print("No regressions against %s" % os.path.basename(args.baseline))
+    return 1 if failures else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,85 @@
+// Compares a full jansson parse against the on-demand scanner for the one
+// lookup kpm actually does on a registry index: langs.<lang>.path in
+// langs/index.json and <lib>.path in libs/index.json.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <jansson.h>
+#include "json/scanner.h"
+
+static char *make_index(size_t target_size, int nested, int *entries) {
+    size_t size = target_size + 4096;
+    char *json = malloc(size);
+    size_t len = snprintf(json, size, nested ? "{\"langs\":{" : "{");
+    int n = 0;
+    while (len < target_size) {
+        len += snprintf(json + len, size - len,
+            "%s\"entry%d\":{\"lang\":\"c\",\"description\":\"Synthetic entry %d with an \\\"escaped\\\" note\","
+            "\"keywords\":[\"alpha\",\"beta\",\"gamma\"],\"stars\":%d,\"path\":\"entry%d/entry%d.json\"}",
+            n ? "," : "", n, n, n * 7, n, n);
+        n++;
+    }
+    len += snprintf(json + len, size - len, nested ? "}}" : "}");
+    *entries = n;
+    return json;
+}
+
+static double now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+static void run(const char *label, int nested, size_t target_size, int rounds) {
+    int entries;
+    char *json = make_index(target_size, nested, &entries);
+    size_t len = strlen(json);
+    char key[64];
+    snprintf(key, sizeof(key), "entry%d", entries - 1); // Worst case, the last entry
+
+    double start = now_ms();
+    for (int r = 0; r < rounds; r++) {
+        json_error_t error;
+        json_t *root = json_loads(json, 0, &error);
+        json_t *obj = nested ? json_object_get(json_object_get(root, "langs"), key) : json_object_get(root, key);
+        if (json_string_value(json_object_get(obj, "path")) == NULL) {
+            fprintf(stderr, "jansson lookup failed\n");
+            exit(1);
+        }
+        json_decref(root);
+    }
+    double jansson_ms = (now_ms() - start) / rounds;
+
+    start = now_ms();
+    size_t index_bytes = 0;
+    for (int r = 0; r < rounds; r++) {
+        JsonScanner scanner;
+        json_scanner_init(&scanner, json, len);
+        const char *nested_path[] = {"langs", key, "path"};
+        const char *flat_path[] = {key, "path"};
+        char *path = nested ? json_scanner_find_string(&scanner, nested_path, 3) : json_scanner_find_string(&scanner, flat_path, 2);
+        if (path == NULL) {
+            fprintf(stderr, "scanner lookup failed\n");
+            exit(1);
+        }
+        index_bytes = scanner.count * sizeof(uint32_t);
+        free(path);
+        json_scanner_free(&scanner);
+    }
+    double scanner_ms = (now_ms() - start) / rounds;
+
+    double mb = len / (1024.0 * 1024.0);
+    printf("%-16s %6.1f MB %7d entries | jansson %8.2f ms (%7.1f MB/s) | scanner %7.2f ms (%7.1f MB/s, %.1f MB index) | %.1fx\n",
+           label, mb, entries, jansson_ms, mb / (jansson_ms / 1000), scanner_ms, mb / (scanner_ms / 1000),
+           index_bytes / (1024.0 * 1024.0), jansson_ms / scanner_ms);
+    free(json);
+}
+
+int main(int argc, char **argv) {
+    size_t size_mb = argc > 1 ? strtoul(argv[1], NULL, 10) : 10;
+    int rounds = argc > 2 ? atoi(argv[2]) : 5;
+    run("langs/index.json", 1, size_mb << 20, rounds);
+    run("libs/index.json", 0, size_mb << 20, rounds);
+    return 0;
+}
@@ -0,0 +1,98 @@
+#!/usr/bin/env python3
+"""Batch `kpm install` of hundreds of libraries under valgrind.
+
+Adds --libraries generated libraries (two small files each) to the fixture
+registry, serves it with the stand-in and installs all of them with one
+`kpm install` run under --runner, valgrind's leak checker by default. Fails
+if the runner reports a definite or indirect leak (or any other error), or if
+any library did not end up installed. --runner "" runs kpm as it is, e.g. a
+-fsanitize=address build whose LeakSanitizer does the checking.
+"""
+import argparse
+import json
+import os
+import shlex
+import subprocess
+import sys
+import tempfile
+import time
+
+import e2e
+
+VALGRIND = "valgrind --leak-check=full --errors-for-leak-kinds=definite,indirect --error-exitcode=1"
+
+
+def add_libraries(root, count):
+    index_path = os.path.join(root, "libs", "index.json")
+    with open(index_path) as f:
+        index = json.load(f)
+    names = []
+    for n in range(count):
+        name = "leak%03d" % n
+        lib_dir = os.path.join(root, "libs", name)
+        src = "src/%s.c" % name
+        header = "include/%s.h" % name
+        e2e.fill(os.path.join(lib_dir, "files", src), lambda i: "int %s_value%d = %d;\n" % (name, i, i), 512)
+        e2e.fill(os.path.join(lib_dir, "files", header), lambda i: "extern int %s_value%d;\n" % (name, i), 256)
+        lib_json = {
+            "name": name,
+            "git_url": "https://example.com/%s.git" % name,
+            "raw_path": "${registry}/libs/%s/files/" % name,
+            "has_headers": True,
+            "is_prebuilt": False,
+            "description": "leak check library",
+            "author": "bench",
+            "license": "MIT",
+            "added_by": "bench",
+            "src_paths": [src],
+            "header_paths": [header],
+            "keywords": ["bench"],
+        }
+        with open(os.path.join(lib_dir, "%s.json" % name), "w") as f:
+            json.dump(lib_json, f, indent=4)
+        index[name] = {"lang": "c", "path": "%s/%s.json" % (name, name)}
+        names.append(name)
+    with open(index_path, "w") as f:
+        json.dump(index, f, indent=4)
+    return names
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("--kpm", default=os.path.join(e2e.BENCH_DIR, "..", "kpm"))
+    parser.add_argument("--libraries", type=int, default=300)
+    parser.add_argument("--runner", default=VALGRIND, help="command kpm runs under, \"\" for none")
+    args = parser.parse_args()
+    kpm = os.path.abspath(args.kpm)
+
+    with tempfile.TemporaryDirectory(prefix="kpm-leak-check-") as work_dir:
+        root = e2e.make_registry(work_dir)
+        names = add_libraries(root, args.libraries)
+        run_dir = os.path.join(work_dir, "project")
+        os.makedirs(run_dir)
+        e2e.write_project_json(run_dir)
+        registry = e2e.Registry(root)
+        try:
+            env = dict(os.environ, KPM_REGISTRY_URL=registry.url, KPM_CACHE_DIR=os.path.join(work_dir, "cache"))
+            env.pop("KPM_REGISTRY_MIRRORS", None)
+            env.pop("KPM_PROXY", None)
+            start = time.perf_counter()
+            result = subprocess.run(shlex.split(args.runner) + [kpm, "install"] + names, cwd=run_dir, env=env,
+                                    stdout=subprocess.DEVNULL, stderr=subprocess.PIPE, text=True)
+            elapsed = time.perf_counter() - start
+            requests = registry.snapshot(None)["requests"]
+        finally:
+            registry.close()
+        missing = [name for name in names if not os.path.isdir(os.path.join(run_dir, "libs", name))]
+
+    print("%d libraries installed in %.1f s, %d requests, exit code %d" % (len(names) - len(missing), elapsed,
+                                                                         requests, result.returncode))
+    if result.returncode != 0:
+        sys.stderr.write(result.stderr)
+        raise SystemExit("kpm install reported errors or leaks")
+    if missing:
+        raise SystemExit("Not installed: %s" % ", ".join(missing))
+
+
+if __name__ == "__main__":
+    main()
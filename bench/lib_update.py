@@ -0,0 +1,119 @@
+#!/usr/bin/env python3
+"""Keeps installed libraries fresh with `kpm update`.
+
+Installs the small, medium and large fixture libraries against the stand-in,
+then updates them: warm with nothing changed upstream (every library json and
+file should come back 304 with no bodies), and after medium had one file
+changed, one added and one dropped from its json (only those two are fetched
+and the dropped one removed). Also checks that the files update left alone kept
+their mtimes and that a locally edited file is fetched outright and restored.
+"""
+import argparse
+import json
+import os
+import re
+import subprocess
+import sys
+import tempfile
+import time
+
+import e2e
+
+SUMMARY = re.compile(r"^(\d+) libraries: (\d+) updated, (\d+) up to date, (\d+) failed, (\d+) files fetched, "
+                     r"(\d+) not modified, (\d+) removed, (\d+) bytes downloaded$", re.M)
+
+
+def update(kpm, registry, env, run_dir):
+    registry.reset()
+    start = time.perf_counter()
+    result = subprocess.run([kpm, "update"], cwd=run_dir, env=env, capture_output=True, text=True)
+    elapsed = (time.perf_counter() - start) * 1000
+    match = SUMMARY.search(result.stdout)
+    if result.returncode != 0 or match is None:
+        sys.stderr.write(result.stdout + result.stderr)
+        raise SystemExit("kpm update failed")
+    stats = registry.snapshot(None)
+    _, updated, current, _, fetched, not_modified, removed, _ = map(int, match.groups())
+    return elapsed, updated, current, fetched, not_modified, removed, stats["requests"], stats["bytes"]
+
+
+def mtimes(lib_dir):
+    found = {}
+    for root, _, files in os.walk(lib_dir):
+        for name in files:
+            path = os.path.join(root, name)
+            found[os.path.relpath(path, lib_dir)] = os.stat(path).st_mtime_ns
+    return found
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("--kpm", default=os.path.join(e2e.BENCH_DIR, "..", "kpm"))
+    args = parser.parse_args()
+    kpm = os.path.abspath(args.kpm)
+
+    with tempfile.TemporaryDirectory(prefix="kpm-lib-update-") as work_dir:
+        root = e2e.make_registry(work_dir)
+        run_dir = os.path.join(work_dir, "project")
+        os.makedirs(run_dir)
+        e2e.write_project_json(run_dir)
+        registry = e2e.Registry(root)
+        try:
+            env = dict(os.environ, KPM_REGISTRY_URL=registry.url, KPM_CACHE_DIR=os.path.join(work_dir, "cache"))
+            env.pop("KPM_REGISTRY_MIRRORS", None)
+            env.pop("KPM_PROXY", None)
+            names = [name for name, _, _ in e2e.LIBRARIES]
+            subprocess.run([kpm, "install"] + names, cwd=run_dir, env=env, check=True,
+                           stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+            runs = [("warm", update(kpm, registry, env, run_dir))]
+
+            # One file changed, one added and one dropped upstream
+            lib_dir = os.path.join(root, "libs", "medium")
+            json_path = os.path.join(lib_dir, "medium.json")
+            with open(json_path) as f:
+                lib_json = json.load(f)
+            with open(os.path.join(lib_dir, "files", lib_json["src_paths"][0]), "a") as f:
+                f.write("int medium_changed = 1;\n")
+            added = "src/medium_added.c"
+            e2e.fill(os.path.join(lib_dir, "files", added), lambda n: "int medium_added%d = %d;\n" % (n, n), 1024)
+            dropped = lib_json["header_paths"].pop()
+            lib_json["src_paths"].append(added)
+            with open(json_path, "w") as f:
+                json.dump(lib_json, f, indent=4)
+            installed = os.path.join(run_dir, "libs", "medium")
+            before = mtimes(installed)
+            time.sleep(0.05)
+            runs.append(("one-changed", update(kpm, registry, env, run_dir)))
+            after = mtimes(installed)
+            touched = sorted(path for path in after if before.get(path) != after[path])
+            gone = sorted(set(before) - set(after))
+
+            # A local edit is not trusted for a conditional request
+            edited = os.path.join(run_dir, "libs", "small", "src", "small_0.c")
+            with open(edited, "a") as f:
+                f.write("// local edit\n")
+            runs.append(("local-edit", update(kpm, registry, env, run_dir)))
+            with open(edited) as f:
+                restored = "// local edit" not in f.read()
+        finally:
+            registry.close()
+
+    print("%-12s %10s %8s %11s %8s %13s %8s %9s %10s" % ("run", "ms", "updated", "up-to-date", "fetched",
+                                                        "not-modified", "removed", "requests", "bytes"))
+    for name, (elapsed, updated, current, fetched, not_modified, removed, requests, downloaded) in runs:
+        print("%-12s %10.2f %8d %11d %8d %13d %8d %9d %10d" % (name, elapsed, updated, current, fetched,
+                                                               not_modified, removed, requests, downloaded))
+    print("rewritten after one change: %s, removed: %s" % (", ".join(touched), ", ".join(gone)))
+    warm, one, edit = runs[0][1], runs[1][1], runs[2][1]
+    if warm[3] != 0 or warm[7] != 0 or warm[1] != 0:
+        raise SystemExit("Expected the warm update to fetch no bodies")
+    if one[3] != 2 or one[5] != 1 or one[1] != 1:
+        raise SystemExit("Expected the changed and added file fetched and the dropped one removed")
+    if touched != sorted([lib_json["src_paths"][0], added]) or gone != [dropped]:
+        raise SystemExit("Expected only the changed and added files written")
+    if edit[3] != 1 or not restored:
+        raise SystemExit("Expected the locally edited file fetched again and restored")
+
+
+if __name__ == "__main__":
+    main()
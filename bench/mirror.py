@@ -0,0 +1,75 @@
+#!/usr/bin/env python3
+"""Times `kpm mirror` against `kpm registry serve` (which sends ETags).
+
+Mirrors the e2e fixture registry three times: cold into an empty directory,
+warm with nothing changed upstream (every object should come back 304), and
+after one library file changed (exactly one object should be fetched).
+"""
+import argparse
+import os
+import re
+import subprocess
+import sys
+import tempfile
+import time
+
+import e2e
+
+SUMMARY = re.compile(r"^(\d+) objects: (\d+) fetched, (\d+) not modified, (\d+) unchanged, (\d+) missing, "
+                     r"(\d+) failed, (\d+) bytes downloaded$", re.M)
+
+
+def mirror(kpm, work_dir, env):
+    start = time.perf_counter()
+    result = subprocess.run([kpm, "mirror", os.path.join(work_dir, "mirror")], env=env,
+                            capture_output=True, text=True)
+    elapsed = (time.perf_counter() - start) * 1000
+    match = SUMMARY.search(result.stdout)
+    if result.returncode != 0 or match is None:
+        sys.stderr.write(result.stdout + result.stderr)
+        raise SystemExit("kpm mirror failed")
+    objects, fetched, not_modified, unchanged, _, _, downloaded = map(int, match.groups())
+    return elapsed, objects, fetched, not_modified, unchanged, downloaded
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument("--kpm", default=os.path.join(e2e.BENCH_DIR, "..", "kpm"))
+    args = parser.parse_args()
+    kpm = os.path.abspath(args.kpm)
+
+    with tempfile.TemporaryDirectory(prefix="kpm-mirror-") as work_dir:
+        registry = e2e.make_registry(work_dir)
+        server = subprocess.Popen([kpm, "registry", "serve", registry, "--port", "0"],
+                                  stdout=subprocess.PIPE, text=True)
+        try:
+            url = server.stdout.readline().strip().rsplit(" on ", 1)[1]
+            # kpm registry serve sends files as they are, fill in what the stand-in would
+            for name, _, _ in e2e.LIBRARIES:
+                path = os.path.join(registry, "libs", name, "%s.json" % name)
+                with open(path) as f:
+                    text = f.read().replace("${registry}", url)
+                with open(path, "w") as f:
+                    f.write(text)
+
+            env = dict(os.environ, KPM_REGISTRY_URL=url, KPM_CACHE_DIR=os.path.join(work_dir, "cache"))
+            env.pop("KPM_REGISTRY_MIRRORS", None)
+            runs = [("cold", mirror(kpm, work_dir, env)), ("warm", mirror(kpm, work_dir, env))]
+            with open(os.path.join(registry, "libs", "large", "files", "src", "large_0.c"), "a") as f:
+                f.write("int large_0_changed;\n")
+            runs.append(("one-changed", mirror(kpm, work_dir, env)))
+        finally:
+            server.terminate()
+            server.wait()
+
+    print("%-12s %10s %8s %8s %13s %10s %12s" % ("run", "ms", "objects", "fetched", "not-modified", "unchanged",
+                                                 "bytes"))
+    for name, (elapsed, objects, fetched, not_modified, unchanged, downloaded) in runs:
+        print("%-12s %10.2f %8d %8d %13d %10d %12d" % (name, elapsed, objects, fetched, not_modified, unchanged,
+                                                       downloaded))
+    if runs[1][1][2] != 0 or runs[2][1][2] != 1:
+        raise SystemExit("Expected 0 objects fetched warm and 1 after one change")
+
+
+if __name__ == "__main__":
+    main()
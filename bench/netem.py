@@ -0,0 +1,398 @@
+#!/usr/bin/env python3
+"""Userspace network emulation in front of the registry stand-in.
+
+An HTTP proxy between kpm and registry_server.py that makes the link look like
+a bad network without tc or root:
+
+    latency_ms      added to every request, and once more for each new connection
+    jitter_ms       latency varies uniformly by up to this much either way
+    bandwidth_kbit  one link shared by every connection, 0 for unlimited
+    loss            chance that a 16 KB chunk stalls for stall_ms, the way a lost
+                    packet waits for a retransmit
+    stall_ms        how long such a stall lasts
+    reset_rate      chance that a response is cut off with a TCP reset partway in
+    error_rate      chance that a request starts a burst of error_burst responses
+                    with error_status (503 or 429) instead of the file
+    retry_after     seconds the injected errors ask for in Retry-After, 0 for none
+                    (a 429 always sends one, 1 second by default)
+
+Scenario files (bench/scenarios/*.json) name these settings, the kpm commands
+to run through them and how often:
+
+    {"description": "...", "netem": {"latency_ms": 40, "loss": 0.01},
+     "env": {"KPM_HOST_CONCURRENCY": "2"}, "iterations": 3,
+     "commands": ["init c", "install medium"]}
+
+    python3 netem.py scenarios/*.json [--output results.json]
+
+runs every command cold (fresh cache) through a fresh proxy per scenario and
+reports the distribution of command wall times and of the per-request times
+the proxy saw, with the stalls, resets and errors it injected. A command that
+fails is counted, not fatal, and makes the exit code 1.
+
+    python3 netem.py --serve http://127.0.0.1:PORT --latency-ms 80 --loss 0.02
+
+only runs the proxy in front of a stand-in that is already up, printing its
+port like registry_server.py does. GET /__netem/stats and /__netem/reset
+report and zero its counters.
+"""
+import argparse
+import http.client
+import json
+import os
+import random
+import shutil
+import socket
+import struct
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+import urllib.parse
+from http.server import BaseHTTPRequestHandler, ThreadingHTTPServer
+
+import e2e
+
+BENCH_DIR = e2e.BENCH_DIR
+CHUNK = 16 * 1024
+
+# name: (default, help)
+SHAPING = {
+    "latency_ms": (0, "added to every request and to every new connection"),
+    "jitter_ms": (0, "latency varies by up to this much either way"),
+    "bandwidth_kbit": (0, "link bandwidth shared by all connections, 0 for unlimited"),
+    "loss": (0.0, "chance that a 16 KB chunk stalls"),
+    "stall_ms": (200, "how long a stall lasts"),
+    "reset_rate": (0.0, "chance that a response is cut off with a reset"),
+    "error_rate": (0.0, "chance that a request starts a burst of errors"),
+    "error_burst": (3, "responses in an error burst"),
+    "error_status": (503, "status of injected errors"),
+    "retry_after": (0, "Retry-After seconds on injected errors, 0 for none"),
+}
+
+# Connection-level headers are between the proxy and each side, not end to end
+HOP_HEADERS = {"connection", "keep-alive", "proxy-connection", "transfer-encoding", "te", "upgrade", "host",
+               "content-length"}
+
+
+class Link:
+    """What every connection through the proxy shares: the settings, the bandwidth and the dice."""
+
+    def __init__(self, settings, seed):
+        self.settings = dict((name, default) for name, (default, _) in SHAPING.items())
+        self.settings.update(settings)
+        self.random = random.Random(seed)
+        self.lock = threading.Lock()
+        self.free_at = 0.0
+        self.burst_left = 0
+        self.reset()
+
+    def reset(self):
+        with self.lock:
+            self.counters = {"requests": 0, "bytes": 0, "stalls": 0, "resets": 0, "errors": 0}
+            self.latencies = []
+
+    def count(self, name, n=1):
+        with self.lock:
+            self.counters[name] += n
+
+    def record(self, seconds):
+        with self.lock:
+            self.latencies.append(seconds * 1000)
+
+    def snapshot(self):
+        with self.lock:
+            return dict(self.counters, request_ms=list(self.latencies))
+
+    def chance(self, p):
+        with self.lock:
+            return p > 0 and self.random.random() < p
+
+    def delay(self):
+        latency = self.settings["latency_ms"]
+        jitter = self.settings["jitter_ms"]
+        with self.lock:
+            ms = latency + (self.random.uniform(-jitter, jitter) if jitter else 0)
+        return max(ms, 0) / 1000.0
+
+    def cut_at(self, size):
+        """Where to reset a response of size bytes, None to send it all."""
+        if size == 0 or not self.chance(self.settings["reset_rate"]):
+            return None
+        with self.lock:
+            return self.random.randrange(size)
+
+    def error(self):
+        with self.lock:
+            if self.burst_left > 0:
+                self.burst_left -= 1
+                return True
+            rate = self.settings["error_rate"]
+            if rate > 0 and self.random.random() < rate:
+                self.burst_left = self.settings["error_burst"] - 1
+                return True
+            return False
+
+    def transmit(self, size):
+        """Waits until size bytes would have crossed the link, behind whatever is already on it."""
+        kbit = self.settings["bandwidth_kbit"]
+        if not kbit:
+            return
+        with self.lock:
+            now = time.monotonic()
+            self.free_at = max(now, self.free_at) + size * 8 / (kbit * 1000.0)
+            wait = self.free_at - now
+        time.sleep(wait)
+
+
+class NetemHandler(BaseHTTPRequestHandler):
+    protocol_version = "HTTP/1.1"
+    disable_nagle_algorithm = True  # Headers and body go out as separate writes
+    link = None
+    upstream = None  # (host, port)
+
+    def log_message(self, format, *args):
+        pass
+
+    def setup(self):
+        super().setup()
+        time.sleep(self.link.delay())  # The handshake costs a round trip
+
+    def send_json(self, value):
+        body = json.dumps(value).encode()
+        self.send_response(200)
+        self.send_header("Content-Type", "application/json")
+        self.send_header("Content-Length", str(len(body)))
+        self.end_headers()
+        self.wfile.write(body)
+
+    def fetch(self):
+        host, port = self.upstream
+        conn = http.client.HTTPConnection(host, port, timeout=60)
+        try:
+            headers = dict((k, v) for k, v in self.headers.items() if k.lower() not in HOP_HEADERS)
+            conn.request("GET", self.path, headers=headers)
+            response = conn.getresponse()
+            body = response.read()
+            headers = [(k, v) for k, v in response.getheaders() if k.lower() not in HOP_HEADERS]
+            return response.status, headers, body
+        finally:
+            conn.close()
+
+    def reset_connection(self):
+        self.wfile.flush()
+        self.connection.setsockopt(socket.SOL_SOCKET, socket.SO_LINGER, struct.pack("ii", 1, 0))
+        # Closing the descriptor ourselves sends the reset, socketserver would shut down with a FIN first
+        os.close(self.connection.detach())
+        self.close_connection = True
+
+    def do_GET(self):
+        if self.path == "/__netem/stats":
+            self.send_json(self.link.snapshot())
+            return
+        if self.path == "/__netem/reset":
+            self.link.reset()
+            self.send_json({})
+            return
+
+        start = time.monotonic()
+        self.link.count("requests")
+        time.sleep(self.link.delay())
+        settings = self.link.settings
+        if self.link.error():
+            self.link.count("errors")
+            status = settings["error_status"]
+            body = ("%d: injected by netem" % status).encode()
+            headers = [("Content-Type", "text/plain")]
+            if settings["retry_after"] or status == 429:
+                headers.append(("Retry-After", str(settings["retry_after"] or 1)))
+        else:
+            try:
+                status, headers, body = self.fetch()
+            except OSError:
+                status, headers, body = 502, [("Content-Type", "text/plain")], b"502: upstream unreachable"
+
+        self.send_response(status)
+        for name, value in headers:
+            self.send_header(name, value)
+        self.send_header("Content-Length", str(len(body)))
+        self.end_headers()
+        cut = self.link.cut_at(len(body))
+        for offset in range(0, len(body), CHUNK):
+            chunk = body[offset:offset + CHUNK]
+            if cut is not None and offset + len(chunk) > cut:
+                chunk = chunk[:cut - offset]
+            if self.link.chance(settings["loss"]):
+                self.link.count("stalls")
+                time.sleep(settings["stall_ms"] / 1000.0)
+            self.link.transmit(len(chunk))
+            self.wfile.write(chunk)
+            self.link.count("bytes", len(chunk))
+            if cut is not None and offset + CHUNK > cut:
+                self.link.count("resets")
+                self.reset_connection()
+                break
+        self.link.record(time.monotonic() - start)
+
+
+class Netem:
+    """The proxy on a free port, serving from a thread of this process."""
+
+    def __init__(self, settings, seed):
+        self.link = Link(settings, seed)
+        handler = type("Handler", (NetemHandler,), {"link": self.link})
+        self.handler = handler
+        self.server = ThreadingHTTPServer(("127.0.0.1", 0), handler)
+        self.server.daemon_threads = True
+        self.url = "http://127.0.0.1:%d" % self.server.server_address[1]
+
+    def start(self, upstream_url):
+        parsed = urllib.parse.urlsplit(upstream_url)
+        self.handler.upstream = (parsed.hostname, parsed.port)
+        self.thread = threading.Thread(target=self.server.serve_forever, daemon=True)
+        self.thread.start()
+
+    def close(self):
+        self.server.shutdown()
+        self.server.server_close()
+
+
+class Upstream(e2e.Registry):
+    """registry_server.py filling in the proxy's URL, so library files come through it too."""
+
+    def __init__(self, root, base_url):
+        self.proc = subprocess.Popen([sys.executable, os.path.join(BENCH_DIR, "registry_server.py"), root,
+                                      "--base-url", base_url], stdout=subprocess.PIPE, text=True)
+        self.port = int(self.proc.stdout.readline())
+        self.url = "http://127.0.0.1:%d" % self.port
+
+
+def parse_command(text):
+    words = text.split()
+    if len(words) == 2 and words[0] == "init":
+        return "init-" + words[1], ["init"], e2e.init_answers(words[1]), lambda d: None
+    if len(words) == 2 and words[0] == "install":
+        return "install-" + words[1], ["install", words[1]], "", e2e.write_project_json
+    raise SystemExit("Unknown scenario command %r, expected \"init <lang>\" or \"install <library>\"" % text)
+
+
+def distribution(values):
+    if not values:
+        return {"count": 0}
+    return {"count": len(values), "min": round(min(values), 2), "p50": round(e2e.percentile(values, 50), 2),
+            "p90": round(e2e.percentile(values, 90), 2), "p99": round(e2e.percentile(values, 99), 2),
+            "max": round(max(values), 2)}
+
+
+def run_scenario(kpm, root, work_dir, name, scenario, iterations, seed):
+    unknown = set(scenario.get("netem", {})) - set(SHAPING)
+    if unknown:
+        raise SystemExit("%s: unknown netem settings %s" % (name, ", ".join(sorted(unknown))))
+    netem = Netem(scenario.get("netem", {}), seed)
+    upstream = Upstream(root, netem.url)
+    netem.start(upstream.url)
+    results = {}
+    try:
+        for text in scenario["commands"]:
+            label, args, stdin, setup = parse_command(text)
+            netem.link.reset()
+            times = []
+            failed = 0
+            retries = 0
+            for i in range(iterations):
+                run_dir = os.path.join(work_dir, name, "%s-%d" % (label, i))
+                os.makedirs(run_dir)
+                setup(run_dir)
+                env = dict(os.environ, KPM_REGISTRY_URL=netem.url, KPM_CACHE_DIR=os.path.join(run_dir, ".cache"),
+                           **scenario.get("env", {}))
+                env.pop("KPM_REGISTRY_MIRRORS", None)
+                env.pop("KPM_PROXY", None)
+                start = time.perf_counter()
+                try:
+                    result = subprocess.run([kpm, "--stats=stats.prom"] + args, cwd=run_dir, env=env, input=stdin,
+                                            text=True, stdout=subprocess.PIPE, stderr=subprocess.STDOUT,
+                                            timeout=scenario.get("timeout_s", 300))
+                    ok = result.returncode == 0 and "Failed to" not in result.stdout
+                except subprocess.TimeoutExpired:
+                    ok = False
+                times.append((time.perf_counter() - start) * 1000)
+                failed += 0 if ok else 1
+                stats_path = os.path.join(run_dir, "stats.prom")
+                if os.path.exists(stats_path):
+                    with open(stats_path) as f:
+                        samples = dict((k, int(v)) for k, v in e2e.STATS_SAMPLE.findall(f.read()))
+                    retries += samples.get("kpm_retries", 0)
+            link = netem.link.snapshot()
+            results[label] = {"ms": [round(t, 2) for t in times], "command": distribution(times),
+                              "request": distribution(link["request_ms"]), "failed": failed, "retries": retries,
+                              "requests": link["requests"], "bytes": link["bytes"], "stalls": link["stalls"],
+                              "resets": link["resets"], "errors": link["errors"]}
+    finally:
+        netem.close()
+        upstream.close()
+    return {"description": scenario.get("description", ""), "netem": netem.link.settings, "commands": results}
+
+
+def serve(args):
+    settings = dict((name, getattr(args, name)) for name in SHAPING)
+    netem = Netem(settings, args.seed)
+    netem.start(args.serve)
+    print(netem.server.server_address[1], flush=True)
+    try:
+        netem.thread.join()
+    except KeyboardInterrupt:
+        pass
+    return 0
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("scenarios", nargs="*", help="scenario .json files to run")
+    parser.add_argument("--kpm", default=os.path.join(BENCH_DIR, "..", "kpm"))
+    parser.add_argument("--iterations", type=int, help="overrides each scenario's iterations")
+    parser.add_argument("--seed", type=int, default=1, help="for the loss, reset and error dice")
+    parser.add_argument("--output", help="also write every sample and distribution as JSON here")
+    parser.add_argument("--serve", metavar="UPSTREAM", help="only run the proxy in front of this URL")
+    for name, (default, help) in SHAPING.items():
+        parser.add_argument("--" + name.replace("_", "-"), type=type(default), default=default, help=help)
+    args = parser.parse_args()
+    if args.serve:
+        return serve(args)
+    if not args.scenarios:
+        parser.error("no scenario files given")
+    kpm = os.path.abspath(args.kpm)
+
+    work_dir = tempfile.mkdtemp(prefix="kpm-netem-")
+    results = {}
+    try:
+        root = e2e.make_registry(work_dir, kpm=kpm)
+        print("%-14s %-15s %5s %6s %10s %10s %10s %10s %10s %10s %7s %6s %6s %6s"
+              % ("scenario", "command", "runs", "failed", "p50 ms", "p90 ms", "p99 ms", "max ms", "req p50",
+                 "req p99", "retries", "stalls", "resets", "errors"))
+        for path in args.scenarios:
+            name = os.path.splitext(os.path.basename(path))[0]
+            with open(path) as f:
+                scenario = json.load(f)
+            iterations = args.iterations or scenario.get("iterations", 3)
+            results[name] = run_scenario(kpm, root, work_dir, name, scenario, iterations, args.seed)
+            for label, r in results[name]["commands"].items():
+                c, q = r["command"], r["request"]
+                print("%-14s %-15s %5d %6d %10.2f %10.2f %10.2f %10.2f %10.2f %10.2f %7d %6d %6d %6d"
+                      % (name, label, c["count"], r["failed"], c["p50"], c["p90"], c["p99"], c["max"],
+                         q.get("p50", 0), q.get("p99", 0), r["retries"], r["stalls"], r["resets"], r["errors"]))
+    finally:
+        shutil.rmtree(work_dir, ignore_errors=True)
+
+    if args.output:
+        with open(args.output, "w") as f:
+            json.dump(results, f, indent=4, sort_keys=True)
+            f.write("\n")
+    failed = sum(r["failed"] for s in results.values() for r in s["commands"].values())
+    if failed:
+        print("FAILED %d runs did not complete" % failed)
+    return 1 if failed else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
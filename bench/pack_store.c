@@ -0,0 +1,268 @@
+// 100k small cached objects stored the way kpm proxy used to keep them (an
+// object file and a .meta file each, one directory) against the pack store,
+// with and without per-object compression: writing them, reopening and
+// listing them, random reads, deleting half and what is left on disk.
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <ftw.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "cache/cache.h"
+#include "cache/pack.h"
+
+typedef struct {
+    const char *name;
+    double write_ms;
+    double open_ms;
+    double read_ms;
+    double delete_ms;
+    double compact_ms;
+    unsigned long long disk_bytes;
+    unsigned long long files;
+} Result;
+
+static double now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+// Source-like text, 100 bytes to 4 KB, so compression has something to do
+static size_t make_object(int i, char *out, size_t size) {
+    size_t want = 100 + (size_t)((i * 2654435761u) % 3900);
+    size_t len = 0;
+    int line = 0;
+    while (len < want && len + 80 < size) {
+        len += (size_t)snprintf(out + len, size - len, "int object_%d_value_%d = %d; // line %d\n", i, line, i ^ line, line);
+        line++;
+    }
+    return len < want ? len : want;
+}
+
+static uint64_t object_key(int i) {
+    char url[128];
+    int len = snprintf(url, sizeof(url), "https://registry.example.com/libs/lib%d/files/src/file%d.c", i / 16, i);
+    return hash_bytes(url, (size_t)len);
+}
+
+static int make_meta(int i, char *out, size_t size) {
+    return snprintf(out, size, "https://registry.example.com/libs/lib%d/files/src/file%d.c\n\"%x\"\n\n%d 1700000000\n",
+                    i / 16, i, i * 31, i);
+}
+
+static unsigned long long disk_bytes;
+static unsigned long long disk_files;
+
+static int add_usage(const char *path, const struct stat *st, int type, struct FTW *ftw) {
+    (void)path;
+    (void)ftw;
+    if (type == FTW_F) {
+        disk_bytes += (unsigned long long)st->st_blocks * 512;
+        disk_files++;
+    }
+    return 0;
+}
+
+static void usage(const char *dir, Result *result) {
+    disk_bytes = 0;
+    disk_files = 0;
+    nftw(dir, add_usage, 16, FTW_PHYS);
+    result->disk_bytes = disk_bytes;
+    result->files = disk_files;
+}
+
+static int remove_entry(const char *path, const struct stat *st, int type, struct FTW *ftw) {
+    (void)st;
+    (void)type;
+    (void)ftw;
+    return remove(path);
+}
+
+static void write_file(const char *path, const char *data, size_t size) {
+    FILE *fp = fopen(path, "wb");
+    if (fp == NULL || fwrite(data, 1, size, fp) != size || fclose(fp) != 0) {
+        perror(path);
+        exit(1);
+    }
+}
+
+static void run_files(const char *dir, int count, const int *order, Result *result) {
+    char *data = malloc(8192);
+    char path[4400];
+    char meta[512];
+    mkdir(dir, 0755);
+
+    double start = now_ms();
+    for (int i = 0; i < count; i++) {
+        size_t size = make_object(i, data, 8192);
+        snprintf(path, sizeof(path), "%s/%016llx", dir, (unsigned long long)object_key(i));
+        write_file(path, data, size);
+        int meta_len = make_meta(i, meta, sizeof(meta));
+        snprintf(path, sizeof(path), "%s/%016llx.meta", dir, (unsigned long long)object_key(i));
+        write_file(path, meta, (size_t)meta_len);
+    }
+    result->write_ms = now_ms() - start;
+
+    // What the proxy did on start: every .meta read, every object stat'ed
+    start = now_ms();
+    DIR *d = opendir(dir);
+    struct dirent *item;
+    int listed = 0;
+    while ((item = readdir(d)) != NULL) {
+        size_t len = strlen(item->d_name);
+        if (len < 5 || strcmp(item->d_name + len - 5, ".meta") != 0) {
+            continue;
+        }
+        snprintf(path, sizeof(path), "%s/%s", dir, item->d_name);
+        FILE *fp = fopen(path, "r");
+        if (fp == NULL || fread(meta, 1, sizeof(meta), fp) == 0) {
+            perror(path);
+            exit(1);
+        }
+        fclose(fp);
+        path[strlen(path) - 5] = '\0';
+        struct stat st;
+        if (stat(path, &st) == 0) {
+            listed++;
+        }
+    }
+    closedir(d);
+    result->open_ms = now_ms() - start;
+    if (listed != count) {
+        fprintf(stderr, "files: listed %d of %d objects\n", listed, count);
+        exit(1);
+    }
+
+    start = now_ms();
+    for (int n = 0; n < count; n++) {
+        snprintf(path, sizeof(path), "%s/%016llx", dir, (unsigned long long)object_key(order[n]));
+        int fd = open(path, O_RDONLY);
+        struct stat st;
+        if (fd == -1 || fstat(fd, &st) != 0 || read(fd, data, (size_t)st.st_size) != st.st_size) {
+            perror(path);
+            exit(1);
+        }
+        close(fd);
+    }
+    result->read_ms = now_ms() - start;
+
+    start = now_ms();
+    for (int i = 0; i < count; i += 2) {
+        snprintf(path, sizeof(path), "%s/%016llx", dir, (unsigned long long)object_key(i));
+        unlink(path);
+        strcat(path, ".meta");
+        unlink(path);
+    }
+    result->delete_ms = now_ms() - start;
+    result->compact_ms = 0;
+    usage(dir, result);
+    free(data);
+}
+
+static int count_object(uint64_t key, const char *meta, size_t meta_size, size_t size, void *userdata) {
+    (void)key;
+    (void)meta;
+    (void)meta_size;
+    (void)size;
+    (*(int *)userdata)++;
+    return 0;
+}
+
+static void run_pack(const char *dir, int compress, int count, const int *order, Result *result) {
+    char *data = malloc(8192);
+    char meta[512];
+
+    double start = now_ms();
+    PackStore *store = pack_open(dir, compress);
+    for (int i = 0; i < count; i++) {
+        size_t size = make_object(i, data, 8192);
+        int meta_len = make_meta(i, meta, sizeof(meta));
+        if (pack_put(store, object_key(i), meta, (size_t)meta_len, data, size) != 0) {
+            exit(1);
+        }
+    }
+    pack_close(store);
+    result->write_ms = now_ms() - start;
+
+    start = now_ms();
+    store = pack_open(dir, compress);
+    int listed = 0;
+    pack_foreach(store, count_object, &listed);
+    result->open_ms = now_ms() - start;
+    if (listed != count) {
+        fprintf(stderr, "pack: listed %d of %d objects\n", listed, count);
+        exit(1);
+    }
+
+    start = now_ms();
+    for (int n = 0; n < count; n++) {
+        PackObject object;
+        if (pack_get(store, object_key(order[n]), &object, PACK_READ_DATA) != 0) {
+            fprintf(stderr, "pack: object %d missing\n", order[n]);
+            exit(1);
+        }
+        pack_object_free(&object);
+    }
+    result->read_ms = now_ms() - start;
+
+    start = now_ms();
+    for (int i = 0; i < count; i += 2) {
+        pack_delete(store, object_key(i));
+    }
+    pack_flush(store);
+    result->delete_ms = now_ms() - start;
+
+    start = now_ms();
+    pack_maybe_compact(store, 1);
+    pack_wait(store);
+    result->compact_ms = now_ms() - start;
+    pack_close(store);
+    usage(dir, result);
+    free(data);
+}
+
+int main(int argc, char **argv) {
+    int count = argc > 1 ? atoi(argv[1]) : 100000;
+    char dir[] = "/var/tmp/kpm-pack-bench-XXXXXX";
+    if (count <= 0 || mkdtemp(dir) == NULL) {
+        fprintf(stderr, "Usage: %s [objects]\n", argv[0]);
+        return 1;
+    }
+    int *order = malloc((size_t)count * sizeof(int));
+    for (int i = 0; i < count; i++) {
+        order[i] = i;
+    }
+    srand(42);
+    for (int i = count - 1; i > 0; i--) {
+        int j = rand() % (i + 1);
+        int tmp = order[i];
+        order[i] = order[j];
+        order[j] = tmp;
+    }
+
+    Result results[3] = {{.name = "files"}, {.name = "pack"}, {.name = "pack+zlib"}};
+    char path[4200];
+    snprintf(path, sizeof(path), "%s/files", dir);
+    run_files(path, count, order, &results[0]);
+    snprintf(path, sizeof(path), "%s/pack", dir);
+    run_pack(path, 0, count, order, &results[1]);
+    snprintf(path, sizeof(path), "%s/pack-zlib", dir);
+    run_pack(path, 1, count, order, &results[2]);
+    nftw(dir, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+
+    printf("%d objects, reads in random order, half deleted before measuring disk use\n", count);
+    printf("%-10s %10s %10s %10s %10s %10s %12s %8s\n", "store", "write ms", "open ms", "read ms", "delete ms",
+           "compact ms", "disk KB", "files");
+    for (int i = 0; i < 3; i++) {
+        printf("%-10s %10.1f %10.1f %10.1f %10.1f %10.1f %12llu %8llu\n", results[i].name, results[i].write_ms,
+               results[i].open_ms, results[i].read_ms, results[i].delete_ms, results[i].compact_ms,
+               results[i].disk_bytes / 1024, results[i].files);
+    }
+    free(order);
+    return 0;
+}
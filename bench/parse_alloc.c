@@ -0,0 +1,83 @@
+// Parses synthetic library and template JSON the same way `kpm install` and
+// `kpm init` do, and reports how many allocations the arena served versus how
+// many times it had to call malloc. Run under valgrind with `make leak-check`.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "package_manager/fetch.h"
+#include "templates/custom.h"
+
+static char *make_library_json(int n) {
+    size_t size = 16384;
+    char *json = malloc(size);
+    int len = snprintf(json, size,
+        "{\"name\":\"lib%d\",\"git_url\":\"https://github.com/example/lib%d.git\","
+        "\"raw_path\":\"https://raw.githubusercontent.com/example/lib%d/main/\","
+        "\"has_headers\":true,\"is_prebuilt\":false,\"description\":\"Synthetic library %d\","
+        "\"author\":\"bench\",\"license\":\"MIT\",\"added_by\":\"bench\",", n, n, n, n);
+    const char *arrays[] = {"src_paths", "header_paths", "keywords"};
+    for (size_t a = 0; a < 3; a++) {
+        len += snprintf(json + len, size - len, "\"%s\":[", arrays[a]);
+        for (int i = 0; i < 20; i++) {
+            len += snprintf(json + len, size - len, "%s\"src/module_%d/file_%d.c\"", i ? "," : "", n, i);
+        }
+        len += snprintf(json + len, size - len, "]%s", a < 2 ? "," : "}");
+    }
+    return json;
+}
+
+static const char *template_json =
+    "{\"name\":\"c\",\"version\":2,\"system_support\":[\"linux\",\"windows\"],\"lib_support\":1,"
+    "\"build_file_path\":{\"makefile\":\"c/makefile\",\"bash\":\"c/build.sh\"},"
+    "\"git_ignore_path\":\"c/.gitignore\",\"description\":\"C template\",\"template_author\":\"bench\","
+    "\"default_main_file\":\"main.c\",\"extensions\":[\".c\",\".h\"],\"dependencies\":[],"
+    "\"template_version\":\"1.0.0\",\"update_url\":\"c/update.json\","
+    "\"folders_to_create\":[\"src\",\"build\",\"libs\"],\"commands_to_run\":[],"
+    "\"main_file_path\":\"src/main.c\",\"main_file_template\":\"c/main.c\",\"comment\":\"//\","
+    "\"compiler_urls\":[\"https://gcc.gnu.org\"],\"files_to_include\":[\"config.mk\",\"version.h\"],"
+    "\"compiler_cmd\":\"gcc --version\",\"package_install\":\"(null)\"}";
+
+static double elapsed_ms(struct timespec start) {
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return (end.tv_sec - start.tv_sec) * 1000.0 + (end.tv_nsec - start.tv_nsec) / 1e6;
+}
+
+int main(int argc, char **argv) {
+    int iterations = argc > 1 ? atoi(argv[1]) : 500;
+    size_t allocations = 0, blocks = 0, bytes = 0;
+    struct timespec start;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < iterations; i++) {
+        char *json = make_library_json(i);
+        LibraryInfo *lib_info = parse_library_json(json);
+        if (lib_info == NULL) {
+            fprintf(stderr, "Failed to parse library %d\n", i);
+            return 1;
+        }
+        allocations += lib_info->arena.allocations;
+        blocks += lib_info->arena.blocks;
+        bytes += lib_info->arena.bytes;
+        free_library_info(lib_info);
+        free(json);
+    }
+    printf("libraries: %d parsed in %.2f ms, %zu allocations served by %zu malloc calls (%zu bytes)\n",
+           iterations, elapsed_ms(start), allocations, blocks, bytes);
+
+    allocations = blocks = bytes = 0;
+    ProjectInfo info;
+    memset(&info, 0, sizeof(info));
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < iterations; i++) {
+        parse_json(template_json, &info);
+        allocations += info.arena.allocations;
+        blocks += info.arena.blocks;
+        bytes += info.arena.bytes;
+    }
+    free_project_info(&info);
+    printf("templates: %d parsed in %.2f ms, %zu allocations served by %zu malloc calls (%zu bytes)\n",
+           iterations, elapsed_ms(start), allocations, blocks, bytes);
+    return 0;
+}
@@ -0,0 +1,2 @@
+#!/bin/sh
+gcc -Wall -Wextra src/main.c -o build/${project_name}
@@ -0,0 +1,6 @@
+#include <stdio.h>
+
+int main() {
+    printf("Hello from KickStart\n");
+    return 0;
+}
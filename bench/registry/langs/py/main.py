@@ -0,0 +1,6 @@
+def main():
+    print("Hello from KickStart")
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,201 @@
+#!/usr/bin/env python3
+"""Local stand-in for the KickStartFiles registry used by the benchmarks.
+
+Serves a directory laid out like KickStartFiles (langs/, libs/, LICENCE/) and
+counts requests and response bytes. ${registry} inside .json files is replaced
+with the server's own base URL so library raw_path entries point back here,
+or with --base-url when something (bench/netem.py) sits in front of it.
+
+    GET /__stats  -> {"requests": N, "bytes": N}
+    GET /__reset  -> zeroes the counters
+
+Files carry an ETag and Last-Modified and honour If-None-Match/If-Modified-Since
+(304) and Range/If-Range, so conditional and resumed downloads can be tested. --drop-after N --drop-count K cuts the connection
+after N body bytes on the first K file responses that are longer than that.
+--max-inflight N answers 429 with Retry-After to file requests beyond N at
+once, the way raw.githubusercontent.com throttles; /__stats then also reports
+"throttled" and the "peak_inflight" it let through.
+"""
+import argparse
+import email.utils
+import json
+import os
+import re
+import socket
+import sys
+import threading
+import time
+from http.server import SimpleHTTPRequestHandler, ThreadingHTTPServer
+
+
+class Stats:
+    def __init__(self):
+        self.lock = threading.Lock()
+        self.requests = 0
+        self.bytes = 0
+        self.drops_left = 0
+        self.inflight = 0
+        self.peak_inflight = 0
+        self.throttled = 0
+
+    def enter(self, limit):
+        with self.lock:
+            if limit and self.inflight >= limit:
+                self.throttled += 1
+                return False
+            self.inflight += 1
+            self.peak_inflight = max(self.peak_inflight, self.inflight)
+            return True
+
+    def leave(self):
+        with self.lock:
+            self.inflight -= 1
+
+    def add(self, size):
+        with self.lock:
+            self.requests += 1
+            self.bytes += size
+
+    def take_drop(self):
+        with self.lock:
+            if self.drops_left <= 0:
+                return False
+            self.drops_left -= 1
+            return True
+
+    def snapshot(self):
+        with self.lock:
+            return {"requests": self.requests, "bytes": self.bytes, "throttled": self.throttled,
+                    "peak_inflight": self.peak_inflight}
+
+    def reset(self):
+        with self.lock:
+            self.requests = 0
+            self.bytes = 0
+            self.throttled = 0
+            self.peak_inflight = 0
+
+
+def not_modified_since(header, mtime):
+    try:
+        since = email.utils.parsedate_to_datetime(header).timestamp()
+    except (TypeError, ValueError):
+        return False
+    return int(mtime) <= since
+
+
+class RegistryHandler(SimpleHTTPRequestHandler):
+    stats = Stats()
+    base_url = ""
+    delay = 0.0
+    drop_after = 0
+    max_inflight = 0
+    retry_after = 1
+
+    def log_message(self, format, *args):
+        pass
+
+    def send_body(self, status, body, content_type, headers=()):
+        self.send_response(status)
+        self.send_header("Content-Type", content_type)
+        self.send_header("Content-Length", str(len(body)))
+        for name, value in headers:
+            self.send_header(name, value)
+        self.end_headers()
+        if self.drop_after and len(body) > self.drop_after and self.stats.take_drop():
+            # Headers promised the whole body, the client sees a transfer cut short
+            self.wfile.write(body[:self.drop_after])
+            self.wfile.flush()
+            self.connection.shutdown(socket.SHUT_RDWR)
+            self.close_connection = True
+            return self.drop_after
+        self.wfile.write(body)
+        return len(body)
+
+    def do_GET(self):
+        if self.path == "/__stats":
+            self.send_body(200, json.dumps(self.stats.snapshot()).encode(), "application/json")
+            return
+        if self.path == "/__reset":
+            self.stats.reset()
+            self.send_body(200, b"{}", "application/json")
+            return
+
+        if not self.stats.enter(self.max_inflight):
+            self.stats.add(0)
+            self.send_body(429, b"429: Too Many Requests", "text/plain", [("Retry-After", str(self.retry_after))])
+            return
+        try:
+            self.serve_file()
+        finally:
+            self.stats.leave()
+
+    def serve_file(self):
+        if self.delay:
+            time.sleep(self.delay)
+        path = self.translate_path(self.path)
+        if not os.path.isfile(path):
+            self.stats.add(0)
+            self.send_body(404, b"404: Not Found", "text/plain")
+            return
+        with open(path, "rb") as f:
+            body = f.read()
+        if path.endswith(".json"):
+            body = body.replace(b"${registry}", self.base_url.encode())
+        st = os.stat(path)
+        etag = '"%x-%x"' % (int(st.st_mtime_ns), len(body))
+        headers = [("ETag", etag), ("Last-Modified", email.utils.formatdate(st.st_mtime, usegmt=True)),
+                   ("Accept-Ranges", "bytes")]
+        if_none_match = self.headers.get("If-None-Match")
+        if_modified_since = self.headers.get("If-Modified-Since")
+        if (if_none_match is not None and etag in [tag.strip() for tag in if_none_match.split(",")]) or \
+                (if_none_match is None and if_modified_since is not None and
+                 not_modified_since(if_modified_since, st.st_mtime)):
+            self.stats.add(self.send_body(304, b"", "text/plain", headers[:2]))
+            return
+        status = 200
+        match = re.match(r"bytes=(\d+)-$", self.headers.get("Range", ""))
+        if_range = self.headers.get("If-Range")
+        if match and (if_range is None or if_range in (etag, headers[1][1])):
+            start = int(match.group(1))
+            if start >= len(body):
+                self.stats.add(0)
+                self.send_body(416, b"", "text/plain", [("Content-Range", "bytes */%d" % len(body))])
+                return
+            headers.append(("Content-Range", "bytes %d-%d/%d" % (start, len(body) - 1, len(body))))
+            body = body[start:]
+            status = 206
+        self.stats.add(self.send_body(status, body, "text/plain; charset=utf-8", headers))
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("root", help="registry directory to serve")
+    parser.add_argument("--port", type=int, default=0, help="0 picks a free port")
+    parser.add_argument("--delay-ms", type=int, default=0, help="answer every file request this late, to stand in for a slow mirror")
+    parser.add_argument("--drop-after", type=int, default=0, help="cut file responses off after this many body bytes")
+    parser.add_argument("--drop-count", type=int, default=0, help="how many responses --drop-after applies to")
+    parser.add_argument("--max-inflight", type=int, default=0, help="answer 429 beyond this many requests at once")
+    parser.add_argument("--retry-after", type=int, default=1, help="seconds the 429s ask clients to wait")
+    parser.add_argument("--base-url", help="what ${registry} becomes, defaults to this server's own URL")
+    args = parser.parse_args()
+
+    root = os.path.abspath(args.root)
+    handler = lambda *a, **kw: RegistryHandler(*a, directory=root, **kw)
+    server = ThreadingHTTPServer(("127.0.0.1", args.port), handler)
+    RegistryHandler.base_url = args.base_url or "http://127.0.0.1:%d" % server.server_address[1]
+    RegistryHandler.delay = args.delay_ms / 1000.0
+    RegistryHandler.drop_after = args.drop_after
+    RegistryHandler.stats.drops_left = args.drop_count
+    RegistryHandler.max_inflight = args.max_inflight
+    RegistryHandler.retry_after = args.retry_after
+    print(server.server_address[1], flush=True)
+    try:
+        server.serve_forever()
+    except KeyboardInterrupt:
+        pass
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,137 @@
+#!/usr/bin/env python3
+"""Training workload and latency report for `make release`.
+
+`train` runs an instrumented kpm through what CI runs it for: startup, every
+e2e init and install scenario against the registry stand-in over HTTP, against
+the registry directory and through `kpm proxy`, and `kpm doctor`. That writes
+the profile the release build is optimised with.
+
+`compare` times two builds against each other, alternating between them for
+--rounds rounds: startup (kpm with no arguments, p50 of --startup-runs) and the
+e2e init/install scenarios over HTTP and against the directory, each the median
+of its rounds' p50s. Wall time is mostly the registry and the disk, so the CPU
+time kpm itself used is reported next to it; that is what the build changes.
+Prints the change per scenario and the binary sizes.
+"""
+import argparse
+import json
+import os
+import resource
+import subprocess
+import sys
+import tempfile
+import time
+
+import e2e
+
+MODES = [("http", []), ("local", ["--local"])]
+
+
+def run_e2e(kpm, work_dir, mode_args, iterations, name):
+    output = os.path.join(work_dir, "%s.json" % name)
+    # No baseline to compare with, only a failing scenario fails the run
+    result = subprocess.run([sys.executable, os.path.join(e2e.BENCH_DIR, "e2e.py"), "--kpm", kpm,
+                             "--iterations", str(iterations), "--baseline", os.path.join(work_dir, "none.json"),
+                             "--output", output] + mode_args, stdout=subprocess.PIPE, stderr=subprocess.STDOUT,
+                            text=True)
+    if result.returncode != 0:
+        sys.stderr.write(result.stdout)
+        raise SystemExit("e2e scenarios failed for %s" % kpm)
+    with open(output) as f:
+        return json.load(f)
+
+
+def startup(kpm, runs):
+    times = []
+    cpu_times = []
+    for _ in range(runs):
+        start = time.perf_counter()
+        usage = resource.getrusage(resource.RUSAGE_CHILDREN)
+        subprocess.run([kpm], stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+        times.append((time.perf_counter() - start) * 1000)
+        after = resource.getrusage(resource.RUSAGE_CHILDREN)
+        cpu_times.append((after.ru_utime - usage.ru_utime + after.ru_stime - usage.ru_stime) * 1000)
+    return e2e.percentile(times, 50), e2e.percentile(cpu_times, 50)
+
+
+def median(values):
+    ordered = sorted(values)
+    middle = len(ordered) // 2
+    return ordered[middle] if len(ordered) % 2 else (ordered[middle - 1] + ordered[middle]) / 2
+
+
+def train(args):
+    kpm = os.path.abspath(args.kpm)
+    with tempfile.TemporaryDirectory(prefix="kpm-release-train-") as work_dir:
+        startup(kpm, 20)
+        for name, mode_args in MODES + [("proxy", ["--proxy"])]:
+            print("Training on the %s scenarios" % name)
+            run_e2e(kpm, work_dir, mode_args, args.iterations, name)
+        subprocess.run([kpm, "doctor"], env=dict(os.environ, KPM_CACHE_DIR=os.path.join(work_dir, "cache")),
+                       stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+    return 0
+
+
+def compare(args):
+    builds = [("before", os.path.abspath(args.before)), ("after", os.path.abspath(args.after))]
+    samples = {}
+    with tempfile.TemporaryDirectory(prefix="kpm-release-compare-") as work_dir:
+        for round_index in range(args.rounds):
+            # Alternating keeps a noisy machine from favouring whichever build ran last
+            order = builds if round_index % 2 == 0 else builds[::-1]
+            for label, kpm in order:
+                samples.setdefault(("startup", label), []).append(startup(kpm, args.startup_runs))
+                for mode, mode_args in MODES:
+                    results = run_e2e(kpm, work_dir, mode_args, args.iterations, "%s-%s-%d" % (label, mode,
+                                                                                               round_index))
+                    for scenario, result in results.items():
+                        samples.setdefault(("%s (%s)" % (scenario, mode), label), []).append(
+                            (result["p50_ms"], result["cpu_ms"]))
+
+    rows = []
+    names = []
+    for name, _ in samples:
+        if name not in names:
+            names.append(name)
+    print("%-22s %11s %11s %8s %11s %11s %8s" % ("scenario", "before ms", "after ms", "change", "before cpu",
+                                                "after cpu", "change"))
+    for name in names:
+        row = {"scenario": name}
+        line = "%-22s" % name
+        for index, key in enumerate(("ms", "cpu_ms")):
+            before = median([sample[index] for sample in samples[(name, "before")]])
+            after = median([sample[index] for sample in samples[(name, "after")]])
+            change = (after - before) / before * 100 if before else 0.0
+            row.update({"before_" + key: round(before, 2), "after_" + key: round(after, 2),
+                        "change_pct" if key == "ms" else "cpu_change_pct": round(change, 1)})
+            line += " %11.2f %11.2f %7.1f%%" % (before, after, change)
+        rows.append(row)
+        print(line)
+    sizes = dict((label, os.path.getsize(kpm)) for label, kpm in builds)
+    print("binary size: before %d bytes, after %d bytes" % (sizes["before"], sizes["after"]))
+    if args.output:
+        with open(args.output, "w") as f:
+            json.dump({"scenarios": rows, "sizes": sizes}, f, indent=4, sort_keys=True)
+            f.write("\n")
+    return 0
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    commands = parser.add_subparsers(dest="command", required=True)
+    train_parser = commands.add_parser("train", help="run the training workload")
+    train_parser.add_argument("--kpm", required=True, help="the instrumented build")
+    train_parser.add_argument("--iterations", type=int, default=3)
+    compare_parser = commands.add_parser("compare", help="report the latency change between two builds")
+    compare_parser.add_argument("--before", required=True)
+    compare_parser.add_argument("--after", required=True)
+    compare_parser.add_argument("--iterations", type=int, default=5)
+    compare_parser.add_argument("--rounds", type=int, default=4)
+    compare_parser.add_argument("--startup-runs", type=int, default=100)
+    compare_parser.add_argument("--output", help="also write the report as JSON here")
+    args = parser.parse_args()
+    return train(args) if args.command == "train" else compare(args)
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,148 @@
+#!/usr/bin/env python3
+"""Dropped connections during kpm install and clib's fallback tarball.
+
+Serves the e2e registry with registry_server.py cutting the first --drops file
+responses off after --drop-after bytes, then runs `kpm install large` and
+bench/tar_stream's stream mode (clib's download path) against it. Both have to
+produce the same files as an undisturbed run, and resuming should mean the
+bytes served barely exceed the undisturbed total: only what was in flight when
+the connection dropped is sent twice.
+"""
+import argparse
+import filecmp
+import os
+import re
+import shutil
+import subprocess
+import sys
+import tarfile
+import tempfile
+import time
+
+import e2e
+
+BENCH_DIR = e2e.BENCH_DIR
+
+
+class Server(e2e.Registry):
+    def __init__(self, root, drop_after=0, drops=0):
+        self.proc = subprocess.Popen([sys.executable, os.path.join(BENCH_DIR, "registry_server.py"), root,
+                                      "--drop-after", str(drop_after), "--drop-count", str(drops)],
+                                     stdout=subprocess.PIPE, text=True)
+        self.port = int(self.proc.stdout.readline())
+        self.url = "http://127.0.0.1:%d" % self.port
+
+
+def same_tree(a, b):
+    # libs/.kpm records the registry's url, which differs between servers
+    diff = filecmp.dircmp(a, b, ignore=filecmp.DEFAULT_IGNORES + [".kpm"])
+    pending = [diff]
+    while pending:
+        d = pending.pop()
+        if d.left_only or d.right_only or d.diff_files or d.funny_files:
+            return False
+        pending.extend(d.subdirs.values())
+    return True
+
+
+def install(kpm, server, work_dir, name):
+    run_dir = os.path.join(work_dir, name)
+    os.makedirs(run_dir)
+    e2e.write_project_json(run_dir)
+    env = dict(os.environ, KPM_REGISTRY_URL=server.url, KPM_CACHE_DIR=os.path.join(work_dir, name + "-cache"),
+               KPM_RETRIES="8")
+    start = time.perf_counter()
+    result = subprocess.run([kpm, "--stats=stats.prom", "install", "large"], cwd=run_dir, env=env,
+                            stdout=subprocess.PIPE, stderr=subprocess.STDOUT, text=True)
+    elapsed = (time.perf_counter() - start) * 1000
+    if result.returncode != 0:
+        sys.stderr.write(result.stdout)
+        raise SystemExit("kpm install failed with exit code %d" % result.returncode)
+    with open(os.path.join(run_dir, "stats.prom")) as f:
+        samples = dict((k, int(v)) for k, v in e2e.STATS_SAMPLE.findall(f.read()))
+    served = server.snapshot(run_dir)
+    return run_dir, elapsed, served, samples
+
+
+def fetch_tarball(bench, server, work_dir, name):
+    out = os.path.join(work_dir, name)
+    os.makedirs(out)
+    env = dict(os.environ, KPM_RETRIES="8")
+    result = subprocess.run([bench, "stream", server.url + "/fallback.tar.gz", out], env=env,
+                            stdout=subprocess.PIPE, stderr=subprocess.PIPE, text=True)
+    if result.returncode != 0:
+        raise SystemExit("tar_stream failed: %s" % result.stderr)
+    retries = len(re.findall(r"^Retrying ", result.stderr, re.M))
+    return out, float(result.stdout), server.snapshot(out), retries
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("--kpm", default=os.path.join(BENCH_DIR, "..", "kpm"))
+    parser.add_argument("--bench", default=os.path.join(BENCH_DIR, "tar_stream"))
+    parser.add_argument("--drop-after", type=int, default=4096, help="body bytes sent before a connection is cut")
+    parser.add_argument("--drops", type=int, default=40, help="how many responses get cut")
+    parser.add_argument("--tarball-drop-after", type=int, default=256 * 1024, help="the same for the tarball")
+    args = parser.parse_args()
+    kpm = os.path.abspath(args.kpm)
+
+    work_dir = tempfile.mkdtemp(prefix="kpm-resume-")
+    failures = []
+    try:
+        root = e2e.make_registry(work_dir)
+        # 4 MB of sources, about 1 MB compressed, so drops land in the middle of the inflate
+        source = os.path.join(work_dir, "tarball-src")
+        for i in range(64):
+            e2e.fill(os.path.join(source, "pkg", "file%02d.c" % i), lambda n: "int pkg_%d_value%d = %d;\n" % (i, n, n * 7919),
+                     64 * 1024)
+        with tarfile.open(os.path.join(root, "fallback.tar.gz"), "w:gz") as tar:
+            tar.add(os.path.join(source, "pkg"), arcname="pkg")
+
+        print("%-14s %-9s %10s %9s %12s %8s %14s" % ("target", "run", "ms", "requests", "bytes served", "retries", "bytes resumed"))
+        rows = []
+        for name, drops in (("clean", 0), ("dropped", args.drops)):
+            server = Server(root, args.drop_after, drops)
+            try:
+                run_dir, ms, served, samples = install(kpm, server, work_dir, "install-" + name)
+                rows.append(("install-large", name, ms, served["requests"], served["bytes"], samples["kpm_retries"],
+                             samples["kpm_resumed_bytes"], run_dir))
+            finally:
+                server.close()
+            # Every resumed response is long enough to be cut again, so the archive gets a few drops, not all of them
+            server = Server(root, args.tarball_drop_after, min(drops, 3))
+            try:
+                out, ms, served, retries = fetch_tarball(args.bench, server, work_dir, "tarball-" + name)
+                rows.append(("tarball", name, ms, served["requests"], served["bytes"], retries, None, out))
+            finally:
+                server.close()
+        for target, name, ms, requests, served, retries, resumed, _ in rows:
+            print("%-14s %-9s %10.2f %9d %12d %8d %14s" % (target, name, ms, requests, served, retries,
+                                                          "-" if resumed is None else resumed))
+
+        clean = dict((r[0], r) for r in rows if r[1] == "clean")
+        for target, name, _, _, served, retries, _, path in rows:
+            if name != "dropped":
+                continue
+            expected = clean[target]
+            if not same_tree(os.path.join(expected[7], "libs") if target == "install-large" else expected[7],
+                             os.path.join(path, "libs") if target == "install-large" else path):
+                failures.append("%s: files differ from the undisturbed run" % target)
+            if retries == 0:
+                failures.append("%s: no connection was dropped" % target)
+            # Anything past what was cut off in flight means a body was fetched again from the start
+            drop_after = args.drop_after if target == "install-large" else args.tarball_drop_after
+            if served > expected[4] + retries * drop_after:
+                failures.append("%s: served %d bytes, more than %d + what the %d drops cut off"
+                                % (target, served, expected[4], retries))
+    finally:
+        shutil.rmtree(work_dir, ignore_errors=True)
+
+    for failure in failures:
+        print("FAILED %s" % failure)
+    if not failures:
+        print("Dropped runs match the undisturbed ones")
+    return 1 if failures else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
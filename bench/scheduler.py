@@ -0,0 +1,93 @@
+#!/usr/bin/env python3
+"""kpm install through the request scheduler against a slow, throttling registry.
+
+Serves the e2e registry with --delay-ms of latency per file and runs
+`kpm install large` three ways: one request at a time (KPM_HOST_CONCURRENCY=1,
+how kpm fetched before), with the default per-host concurrency, and with the
+default against a stand-in that answers 429 + Retry-After beyond --max-inflight
+requests at once. Every run has to install the same files; the throttled one
+has to finish without failures and report how often it was throttled.
+"""
+import argparse
+import os
+import shutil
+import subprocess
+import sys
+import tempfile
+import time
+
+import e2e
+from resume import Server, same_tree
+
+BENCH_DIR = e2e.BENCH_DIR
+
+
+class SlowServer(Server):
+    def __init__(self, root, delay_ms, max_inflight):
+        self.proc = subprocess.Popen([sys.executable, os.path.join(BENCH_DIR, "registry_server.py"), root,
+                                      "--delay-ms", str(delay_ms), "--max-inflight", str(max_inflight)],
+                                     stdout=subprocess.PIPE, text=True)
+        self.port = int(self.proc.stdout.readline())
+        self.url = "http://127.0.0.1:%d" % self.port
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("--kpm", default=os.path.join(BENCH_DIR, "..", "kpm"))
+    parser.add_argument("--delay-ms", type=int, default=20, help="latency of every file request")
+    parser.add_argument("--max-inflight", type=int, default=3, help="concurrent requests the throttling run allows")
+    args = parser.parse_args()
+    kpm = os.path.abspath(args.kpm)
+
+    work_dir = tempfile.mkdtemp(prefix="kpm-scheduler-")
+    failures = []
+    try:
+        root = e2e.make_registry(work_dir)
+        runs = [("sequential", {"KPM_HOST_CONCURRENCY": "1"}, 0),
+                ("concurrent", {}, 0),
+                ("throttled", {}, args.max_inflight)]
+        print("%-12s %10s %9s %12s %10s %14s %8s" % ("run", "ms", "requests", "bytes", "throttled", "peak inflight",
+                                                     "retries"))
+        dirs = {}
+        for name, extra_env, max_inflight in runs:
+            run_dir = os.path.join(work_dir, name)
+            os.makedirs(run_dir)
+            e2e.write_project_json(run_dir)
+            server = SlowServer(root, args.delay_ms, max_inflight)
+            try:
+                env = dict(os.environ, KPM_REGISTRY_URL=server.url, KPM_CACHE_DIR=os.path.join(work_dir, name + "-cache"),
+                           **extra_env)
+                start = time.perf_counter()
+                result = subprocess.run([kpm, "--stats=stats.prom", "install", "large"], cwd=run_dir, env=env,
+                                        stdout=subprocess.PIPE, stderr=subprocess.STDOUT, text=True)
+                elapsed = (time.perf_counter() - start) * 1000
+                served = server.snapshot(run_dir)
+            finally:
+                server.close()
+            if result.returncode != 0 or "Failed to save" in result.stdout:
+                sys.stderr.write(result.stdout)
+                failures.append("%s: install failed" % name)
+                continue
+            with open(os.path.join(run_dir, "stats.prom")) as f:
+                samples = dict((k, int(v)) for k, v in e2e.STATS_SAMPLE.findall(f.read()))
+            print("%-12s %10.2f %9d %12d %10d %14d %8d" % (name, elapsed, served["requests"], served["bytes"],
+                                                           served["throttled"], served["peak_inflight"],
+                                                           samples["kpm_retries"]))
+            dirs[name] = os.path.join(run_dir, "libs")
+            if max_inflight and served["throttled"] != samples["kpm_throttled"]:
+                failures.append("%s: server sent %d 429s, kpm saw %d" % (name, served["throttled"], samples["kpm_throttled"]))
+        for name in dirs:
+            if name != "sequential" and "sequential" in dirs and not same_tree(dirs["sequential"], dirs[name]):
+                failures.append("%s: files differ from the sequential run" % name)
+    finally:
+        shutil.rmtree(work_dir, ignore_errors=True)
+
+    for failure in failures:
+        print("FAILED %s" % failure)
+    if not failures:
+        print("All runs installed the same files")
+    return 1 if failures else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,245 @@
+// Load test for kpm registry serve: starts the server on a registry directory,
+// keeps <connections> keep-alive connections busy fetching every file in it
+// round robin for <seconds>, then reports requests per second, throughput and
+// latency percentiles.
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#define MAX_PATHS 4096
+
+typedef struct {
+    int fd;
+    char request[1024];
+    size_t request_len;
+    size_t request_sent;
+    char header[4096];
+    size_t header_len;
+    long long body_left;  // -1 until the headers are in
+    int status;
+    long long start_us;
+} Client;
+
+static char *paths[MAX_PATHS];
+static int path_count = 0;
+static size_t root_len = 0;
+static long long *latencies = NULL;
+static size_t latency_count = 0;
+static size_t latency_capacity = 0;
+
+static long long now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int collect(const char *path, const struct stat *st, int type, struct FTW *ftw) {
+    (void)st;
+    (void)ftw;
+    if (type == FTW_F && path_count < MAX_PATHS) {
+        paths[path_count++] = strdup(path + root_len);
+    }
+    return 0;
+}
+
+static void record(long long us) {
+    if (latency_count == latency_capacity) {
+        latency_capacity = latency_capacity ? latency_capacity * 2 : 4096;
+        latencies = realloc(latencies, latency_capacity * sizeof(*latencies));
+    }
+    latencies[latency_count++] = us;
+}
+
+static int compare_ll(const void *a, const void *b) {
+    long long x = *(const long long *)a, y = *(const long long *)b;
+    return (x > y) - (x < y);
+}
+
+static double percentile_ms(double pct) {
+    size_t rank = (size_t)(pct / 100.0 * (double)latency_count);
+    if (rank >= latency_count) {
+        rank = latency_count - 1;
+    }
+    return latencies[rank] / 1000.0;
+}
+
+static void next_request(Client *client, unsigned long n) {
+    client->request_len = (size_t)snprintf(client->request, sizeof(client->request),
+        "GET %s HTTP/1.1\r\nHost: 127.0.0.1\r\nUser-Agent: serve_load\r\n\r\n", paths[n % (unsigned long)path_count]);
+    client->request_sent = 0;
+    client->header_len = 0;
+    client->body_left = -1;
+    client->start_us = now_us();
+}
+
+static pid_t start_server(const char *kpm, const char *root, int *port) {
+    int out[2];
+    if (pipe(out) != 0) {
+        return -1;
+    }
+    pid_t pid = fork();
+    if (pid == 0) {
+        dup2(out[1], STDOUT_FILENO);
+        close(out[0]);
+        execl(kpm, kpm, "registry", "serve", root, "--port", "0", (char *)NULL);
+        perror(kpm);
+        _exit(127);
+    }
+    close(out[1]);
+    char line[512];
+    size_t len = 0;
+    while (len < sizeof(line) - 1) {
+        ssize_t n = read(out[0], line + len, 1);
+        if (n <= 0 || line[len] == '\n') {
+            break;
+        }
+        len += (size_t)n;
+    }
+    line[len] = '\0';
+    close(out[0]);
+    char *colon = strrchr(line, ':');
+    *port = colon ? atoi(colon + 1) : 0;
+    if (*port == 0) {
+        fprintf(stderr, "Server did not start: %s\n", line);
+        kill(pid, SIGTERM);
+        waitpid(pid, NULL, 0);
+        return -1;
+    }
+    return pid;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 3) {
+        fprintf(stderr, "Usage: %s <kpm> <registry dir> [connections] [seconds]\n", argv[0]);
+        return 1;
+    }
+    const char *kpm = argv[1];
+    const char *root = argv[2];
+    int connections = argc > 3 ? atoi(argv[3]) : 32;
+    int seconds = argc > 4 ? atoi(argv[4]) : 5;
+
+    root_len = strlen(root);
+    while (root_len > 1 && root[root_len - 1] == '/') {
+        root_len--;
+    }
+    nftw(root, collect, 16, FTW_PHYS);
+    if (path_count == 0) {
+        fprintf(stderr, "No files under %s\n", root);
+        return 1;
+    }
+    int port;
+    pid_t server = start_server(kpm, root, &port);
+    if (server < 0) {
+        return 1;
+    }
+
+    int epoll_fd = epoll_create1(0);
+    Client *clients = calloc((size_t)connections, sizeof(Client));
+    struct sockaddr_in addr = {.sin_family = AF_INET, .sin_port = htons((unsigned short)port)};
+    inet_pton(AF_INET, "127.0.0.1", &addr.sin_addr);
+    unsigned long issued = 0;
+    for (int i = 0; i < connections; i++) {
+        Client *client = &clients[i];
+        client->fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (connect(client->fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+            perror("connect");
+            kill(server, SIGTERM);
+            return 1;
+        }
+        int one = 1;
+        setsockopt(client->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        fcntl(client->fd, F_SETFL, O_NONBLOCK);
+        next_request(client, issued++);
+        struct epoll_event event = {.events = EPOLLOUT, .data.ptr = client};
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client->fd, &event);
+    }
+
+    unsigned long long bytes = 0;
+    unsigned long errors = 0;
+    char buffer[65536];
+    struct epoll_event events[256];
+    long long start = now_us();
+    long long deadline = start + (long long)seconds * 1000000;
+    while (now_us() < deadline) {
+        int count = epoll_wait(epoll_fd, events, 256, 100);
+        for (int i = 0; i < count; i++) {
+            Client *client = events[i].data.ptr;
+            if (client->request_sent < client->request_len) {
+                ssize_t n = send(client->fd, client->request + client->request_sent,
+                                 client->request_len - client->request_sent, MSG_NOSIGNAL);
+                if (n > 0) {
+                    client->request_sent += (size_t)n;
+                }
+                if (client->request_sent == client->request_len) {
+                    struct epoll_event event = {.events = EPOLLIN, .data.ptr = client};
+                    epoll_ctl(epoll_fd, EPOLL_CTL_MOD, client->fd, &event);
+                }
+                continue;
+            }
+            ssize_t n;
+            while ((n = recv(client->fd, buffer, sizeof(buffer), 0)) > 0) {
+                bytes += (unsigned long long)n;
+                size_t left = (size_t)n;
+                if (client->body_left < 0) {
+                    size_t take = left < sizeof(client->header) - client->header_len - 1 ? left : sizeof(client->header) - client->header_len - 1;
+                    memcpy(client->header + client->header_len, buffer, take);
+                    client->header_len += take;
+                    client->header[client->header_len] = '\0';
+                    char *end = strstr(client->header, "\r\n\r\n");
+                    if (end == NULL) {
+                        continue;
+                    }
+                    size_t header_bytes = (size_t)(end + 4 - client->header) - (client->header_len - take);
+                    client->status = atoi(client->header + 9);
+                    char *length = strcasestr(client->header, "\r\nContent-Length:");
+                    client->body_left = length ? atoll(length + 17) : 0;
+                    left = (size_t)n - header_bytes;
+                }
+                client->body_left -= (long long)left;
+            }
+            if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK)) {
+                fprintf(stderr, "Connection closed by the server\n");
+                kill(server, SIGTERM);
+                return 1;
+            }
+            if (client->body_left == 0) {
+                record(now_us() - client->start_us);
+                if (client->status != 200) {
+                    errors++;
+                }
+                next_request(client, issued++);
+                struct epoll_event event = {.events = EPOLLOUT, .data.ptr = client};
+                epoll_ctl(epoll_fd, EPOLL_CTL_MOD, client->fd, &event);
+            }
+        }
+    }
+    double elapsed = (now_us() - start) / 1e6;
+
+    kill(server, SIGTERM);
+    waitpid(server, NULL, 0);
+    if (latency_count == 0) {
+        fprintf(stderr, "No requests completed\n");
+        return 1;
+    }
+    qsort(latencies, latency_count, sizeof(*latencies), compare_ll);
+    printf("%d connections, %d files, %.1f s\n", connections, path_count, elapsed);
+    printf("requests      %zu (%lu errors)\n", latency_count, errors);
+    printf("requests/s    %.0f\n", latency_count / elapsed);
+    printf("throughput    %.1f MB/s\n", bytes / elapsed / (1024 * 1024));
+    printf("latency ms    p50 %.3f  p95 %.3f  p99 %.3f  max %.3f\n",
+           percentile_ms(50), percentile_ms(95), percentile_ms(99), latencies[latency_count - 1] / 1000.0);
+    return errors ? 1 : 0;
+}
@@ -0,0 +1,138 @@
+#!/usr/bin/env python3
+"""Cold-start time of the kpm commands that never touch the network.
+
+Times `kpm` with no arguments, `kpm install small` against the registry
+directory (file://, nothing fetched over HTTP) and `kpm run` in a project with
+a makefile that does nothing, plus `kpm install small` over HTTP for scale. Each
+is the p50 wall and CPU time of --runs runs. With --before (a `make LAZY_CURL=0`
+build, or any other) the two are timed alternately and the change is printed.
+
+Also checks with --trace that only the HTTP install loads libcurl.
+"""
+import argparse
+import json
+import os
+import resource
+import shutil
+import subprocess
+import sys
+import tempfile
+import time
+
+import e2e
+
+TRIVIAL_MAKEFILE = "all:\n\t@true\n\nrun:\n\t@true\n"
+
+
+def no_setup(run_dir):
+    pass
+
+
+def run_setup(run_dir):
+    with open(os.path.join(run_dir, "makefile"), "w") as f:
+        f.write(TRIVIAL_MAKEFILE)
+
+
+class Command:
+    def __init__(self, name, args, setup, env, loads_curl, status=0):
+        self.name = name
+        self.args = args
+        self.setup = setup
+        self.env = env
+        self.loads_curl = loads_curl
+        self.status = status
+
+
+def time_once(kpm, command, run_dir, extra_args=()):
+    os.makedirs(run_dir)
+    command.setup(run_dir)
+    start = time.perf_counter()
+    usage = resource.getrusage(resource.RUSAGE_CHILDREN)
+    result = subprocess.run([kpm] + list(extra_args) + command.args, cwd=run_dir, env=command.env,
+                            stdout=subprocess.DEVNULL, stderr=subprocess.PIPE, text=True)
+    elapsed = (time.perf_counter() - start) * 1000
+    after = resource.getrusage(resource.RUSAGE_CHILDREN)
+    if result.returncode != command.status:
+        sys.stderr.write(result.stderr)
+        raise SystemExit("%s failed with exit code %d" % (command.name, result.returncode))
+    return elapsed, (after.ru_utime - usage.ru_utime + after.ru_stime - usage.ru_stime) * 1000
+
+
+def loads_curl(kpm, command, run_dir):
+    trace = os.path.join(run_dir, "..", os.path.basename(run_dir) + ".json")
+    time_once(kpm, command, run_dir, ["--trace=%s" % trace])
+    with open(trace) as f:
+        events = json.load(f)
+    events = events.get("traceEvents", events) if isinstance(events, dict) else events
+    return any(event.get("name", "").startswith("dlopen ") for event in events)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("--kpm", default=os.path.join(e2e.BENCH_DIR, "..", "kpm"))
+    parser.add_argument("--before", help="a build to compare with, e.g. make LAZY_CURL=0")
+    parser.add_argument("--runs", type=int, default=50)
+    args = parser.parse_args()
+    builds = [("after", os.path.abspath(args.kpm))]
+    if args.before:
+        builds.insert(0, ("before", os.path.abspath(args.before)))
+
+    work_dir = tempfile.mkdtemp(prefix="kpm-startup-")
+    local_root = os.path.join(work_dir, "local")
+    http_root = os.path.join(work_dir, "http")
+    os.makedirs(local_root)
+    os.makedirs(http_root)
+    local = e2e.LocalRegistry(e2e.make_registry(local_root, True, builds[-1][1]))
+    registry = e2e.Registry(e2e.make_registry(http_root))
+    try:
+        def env(url):
+            env = dict(os.environ, KPM_REGISTRY_URL=url, KPM_CACHE_DIR=os.path.join(work_dir, "cache"))
+            env.pop("KPM_REGISTRY_MIRRORS", None)
+            env.pop("KPM_PROXY", None)
+            return env
+
+        commands = [
+            Command("usage", [], no_setup, env(local.url), False, status=1),
+            Command("install (local)", ["install", "small"], e2e.write_project_json, env(local.url), False),
+            Command("run", ["run"], run_setup, env(local.url), False),
+            Command("install (http)", ["install", "small"], e2e.write_project_json, env(registry.url), True),
+        ]
+
+        failures = []
+        for command in commands:
+            run_dir = os.path.join(work_dir, "trace", command.name.replace(" ", "-"))
+            if loads_curl(builds[-1][1], command, run_dir) != command.loads_curl:
+                failures.append("%s %s libcurl" % (command.name, "did not load" if command.loads_curl else "loaded"))
+
+        samples = {}
+        for index in range(args.runs):
+            # Alternating keeps a noisy machine from favouring either build
+            order = builds if index % 2 == 0 else builds[::-1]
+            for label, kpm in order:
+                for command in commands:
+                    run_dir = os.path.join(work_dir, "runs", label, command.name.replace(" ", "-"), str(index))
+                    samples.setdefault((command.name, label), []).append(time_once(kpm, command, run_dir))
+    finally:
+        registry.close()
+        shutil.rmtree(work_dir, ignore_errors=True)
+
+    print("%-16s %10s %10s" % ("command", "p50 ms", "cpu ms") + ("  %10s %10s %8s" % ("before ms", "before cpu",
+                                                                                     "change") if args.before else ""))
+    for command in commands:
+        after = samples[(command.name, "after")]
+        wall = e2e.percentile([s[0] for s in after], 50)
+        cpu = e2e.percentile([s[1] for s in after], 50)
+        line = "%-16s %10.2f %10.2f" % (command.name, wall, cpu)
+        if args.before:
+            before = samples[(command.name, "before")]
+            before_wall = e2e.percentile([s[0] for s in before], 50)
+            line += "  %10.2f %10.2f %7.1f%%" % (before_wall, e2e.percentile([s[1] for s in before], 50),
+                                                 (wall - before_wall) / before_wall * 100)
+        print(line)
+    for failure in failures:
+        print("FAIL %s" % failure)
+    return 1 if failures else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,98 @@
+// Fetches and extracts a .tar.gz the way clib's fallback used to (download to a
+// file, then tar -xzf) and the way it does now (streamed through tarstream.c),
+// printing wall time for each. Run by tarball.py against kpm registry serve, and by
+// resume.py against a registry that drops connections.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <curl/curl.h>
+#include "../clib/tarstream.h"
+#include "../clib/download.h"
+
+static double now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+static size_t write_file(char *buffer, size_t size, size_t nmemb, void *userp) {
+    return fwrite(buffer, size, nmemb, userp);
+}
+
+typedef struct {
+    const char *dir;
+    TarStream *stream;
+} Archive;
+
+static size_t write_stream(const char *data, size_t size, void *userdata) {
+    Archive *archive = userdata;
+    return tar_stream_write(archive->stream, data, size) == 0 ? size : 0;
+}
+
+static int restart_stream(void *userdata) {
+    Archive *archive = userdata;
+    tar_stream_free(archive->stream);
+    archive->stream = tar_stream_new(archive->dir);
+    return archive->stream ? 0 : -1;
+}
+
+static int download(const char *url, curl_write_callback callback, void *userdata) {
+    CURL *curl = curl_easy_init();
+    curl_easy_setopt(curl, CURLOPT_URL, url);
+    curl_easy_setopt(curl, CURLOPT_FAILONERROR, 1L);
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, callback);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, userdata);
+    CURLcode res = curl_easy_perform(curl);
+    curl_easy_cleanup(curl);
+    if (res != CURLE_OK) {
+        fprintf(stderr, "curl_easy_perform() failed: %s\n", curl_easy_strerror(res));
+        return -1;
+    }
+    return 0;
+}
+
+static int tar_mode(const char *url, const char *dir) {
+    char archive[4200];
+    snprintf(archive, sizeof(archive), "%s/fallback.tar.gz", dir);
+    FILE *fp = fopen(archive, "wb");
+    if (fp == NULL) {
+        perror("fopen");
+        return -1;
+    }
+    int ret = download(url, write_file, fp);
+    fclose(fp);
+    if (ret != 0) {
+        return -1;
+    }
+    char command[8600];
+    snprintf(command, sizeof(command), "tar -xzf %s -C %s", archive, dir);
+    return system(command) == 0 ? 0 : -1;
+}
+
+static int stream_mode(const char *url, const char *dir) {
+    // Same download path as clib, so a dropped connection resumes
+    Archive archive = {dir, tar_stream_new(dir)};
+    if (archive.stream == NULL) {
+        return -1;
+    }
+    DownloadSink sink = {write_stream, restart_stream, &archive};
+    int ret = download_resumable(url, &sink);
+    if (ret == 0) {
+        ret = tar_stream_finish(archive.stream);
+    }
+    tar_stream_free(archive.stream);
+    return ret;
+}
+
+int main(int argc, char **argv) {
+    if (argc != 4 || (strcmp(argv[1], "tar") != 0 && strcmp(argv[1], "stream") != 0)) {
+        fprintf(stderr, "Usage: %s <tar|stream> <url> <dir>\n", argv[0]);
+        return 1;
+    }
+    curl_global_init(CURL_GLOBAL_DEFAULT);
+    double start = now_ms();
+    int ret = strcmp(argv[1], "tar") == 0 ? tar_mode(argv[2], argv[3]) : stream_mode(argv[2], argv[3]);
+    printf("%.2f\n", now_ms() - start);
+    return ret == 0 ? 0 : 1;
+}
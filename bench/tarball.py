@@ -0,0 +1,94 @@
+#!/usr/bin/env python3
+"""clib fallback extraction on a ~100 MB tarball.
+
+Builds a .tar.gz holding --size-mb of source-like files, serves it with
+`kpm registry serve` and runs bench/tar_stream in both modes: "tar" downloads
+the archive to disk and runs tar -xzf (the old fallback), "stream" inflates and
+extracts it in process as it arrives. Reports p50/min wall time per mode and
+checks both produced the same tree.
+"""
+import argparse
+import filecmp
+import os
+import random
+import shutil
+import statistics
+import subprocess
+import tarfile
+import tempfile
+
+BENCH_DIR = os.path.dirname(os.path.abspath(__file__))
+
+
+def make_tarball(path, size_mb):
+    rng = random.Random(1)
+    words = ["int", "return", "static", "struct", "value", "buffer", "size_t", "if", "for", "while", "char",
+             "const", "void", "NULL", "count", "length", "error", "result"]
+    source = os.path.join(os.path.dirname(path), "src")
+    written = 0
+    n = 0
+    while written < size_mb * 1024 * 1024:
+        file_path = os.path.join(source, "pkg", "dir%03d" % (n % 97), "file%05d.c" % n)
+        os.makedirs(os.path.dirname(file_path), exist_ok=True)
+        lines = []
+        target = rng.randint(2 * 1024, 256 * 1024)
+        size = 0
+        while size < target:
+            line = " ".join(rng.choice(words) for _ in range(rng.randint(3, 12))) + ";\n"
+            lines.append(line)
+            size += len(line)
+        with open(file_path, "w") as f:
+            f.write("".join(lines))
+        written += size
+        n += 1
+    with tarfile.open(path, "w:gz") as tar:
+        tar.add(os.path.join(source, "pkg"), arcname="pkg")
+    shutil.rmtree(source)
+    return n, written
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("--kpm", default=os.path.join(BENCH_DIR, "..", "kpm"))
+    parser.add_argument("--bench", default=os.path.join(BENCH_DIR, "tar_stream"))
+    parser.add_argument("--size-mb", type=int, default=100)
+    parser.add_argument("--iterations", type=int, default=5)
+    args = parser.parse_args()
+
+    with tempfile.TemporaryDirectory(prefix="kpm-tarball-") as work_dir:
+        serve_dir = os.path.join(work_dir, "serve")
+        os.makedirs(serve_dir)
+        archive = os.path.join(serve_dir, "fallback.tar.gz")
+        files, raw = make_tarball(archive, args.size_mb)
+        print("%d files, %.1f MB uncompressed, %.1f MB compressed" % (files, raw / 1e6, os.path.getsize(archive) / 1e6))
+
+        server = subprocess.Popen([os.path.abspath(args.kpm), "registry", "serve", serve_dir, "--port", "0"],
+                                  stdout=subprocess.PIPE, text=True)
+        try:
+            url = server.stdout.readline().strip().rsplit(" on ", 1)[1] + "/fallback.tar.gz"
+            times = {"tar": [], "stream": []}
+            for i in range(args.iterations):
+                for mode in times:
+                    out = os.path.join(work_dir, "%s-%d" % (mode, i))
+                    os.makedirs(out)
+                    result = subprocess.run([args.bench, mode, url, out], capture_output=True, text=True)
+                    if result.returncode != 0:
+                        raise SystemExit("%s failed: %s" % (mode, result.stderr))
+                    times[mode].append(float(result.stdout))
+                    if i > 0:
+                        shutil.rmtree(out)
+            diff = filecmp.dircmp(os.path.join(work_dir, "tar-0", "pkg"), os.path.join(work_dir, "stream-0", "pkg"))
+            if diff.left_only or diff.right_only or diff.diff_files or any(
+                    sub.left_only or sub.right_only or sub.diff_files for sub in diff.subdirs.values()):
+                raise SystemExit("tar and stream extracted different trees")
+        finally:
+            server.terminate()
+            server.wait()
+
+    print("%-8s %10s %10s" % ("mode", "p50 ms", "min ms"))
+    for mode, samples in times.items():
+        print("%-8s %10.1f %10.1f" % (mode, statistics.median(samples), min(samples)))
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,127 @@
+#!/usr/bin/env python3
+"""Keeps a catalogue of language templates fresh with `kpm template update`.
+
+Publishes copies of the fixture templates (24 by default) with `kpm template
+bundle --index`, then updates all of them against the stand-in: cold with
+nothing cached, warm with nothing changed upstream (only the index should be
+fetched), and after one template's main file changed and its version was bumped
+(index, its manifest and the two files that differ). Finally checks that kpm
+init takes the updated file from the cache without fetching the template.
+"""
+import argparse
+import json
+import os
+import re
+import shutil
+import subprocess
+import sys
+import tempfile
+import time
+
+import e2e
+
+SUMMARY = re.compile(r"^(\d+) templates: (\d+) updated, (\d+) up to date, (\d+) failed, (\d+) files fetched, "
+                     r"(\d+) bytes downloaded$", re.M)
+
+
+def copy_template(langs_dir, source, lang):
+    """langs/<source> as langs/<lang>, every path in its json pointed at the copy."""
+    shutil.copytree(os.path.join(langs_dir, source), os.path.join(langs_dir, lang))
+    json_path = os.path.join(langs_dir, lang, "%s.json" % lang)
+    os.rename(os.path.join(langs_dir, lang, "%s.json" % source), json_path)
+    with open(json_path) as f:
+        text = f.read().replace('"%s/' % source, '"%s/' % lang)
+    template = json.loads(text)
+    template["name"] = lang
+    with open(json_path, "w") as f:
+        json.dump(template, f, indent=4)
+    return "/%s/%s.json" % (lang, lang)
+
+
+def publish(kpm, langs_dir, lang):
+    subprocess.run([kpm, "template", "bundle", langs_dir, lang, "--index"], check=True, stdout=subprocess.DEVNULL)
+
+
+def update(kpm, registry, env, langs):
+    registry.reset()
+    start = time.perf_counter()
+    result = subprocess.run([kpm, "template", "update"] + langs, env=env, capture_output=True, text=True)
+    elapsed = (time.perf_counter() - start) * 1000
+    match = SUMMARY.search(result.stdout)
+    if result.returncode != 0 or match is None:
+        sys.stderr.write(result.stdout + result.stderr)
+        raise SystemExit("kpm template update failed")
+    stats = registry.snapshot(None)
+    _, updated, current, _, fetched, _ = map(int, match.groups())
+    return elapsed, updated, current, fetched, stats["requests"], stats["bytes"]
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("--kpm", default=os.path.join(e2e.BENCH_DIR, "..", "kpm"))
+    parser.add_argument("--templates", type=int, default=24)
+    args = parser.parse_args()
+    kpm = os.path.abspath(args.kpm)
+
+    with tempfile.TemporaryDirectory(prefix="kpm-template-update-") as work_dir:
+        root = e2e.make_registry(work_dir)
+        langs_dir = os.path.join(root, "langs")
+        with open(os.path.join(langs_dir, "index.json")) as f:
+            index = json.load(f)
+        langs = []
+        for i in range(args.templates):
+            source = e2e.INIT_LANGUAGES[i % len(e2e.INIT_LANGUAGES)]
+            lang = "%s%d" % (source, i)
+            index["langs"][lang] = {"path": copy_template(langs_dir, source, lang)}
+            langs.append(lang)
+        with open(os.path.join(langs_dir, "index.json"), "w") as f:
+            json.dump(index, f, indent=4)
+        for lang in langs:
+            publish(kpm, langs_dir, lang)
+
+        registry = e2e.Registry(root)
+        try:
+            env = dict(os.environ, KPM_REGISTRY_URL=registry.url, KPM_CACHE_DIR=os.path.join(work_dir, "cache"))
+            env.pop("KPM_REGISTRY_MIRRORS", None)
+            runs = [("cold", update(kpm, registry, env, langs)), ("warm", update(kpm, registry, env, []))]
+
+            changed = langs[0]
+            with open(os.path.join(langs_dir, changed, "main.c"), "a") as f:
+                f.write("// changed upstream\n")
+            json_path = os.path.join(langs_dir, changed, "%s.json" % changed)
+            with open(json_path) as f:
+                template = json.load(f)
+            template["template_version"] = "1.0.1"
+            with open(json_path, "w") as f:
+                json.dump(template, f, indent=4)
+            publish(kpm, langs_dir, changed)
+            runs.append(("one-changed", update(kpm, registry, env, [])))
+
+            # init from the refreshed snapshot and cache, only the licence is fetched
+            run_dir = os.path.join(work_dir, "init")
+            os.makedirs(run_dir)
+            registry.reset()
+            subprocess.run([kpm, "init"], cwd=run_dir, env=env, input=e2e.init_answers(changed), text=True,
+                           check=True, stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+            init_stats = registry.snapshot(None)
+            with open(os.path.join(run_dir, "src", "main.c")) as f:
+                init_changed = "// changed upstream" in f.read()
+        finally:
+            registry.close()
+
+    print("%-12s %10s %8s %11s %8s %9s %10s" % ("run", "ms", "updated", "up-to-date", "fetched", "requests",
+                                                "bytes"))
+    for name, (elapsed, updated, current, fetched, requests, downloaded) in runs:
+        print("%-12s %10.2f %8d %11d %8d %9d %10d" % (name, elapsed, updated, current, fetched, requests, downloaded))
+    print("init after update: %d requests, %d bytes" % (init_stats["requests"], init_stats["bytes"]))
+    warm, one = runs[1][1], runs[2][1]
+    if warm[4] != 1 or warm[3] != 0:
+        raise SystemExit("Expected the warm update to fetch only the index")
+    if one[4] != 4 or one[3] != 2:
+        raise SystemExit("Expected index, manifest and two files after one change")
+    if not init_changed:
+        raise SystemExit("kpm init did not use the updated template")
+
+
+if __name__ == "__main__":
+    main()
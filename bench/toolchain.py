@@ -0,0 +1,108 @@
+#!/usr/bin/env python3
+"""The toolchain probe cache behind `kpm doctor` and kpm init's compiler check.
+
+Puts stand-in compilers that take --delay seconds to start (a JVM or Swift
+toolchain) first on PATH, then runs `kpm doctor`: cold (every toolchain probed
+at once, so about one delay rather than one per toolchain), warm (nothing run),
+after one stand-in's binary changed (only it probed again) and with PATH
+changed (everything probed again). Finally runs the c template's compiler check
+through `kpm init` and counts the processes it spawned cold and warm.
+"""
+import argparse
+import os
+import re
+import shutil
+import subprocess
+import sys
+import tempfile
+import time
+
+import e2e
+
+SUMMARY = re.compile(r"^(\d+) of (\d+) toolchains found, (\d+) probed, (\d+) from ", re.M)
+SLOW_TOOLCHAINS = ["javac", "java", "swift", "zig"]
+
+
+def stand_in(bin_dir, name, delay):
+    path = os.path.join(bin_dir, name)
+    with open(path, "w") as f:
+        f.write("#!/bin/sh\nsleep %s\necho \"%s (stand-in) 1.0\"\n" % (delay, name))
+    os.chmod(path, 0o755)
+    return path
+
+
+def doctor(kpm, env):
+    start = time.perf_counter()
+    result = subprocess.run([kpm, "doctor"], env=env, capture_output=True, text=True)
+    elapsed = (time.perf_counter() - start) * 1000
+    match = SUMMARY.search(result.stdout)
+    if result.returncode != 0 or match is None:
+        sys.stderr.write(result.stdout + result.stderr)
+        raise SystemExit("kpm doctor failed")
+    found, _, probed, cached = map(int, match.groups())
+    return elapsed, found, probed, cached
+
+
+def init_spawns(kpm, registry, env, work_dir, name):
+    run_dir = os.path.join(work_dir, name)
+    os.makedirs(run_dir)
+    subprocess.run([kpm, "--stats=stats.prom", "init"], cwd=run_dir, env=env, input=e2e.init_answers("c"), text=True,
+                   check=True, stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+    with open(os.path.join(run_dir, "stats.prom")) as f:
+        samples = dict((k, int(v)) for k, v in e2e.STATS_SAMPLE.findall(f.read()))
+    return samples["kpm_processes_spawned"]
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("--kpm", default=os.path.join(e2e.BENCH_DIR, "..", "kpm"))
+    parser.add_argument("--delay", type=float, default=0.5, help="seconds each stand-in takes to start")
+    args = parser.parse_args()
+    kpm = os.path.abspath(args.kpm)
+
+    with tempfile.TemporaryDirectory(prefix="kpm-toolchain-") as work_dir:
+        bin_dir = os.path.join(work_dir, "bin")
+        os.makedirs(bin_dir)
+        for name in SLOW_TOOLCHAINS:
+            stand_in(bin_dir, name, args.delay)
+        env = dict(os.environ, KPM_CACHE_DIR=os.path.join(work_dir, "cache"),
+                   PATH=bin_dir + os.pathsep + os.environ.get("PATH", ""))
+        runs = [("cold", doctor(kpm, env)), ("warm", doctor(kpm, env))]
+        # A new build of one toolchain: same path, new inode and mtime
+        os.remove(os.path.join(bin_dir, "swift"))
+        stand_in(bin_dir, "swift", args.delay)
+        runs.append(("one-changed", doctor(kpm, env)))
+        other_bin = os.path.join(work_dir, "other-bin")
+        shutil.copytree(bin_dir, other_bin)
+        env["PATH"] = other_bin + os.pathsep + env["PATH"]
+        runs.append(("path-changed", doctor(kpm, env)))
+
+        root = e2e.make_registry(work_dir, kpm=kpm)
+        registry = e2e.Registry(root)
+        try:
+            init_env = dict(env, KPM_REGISTRY_URL=registry.url, KPM_CACHE_DIR=os.path.join(work_dir, "init-cache"))
+            init_env.pop("KPM_REGISTRY_MIRRORS", None)
+            spawns = [init_spawns(kpm, registry, init_env, work_dir, "init-cold"),
+                      init_spawns(kpm, registry, init_env, work_dir, "init-warm")]
+        finally:
+            registry.close()
+
+    print("%-13s %10s %6s %7s %7s" % ("run", "ms", "found", "probed", "cached"))
+    for name, (elapsed, found, probed, cached) in runs:
+        print("%-13s %10.2f %6d %7d %7d" % (name, elapsed, found, probed, cached))
+    print("kpm init (c) processes spawned: cold %d, warm %d" % tuple(spawns))
+    cold, warm, one, moved = [run[1] for run in runs]
+    if cold[0] > len(SLOW_TOOLCHAINS) * args.delay * 1000:
+        raise SystemExit("Expected the cold probes to run at once")
+    if warm[2] != 0:
+        raise SystemExit("Expected the warm run to probe nothing")
+    if one[2] != 1:
+        raise SystemExit("Expected only the changed toolchain probed")
+    if moved[2] != moved[1]:
+        raise SystemExit("Expected a PATH change to probe everything again")
+    if spawns[1] >= spawns[0]:
+        raise SystemExit("Expected kpm init to spawn less with the toolchain cached")
+
+
+if __name__ == "__main__":
+    main()
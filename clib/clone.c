@@ -0,0 +1,213 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include "clone.h"
+#include "cache/cache.h"
+
+#define GIT_MAX_ARGS 16
+
+static const char *strategy_names[] = {"full", "shallow", "partial", "sparse"};
+
+CloneStrategy clone_strategy(const char *name, size_t path_count) {
+    const char *env = getenv("KPM_CLONE_STRATEGY");
+    if (env && env[0] != '\0') {
+        name = env;
+    }
+    for (size_t i = 0; name && i < sizeof(strategy_names) / sizeof(strategy_names[0]); i++) {
+        if (strcmp(name, strategy_names[i]) == 0) {
+            return (CloneStrategy)i;
+        }
+    }
+    if (name) {
+        fprintf(stderr, "Unknown clone strategy %s, using the default\n", name);
+    }
+    return path_count > 0 ? CLONE_SPARSE : CLONE_PARTIAL;
+}
+
+// Runs git with argv (argv[0] is "git"), no shell in between
+static int run_git(const char *const *argv) {
+    fflush(stdout); // Keep our output ahead of git's
+    pid_t pid = fork();
+    if (pid == 0) {
+        execvp("git", (char *const *)argv);
+        perror("git");
+        _exit(127);
+    }
+    if (pid < 0) {
+        perror("fork");
+        return -1;
+    }
+    int status;
+    while (waitpid(pid, &status, 0) < 0) {
+        if (errno != EINTR) {
+            return -1;
+        }
+    }
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0 ? 0 : -1;
+}
+
+// The clone/fetch flags that make up a strategy
+static size_t strategy_args(CloneStrategy strategy, const char **argv, size_t argc) {
+    if (strategy == CLONE_SHALLOW) {
+        argv[argc++] = "--depth";
+        argv[argc++] = "1";
+    } else if (strategy == CLONE_PARTIAL || strategy == CLONE_SPARSE) {
+        argv[argc++] = "--filter=blob:none";
+    }
+    return argc;
+}
+
+static int remove_entry(const char *path, const struct stat *st, int flag, struct FTW *ftw) {
+    (void)st;
+    (void)flag;
+    (void)ftw;
+    return remove(path);
+}
+
+// Restricts dir to the top-level files and the declared paths, then fills in the
+// working tree. The checkout only asks the server for the blobs it needs
+static int checkout(const char *dir, CloneStrategy strategy, const char **paths, size_t path_count) {
+    if (strategy == CLONE_SPARSE && path_count > 0) {
+        const char **argv = calloc(path_count + 9, sizeof(char *));
+        char **patterns = calloc(path_count, sizeof(char *));
+        size_t argc = 0;
+        argv[argc++] = "git";
+        argv[argc++] = "-C";
+        argv[argc++] = dir;
+        argv[argc++] = "sparse-checkout";
+        argv[argc++] = "set";
+        argv[argc++] = "--no-cone";
+        argv[argc++] = "/*";
+        argv[argc++] = "!/*/";
+        for (size_t i = 0; i < path_count; i++) {
+            size_t size = strlen(paths[i]) + 2;
+            patterns[i] = malloc(size);
+            snprintf(patterns[i], size, "/%s", paths[i][0] == '/' ? paths[i] + 1 : paths[i]);
+            argv[argc++] = patterns[i];
+        }
+        int ret = run_git(argv);
+        for (size_t i = 0; i < path_count; i++) {
+            free(patterns[i]);
+        }
+        free(patterns);
+        free(argv);
+        if (ret != 0) {
+            return -1;
+        }
+    }
+    const char *reset[] = {"git", "-C", dir, "reset", "--hard", "-q", NULL};
+    return run_git(reset);
+}
+
+static int plain_clone(const char *git_url, const char *dir, CloneStrategy strategy, const char **paths, size_t path_count) {
+    const char *argv[GIT_MAX_ARGS];
+    size_t argc = 0;
+    argv[argc++] = "git";
+    argv[argc++] = "clone";
+    argv[argc++] = "--no-checkout";
+    argc = strategy_args(strategy, argv, argc);
+    argv[argc++] = "--";
+    argv[argc++] = git_url;
+    argv[argc++] = dir;
+    argv[argc] = NULL;
+    if (run_git(argv) != 0) {
+        return -1;
+    }
+    return checkout(dir, strategy, paths, path_count);
+}
+
+// Brings the bare repository in <cache>/git/ up to date and adds dir as a worktree of it
+static int cached_clone(const char *git_url, const char *dir, CloneStrategy strategy, const char **paths, size_t path_count) {
+    char cache[4096];
+    snprintf(cache, sizeof(cache), "%s/%s", get_cache_dir(), CLONE_CACHE_DIR);
+    if (make_dirs(cache) != 0) {
+        fprintf(stderr, "Failed to create %s: %s\n", cache, strerror(errno));
+        return -1;
+    }
+    char repo[4200];
+    char lock_path[4300];
+    char head[4300];
+    // A shallow or blobless repository can't stand in for a full one, each gets its own
+    const char *kind = strategy == CLONE_SPARSE ? strategy_names[CLONE_PARTIAL] : strategy_names[strategy];
+    snprintf(repo, sizeof(repo), "%s/%016llx-%s.git", cache, (unsigned long long)hash_bytes(git_url, strlen(git_url)), kind);
+    snprintf(lock_path, sizeof(lock_path), "%s.lock", repo);
+    snprintf(head, sizeof(head), "%s/HEAD", repo);
+    // Two installs of the same library would otherwise fetch into it at once
+    int lock = open(lock_path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (lock == -1 || flock(lock, LOCK_EX) != 0) {
+        fprintf(stderr, "Failed to lock %s: %s\n", lock_path, strerror(errno));
+        if (lock != -1) {
+            close(lock);
+        }
+        return -1;
+    }
+
+    int ret = 0;
+    const char *argv[GIT_MAX_ARGS];
+    size_t argc = 0;
+    if (access(head, F_OK) != 0) {
+        // Cloned next to it and renamed, so an interrupted clone is never mistaken for a cache
+        char tmp[4300];
+        snprintf(tmp, sizeof(tmp), "%s.tmp", repo);
+        nftw(tmp, remove_entry, 32, FTW_DEPTH | FTW_PHYS);
+        argv[argc++] = "git";
+        argv[argc++] = "clone";
+        argv[argc++] = "--bare";
+        argc = strategy_args(strategy, argv, argc);
+        argv[argc++] = "--";
+        argv[argc++] = git_url;
+        argv[argc++] = tmp;
+        argv[argc] = NULL;
+        ret = run_git(argv) == 0 && rename(tmp, repo) == 0 ? 0 : -1;
+    } else {
+        argv[argc++] = "git";
+        argv[argc++] = "-C";
+        argv[argc++] = repo;
+        argv[argc++] = "fetch";
+        argv[argc++] = "-q";
+        argv[argc++] = "--prune";
+        if (strategy == CLONE_SHALLOW) {
+            argv[argc++] = "--depth";
+            argv[argc++] = "1";
+        }
+        argv[argc++] = "origin";
+        argv[argc++] = "+refs/heads/*:refs/heads/*";
+        argv[argc] = NULL;
+        if (run_git(argv) != 0) {
+            fprintf(stderr, "Fetching %s failed, using the cached copy\n", git_url);
+        }
+    }
+
+    if (ret == 0) {
+        // Whatever an earlier install left in dir goes, prune forgets the worktree it was
+        const char *prune[] = {"git", "-C", repo, "worktree", "prune", NULL};
+        const char *add[] = {"git", "-C", repo, "worktree", "add", "-q", "--detach", "--no-checkout", dir, "HEAD", NULL};
+        nftw(dir, remove_entry, 32, FTW_DEPTH | FTW_PHYS);
+        run_git(prune);
+        ret = run_git(add) == 0 ? checkout(dir, strategy, paths, path_count) : -1;
+    }
+    flock(lock, LOCK_UN);
+    close(lock);
+    return ret;
+}
+
+int clone_library(const char *git_url, const char *dir, CloneStrategy strategy, const char **paths, size_t path_count) {
+    printf("Cloning %s (%s)\n", git_url, strategy_names[strategy]);
+    const char *cache = getenv("KPM_GIT_CACHE");
+    if (!cache || strcmp(cache, "0") != 0) {
+        if (cached_clone(git_url, dir, strategy, paths, path_count) == 0) {
+            return 0;
+        }
+        fprintf(stderr, "Cached clone failed, cloning directly\n");
+    }
+    nftw(dir, remove_entry, 32, FTW_DEPTH | FTW_PHYS);
+    return plain_clone(git_url, dir, strategy, paths, path_count);
+}
@@ -0,0 +1,27 @@
+#ifndef __CLONE__H
+#define __CLONE__H
+#include <stddef.h>
+
+// How clib gets a library's sources from its git_url. The library json can pick one with
+// "clone": "full" | "shallow" | "partial" | "sparse", KPM_CLONE_STRATEGY overrides it.
+//   full     every commit and blob, a plain git clone
+//   shallow  --depth 1, just the current commit
+//   partial  --filter=blob:none, blobs are only fetched for the tree that is checked out
+//   sparse   partial, and only the top-level files plus src_paths/header_paths are checked out
+// The default is sparse when the library declares paths and partial otherwise.
+// Unless KPM_GIT_CACHE=0 the repository is kept bare in <cache>/git/ and each install
+// checks out a worktree of it, so a repeat install only fetches the new commits.
+#define CLONE_CACHE_DIR "git"
+
+typedef enum {
+    CLONE_FULL,
+    CLONE_SHALLOW,
+    CLONE_PARTIAL,
+    CLONE_SPARSE
+} CloneStrategy;
+
+// name is the library json's "clone" value, NULL if it has none
+CloneStrategy clone_strategy(const char *name, size_t path_count);
+// 0 once dir holds a checkout of git_url, anything already in dir is replaced
+int clone_library(const char *git_url, const char *dir, CloneStrategy strategy, const char **paths, size_t path_count);
+#endif //__CLONE__H
@@ -0,0 +1,185 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include <curl/curl.h>
+#include "download.h"
+
+typedef struct {
+    const DownloadSink *sink;
+    CURL *curl;
+    unsigned long long offset;  // Body bytes handed to the sink so far
+    int checked;                // The status of this try has been looked at
+    int sink_failed;
+    char validator[128];        // ETag, or failing that Last-Modified
+} DownloadState;
+
+static size_t write_body(char *data, size_t size, size_t nmemb, void *userp) {
+    DownloadState *state = userp;
+    size_t len = size * nmemb;
+    if (!state->checked) {
+        state->checked = 1;
+        long status = 0;
+        curl_easy_getinfo(state->curl, CURLINFO_RESPONSE_CODE, &status);
+        if (state->offset > 0 && status != 206) {
+            if (state->sink->restart(state->sink->userdata) != 0) {
+                state->sink_failed = 1;
+                return 0;
+            }
+            state->offset = 0;
+        }
+    }
+    if (state->sink->write(data, len, state->sink->userdata) != len) {
+        state->sink_failed = 1;
+        return 0;
+    }
+    state->offset += len;
+    return len;
+}
+
+// Keeps the validator of the final response, redirects reset it
+static size_t read_header(char *buffer, size_t size, size_t nitems, void *userp) {
+    DownloadState *state = userp;
+    size_t len = size * nitems;
+    char line[256];
+    size_t copy = len < sizeof(line) - 1 ? len : sizeof(line) - 1;
+    memcpy(line, buffer, copy);
+    line[copy] = '\0';
+    line[strcspn(line, "\r\n")] = '\0';
+    if (strncmp(line, "HTTP/", 5) == 0) {
+        state->validator[0] = '\0';
+    } else if (strncasecmp(line, "ETag:", 5) == 0) {
+        snprintf(state->validator, sizeof(state->validator), "%s", line + 5 + strspn(line + 5, " \t"));
+    } else if (strncasecmp(line, "Last-Modified:", 14) == 0 && state->validator[0] == '\0') {
+        snprintf(state->validator, sizeof(state->validator), "%s", line + 14 + strspn(line + 14, " \t"));
+    }
+    return len;
+}
+
+static int retryable(CURLcode res, long status) {
+    switch (res) {
+        case CURLE_HTTP_RETURNED_ERROR:
+            return status == 429 || status >= 500;
+        case CURLE_COULDNT_RESOLVE_HOST:
+        case CURLE_COULDNT_CONNECT:
+        case CURLE_OPERATION_TIMEDOUT:
+        case CURLE_SEND_ERROR:
+        case CURLE_RECV_ERROR:
+        case CURLE_PARTIAL_FILE:
+        case CURLE_GOT_NOTHING:
+        case CURLE_HTTP2:
+        case CURLE_HTTP2_STREAM:
+        case CURLE_SSL_CONNECT_ERROR:
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+// Full jitter: anywhere from 0 to base * 2^retry
+static void backoff(const char *url, int retry) {
+    static unsigned int seed = 0;
+    if (seed == 0) {
+        seed = (unsigned int)time(NULL) ^ (unsigned int)getpid();
+    }
+    long cap = DOWNLOAD_BASE_DELAY_MS << (retry < 16 ? retry : 16);
+    if (cap > DOWNLOAD_MAX_DELAY_MS) {
+        cap = DOWNLOAD_MAX_DELAY_MS;
+    }
+    long delay = rand_r(&seed) % (cap + 1);
+    fprintf(stderr, "Retrying %s in %ld ms\n", url, delay);
+    struct timespec ts = {delay / 1000, (delay % 1000) * 1000000L};
+    nanosleep(&ts, NULL);
+}
+
+int download_resumable(const char *url, const DownloadSink *sink) {
+    const char *env = getenv("KPM_RETRIES");
+    int retries = env && env[0] != '\0' ? atoi(env) : DOWNLOAD_RETRIES;
+    DownloadState state;
+    memset(&state, 0, sizeof(state));
+    state.sink = sink;
+    state.curl = curl_easy_init();
+    if (state.curl == NULL) {
+        fprintf(stderr, "Failed to initialize curl\n");
+        return -1;
+    }
+    int ret = -1;
+    for (int retry = 0;; retry++) {
+        char range[64];
+        char if_range[160];
+        struct curl_slist *headers = NULL;
+        curl_easy_reset(state.curl);
+        curl_easy_setopt(state.curl, CURLOPT_URL, url);
+        curl_easy_setopt(state.curl, CURLOPT_FOLLOWLOCATION, 1L);
+        curl_easy_setopt(state.curl, CURLOPT_FAILONERROR, 1L);
+        curl_easy_setopt(state.curl, CURLOPT_WRITEFUNCTION, write_body);
+        curl_easy_setopt(state.curl, CURLOPT_WRITEDATA, &state);
+        curl_easy_setopt(state.curl, CURLOPT_HEADERFUNCTION, read_header);
+        curl_easy_setopt(state.curl, CURLOPT_HEADERDATA, &state);
+        if (state.offset > 0 && state.validator[0]) {
+            // If-Range makes sure the rest belongs to the same object as what we have
+            snprintf(range, sizeof(range), "%llu-", state.offset);
+            snprintf(if_range, sizeof(if_range), "If-Range: %s", state.validator);
+            headers = curl_slist_append(headers, if_range);
+            curl_easy_setopt(state.curl, CURLOPT_RANGE, range);
+            curl_easy_setopt(state.curl, CURLOPT_HTTPHEADER, headers);
+        } else if (state.offset > 0) {
+            if (sink->restart(sink->userdata) != 0) {
+                break;
+            }
+            state.offset = 0; // Nothing to check a range against
+        }
+        state.checked = 0;
+        CURLcode res = curl_easy_perform(state.curl);
+        long status = 0;
+        curl_easy_getinfo(state.curl, CURLINFO_RESPONSE_CODE, &status);
+        curl_slist_free_all(headers);
+        if (res == CURLE_OK) {
+            ret = 0;
+            break;
+        }
+        if (res == CURLE_HTTP_RETURNED_ERROR && status == 416 && state.offset > 0) {
+            state.validator[0] = '\0'; // What we have no longer fits, the next try starts over
+        } else if (state.sink_failed || retry >= retries || !retryable(res, status)) {
+            fprintf(stderr, "curl_easy_perform() failed: %s\n", curl_easy_strerror(res));
+            break;
+        }
+        if (retry >= retries) {
+            break;
+        }
+        backoff(url, retry);
+    }
+    curl_easy_cleanup(state.curl);
+    return ret;
+}
+
+static size_t write_part(const char *data, size_t size, void *userdata) {
+    return fwrite(data, 1, size, userdata);
+}
+
+static int restart_part(void *userdata) {
+    FILE *fp = userdata;
+    return fflush(fp) == 0 && ftruncate(fileno(fp), 0) == 0 && fseek(fp, 0, SEEK_SET) == 0 ? 0 : -1;
+}
+
+int download_file(const char *url, const char *path) {
+    char part_path[4200];
+    snprintf(part_path, sizeof(part_path), "%s.part", path);
+    FILE *fp = fopen(part_path, "wb");
+    if (!fp) {
+        perror("fopen");
+        return -1;
+    }
+    DownloadSink sink = {write_part, restart_part, fp};
+    int ret = download_resumable(url, &sink);
+    if (fclose(fp) != 0) {
+        ret = -1;
+    }
+    if (ret != 0 || rename(part_path, path) != 0) {
+        unlink(part_path);
+        return -1;
+    }
+    return 0;
+}
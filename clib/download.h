@@ -0,0 +1,24 @@
+#ifndef __DOWNLOAD__H
+#define __DOWNLOAD__H
+#include <stddef.h>
+
+// Downloads that survive a dropped connection. Connection failures, 429 and 5xx are
+// retried with exponential backoff and full jitter (KPM_RETRIES sets how often), and a
+// retry asks for the rest of the body with Range/If-Range instead of starting over.
+#define DOWNLOAD_RETRIES 4
+#define DOWNLOAD_BASE_DELAY_MS 250
+#define DOWNLOAD_MAX_DELAY_MS 8000
+
+typedef struct {
+    // Gets the body in order, returns size or anything else to abort
+    size_t (*write)(const char *data, size_t size, void *userdata);
+    // The server is sending the whole body again (no range support, or the object
+    // changed), everything written so far has to go. 0 to carry on
+    int (*restart)(void *userdata);
+    void *userdata;
+} DownloadSink;
+
+int download_resumable(const char *url, const DownloadSink *sink);
+// Downloads into <path>.part and renames it to path once complete
+int download_file(const char *url, const char *path);
+#endif //__DOWNLOAD__H
@@ -5,43 +5,16 @@
 #include <curl/curl.h>
 #include <unistd.h>
 #include <sys/types.h>
+#include <sys/stat.h>
 #include <sys/wait.h>
+#include "registry/registry.h"
+#include "tarstream.h"
+#include "clone.h"
+#include "download.h"
 
 #define TMP_DIR "/tmp/libmanager"
 #define LIBS_DIR "libs"
 
-size_t write_data(void *buffer, size_t size, size_t nmemb, void *userp) {
-    FILE *fp = (FILE *)userp;
-    return fwrite(buffer, size, nmemb, fp);
-}
-
-void download_file(const char *url, const char *filename) {
-    CURL *curl;
-    FILE *fp;
-    CURLcode res;
-
-    curl = curl_easy_init();
-    if (curl) {
-        fp = fopen(filename, "wb");
-        if (!fp) {
-            perror("fopen");
-            return;
-        }
-
-        curl_easy_setopt(curl, CURLOPT_URL, url);
-        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_data);
-        curl_easy_setopt(curl, CURLOPT_WRITEDATA, fp);
-
-        res = curl_easy_perform(curl);
-        if (res != CURLE_OK) {
-            fprintf(stderr, "curl_easy_perform() failed: %s\n", curl_easy_strerror(res));
-        }
-
-        fclose(fp);
-        curl_easy_cleanup(curl);
-    }
-}
-
 void execute_commands(json_t *commands) {
     json_t *command;
     size_t i;
@@ -55,16 +28,41 @@ void execute_commands(json_t *commands) {
     }
 }
 
-int clone_repository(const char *git_url, const char *dir) {
-    char command[512];
-    snprintf(command, sizeof(command), "git clone %s %s", git_url, dir);
-    return system(command);
+typedef struct {
+    const char *dir;
+    TarStream *stream;
+} Archive;
+
+static size_t write_archive(const char *data, size_t size, void *userdata) {
+    Archive *archive = userdata;
+    return tar_stream_write(archive->stream, data, size) == 0 ? size : 0;
 }
 
-int extract_archive(const char *filename, const char *dir) {
-    char command[512];
-    snprintf(command, sizeof(command), "tar -xzvf %s -C %s", filename, dir);
-    return system(command);
+// The server sent the whole archive again, the files written so far get overwritten
+static int restart_archive(void *userdata) {
+    Archive *archive = userdata;
+    tar_stream_free(archive->stream);
+    archive->stream = tar_stream_new(archive->dir);
+    return archive->stream ? 0 : -1;
+}
+
+// Extracts the .tar.gz at url into dir while it downloads, nothing is staged on disk.
+// A dropped connection picks up where it left off
+int stream_archive(const char *url, const char *dir) {
+    Archive archive = {dir, tar_stream_new(dir)};
+    if (!archive.stream) {
+        fprintf(stderr, "Failed to initialize the download\n");
+        return -1;
+    }
+    DownloadSink sink = {write_archive, restart_archive, &archive};
+    int ret = download_resumable(url, &sink);
+    if (ret == 0 && archive.stream && tar_stream_finish(archive.stream) != 0) {
+        ret = -1;
+    } else if (ret == 0) {
+        printf("Extracted %zu entries, %llu bytes\n", tar_stream_entries(archive.stream), tar_stream_bytes(archive.stream));
+    }
+    tar_stream_free(archive.stream);
+    return ret;
 }
 
 void build_library(const char *build_dir, json_t *build_commands) {
@@ -73,29 +71,10 @@ void build_library(const char *build_dir, json_t *build_commands) {
 }
 
 void process_library(const char *name) {
-    char url[256];
-    snprintf(url, sizeof(url), "https://github.com/KingVentrix007/KickStartFiles/libs/%s.json", name);
-
-    CURL *curl = curl_easy_init();
-    if (!curl) {
-        fprintf(stderr, "Failed to initialize curl\n");
-        return;
-    }
-
-    FILE *fp = fopen("library.json", "wb");
-    if (!fp) {
-        perror("fopen");
-        return;
-    }
-
-    curl_easy_setopt(curl, CURLOPT_URL, url);
-    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_data);
-    curl_easy_setopt(curl, CURLOPT_WRITEDATA, fp);
-    CURLcode res = curl_easy_perform(curl);
-    fclose(fp);
-    curl_easy_cleanup(curl);
+    char url[1024];
+    snprintf(url, sizeof(url), "%s/%s.json", registry_libs_url(), name);
 
-    if (res != CURLE_OK) {
+    if (download_file(url, "library.json") != 0) {
         fprintf(stderr, "Failed to download JSON file\n");
         return;
     }
@@ -117,15 +96,28 @@ void process_library(const char *name) {
         char clone_dir[256];
         snprintf(clone_dir, sizeof(clone_dir), "%s/%s", TMP_DIR, name);
 
-        if (clone_repository(json_string_value(git_url), clone_dir) != 0) {
+        // Only these are needed from cpkg-style libraries, the rest of the tree can stay on the server
+        const char *paths[1024];
+        size_t path_count = 0;
+        const char *lists[] = {"src_paths", "header_paths"};
+        for (size_t l = 0; l < 2; l++) {
+            json_t *list = json_object_get(root, lists[l]);
+            for (size_t i = 0; json_is_array(list) && i < json_array_size(list) && path_count < 1024; i++) {
+                if (json_is_string(json_array_get(list, i))) {
+                    paths[path_count++] = json_string_value(json_array_get(list, i));
+                }
+            }
+        }
+        json_t *clone = json_object_get(root, "clone");
+        CloneStrategy strategy = clone_strategy(json_is_string(clone) ? json_string_value(clone) : NULL, path_count);
+
+        if (clone_library(json_string_value(git_url), clone_dir, strategy, paths, path_count) != 0) {
             printf("Cloning failed. Attempting fallback...\n");
 
             if (json_is_string(fallback_url)) {
-                char fallback_file[256];
-                snprintf(fallback_file, sizeof(fallback_file), "%s/fallback.tar.gz", TMP_DIR);
-                download_file(json_string_value(fallback_url), fallback_file);
-                extract_archive(fallback_file, TMP_DIR);
-                execute_commands(fallback_commands);
+                if (stream_archive(json_string_value(fallback_url), TMP_DIR) == 0) {
+                    execute_commands(fallback_commands);
+                }
             }
         }
 
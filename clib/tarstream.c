@@ -0,0 +1,431 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <zlib.h>
+#include "tarstream.h"
+#include "cache/cache.h"
+
+#define TAR_META_MAX (1024 * 1024) // Long names and pax headers, anything bigger is refused
+
+typedef enum {
+    TAR_HEADER,
+    TAR_DATA,
+    TAR_META,
+    TAR_PADDING,
+    TAR_END
+} TarState;
+
+struct TarStream {
+    z_stream zs;
+    int member_done;                // The current gzip member has ended
+    unsigned char *out;
+    char dir[1024];
+    TarState state;
+    unsigned char header[TAR_BLOCK];
+    size_t header_fill;
+    unsigned long long entry_size;  // Data bytes in the current entry, padded to a block
+    unsigned long long remaining;   // Of those, still to come
+    size_t padding;                 // Bytes left before the next block
+    int fd;                         // File being written, -1 while skipping
+    char path[4096];
+    long long mtime;
+    char meta_type;                 // 'L', 'K' or 'x' while collecting their data
+    char *meta;
+    size_t meta_fill;
+    char long_name[4096];           // Set by an L or pax record for the next entry
+    char long_link[4096];
+    unsigned long long pax_size;
+    int has_pax_size;
+    int zero_blocks;
+    int error;
+    size_t entries;
+    unsigned long long bytes;
+};
+
+// Octal, or base-256 (GNU) when the high bit of the first byte is set
+static unsigned long long parse_number(const unsigned char *field, size_t size) {
+    unsigned long long value = 0;
+    if (field[0] & 0x80) {
+        value = field[0] & 0x7f;
+        for (size_t i = 1; i < size; i++) {
+            value = (value << 8) | field[i];
+        }
+        return value;
+    }
+    size_t i = 0;
+    while (i < size && (field[i] == ' ' || field[i] == '\0')) {
+        i++;
+    }
+    for (; i < size && field[i] >= '0' && field[i] <= '7'; i++) {
+        value = value * 8 + (field[i] - '0');
+    }
+    return value;
+}
+
+static int checksum_ok(const unsigned char *header) {
+    unsigned long long sum = 0;
+    for (size_t i = 0; i < TAR_BLOCK; i++) {
+        sum += (i >= 148 && i < 156) ? ' ' : header[i];
+    }
+    return sum == parse_number(header + 148, 8);
+}
+
+// The entry name with any leading ./ dropped, NULL if it could leave the directory
+static const char *safe_path(const char *path) {
+    while (strncmp(path, "./", 2) == 0) {
+        path += 2;
+    }
+    return safe_relative_path(path) ? path : NULL;
+}
+
+static int make_parents(char *path) {
+    for (char *p = path + 1; *p; p++) {
+        if (*p == '/') {
+            *p = '\0';
+            int ret = mkdir(path, 0755);
+            *p = '/';
+            if (ret != 0 && errno != EEXIST) {
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+// pax records are "<length> <key>=<value>\n"
+static void parse_pax(TarStream *stream) {
+    char *p = stream->meta;
+    char *end = stream->meta + stream->meta_fill;
+    while (p < end) {
+        char *space;
+        unsigned long length = strtoul(p, &space, 10);
+        if (*space != ' ' || length == 0 || p + length > end) {
+            return;
+        }
+        char *key = space + 1;
+        char *equals = memchr(key, '=', p + length - key);
+        if (equals != NULL) {
+            int value_len = (int)(p + length - 1 - (equals + 1));
+            if (strncmp(key, "path=", 5) == 0) {
+                snprintf(stream->long_name, sizeof(stream->long_name), "%.*s", value_len, equals + 1);
+            } else if (strncmp(key, "linkpath=", 9) == 0) {
+                snprintf(stream->long_link, sizeof(stream->long_link), "%.*s", value_len, equals + 1);
+            } else if (strncmp(key, "size=", 5) == 0) {
+                stream->pax_size = strtoull(equals + 1, NULL, 10);
+                stream->has_pax_size = 1;
+            }
+        }
+        p += length;
+    }
+}
+
+static void start_padding(TarStream *stream, unsigned long long size) {
+    stream->padding = (TAR_BLOCK - size % TAR_BLOCK) % TAR_BLOCK;
+    stream->state = stream->padding ? TAR_PADDING : TAR_HEADER;
+}
+
+static void finish_entry(TarStream *stream) {
+    if (stream->fd != -1) {
+        struct timespec times[2] = {{stream->mtime, 0}, {stream->mtime, 0}};
+        futimens(stream->fd, times); // make decides what to rebuild from these
+        if (close(stream->fd) != 0) {
+            fprintf(stderr, "Error writing %s: %s\n", stream->path, strerror(errno));
+            stream->error = 1;
+        }
+        stream->fd = -1;
+    }
+}
+
+static void start_entry(TarStream *stream) {
+    const unsigned char *h = stream->header;
+    char name[4096];
+    char link_name[4096];
+    if (stream->long_name[0]) {
+        snprintf(name, sizeof(name), "%s", stream->long_name);
+    } else if (memcmp(h + 257, "ustar", 5) == 0 && h[345]) {
+        snprintf(name, sizeof(name), "%.155s/%.100s", (const char *)h + 345, (const char *)h);
+    } else {
+        snprintf(name, sizeof(name), "%.100s", (const char *)h);
+    }
+    if (stream->long_link[0]) {
+        snprintf(link_name, sizeof(link_name), "%s", stream->long_link);
+    } else {
+        snprintf(link_name, sizeof(link_name), "%.100s", (const char *)h + 157);
+    }
+    unsigned long long size = stream->has_pax_size ? stream->pax_size : parse_number(h + 124, 12);
+    char type = (char)h[156];
+    stream->long_name[0] = '\0';
+    stream->long_link[0] = '\0';
+    stream->has_pax_size = 0;
+    stream->entry_size = size;
+    stream->remaining = size;
+    stream->fd = -1;
+    stream->state = TAR_DATA;
+
+    const char *relative = safe_path(name);
+    if (relative == NULL) {
+        fprintf(stderr, "Skipping %s, it points outside %s\n", name, stream->dir);
+        return;
+    }
+    if (snprintf(stream->path, sizeof(stream->path), "%s/%s", stream->dir, relative) >= (int)sizeof(stream->path)) {
+        fprintf(stderr, "Skipping %s, the path is too long\n", name);
+        return;
+    }
+    if (make_parents(stream->path) != 0) {
+        fprintf(stderr, "Error creating directories for %s: %s\n", stream->path, strerror(errno));
+        stream->error = 1;
+        return;
+    }
+    mode_t mode = (mode_t)parse_number(h + 100, 8) & 0777;
+    stream->mtime = (long long)parse_number(h + 136, 12);
+    stream->entries++;
+    switch (type) {
+        case '0':
+        case '\0':
+        case '7':
+            unlink(stream->path); // Never write through a link an earlier entry left here
+            stream->fd = open(stream->path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC | O_NOFOLLOW, mode | 0600);
+            if (stream->fd == -1) {
+                fprintf(stderr, "Error creating %s: %s\n", stream->path, strerror(errno));
+                stream->error = 1;
+            }
+            break;
+        case '5':
+            if (mkdir(stream->path, mode | 0700) != 0 && errno != EEXIST) {
+                fprintf(stderr, "Error creating %s: %s\n", stream->path, strerror(errno));
+                stream->error = 1;
+            }
+            break;
+        case '2':
+            if (link_name[0] == '/' || strstr(link_name, "..") != NULL) {
+                fprintf(stderr, "Skipping symlink %s -> %s\n", name, link_name);
+                break;
+            }
+            unlink(stream->path);
+            if (symlink(link_name, stream->path) != 0) {
+                fprintf(stderr, "Error creating %s: %s\n", stream->path, strerror(errno));
+            }
+            break;
+        case '1': {
+            const char *target = safe_path(link_name);
+            char target_path[8200];
+            if (target == NULL) {
+                fprintf(stderr, "Skipping hard link %s -> %s\n", name, link_name);
+                break;
+            }
+            snprintf(target_path, sizeof(target_path), "%s/%s", stream->dir, target);
+            unlink(stream->path);
+            if (link(target_path, stream->path) != 0) {
+                fprintf(stderr, "Error linking %s: %s\n", stream->path, strerror(errno));
+            }
+            break;
+        }
+        default:
+            break; // Devices, fifos and unknown types are skipped
+    }
+}
+
+static void read_header(TarStream *stream) {
+    const unsigned char *h = stream->header;
+    int zero = 1;
+    for (size_t i = 0; i < TAR_BLOCK && zero; i++) {
+        zero = h[i] == 0;
+    }
+    if (zero) {
+        if (++stream->zero_blocks == 2) {
+            stream->state = TAR_END;
+        }
+        return;
+    }
+    stream->zero_blocks = 0;
+    if (!checksum_ok(h)) {
+        fprintf(stderr, "Corrupt tar header\n");
+        stream->error = 1;
+        return;
+    }
+    char type = (char)h[156];
+    if (type == 'L' || type == 'K' || type == 'x') {
+        stream->entry_size = parse_number(h + 124, 12);
+        stream->remaining = stream->entry_size;
+        if (stream->remaining > TAR_META_MAX) {
+            fprintf(stderr, "Tar header record too large\n");
+            stream->error = 1;
+            return;
+        }
+        stream->meta = realloc(stream->meta, stream->remaining + 1);
+        stream->meta_fill = 0;
+        stream->meta_type = type;
+        stream->state = stream->remaining ? TAR_META : TAR_HEADER;
+        return;
+    }
+    if (type == 'g') {
+        stream->entry_size = parse_number(h + 124, 12); // Global pax headers are ignored
+        stream->remaining = stream->entry_size;
+        stream->fd = -1;
+        stream->state = TAR_DATA;
+    } else {
+        start_entry(stream);
+    }
+    if (stream->state == TAR_DATA && stream->remaining == 0) {
+        finish_entry(stream);
+        stream->state = TAR_HEADER;
+    }
+}
+
+static void finish_meta(TarStream *stream) {
+    stream->meta[stream->meta_fill] = '\0';
+    if (stream->meta_type == 'L') {
+        snprintf(stream->long_name, sizeof(stream->long_name), "%s", stream->meta);
+    } else if (stream->meta_type == 'K') {
+        snprintf(stream->long_link, sizeof(stream->long_link), "%s", stream->meta);
+    } else {
+        parse_pax(stream);
+    }
+}
+
+// Runs the tar state machine over freshly inflated bytes
+static void consume(TarStream *stream, const unsigned char *data, size_t size) {
+    while (size > 0 && !stream->error) {
+        size_t n = 0;
+        switch (stream->state) {
+            case TAR_HEADER:
+                n = TAR_BLOCK - stream->header_fill;
+                n = n < size ? n : size;
+                memcpy(stream->header + stream->header_fill, data, n);
+                stream->header_fill += n;
+                if (stream->header_fill == TAR_BLOCK) {
+                    stream->header_fill = 0;
+                    read_header(stream);
+                }
+                break;
+            case TAR_DATA:
+            case TAR_META:
+                n = stream->remaining < size ? (size_t)stream->remaining : size;
+                if (stream->state == TAR_META) {
+                    memcpy(stream->meta + stream->meta_fill, data, n);
+                    stream->meta_fill += n;
+                } else if (stream->fd != -1) {
+                    for (size_t written = 0; written < n;) {
+                        ssize_t ret = write(stream->fd, data + written, n - written);
+                        if (ret < 0) {
+                            if (errno == EINTR) {
+                                continue;
+                            }
+                            fprintf(stderr, "Error writing %s: %s\n", stream->path, strerror(errno));
+                            stream->error = 1;
+                            return;
+                        }
+                        written += (size_t)ret;
+                    }
+                    stream->bytes += n;
+                }
+                stream->remaining -= n;
+                if (stream->remaining == 0) {
+                    if (stream->state == TAR_META) {
+                        finish_meta(stream);
+                    } else {
+                        finish_entry(stream);
+                    }
+                    start_padding(stream, stream->entry_size);
+                }
+                break;
+            case TAR_PADDING:
+                n = stream->padding < size ? stream->padding : size;
+                stream->padding -= n;
+                if (stream->padding == 0) {
+                    stream->state = TAR_HEADER;
+                }
+                break;
+            case TAR_END:
+                return; // Trailing zero blocks
+        }
+        data += n;
+        size -= n;
+    }
+}
+
+TarStream *tar_stream_new(const char *dir) {
+    TarStream *stream = calloc(1, sizeof(TarStream));
+    if (stream == NULL) {
+        return NULL;
+    }
+    stream->out = malloc(TAR_INFLATE_CHUNK);
+    // 15 + 32: gzip or zlib header, detected automatically
+    if (stream->out == NULL || inflateInit2(&stream->zs, 15 + 32) != Z_OK) {
+        free(stream->out);
+        free(stream);
+        return NULL;
+    }
+    snprintf(stream->dir, sizeof(stream->dir), "%s", dir);
+    stream->fd = -1;
+    stream->state = TAR_HEADER;
+    return stream;
+}
+
+int tar_stream_write(TarStream *stream, const void *data, size_t size) {
+    stream->zs.next_in = (unsigned char *)data;
+    stream->zs.avail_in = (unsigned int)size;
+    while (!stream->error) {
+        if (stream->member_done) {
+            if (stream->zs.avail_in == 0 || stream->state == TAR_END) {
+                break; // Nothing but padding after the archive
+            }
+            inflateReset(&stream->zs); // Concatenated gzip members
+            stream->member_done = 0;
+        }
+        stream->zs.next_out = stream->out;
+        stream->zs.avail_out = TAR_INFLATE_CHUNK;
+        int ret = inflate(&stream->zs, Z_NO_FLUSH);
+        if (ret != Z_OK && ret != Z_STREAM_END && ret != Z_BUF_ERROR) {
+            fprintf(stderr, "Error decompressing archive: %s\n", stream->zs.msg ? stream->zs.msg : "corrupt data");
+            stream->error = 1;
+            break;
+        }
+        consume(stream, stream->out, TAR_INFLATE_CHUNK - stream->zs.avail_out);
+        if (ret == Z_STREAM_END) {
+            stream->member_done = 1;
+        } else if (stream->zs.avail_in == 0 && stream->zs.avail_out != 0) {
+            break;
+        } else if (ret == Z_BUF_ERROR) {
+            break;
+        }
+    }
+    return stream->error ? -1 : 0;
+}
+
+int tar_stream_finish(TarStream *stream) {
+    if (stream->error) {
+        return -1;
+    }
+    // Some writers stop after a single zero block, or none at all
+    if (!stream->member_done || (stream->state != TAR_END && !(stream->state == TAR_HEADER && stream->header_fill == 0))) {
+        fprintf(stderr, "Archive is truncated\n");
+        return -1;
+    }
+    return 0;
+}
+
+void tar_stream_free(TarStream *stream) {
+    if (stream == NULL) {
+        return;
+    }
+    if (stream->fd != -1) {
+        close(stream->fd);
+    }
+    inflateEnd(&stream->zs);
+    free(stream->out);
+    free(stream->meta);
+    free(stream);
+}
+
+size_t tar_stream_entries(const TarStream *stream) {
+    return stream->entries;
+}
+
+unsigned long long tar_stream_bytes(const TarStream *stream) {
+    return stream->bytes;
+}
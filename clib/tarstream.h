@@ -0,0 +1,23 @@
+#ifndef __TARSTREAM__H
+#define __TARSTREAM__H
+#include <stddef.h>
+
+// Extracts a .tar.gz as it arrives: bytes fed in are inflated with zlib and the tar
+// entries written out straight away, so nothing is staged on disk and no tar process
+// is needed. Handles ustar, GNU long names and pax path/linkpath/size records.
+// Paths that would leave dir (absolute, ..) are skipped.
+#define TAR_BLOCK 512
+#define TAR_INFLATE_CHUNK (256 * 1024)
+
+typedef struct TarStream TarStream;
+
+TarStream *tar_stream_new(const char *dir);
+// Feeds compressed bytes, -1 on a corrupt archive or a write error
+int tar_stream_write(TarStream *stream, const void *data, size_t size);
+// 0 if the archive ended cleanly
+int tar_stream_finish(TarStream *stream);
+void tar_stream_free(TarStream *stream);
+// Entries and bytes written so far
+size_t tar_stream_entries(const TarStream *stream);
+unsigned long long tar_stream_bytes(const TarStream *stream);
+#endif //__TARSTREAM__H
@@ -0,0 +1,153 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include "cache.h"
+
+const char *get_cache_dir() {
+    static char cache_dir[4096] = "";
+    if (cache_dir[0] != '\0') {
+        return cache_dir;
+    }
+
+    const char *env = getenv("KPM_CACHE_DIR");
+    if (env && env[0] != '\0') {
+        snprintf(cache_dir, sizeof(cache_dir), "%s", env);
+        return cache_dir;
+    }
+    env = getenv("XDG_CACHE_HOME");
+    if (env && env[0] != '\0') {
+        snprintf(cache_dir, sizeof(cache_dir), "%s/kpm", env);
+        return cache_dir;
+    }
+    env = getenv("HOME");
+    snprintf(cache_dir, sizeof(cache_dir), "%s/.cache/kpm", env ? env : "/tmp");
+    return cache_dir;
+}
+
+// Same as mkdir -p
+int make_dirs(const char *path) {
+    char tmp[4096];
+    snprintf(tmp, sizeof(tmp), "%s", path);
+
+    for (char *p = tmp + 1; *p; p++) {
+        if (*p == '/') {
+            *p = '\0';
+            if (mkdir(tmp, 0755) != 0 && errno != EEXIST) {
+                return -1;
+            }
+            *p = '/';
+        }
+    }
+    if (mkdir(tmp, 0755) != 0 && errno != EEXIST) {
+        return -1;
+    }
+    return 0;
+}
+
+int cache_path(char *out, size_t size, const char *subdir, const char *name) {
+    char dir[4096];
+    snprintf(dir, sizeof(dir), "%s/%s", get_cache_dir(), subdir);
+    if (make_dirs(dir) != 0) {
+        fprintf(stderr, "Failed to create cache directory %s: %s\n", dir, strerror(errno));
+        return -1;
+    }
+    int len = snprintf(out, size, "%s/%s", dir, name);
+    if (len < 0 || (size_t)len >= size) {
+        return -1;
+    }
+    return 0;
+}
+
+int safe_relative_path(const char *path) {
+    if (path == NULL || path[0] == '\0' || path[0] == '/') {
+        return 0;
+    }
+    const char *p = path;
+    while (*p) {
+        size_t len = strcspn(p, "/");
+        if (len == 0 || (len == 1 && p[0] == '.') || (len == 2 && p[0] == '.' && p[1] == '.')) {
+            return 0;
+        }
+        p += len;
+        if (*p == '/') {
+            p++;
+        }
+    }
+    return 1;
+}
+
+char *read_file_data(const char *path, size_t *size) {
+    FILE *file = fopen(path, "rb");
+    if (file == NULL) {
+        return NULL;
+    }
+    fseek(file, 0, SEEK_END);
+    long len = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    char *data = len >= 0 ? malloc((size_t)len + 1) : NULL;
+    if (data != NULL && fread(data, 1, (size_t)len, file) != (size_t)len) {
+        free(data);
+        data = NULL;
+    }
+    fclose(file);
+    if (data != NULL) {
+        data[len] = '\0';
+        *size = (size_t)len;
+    }
+    return data;
+}
+
+int write_file_atomic(const char *path, const void *data, size_t size) {
+    char tmp[4200];
+    snprintf(tmp, sizeof(tmp), "%s.tmp.%d", path, (int)getpid());
+    FILE *file = fopen(tmp, "wb");
+    if (file == NULL) {
+        return -1;
+    }
+    size_t written = fwrite(data, 1, size, file);
+    if (fclose(file) != 0 || written != size || rename(tmp, path) != 0) {
+        unlink(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+// FNV-1a, used to key and validate cache entries
+uint64_t hash_bytes(const void *data, size_t len) {
+    return hash_update(HASH_INIT, data, len);
+}
+
+uint64_t hash_update(uint64_t hash, const void *data, size_t len) {
+    const unsigned char *p = data;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= p[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+int hash_file(const char *path, uint64_t *hash, size_t *size) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+    char buffer[16384];
+    uint64_t h = HASH_INIT;
+    size_t total = 0;
+    ssize_t n;
+    while ((n = read(fd, buffer, sizeof(buffer))) > 0) {
+        h = hash_update(h, buffer, (size_t)n);
+        total += (size_t)n;
+    }
+    close(fd);
+    if (n < 0) {
+        return -1;
+    }
+    *hash = h;
+    *size = total;
+    return 0;
+}
@@ -0,0 +1,24 @@
+#ifndef __CACHE__H
+#define __CACHE__H
+#include <stddef.h>
+#include <stdint.h>
+
+// Root of the per-user cache, $KPM_CACHE_DIR or $XDG_CACHE_HOME/kpm or ~/.cache/kpm
+const char *get_cache_dir();
+// Build <cache>/<subdir>/<name> into out, creating <cache>/<subdir> if needed
+int cache_path(char *out, size_t size, const char *subdir, const char *name);
+int make_dirs(const char *path);
+// 1 if path is relative and has no empty, "." or ".." parts, so it stays under whatever
+// directory it is joined to. For paths that come from a registry
+int safe_relative_path(const char *path);
+// A malloc'd, NUL terminated copy of the file, NULL if it cannot be read
+char *read_file_data(const char *path, size_t *size);
+// Writes a temporary file next to path and renames it over path
+int write_file_atomic(const char *path, const void *data, size_t size);
+#define HASH_INIT 14695981039346656037ULL
+uint64_t hash_bytes(const void *data, size_t len);
+// Continues a hash_bytes over more data, starting from HASH_INIT
+uint64_t hash_update(uint64_t hash, const void *data, size_t len);
+// hash_bytes of a file's contents without holding them in memory, -1 if it cannot be read
+int hash_file(const char *path, uint64_t *hash, size_t *size);
+#endif //__CACHE__H
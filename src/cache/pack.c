@@ -0,0 +1,1039 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <zlib.h>
+#include "pack.h"
+#include "cache.h"
+
+#define COMPACT_TMP_NAME "compact.tmp"
+#define COPY_CHUNK (64 * 1024)
+#define COMPRESS_MAX_SIZE (16 * 1024 * 1024) // Bigger objects are stored as they are
+
+typedef struct {
+    uint32_t id;
+    int fd;
+    uint64_t size;
+} PackFile;
+
+// A compaction in flight: the live entries of every pack up to sealed, copied by
+// the thread into compact.tmp, which becomes pack target
+typedef struct {
+    PackStore *store;
+    char tmp_path[4200];
+    uint32_t target;
+    uint32_t sealed;
+    PackEntry *entries;         // Where each object was when the compaction started
+    uint64_t *offsets;          // And where the thread put it
+    size_t count;
+    PackFile *sources;          // dup'd fds, the store may close its own meanwhile
+    size_t source_count;
+    uint64_t size;
+    int failed;
+    int finished;
+    pthread_t thread;
+} PackCompaction;
+
+struct PackStore {
+    char dir[4096];
+    int compress;
+    pthread_mutex_t lock;
+    PackFile *packs;            // Sorted by id, the last one takes writes
+    size_t pack_count;
+    uint32_t next_id;
+    // The saved index, mapped
+    void *map;
+    size_t map_size;
+    const PackEntry *saved;
+    size_t saved_count;
+    // Writes since, an open addressed table keyed by key (pack 0 is an empty
+    // slot). A PACK_DELETED entry hides whatever the saved index has
+    PackEntry *recent;
+    size_t recent_count;
+    size_t recent_capacity;
+    size_t unsaved;
+    unsigned long long objects;
+    unsigned long long live_bytes;
+    unsigned long long compressed;
+    unsigned long long compactions;
+    PackCompaction *compaction;
+    // Reused for every object, setting a stream up costs more than a small object's inflate
+    z_stream deflater;
+    z_stream inflater;
+    int deflater_ready;
+    int inflater_ready;
+};
+
+static uint64_t record_size(const PackEntry *entry) {
+    return sizeof(PackRecord) + entry->meta_size + entry->stored_size;
+}
+
+static void pack_path(const PackStore *store, uint32_t id, char *out, size_t size) {
+    snprintf(out, size, "%s/pack-%08u.pack", store->dir, id);
+}
+
+static PackFile *find_pack(PackStore *store, uint32_t id) {
+    size_t lo = 0;
+    size_t hi = store->pack_count;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (store->packs[mid].id < id) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo < store->pack_count && store->packs[lo].id == id ? &store->packs[lo] : NULL;
+}
+
+static PackFile *active_pack(PackStore *store) {
+    return &store->packs[store->pack_count - 1];
+}
+
+static int add_pack(PackStore *store, uint32_t id, int fd, uint64_t size) {
+    PackFile *grown = realloc(store->packs, (store->pack_count + 1) * sizeof(PackFile));
+    if (grown == NULL) {
+        return -1;
+    }
+    store->packs = grown;
+    size_t at = store->pack_count;
+    while (at > 0 && store->packs[at - 1].id > id) {
+        store->packs[at] = store->packs[at - 1];
+        at--;
+    }
+    store->packs[at] = (PackFile){id, fd, size};
+    store->pack_count++;
+    if (id >= store->next_id) {
+        store->next_id = id + 1;
+    }
+    return 0;
+}
+
+static void remove_pack(PackStore *store, uint32_t id) {
+    PackFile *pack = find_pack(store, id);
+    if (pack == NULL) {
+        return;
+    }
+    char path[4200];
+    pack_path(store, id, path, sizeof(path));
+    unlink(path);
+    close(pack->fd);
+    size_t at = (size_t)(pack - store->packs);
+    memmove(pack, pack + 1, (store->pack_count - at - 1) * sizeof(PackFile));
+    store->pack_count--;
+}
+
+static int create_pack(PackStore *store, uint32_t id) {
+    char path[4200];
+    pack_path(store, id, path, sizeof(path));
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd == -1) {
+        fprintf(stderr, "Failed to create %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    if (add_pack(store, id, fd, 0) != 0) {
+        close(fd);
+        unlink(path);
+        return -1;
+    }
+    return 0;
+}
+
+static const PackEntry *find_saved(const PackStore *store, uint64_t key) {
+    size_t lo = 0;
+    size_t hi = store->saved_count;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (store->saved[mid].key < key) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo < store->saved_count && store->saved[lo].key == key ? &store->saved[lo] : NULL;
+}
+
+static PackEntry *recent_slot(const PackStore *store, uint64_t key) {
+    if (store->recent_capacity == 0) {
+        return NULL;
+    }
+    size_t mask = store->recent_capacity - 1;
+    for (size_t i = (size_t)(key * 0x9e3779b97f4a7c15ULL >> 20) & mask;; i = (i + 1) & mask) {
+        PackEntry *slot = &store->recent[i];
+        if (slot->pack == 0 || slot->key == key) {
+            return slot;
+        }
+    }
+}
+
+static int recent_put(PackStore *store, const PackEntry *entry) {
+    if ((store->recent_count + 1) * 2 > store->recent_capacity) {
+        size_t capacity = store->recent_capacity ? store->recent_capacity * 2 : 1024;
+        PackEntry *old = store->recent;
+        size_t old_capacity = store->recent_capacity;
+        store->recent = calloc(capacity, sizeof(PackEntry));
+        if (store->recent == NULL) {
+            store->recent = old;
+            return -1;
+        }
+        store->recent_capacity = capacity;
+        for (size_t i = 0; i < old_capacity; i++) {
+            if (old[i].pack != 0) {
+                *recent_slot(store, old[i].key) = old[i];
+            }
+        }
+        free(old);
+    }
+    PackEntry *slot = recent_slot(store, entry->key);
+    if (slot->pack == 0) {
+        store->recent_count++;
+    }
+    *slot = *entry;
+    return 0;
+}
+
+// The live entry for key, NULL if there is none
+static const PackEntry *lookup(const PackStore *store, uint64_t key) {
+    const PackEntry *slot = recent_slot(store, key);
+    if (slot != NULL && slot->pack != 0) {
+        return (slot->flags & PACK_DELETED) ? NULL : slot;
+    }
+    return find_saved(store, key);
+}
+
+static void account(PackStore *store, const PackEntry *entry, int sign) {
+    store->objects += sign;
+    store->live_bytes += sign * (long long)record_size(entry);
+    if (entry->flags & PACK_COMPRESSED) {
+        store->compressed += sign;
+    }
+}
+
+static int compare_key(const void *a, const void *b) {
+    const PackEntry *x = a;
+    const PackEntry *y = b;
+    return (x->key > y->key) - (x->key < y->key);
+}
+
+static int compare_location(const void *a, const void *b) {
+    const PackEntry *x = a;
+    const PackEntry *y = b;
+    if (x->pack != y->pack) {
+        return (x->pack > y->pack) - (x->pack < y->pack);
+    }
+    return (x->offset > y->offset) - (x->offset < y->offset);
+}
+
+// Every live entry sorted by key, the saved index with the recent writes laid over it
+static PackEntry *collect_live(const PackStore *store, size_t *count) {
+    size_t capacity = store->saved_count + store->recent_count;
+    PackEntry *recent = malloc((store->recent_count + 1) * sizeof(PackEntry));
+    PackEntry *live = malloc((capacity + 1) * sizeof(PackEntry));
+    if (recent == NULL || live == NULL) {
+        free(recent);
+        free(live);
+        return NULL;
+    }
+    size_t recent_live = 0;
+    for (size_t i = 0; i < store->recent_capacity; i++) {
+        const PackEntry *entry = &store->recent[i];
+        if (entry->pack != 0 && !(entry->flags & PACK_DELETED)) {
+            recent[recent_live++] = *entry;
+        }
+    }
+    qsort(recent, recent_live, sizeof(PackEntry), compare_key);
+    size_t n = 0;
+    size_t j = 0;
+    for (size_t i = 0; i < store->saved_count; i++) {
+        const PackEntry *entry = &store->saved[i];
+        while (j < recent_live && recent[j].key < entry->key) {
+            live[n++] = recent[j++];
+        }
+        const PackEntry *slot = recent_slot(store, entry->key);
+        if (slot == NULL || slot->pack == 0) {
+            live[n++] = *entry;
+        }
+    }
+    while (j < recent_live) {
+        live[n++] = recent[j++];
+    }
+    free(recent);
+    *count = n;
+    return live;
+}
+
+static void unmap_index(PackStore *store) {
+    if (store->map != NULL) {
+        munmap(store->map, store->map_size);
+    }
+    store->map = NULL;
+    store->map_size = 0;
+    store->saved = NULL;
+    store->saved_count = 0;
+}
+
+// Maps the index if it is intact and only names packs that exist, and says how
+// much of which pack it covers
+static int map_index(PackStore *store, uint32_t *active, uint64_t *active_size) {
+    char path[4200];
+    snprintf(path, sizeof(path), "%s/%s", store->dir, PACK_INDEX_NAME);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return -1;
+    }
+    struct stat st;
+    void *map = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(PackIndexHeader)) {
+        map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    if (map == MAP_FAILED) {
+        return -1;
+    }
+    const PackIndexHeader *header = map;
+    const PackEntry *entries = (const PackEntry *)(header + 1);
+    int ok = header->magic == PACK_INDEX_MAGIC && header->version == PACK_FORMAT_VERSION &&
+             (size_t)st.st_size == sizeof(PackIndexHeader) + header->count * sizeof(PackEntry);
+    for (uint64_t i = 0; ok && i < header->count; i++) {
+        const PackFile *pack = find_pack(store, entries[i].pack);
+        ok = pack != NULL && entries[i].offset + record_size(&entries[i]) <= pack->size &&
+             (i == 0 || entries[i - 1].key < entries[i].key);
+    }
+    if (!ok) {
+        fprintf(stderr, "Ignoring damaged pack index %s\n", path);
+        munmap(map, (size_t)st.st_size);
+        return -1;
+    }
+    store->map = map;
+    store->map_size = (size_t)st.st_size;
+    store->saved = entries;
+    store->saved_count = header->count;
+    *active = header->active;
+    *active_size = header->active_size;
+    return 0;
+}
+
+static int save_index(PackStore *store) {
+    size_t count = 0;
+    PackEntry *live = collect_live(store, &count);
+    if (live == NULL) {
+        return -1;
+    }
+    char path[4200];
+    char tmp_path[4300];
+    snprintf(path, sizeof(path), "%s/%s", store->dir, PACK_INDEX_NAME);
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+    PackIndexHeader header = {PACK_INDEX_MAGIC, PACK_FORMAT_VERSION, count, active_pack(store)->id, 0,
+                              active_pack(store)->size};
+    FILE *fp = fopen(tmp_path, "wb");
+    int ok = fp != NULL && fwrite(&header, sizeof(header), 1, fp) == 1 &&
+             fwrite(live, sizeof(PackEntry), count, fp) == count;
+    if (fp != NULL && fclose(fp) != 0) {
+        ok = 0;
+    }
+    free(live);
+    if (!ok || rename(tmp_path, path) != 0) {
+        fprintf(stderr, "Failed to write %s: %s\n", path, strerror(errno));
+        unlink(tmp_path);
+        return -1;
+    }
+    unmap_index(store);
+    uint32_t active;
+    uint64_t active_size;
+    if (map_index(store, &active, &active_size) != 0) {
+        return -1;
+    }
+    free(store->recent);
+    store->recent = NULL;
+    store->recent_count = 0;
+    store->recent_capacity = 0;
+    store->unsaved = 0;
+    return 0;
+}
+
+static int write_all(int fd, const void *data, size_t size, uint64_t offset) {
+    const char *p = data;
+    while (size > 0) {
+        ssize_t n = pwrite(fd, p, size, (off_t)offset);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        p += n;
+        size -= (size_t)n;
+        offset += (uint64_t)n;
+    }
+    return 0;
+}
+
+static int read_all(int fd, void *data, size_t size, uint64_t offset) {
+    char *p = data;
+    while (size > 0) {
+        ssize_t n = pread(fd, p, size, (off_t)offset);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        p += n;
+        size -= (size_t)n;
+        offset += (uint64_t)n;
+    }
+    return 0;
+}
+
+static int roll_if_full(PackStore *store, uint64_t size) {
+    PackFile *active = active_pack(store);
+    if (active->size > 0 && active->size + size > PACK_MAX_SIZE) {
+        return create_pack(store, store->next_id);
+    }
+    return 0;
+}
+
+// Appends one record, its data from memory or, with data NULL, from fd
+static int append(PackStore *store, uint64_t key, uint32_t flags, const void *meta, size_t meta_size,
+                  const void *data, int fd, size_t stored_size, size_t size) {
+    if (meta_size > PACK_MAX_META) {
+        return -1;
+    }
+    if (roll_if_full(store, sizeof(PackRecord) + meta_size + stored_size) != 0) {
+        return -1;
+    }
+    PackFile *active = active_pack(store);
+    PackRecord record = {PACK_RECORD_MAGIC, flags, key, (uint32_t)meta_size, 0, stored_size, size, 0};
+    uint64_t hash = hash_update(HASH_INIT, meta, meta_size);
+    uint64_t offset = active->size;
+    uint64_t at = offset + sizeof(PackRecord) + meta_size;
+    if (data != NULL || stored_size == 0) {
+        hash = hash_update(hash, data, stored_size);
+        if (write_all(active->fd, data, stored_size, at) != 0) {
+            goto failed;
+        }
+    } else {
+        char *chunk = malloc(COPY_CHUNK);
+        size_t done = 0;
+        while (chunk != NULL && done < stored_size) {
+            size_t want = stored_size - done < COPY_CHUNK ? stored_size - done : COPY_CHUNK;
+            if (read_all(fd, chunk, want, done) != 0 || write_all(active->fd, chunk, want, at + done) != 0) {
+                break;
+            }
+            hash = hash_update(hash, chunk, want);
+            done += want;
+        }
+        free(chunk);
+        if (done < stored_size) {
+            goto failed;
+        }
+    }
+    record.hash = hash;
+    // Header last, so a record cut short by a crash fails its hash on replay
+    if (write_all(active->fd, meta, meta_size, offset + sizeof(PackRecord)) != 0 ||
+        write_all(active->fd, &record, sizeof(record), offset) != 0) {
+        goto failed;
+    }
+    active->size = at + stored_size;
+
+    const PackEntry *old = lookup(store, key);
+    if (old != NULL) {
+        account(store, old, -1);
+    }
+    PackEntry entry = {key, offset, stored_size, size, active->id, flags, (uint32_t)meta_size, 0};
+    if (recent_put(store, &entry) != 0) {
+        return -1;
+    }
+    if (!(flags & PACK_DELETED)) {
+        account(store, &entry, 1);
+    }
+    if (++store->unsaved >= PACK_INDEX_INTERVAL) {
+        save_index(store);
+    }
+    return 0;
+
+failed:
+    fprintf(stderr, "Failed to append to pack %u in %s: %s\n", active->id, store->dir, strerror(errno));
+    if (ftruncate(active->fd, (off_t)offset) != 0) {
+        perror("ftruncate");
+    }
+    return -1;
+}
+
+// Applies the records of pack from offset on, and cuts off anything after the last intact one
+static void replay(PackStore *store, PackFile *pack, uint64_t offset) {
+    char *buffer = NULL;
+    size_t capacity = 0;
+    while (offset < pack->size) {
+        PackRecord record;
+        if (pack->size - offset < sizeof(record) || read_all(pack->fd, &record, sizeof(record), offset) != 0 ||
+            record.magic != PACK_RECORD_MAGIC || record.meta_size > PACK_MAX_META ||
+            record.stored_size > pack->size - offset - sizeof(record) - record.meta_size) {
+            break;
+        }
+        size_t body = record.meta_size + record.stored_size;
+        if (body > capacity) {
+            char *grown = realloc(buffer, body);
+            if (grown == NULL) {
+                break;
+            }
+            buffer = grown;
+            capacity = body;
+        }
+        if (read_all(pack->fd, buffer, body, offset + sizeof(record)) != 0 || hash_bytes(buffer, body) != record.hash) {
+            break;
+        }
+        PackEntry entry = {record.key, offset, record.stored_size, record.size, pack->id, record.flags,
+                           record.meta_size, 0};
+        if (recent_put(store, &entry) != 0) {
+            break;
+        }
+        store->unsaved++;
+        offset += sizeof(record) + body;
+    }
+    free(buffer);
+    if (offset < pack->size) {
+        fprintf(stderr, "Dropping %llu damaged bytes at the end of pack %u in %s\n",
+                (unsigned long long)(pack->size - offset), pack->id, store->dir);
+        if (ftruncate(pack->fd, (off_t)offset) == 0) {
+            pack->size = offset;
+        }
+    }
+}
+
+static int load_packs(PackStore *store) {
+    DIR *dir = opendir(store->dir);
+    if (dir == NULL) {
+        return -1;
+    }
+    struct dirent *item;
+    while ((item = readdir(dir)) != NULL) {
+        unsigned int id;
+        char tail;
+        if (sscanf(item->d_name, "pack-%u.pac%c", &id, &tail) != 2 || tail != 'k' || id == 0) {
+            continue;
+        }
+        char path[4200];
+        pack_path(store, id, path, sizeof(path));
+        int fd = open(path, O_RDWR | O_CLOEXEC);
+        struct stat st;
+        if (fd == -1 || fstat(fd, &st) != 0 || add_pack(store, id, fd, (uint64_t)st.st_size) != 0) {
+            if (fd != -1) {
+                close(fd);
+            }
+            closedir(dir);
+            return -1;
+        }
+    }
+    closedir(dir);
+    if (store->pack_count == 0) {
+        return create_pack(store, 1);
+    }
+    return 0;
+}
+
+PackStore *pack_open(const char *dir, int compress) {
+    if (make_dirs(dir) != 0) {
+        fprintf(stderr, "Failed to create %s: %s\n", dir, strerror(errno));
+        return NULL;
+    }
+    PackStore *store = calloc(1, sizeof(PackStore));
+    if (store == NULL) {
+        return NULL;
+    }
+    snprintf(store->dir, sizeof(store->dir), "%s", dir);
+    store->compress = compress;
+    store->next_id = 1;
+    pthread_mutex_init(&store->lock, NULL);
+    char path[4200];
+    snprintf(path, sizeof(path), "%s/%s", dir, COMPACT_TMP_NAME);
+    unlink(path); // A compaction that never finished
+    if (load_packs(store) != 0) {
+        fprintf(stderr, "Failed to open the packs in %s: %s\n", dir, strerror(errno));
+        pack_close(store);
+        return NULL;
+    }
+
+    uint32_t covered = 0;
+    uint64_t covered_size = 0;
+    if (map_index(store, &covered, &covered_size) != 0) {
+        covered = 0;
+        covered_size = 0;
+    }
+    // Packs newer than the index are replayed whole, in order
+    for (size_t i = 0; i < store->pack_count; i++) {
+        PackFile *pack = &store->packs[i];
+        if (pack->id == covered && covered_size <= pack->size) {
+            replay(store, pack, covered_size);
+        } else if (pack->id > covered) {
+            replay(store, pack, 0);
+        }
+    }
+
+    size_t count = 0;
+    PackEntry *live = collect_live(store, &count);
+    if (live == NULL) {
+        pack_close(store);
+        return NULL;
+    }
+    for (size_t i = 0; i < count; i++) {
+        account(store, &live[i], 1);
+    }
+    if (store->unsaved > 0) {
+        save_index(store);
+    }
+    // Packs nothing points into any more, e.g. left behind by a compaction cut short.
+    // Only once the index is saved, their deletes would otherwise be replayed from them
+    qsort(live, count, sizeof(PackEntry), compare_location);
+    size_t next = 0;
+    for (size_t i = 0; i + 1 < store->pack_count && store->unsaved == 0;) {
+        uint32_t id = store->packs[i].id;
+        while (next < count && live[next].pack < id) {
+            next++;
+        }
+        if (next < count && live[next].pack == id) {
+            i++;
+        } else {
+            remove_pack(store, id);
+        }
+    }
+    free(live);
+    return store;
+}
+
+static void *compact_thread(void *userdata) {
+    PackCompaction *job = userdata;
+    int out = open(job->tmp_path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    char *chunk = malloc(COPY_CHUNK);
+    job->failed = out == -1 || chunk == NULL;
+    uint64_t size = 0;
+    const PackFile *source = NULL;
+    for (size_t i = 0; i < job->count && !job->failed; i++) {
+        const PackEntry *entry = &job->entries[i];
+        if (source == NULL || source->id != entry->pack) {
+            source = NULL;
+            for (size_t j = 0; j < job->source_count; j++) {
+                if (job->sources[j].id == entry->pack) {
+                    source = &job->sources[j];
+                }
+            }
+            if (source == NULL) {
+                job->failed = 1;
+                break;
+            }
+        }
+        job->offsets[i] = size;
+        uint64_t left = record_size(entry);
+        loff_t in_offset = (loff_t)entry->offset;
+        loff_t out_offset = (loff_t)size;
+        while (left > 0) {
+            ssize_t n = copy_file_range(source->fd, &in_offset, out, &out_offset, left, 0);
+            if (n <= 0) {
+                // Not supported between these files, copy by hand
+                size_t want = left < COPY_CHUNK ? left : COPY_CHUNK;
+                if (read_all(source->fd, chunk, want, (uint64_t)in_offset) != 0 ||
+                    write_all(out, chunk, want, (uint64_t)out_offset) != 0) {
+                    job->failed = 1;
+                    break;
+                }
+                n = (ssize_t)want;
+                in_offset += n;
+                out_offset += n;
+            }
+            left -= (uint64_t)n;
+        }
+        size += record_size(entry);
+    }
+    free(chunk);
+    if (out != -1 && close(out) != 0) {
+        job->failed = 1;
+    }
+    job->size = size;
+    pthread_mutex_lock(&job->store->lock);
+    job->finished = 1;
+    pthread_mutex_unlock(&job->store->lock);
+    return NULL;
+}
+
+static void free_compaction(PackCompaction *job) {
+    for (size_t i = 0; i < job->source_count; i++) {
+        close(job->sources[i].fd);
+    }
+    free(job->sources);
+    free(job->entries);
+    free(job->offsets);
+    free(job);
+}
+
+// Called with the lock held once the thread is joined: objects nobody replaced
+// meanwhile move to the new pack, and every pack it replaces goes
+static void finish_compaction(PackStore *store) {
+    PackCompaction *job = store->compaction;
+    store->compaction = NULL;
+    char path[4200];
+    pack_path(store, job->target, path, sizeof(path));
+    int fd = -1;
+    if (job->failed || rename(job->tmp_path, path) != 0 || (fd = open(path, O_RDWR | O_CLOEXEC)) == -1 ||
+        add_pack(store, job->target, fd, job->size) != 0) {
+        fprintf(stderr, "Compacting %s failed\n", store->dir);
+        if (fd != -1) {
+            close(fd);
+        }
+        unlink(job->tmp_path);
+        unlink(path);
+        free_compaction(job);
+        return;
+    }
+    int ok = 1;
+    for (size_t i = 0; i < job->count && ok; i++) {
+        const PackEntry *moved = &job->entries[i];
+        const PackEntry *current = lookup(store, moved->key);
+        if (current != NULL && current->pack == moved->pack && current->offset == moved->offset) {
+            PackEntry entry = *moved;
+            entry.pack = job->target;
+            entry.offset = job->offsets[i];
+            ok = recent_put(store, &entry) == 0;
+        }
+    }
+    // The old packs stay until an index that no longer needs them is on disk
+    if (ok && save_index(store) == 0) {
+        for (size_t i = 0; i < store->pack_count;) {
+            if (store->packs[i].id <= job->sealed && store->packs[i].id != job->target) {
+                remove_pack(store, store->packs[i].id);
+            } else {
+                i++;
+            }
+        }
+    }
+    store->compactions++;
+    free_compaction(job);
+}
+
+// Swaps in a compaction the thread has finished, called with the lock held
+static void reap(PackStore *store) {
+    if (store->compaction != NULL && store->compaction->finished) {
+        pthread_join(store->compaction->thread, NULL); // Past its last use of the lock
+        finish_compaction(store);
+    }
+}
+
+static unsigned long long pack_bytes(const PackStore *store) {
+    unsigned long long total = 0;
+    for (size_t i = 0; i < store->pack_count; i++) {
+        total += store->packs[i].size;
+    }
+    return total;
+}
+
+int pack_maybe_compact(PackStore *store, int force) {
+    pthread_mutex_lock(&store->lock);
+    reap(store);
+    unsigned long long total = pack_bytes(store);
+    unsigned long long dead = total - store->live_bytes;
+    if (store->compaction != NULL || (!force && (dead < PACK_COMPACT_MIN_DEAD || dead < total * PACK_COMPACT_RATIO))) {
+        pthread_mutex_unlock(&store->lock);
+        return 0;
+    }
+    PackCompaction *job = calloc(1, sizeof(PackCompaction));
+    if (job == NULL) {
+        pthread_mutex_unlock(&store->lock);
+        return -1;
+    }
+    job->store = store;
+    snprintf(job->tmp_path, sizeof(job->tmp_path), "%s/%s", store->dir, COMPACT_TMP_NAME);
+    // Everything up to now is sealed and rewritten, new writes go to a pack after the target
+    job->sealed = active_pack(store)->id;
+    job->target = store->next_id++;
+    job->entries = collect_live(store, &job->count);
+    job->offsets = malloc((job->count + 1) * sizeof(uint64_t));
+    job->sources = calloc(store->pack_count, sizeof(PackFile));
+    int ok = job->entries != NULL && job->offsets != NULL && job->sources != NULL && create_pack(store, store->next_id) == 0;
+    for (size_t i = 0; ok && i < store->pack_count; i++) {
+        if (store->packs[i].id <= job->sealed) {
+            job->sources[job->source_count] = store->packs[i];
+            if ((job->sources[job->source_count].fd = fcntl(store->packs[i].fd, F_DUPFD_CLOEXEC, 0)) == -1) {
+                ok = 0;
+                break;
+            }
+            job->source_count++;
+        }
+    }
+    if (ok) {
+        // Reading each pack front to back
+        qsort(job->entries, job->count, sizeof(PackEntry), compare_location);
+        ok = pthread_create(&job->thread, NULL, compact_thread, job) == 0;
+    }
+    if (!ok) {
+        free_compaction(job);
+        pthread_mutex_unlock(&store->lock);
+        return -1;
+    }
+    store->compaction = job;
+    pthread_mutex_unlock(&store->lock);
+    return 1;
+}
+
+void pack_wait(PackStore *store) {
+    pthread_mutex_lock(&store->lock);
+    if (store->compaction != NULL) {
+        // Only API calls swap a compaction in, and this one holds off the others
+        pthread_t thread = store->compaction->thread;
+        pthread_mutex_unlock(&store->lock);
+        pthread_join(thread, NULL);
+        pthread_mutex_lock(&store->lock);
+        finish_compaction(store);
+    }
+    pthread_mutex_unlock(&store->lock);
+}
+
+void pack_close(PackStore *store) {
+    if (store == NULL) {
+        return;
+    }
+    pack_wait(store);
+    if (store->unsaved > 0 && store->pack_count > 0) {
+        save_index(store);
+    }
+    unmap_index(store);
+    for (size_t i = 0; i < store->pack_count; i++) {
+        close(store->packs[i].fd);
+    }
+    free(store->packs);
+    free(store->recent);
+    if (store->deflater_ready) {
+        deflateEnd(&store->deflater);
+    }
+    if (store->inflater_ready) {
+        inflateEnd(&store->inflater);
+    }
+    pthread_mutex_destroy(&store->lock);
+    free(store);
+}
+
+// A malloc'd zlib stream of data in *out, NULL when it does not save an eighth
+// (not worth inflating on every read). Called with the lock held
+static char *compress_object(PackStore *store, const void *data, size_t size, size_t *out_size) {
+    if (!store->deflater_ready) {
+        if (deflateInit(&store->deflater, PACK_COMPRESS_LEVEL) != Z_OK) {
+            return NULL;
+        }
+        store->deflater_ready = 1;
+    } else {
+        deflateReset(&store->deflater);
+    }
+    size_t capacity = size - size / 8;
+    char *out = malloc(capacity);
+    if (out == NULL) {
+        return NULL;
+    }
+    store->deflater.next_in = (Bytef *)data;
+    store->deflater.avail_in = (uInt)size;
+    store->deflater.next_out = (Bytef *)out;
+    store->deflater.avail_out = (uInt)capacity;
+    if (deflate(&store->deflater, Z_FINISH) != Z_STREAM_END) {
+        free(out);
+        return NULL;
+    }
+    *out_size = store->deflater.total_out;
+    return out;
+}
+
+static int inflate_object(PackStore *store, const char *stored, size_t stored_size, char *out, size_t size) {
+    if (!store->inflater_ready) {
+        if (inflateInit(&store->inflater) != Z_OK) {
+            return -1;
+        }
+        store->inflater_ready = 1;
+    } else {
+        inflateReset(&store->inflater);
+    }
+    store->inflater.next_in = (Bytef *)stored;
+    store->inflater.avail_in = (uInt)stored_size;
+    store->inflater.next_out = (Bytef *)out;
+    store->inflater.avail_out = (uInt)size;
+    int ret = inflate(&store->inflater, Z_FINISH);
+    return ret == Z_STREAM_END && store->inflater.total_out == size ? 0 : -1;
+}
+
+int pack_put(PackStore *store, uint64_t key, const void *meta, size_t meta_size, const void *data, size_t size) {
+    pthread_mutex_lock(&store->lock);
+    reap(store);
+    char *compressed = NULL;
+    size_t compressed_size = 0;
+    if (store->compress && size >= PACK_COMPRESS_MIN && size <= COMPRESS_MAX_SIZE) {
+        compressed = compress_object(store, data, size, &compressed_size);
+    }
+    int ret = compressed != NULL
+        ? append(store, key, PACK_COMPRESSED, meta, meta_size, compressed, -1, compressed_size, size)
+        : append(store, key, 0, meta, meta_size, data, -1, size, size);
+    pthread_mutex_unlock(&store->lock);
+    free(compressed);
+    return ret;
+}
+
+int pack_put_fd(PackStore *store, uint64_t key, const void *meta, size_t meta_size, int fd, size_t size) {
+    if (store->compress && size >= PACK_COMPRESS_MIN && size <= COMPRESS_MAX_SIZE) {
+        char *data = malloc(size);
+        if (data == NULL || read_all(fd, data, size, 0) != 0) {
+            free(data);
+            return -1;
+        }
+        int ret = pack_put(store, key, meta, meta_size, data, size);
+        free(data);
+        return ret;
+    }
+    pthread_mutex_lock(&store->lock);
+    reap(store);
+    int ret = append(store, key, 0, meta, meta_size, NULL, fd, size, size);
+    pthread_mutex_unlock(&store->lock);
+    return ret;
+}
+
+int pack_set_meta(PackStore *store, uint64_t key, const void *meta, size_t meta_size) {
+    pthread_mutex_lock(&store->lock);
+    reap(store);
+    const PackEntry *found = lookup(store, key);
+    if (found == NULL) {
+        pthread_mutex_unlock(&store->lock);
+        return -1;
+    }
+    // Copied out, the append may remap the index it points into
+    PackEntry entry = *found;
+    PackFile *pack = find_pack(store, entry.pack);
+    char *stored = malloc(entry.stored_size + 1);
+    int ret = -1;
+    if (pack != NULL && stored != NULL && read_all(pack->fd, stored, entry.stored_size, entry.offset + sizeof(PackRecord) + entry.meta_size) == 0) {
+        ret = append(store, key, entry.flags, meta, meta_size, stored, -1, entry.stored_size, entry.size);
+    }
+    pthread_mutex_unlock(&store->lock);
+    free(stored);
+    return ret;
+}
+
+int pack_get(PackStore *store, uint64_t key, PackObject *out, int flags) {
+    memset(out, 0, sizeof(*out));
+    out->fd = -1;
+    pthread_mutex_lock(&store->lock);
+    reap(store);
+    const PackEntry *found = lookup(store, key);
+    PackEntry entry;
+    PackFile *pack = NULL;
+    if (found != NULL) {
+        entry = *found;
+        pack = find_pack(store, entry.pack);
+    }
+    if (pack == NULL) {
+        pthread_mutex_unlock(&store->lock);
+        return -1;
+    }
+    out->key = key;
+    out->size = entry.size;
+    out->meta_size = entry.meta_size;
+    out->meta = malloc(entry.meta_size + 1);
+    uint64_t data_offset = entry.offset + sizeof(PackRecord) + entry.meta_size;
+    int ok = out->meta != NULL && read_all(pack->fd, out->meta, entry.meta_size, entry.offset + sizeof(PackRecord)) == 0;
+    if (ok && ((entry.flags & PACK_COMPRESSED) || (flags & PACK_READ_DATA))) {
+        char *stored = malloc(entry.stored_size + 1);
+        ok = stored != NULL && read_all(pack->fd, stored, entry.stored_size, data_offset) == 0;
+        if (ok && (entry.flags & PACK_COMPRESSED)) {
+            out->data = malloc(entry.size + 1);
+            ok = out->data != NULL && inflate_object(store, stored, entry.stored_size, out->data, entry.size) == 0;
+            free(stored);
+        } else {
+            out->data = stored;
+        }
+        if (ok) {
+            out->data[entry.size] = '\0';
+        }
+    } else if (ok) {
+        out->fd = fcntl(pack->fd, F_DUPFD_CLOEXEC, 0);
+        out->offset = (off_t)data_offset;
+        ok = out->fd != -1;
+    }
+    pthread_mutex_unlock(&store->lock);
+    if (!ok) {
+        fprintf(stderr, "Failed to read object %016llx from %s\n", (unsigned long long)key, store->dir);
+        pack_object_free(out);
+        return -1;
+    }
+    out->meta[entry.meta_size] = '\0';
+    return 0;
+}
+
+void pack_object_free(PackObject *object) {
+    free(object->meta);
+    free(object->data);
+    if (object->fd != -1) {
+        close(object->fd);
+    }
+    memset(object, 0, sizeof(*object));
+    object->fd = -1;
+}
+
+int pack_delete(PackStore *store, uint64_t key) {
+    pthread_mutex_lock(&store->lock);
+    reap(store);
+    int ret = -1;
+    if (lookup(store, key) != NULL) {
+        ret = append(store, key, PACK_DELETED, NULL, 0, NULL, -1, 0, 0);
+    }
+    pthread_mutex_unlock(&store->lock);
+    return ret;
+}
+
+int pack_foreach(PackStore *store, int (*fn)(uint64_t key, const char *meta, size_t meta_size, size_t size, void *userdata),
+                 void *userdata) {
+    pthread_mutex_lock(&store->lock);
+    reap(store);
+    size_t count = 0;
+    PackEntry *live = collect_live(store, &count);
+    char *meta = malloc(PACK_MAX_META + 1);
+    if (live == NULL || meta == NULL) {
+        pthread_mutex_unlock(&store->lock);
+        free(live);
+        free(meta);
+        return -1;
+    }
+    // In file order, so the metadata reads go front to back
+    qsort(live, count, sizeof(PackEntry), compare_location);
+    int ret = 0;
+    for (size_t i = 0; i < count && ret == 0; i++) {
+        PackFile *pack = find_pack(store, live[i].pack);
+        if (pack == NULL || read_all(pack->fd, meta, live[i].meta_size, live[i].offset + sizeof(PackRecord)) != 0) {
+            continue;
+        }
+        meta[live[i].meta_size] = '\0';
+        ret = fn(live[i].key, meta, live[i].meta_size, live[i].size, userdata);
+    }
+    pthread_mutex_unlock(&store->lock);
+    free(live);
+    free(meta);
+    return 0;
+}
+
+int pack_flush(PackStore *store) {
+    pthread_mutex_lock(&store->lock);
+    reap(store);
+    int ret = store->unsaved > 0 ? save_index(store) : 0;
+    pthread_mutex_unlock(&store->lock);
+    return ret;
+}
+
+void pack_stats(PackStore *store, PackStats *out) {
+    pthread_mutex_lock(&store->lock);
+    reap(store);
+    out->objects = store->objects;
+    out->live_bytes = store->live_bytes;
+    out->pack_bytes = pack_bytes(store);
+    out->packs = store->pack_count;
+    out->compactions = store->compactions;
+    out->compressed = store->compressed;
+    pthread_mutex_unlock(&store->lock);
+}
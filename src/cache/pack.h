@@ -0,0 +1,115 @@
+#ifndef __PACK__H
+#define __PACK__H
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// A store for many small cached objects in a handful of files instead of an
+// inode (or two) each. A directory holds:
+//   pack-<id>.pack  append-only records, the highest id takes new writes
+//   index           every live object sorted by key, mapped and binary searched
+// A record is a PackRecord header, the object's metadata and its data, zlib'd
+// when that saves enough. Deletes and replacements append a new record, so old
+// copies become dead bytes until compaction rewrites the live ones into a new
+// pack on a background thread. Writes since the index was last saved are kept
+// in memory and replayed from the pack tails on open, a torn last record is cut
+// off. Everything is in host byte order, a cache does not leave its machine.
+#define PACK_INDEX_NAME "index"
+#define PACK_RECORD_MAGIC 0x4f424d4b     // "KMBO"
+#define PACK_INDEX_MAGIC 0x58444d4b      // "KMDX"
+#define PACK_FORMAT_VERSION 1
+#define PACK_MAX_SIZE (256LL * 1024 * 1024)      // A pack this big is sealed and a new one started
+#define PACK_INDEX_INTERVAL 4096                  // Unsaved writes before the index is rewritten
+#define PACK_COMPACT_MIN_DEAD (4LL * 1024 * 1024) // Compaction waits for this much garbage...
+#define PACK_COMPACT_RATIO 0.5                    // ...and for it to be this share of the packs
+#define PACK_COMPRESS_MIN 256                     // Smaller objects are never worth inflating
+#define PACK_COMPRESS_LEVEL 1                     // zlib level, reads and writes are on the serving path
+#define PACK_MAX_META (64 * 1024)
+
+// Record flags
+#define PACK_DELETED 1
+#define PACK_COMPRESSED 2
+
+typedef struct {
+    uint32_t magic;
+    uint32_t flags;
+    uint64_t key;
+    uint32_t meta_size;
+    uint32_t reserved;
+    uint64_t stored_size;   // As written, after compression
+    uint64_t size;          // Of the object itself
+    uint64_t hash;          // hash_bytes of the metadata and stored data, checked on replay
+} PackRecord;
+
+typedef struct {
+    uint64_t key;
+    uint64_t offset;        // Of the record header
+    uint64_t stored_size;
+    uint64_t size;
+    uint32_t pack;
+    uint32_t flags;
+    uint32_t meta_size;
+    uint32_t reserved;
+} PackEntry;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t count;
+    uint32_t active;        // The pack being appended to when the index was saved
+    uint32_t reserved;
+    uint64_t active_size;   // How much of it the index covers
+} PackIndexHeader;
+
+typedef struct {
+    uint64_t key;
+    char *meta;             // NUL terminated copy of the metadata
+    size_t meta_size;
+    size_t size;
+    // Stored as is: the object is size bytes at offset in fd (a dup the caller closes).
+    // Compressed, or asked for with PACK_READ_DATA: a malloc'd copy in data and fd is -1
+    int fd;
+    off_t offset;
+    char *data;
+} PackObject;
+
+#define PACK_READ_DATA 1
+
+typedef struct {
+    unsigned long long objects;
+    unsigned long long live_bytes;     // Stored bytes of live records, headers included
+    unsigned long long pack_bytes;     // Total size of every pack
+    unsigned long long packs;
+    unsigned long long compactions;
+    unsigned long long compressed;     // Live objects stored compressed
+} PackStats;
+
+typedef struct PackStore PackStore;
+
+// Opens (creating if needed) the store in dir. compress zlib's objects that shrink
+PackStore *pack_open(const char *dir, int compress);
+// Saves the index, waiting for a compaction in progress
+void pack_close(PackStore *store);
+// Adds or replaces key. meta is anything the caller wants back from pack_get
+int pack_put(PackStore *store, uint64_t key, const void *meta, size_t meta_size, const void *data, size_t size);
+// Same, the data being the first size bytes of fd
+int pack_put_fd(PackStore *store, uint64_t key, const void *meta, size_t meta_size, int fd, size_t size);
+// Replaces key's metadata, keeping its data
+int pack_set_meta(PackStore *store, uint64_t key, const void *meta, size_t meta_size);
+// 0 and the object in out, -1 if key is not stored. pack_object_free releases it
+int pack_get(PackStore *store, uint64_t key, PackObject *out, int flags);
+void pack_object_free(PackObject *object);
+int pack_delete(PackStore *store, uint64_t key);
+// Calls fn for every live object with its metadata, stops early if fn returns non-zero
+int pack_foreach(PackStore *store, int (*fn)(uint64_t key, const char *meta, size_t meta_size, size_t size, void *userdata),
+                 void *userdata);
+// Rewrites the index so the next open replays nothing
+int pack_flush(PackStore *store);
+// Starts a compaction on a background thread when there is enough garbage (or
+// always with force), 1 if one was started. Finished compactions are swapped in
+// by the next call into the store
+int pack_maybe_compact(PackStore *store, int force);
+// Waits for a running compaction and swaps it in
+void pack_wait(PackStore *store);
+void pack_stats(PackStore *store, PackStats *out);
+#endif //__PACK__H
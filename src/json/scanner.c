@@ -0,0 +1,301 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include "scanner.h"
+#include "../stats/stats.h"
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#define BLOCK_SIZE 64
+
+typedef struct {
+    uint64_t quote;
+    uint64_t backslash;
+    uint64_t op; // { } [ ] : ,
+} BlockMasks;
+
+#ifdef __SSE2__
+static uint64_t movemask(__m128i a, __m128i b, __m128i c, __m128i d) {
+    return (uint64_t)(uint16_t)_mm_movemask_epi8(a) |
+           (uint64_t)(uint16_t)_mm_movemask_epi8(b) << 16 |
+           (uint64_t)(uint16_t)_mm_movemask_epi8(c) << 32 |
+           (uint64_t)(uint16_t)_mm_movemask_epi8(d) << 48;
+}
+
+static uint64_t match(const __m128i *in, char ch) {
+    __m128i needle = _mm_set1_epi8(ch);
+    return movemask(_mm_cmpeq_epi8(in[0], needle), _mm_cmpeq_epi8(in[1], needle),
+                    _mm_cmpeq_epi8(in[2], needle), _mm_cmpeq_epi8(in[3], needle));
+}
+
+static void classify(const char *block, BlockMasks *masks) {
+    __m128i in[4];
+    for (int i = 0; i < 4; i++) {
+        in[i] = _mm_loadu_si128((const __m128i *)(block + i * 16));
+    }
+    masks->quote = match(in, '"');
+    masks->backslash = match(in, '\\');
+    masks->op = match(in, '{') | match(in, '}') | match(in, '[') | match(in, ']') |
+                match(in, ':') | match(in, ',');
+}
+#else
+static void classify(const char *block, BlockMasks *masks) {
+    memset(masks, 0, sizeof(*masks));
+    for (int i = 0; i < BLOCK_SIZE; i++) {
+        uint64_t bit = 1ULL << i;
+        switch (block[i]) {
+            case '"': masks->quote |= bit; break;
+            case '\\': masks->backslash |= bit; break;
+            case '{': case '}': case '[': case ']': case ':': case ',': masks->op |= bit; break;
+            default: break;
+        }
+    }
+}
+#endif
+
+// Bits set on every character preceded by an odd-length run of backslashes
+static uint64_t find_escaped(uint64_t backslash, uint64_t *prev_ends_odd) {
+    const uint64_t even_bits = 0x5555555555555555ULL;
+    const uint64_t odd_bits = ~even_bits;
+    uint64_t start_edges = backslash & ~(backslash << 1);
+    uint64_t even_start_mask = even_bits ^ *prev_ends_odd;
+    uint64_t even_starts = start_edges & even_start_mask;
+    uint64_t odd_starts = start_edges & ~even_start_mask;
+    uint64_t even_carries = backslash + even_starts;
+    uint64_t odd_carries;
+    bool ends_odd = __builtin_add_overflow(backslash, odd_starts, &odd_carries);
+    odd_carries |= *prev_ends_odd;
+    *prev_ends_odd = ends_odd ? 1 : 0;
+    uint64_t even_carry_ends = even_carries & ~backslash;
+    uint64_t odd_carry_ends = odd_carries & ~backslash;
+    return (even_carry_ends & odd_bits) | (odd_carry_ends & even_bits);
+}
+
+static uint64_t prefix_xor(uint64_t bits) {
+    bits ^= bits << 1;
+    bits ^= bits << 2;
+    bits ^= bits << 4;
+    bits ^= bits << 8;
+    bits ^= bits << 16;
+    bits ^= bits << 32;
+    return bits;
+}
+
+int json_scanner_init(JsonScanner *scanner, const char *json, size_t len) {
+    memset(scanner, 0, sizeof(*scanner));
+    if (len >= UINT32_MAX) {
+        fprintf(stderr, "JSON document too large to index (%zu bytes)\n", len);
+        return -1;
+    }
+    size_t capacity = len / 8 + 64;
+    scanner->structurals = malloc(capacity * sizeof(uint32_t));
+    if (scanner->structurals == NULL) {
+        return -1;
+    }
+    scanner->json = json;
+    scanner->len = len;
+    STATS_ADD(STAT_JSON_BYTES_PARSED, len);
+
+    uint64_t prev_ends_odd = 0;
+    uint64_t prev_in_string = 0;
+    char tail[BLOCK_SIZE];
+    for (size_t base = 0; base < len; base += BLOCK_SIZE) {
+        const char *block = json + base;
+        if (len - base < BLOCK_SIZE) {
+            memset(tail, ' ', sizeof(tail));
+            memcpy(tail, block, len - base);
+            block = tail;
+        }
+
+        BlockMasks masks;
+        classify(block, &masks);
+        uint64_t escaped = find_escaped(masks.backslash, &prev_ends_odd);
+        uint64_t quotes = masks.quote & ~escaped;
+        uint64_t in_string = prefix_xor(quotes) ^ prev_in_string;
+        prev_in_string = (uint64_t)((int64_t)in_string >> 63);
+        uint64_t structural = (masks.op & ~in_string) | quotes;
+
+        size_t needed = scanner->count + __builtin_popcountll(structural);
+        if (needed > capacity) {
+            while (capacity < needed) {
+                capacity *= 2;
+            }
+            uint32_t *grown = realloc(scanner->structurals, capacity * sizeof(uint32_t));
+            if (grown == NULL) {
+                json_scanner_free(scanner);
+                return -1;
+            }
+            scanner->structurals = grown;
+        }
+        while (structural) {
+            scanner->structurals[scanner->count++] = (uint32_t)(base + __builtin_ctzll(structural));
+            structural &= structural - 1;
+        }
+    }
+    return 0;
+}
+
+void json_scanner_free(JsonScanner *scanner) {
+    free(scanner->structurals);
+    memset(scanner, 0, sizeof(*scanner));
+}
+
+static char at(const JsonScanner *scanner, size_t i) {
+    return i < scanner->count ? scanner->json[scanner->structurals[i]] : '\0';
+}
+
+// Index of the first structural after the value starting at structural i
+static size_t skip_value(const JsonScanner *scanner, size_t i) {
+    char c = at(scanner, i);
+    if (c == '"') {
+        return i + 2;
+    }
+    if (c != '{' && c != '[') {
+        return i; // Scalars have no structurals of their own
+    }
+    size_t depth = 0;
+    for (; i < scanner->count; i++) {
+        c = at(scanner, i);
+        if (c == '{' || c == '[') {
+            depth++;
+        } else if (c == '}' || c == ']') {
+            if (--depth == 0) {
+                return i + 1;
+            }
+        }
+    }
+    return scanner->count;
+}
+
+static size_t encode_utf8(unsigned int cp, char *out) {
+    if (cp < 0x80) {
+        out[0] = (char)cp;
+        return 1;
+    }
+    if (cp < 0x800) {
+        out[0] = (char)(0xC0 | (cp >> 6));
+        out[1] = (char)(0x80 | (cp & 0x3F));
+        return 2;
+    }
+    if (cp < 0x10000) {
+        out[0] = (char)(0xE0 | (cp >> 12));
+        out[1] = (char)(0x80 | ((cp >> 6) & 0x3F));
+        out[2] = (char)(0x80 | (cp & 0x3F));
+        return 3;
+    }
+    out[0] = (char)(0xF0 | (cp >> 18));
+    out[1] = (char)(0x80 | ((cp >> 12) & 0x3F));
+    out[2] = (char)(0x80 | ((cp >> 6) & 0x3F));
+    out[3] = (char)(0x80 | (cp & 0x3F));
+    return 4;
+}
+
+static int read_hex4(const char *p, const char *end, unsigned int *out) {
+    if (end - p < 4) {
+        return -1;
+    }
+    *out = 0;
+    for (int i = 0; i < 4; i++) {
+        char c = p[i];
+        *out <<= 4;
+        if (c >= '0' && c <= '9') *out |= c - '0';
+        else if (c >= 'a' && c <= 'f') *out |= c - 'a' + 10;
+        else if (c >= 'A' && c <= 'F') *out |= c - 'A' + 10;
+        else return -1;
+    }
+    return 0;
+}
+
+// Decodes the JSON string between two quotes into a new buffer
+static char *unescape(const char *start, const char *end) {
+    char *out = malloc(end - start + 1);
+    if (out == NULL) {
+        return NULL;
+    }
+    size_t n = 0;
+    for (const char *p = start; p < end; p++) {
+        if (*p != '\\') {
+            out[n++] = *p;
+            continue;
+        }
+        if (++p >= end) {
+            break;
+        }
+        switch (*p) {
+            case 'b': out[n++] = '\b'; break;
+            case 'f': out[n++] = '\f'; break;
+            case 'n': out[n++] = '\n'; break;
+            case 'r': out[n++] = '\r'; break;
+            case 't': out[n++] = '\t'; break;
+            case 'u': {
+                unsigned int cp;
+                if (read_hex4(p + 1, end, &cp) != 0) {
+                    free(out);
+                    return NULL;
+                }
+                p += 4;
+                unsigned int low;
+                if (cp >= 0xD800 && cp < 0xDC00 && end - p > 6 && p[1] == '\\' && p[2] == 'u' &&
+                    read_hex4(p + 3, end, &low) == 0 && low >= 0xDC00 && low < 0xE000) {
+                    cp = 0x10000 + ((cp - 0xD800) << 10) + (low - 0xDC00);
+                    p += 6;
+                }
+                // A \uXXXX escape is 6 bytes and encodes to at most 4, so this never overflows
+                n += encode_utf8(cp, out + n);
+                break;
+            }
+            default: out[n++] = *p; break;
+        }
+    }
+    out[n] = '\0';
+    return out;
+}
+
+static bool key_equals(const char *start, const char *end, const char *key) {
+    size_t len = end - start;
+    if (memchr(start, '\\', len) == NULL) {
+        return strlen(key) == len && memcmp(start, key, len) == 0;
+    }
+    char *decoded = unescape(start, end);
+    bool equal = decoded && strcmp(decoded, key) == 0;
+    free(decoded);
+    return equal;
+}
+
+// Returns the index of the value stored under key in the object opening at i
+static size_t find_key(const JsonScanner *scanner, size_t i, const char *key) {
+    if (at(scanner, i) != '{') {
+        return scanner->count;
+    }
+    i++;
+    while (at(scanner, i) == '"') {
+        const char *key_start = scanner->json + scanner->structurals[i] + 1;
+        if (at(scanner, i + 1) != '"' || at(scanner, i + 2) != ':') {
+            return scanner->count;
+        }
+        const char *key_end = scanner->json + scanner->structurals[i + 1];
+        size_t value = i + 3;
+        if (key_equals(key_start, key_end, key)) {
+            return value;
+        }
+        i = skip_value(scanner, value);
+        if (at(scanner, i) != ',') {
+            break;
+        }
+        i++;
+    }
+    return scanner->count;
+}
+
+char *json_scanner_find_string(const JsonScanner *scanner, const char *const *path, size_t depth) {
+    size_t i = 0;
+    for (size_t d = 0; d < depth && i < scanner->count; d++) {
+        i = find_key(scanner, i, path[d]);
+    }
+    if (i >= scanner->count || at(scanner, i) != '"' || at(scanner, i + 1) != '"') {
+        return NULL;
+    }
+    return unescape(scanner->json + scanner->structurals[i] + 1, scanner->json + scanner->structurals[i + 1]);
+}
@@ -0,0 +1,21 @@
+#ifndef __SCANNER__H
+#define __SCANNER__H
+#include <stddef.h>
+#include <stdint.h>
+
+// On-demand lookup into a JSON document without building a DOM.
+// json_scanner_init indexes every structural character ({}[]:, and unescaped
+// quotes) outside of strings, 64 bytes at a time, and lookups walk that index,
+// skipping whole values they are not interested in.
+typedef struct {
+    const char *json;
+    size_t len;
+    uint32_t *structurals;
+    size_t count;
+} JsonScanner;
+
+int json_scanner_init(JsonScanner *scanner, const char *json, size_t len);
+// Returns a malloc'd copy of the string at path (object keys from the root), or NULL
+char *json_scanner_find_string(const JsonScanner *scanner, const char *const *path, size_t depth);
+void json_scanner_free(JsonScanner *scanner);
+#endif //__SCANNER__H
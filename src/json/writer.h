@@ -0,0 +1,7 @@
+#ifndef __WRITER__H
+#define __WRITER__H
+#include <stdio.h>
+
+// Appends s to out as a JSON string, quotes included, NULL as ""
+void json_write_string(FILE *out, const char *s);
+#endif //__WRITER__H
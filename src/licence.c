@@ -1,16 +1,12 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <curl/curl.h>
 #include <stdio.h>
 #include <string.h>
 #include <ctype.h>
+#include "registry/registry.h"
+#include "registry/transfer.h"
  // For _getch()
-// Structure to hold the response data
-typedef struct {
-    char *data;
-    size_t size;
-} MemoryBlock;
 char *encode_url(const char *url) {
     size_t length = strlen(url);
     // Allocate memory for the encoded URL. Each special character could be encoded as %XX, so we may need more space.
@@ -43,31 +39,9 @@ char *encode_url(const char *url) {
     return encoded_url;
 }
 
-// Callback function to write data to the MemoryBlock structure
-size_t write_callback_l(void *contents, size_t size, size_t nmemb, void *userp) {
-    size_t total_size = size * nmemb;
-    MemoryBlock *mem = (MemoryBlock *)userp;
-
-    char *new_data = realloc(mem->data, mem->size + total_size + 1);
-    if (new_data == NULL) {
-        fprintf(stderr, "Failed to expand buffer.\n");
-        return 0;
-    }
-
-    mem->data = new_data;
-    memcpy(&(mem->data[mem->size]), contents, total_size);
-    mem->size += total_size;
-    mem->data[mem->size] = '\0'; // Null-terminate the string
-
-    return total_size;
-}
-
 // Function to get license text from GitHub repository
 char* get_license_text(const char *license_name) {
-    CURL *curl;
-    CURLcode res;
-    char url[256];
-    MemoryBlock memory = { .data = NULL, .size = 0 };
+    char url[1024];
 
     // Map license names to their filenames
     // const char *license_file_map[] = {
@@ -100,28 +74,17 @@ char* get_license_text(const char *license_name) {
     //     return NULL;
     // }
 
-    snprintf(url, sizeof(url), "https://raw.githubusercontent.com/KingVentrix007/KickStartFiles/main/LICENCE/%s", license_name);
+    snprintf(url, sizeof(url), "%s/%s", registry_licence_url(), license_name);
     char *new_url = encode_url(url);
-    printf("URL:%s\n",new_url);
-    curl = curl_easy_init();
-    if (!curl) {
-        fprintf(stderr, "Failed to initialize curl.\n");
+    if (new_url == NULL) {
         return NULL;
     }
+    printf("URL:%s\n",new_url);
 
-    curl_easy_setopt(curl, CURLOPT_URL, new_url);
-    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_callback_l);
-    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &memory);
-
-    res = curl_easy_perform(curl);
-    if (res != CURLE_OK) {
-        fprintf(stderr, "curl_easy_perform() failed: %s\n", curl_easy_strerror(res));
-        free(memory.data);
-        memory.data = NULL;
-    }
-
-    curl_easy_cleanup(curl);
-    return memory.data;
+    RegistryResponse response;
+    int result = registry_get(new_url, &response);
+    free(new_url);
+    return result == 0 ? response.data : NULL;
 }
 
 char * get_license(const char *name) {
@@ -4,4 +4,6 @@
 
 char * get_license(const char *name);
 const char* license_menu() ;
+// Percent-encodes everything but unreserved characters, '/' and ':'
+char *encode_url(const char *url);
 #endif
\ No newline at end of file
@@ -6,18 +6,42 @@
 #include <unistd.h>
 #include <jansson.h>
 #include "package_manager/cpkg_main.h"
+#include "package_manager/installed.h"
+#include "templates/snapshot.h"
+#include "templates/bundle.h"
+#include "templates/update.h"
+#include "templates/utils.h"
+#include "trace/trace.h"
+#include "stats/stats.h"
+#include "memory/alloc_profile.h"
+#include "registry/serve.h"
+#include "registry/proxy.h"
+#include "registry/mirror.h"
+#include "toolchain/toolchain.h"
+#include "manifest/manifest.h"
         int create_template();
 
 
-char* get_lang();
-char* get_install();
 int main_build();
-int main(int argc, char **argv) {
+int run_project();
+static int run_command(int argc, char **argv) {
     if (argc < 2) {
-        printf("Usage: %s <init|template|install> [package_name]\n", argv[0]);
+        printf("Usage: %s [--trace=out.json] [--stats[=out.prom]] <init|template|install|update|run|registry|proxy|mirror|doctor> [package_name]\n", argv[0]);
         printf("\tinit: Initialize a new project\n");
         printf("\ttemplate: Create a new project template\n");
-        printf("\tinstall: Install a package\n");
+        printf("\ttemplate compile <language>: Cache a precompiled snapshot of a language template\n");
+        printf("\ttemplate bundle <langs dir> <language> [--index]: Pack a language template into one download\n");
+        printf("\ttemplate update [language...]: Fetch what changed in cached templates\n");
+        printf("\tinstall: Install one or more packages\n");
+        printf("\tupdate [package_name...]: Fetch what changed in installed packages, all of them when none are given\n");
+        printf("\trun: Build and run the project in this directory with its makefile\n");
+        printf("\tregistry serve [dir] [--port <port>] [--bind <address>]: Serve a registry directory over HTTP\n");
+        printf("\tproxy [--port <port>] [--dir <path>] [--max-size <size>] [--ttl <seconds>]: Run a caching proxy, point clients at it with KPM_PROXY\n");
+        printf("\tmirror <dir> [--parallel <n>]: Copy the whole registry to <dir>, or refresh it\n");
+        printf("\tdoctor [--refresh]: Probe every known compiler and tool at once and cache what was found\n");
+        printf("\t--trace=<file>: Write a Chrome trace of the run to <file>\n");
+        printf("\t--stats: Print request, cache, parse, file and process counts on exit\n");
+        printf("\t--stats=<file>: Add the counts to the Prometheus textfile <file> instead\n");
         return 1;
     }
 
@@ -27,26 +51,64 @@ int main(int argc, char **argv) {
         // printf("Package manager is not enabled at the moment\n");
         // return 0;
         if (argc < 3) {
-            fprintf(stderr, "Usage: %s install <package_name>\n", argv[0]);
+            fprintf(stderr, "Usage: %s install <package_name> [package_name...]\n", argv[0]);
             return 1;
         }
 
-        char *lang = get_lang();
-        char *install_cmd = get_install();
-        if (strcmp(lang, "c") == 0) {
-            cpkg_main(argv[2], lang);
-        } else if (strcmp(install_cmd,"(null)") == 0)
-        {
-            cpkg_main(argv[2], lang);
-        }   
-        else
-        {
-            char *command = malloc(strlen(argv[2])+strlen(install_cmd)+50);
-            snprintf(command,strlen(argv[2])+strlen(install_cmd)+50,"%s %s",install_cmd,argv[2]);
-            system(command);
-            free(command);
-            // fprintf(stderr, "Unsupported language: %s\n", lang);
-            // return 1;
+        AllocPhase phase = alloc_phase_enter(ALLOC_PHASE_INSTALL);
+        const Manifest *manifest = manifest_get();
+        if (manifest == NULL) {
+            alloc_phase_leave(phase);
+            return 1;
+        }
+        const char *lang = manifest->language;
+        const char *install_cmd = manifest->install_cmd;
+        int failed = 0;
+        for (int i = 2; i < argc; i++) {
+            if (strcmp(lang, "c") == 0) {
+                failed |= cpkg_main(argv[i], lang);
+            } else if (install_cmd == NULL)
+            {
+                failed |= cpkg_main(argv[i], lang);
+            }   
+            else
+            {
+                char *command = malloc(strlen(argv[i])+strlen(install_cmd)+50);
+                snprintf(command,strlen(argv[i])+strlen(install_cmd)+50,"%s %s",install_cmd,argv[i]);
+                if (trace_system(command) == 0) {
+                    // The version, if any, is whatever was asked for ("requests>=2.0")
+                    failed |= manifest_add_dependency(argv[i], NULL) != 0;
+                } else {
+                    failed = 1;
+                }
+                free(command);
+                // fprintf(stderr, "Unsupported language: %s\n", lang);
+                // return 1;
+            }
+        }
+        alloc_phase_leave(phase);
+        if (failed) {
+            return 1;
+        }
+    } else if (strcmp(argv[1], "update") == 0) {
+        AllocPhase phase = alloc_phase_enter(ALLOC_PHASE_INSTALL);
+        const Manifest *manifest = manifest_get();
+        if (manifest == NULL) {
+            alloc_phase_leave(phase);
+            return 1;
+        }
+        int failed;
+        if (strcmp(manifest->language, "c") != 0 && manifest->install_cmd != NULL) {
+            // Packages installed through the language's own tool are its to update
+            fprintf(stderr, "kpm update only updates packages kpm installed, use %s for %s\n", manifest->install_cmd,
+                    manifest->language);
+            failed = 1;
+        } else {
+            failed = update_main(argc - 2, argv + 2, manifest->language);
+        }
+        alloc_phase_leave(phase);
+        if (failed) {
+            return 1;
         }
     }else if (strcmp(argv[1],"template") == 0)
     {
@@ -54,6 +116,26 @@ int main(int argc, char **argv) {
         {
             printf("Ill get to this, maybe\n");
         }
+        else if(argc >= 3 && strcmp(argv[2],"compile") == 0)
+        {
+            if (argc < 4) {
+                fprintf(stderr, "Usage: %s template compile <language>\n", argv[0]);
+                return 1;
+            }
+            lowercase(argv[3]);
+            return compile_template_snapshot(argv[3]);
+        }
+        else if(argc >= 3 && strcmp(argv[2],"bundle") == 0)
+        {
+            return bundle_main(argc - 3, argv + 3);
+        }
+        else if(argc >= 3 && strcmp(argv[2],"update") == 0)
+        {
+            for (int i = 3; i < argc; i++) {
+                lowercase(argv[i]);
+            }
+            return template_update_main(argc - 3, argv + 3);
+        }
         else
         {   
             create_template();
@@ -61,6 +143,30 @@ int main(int argc, char **argv) {
         }
         
     }
+    else if (strcmp(argv[1], "registry") == 0)
+    {
+        if (argc >= 3 && strcmp(argv[2], "serve") == 0) {
+            return registry_serve_main(argc - 3, argv + 3);
+        }
+        fprintf(stderr, "Usage: %s registry serve [dir] [--port <port>] [--bind <address>]\n", argv[0]);
+        return 1;
+    }
+    else if (strcmp(argv[1], "proxy") == 0)
+    {
+        return proxy_main(argc - 2, argv + 2);
+    }
+    else if (strcmp(argv[1], "mirror") == 0)
+    {
+        return mirror_main(argc - 2, argv + 2);
+    }
+    else if (strcmp(argv[1], "run") == 0)
+    {
+        return run_project();
+    }
+    else if (strcmp(argv[1], "doctor") == 0)
+    {
+        return doctor_main(argc - 2, argv + 2);
+    }
      
     else {
         fprintf(stderr, "Unknown command: %s\n", argv[1]);
@@ -68,4 +174,36 @@ int main(int argc, char **argv) {
     }
 
     return 0;
-}
\ No newline at end of file
+}
+
+int main(int argc, char **argv) {
+    // Global options can go anywhere on the command line, strip them before dispatching
+    int argn = 1;
+    int stats = 0;
+    const char *stats_path = NULL;
+    for (int i = 1; i < argc; i++) {
+        if (strncmp(argv[i], "--trace=", 8) == 0) {
+            if (trace_start(argv[i] + 8) != 0) {
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--stats") == 0) {
+            stats = 1;
+        } else if (strncmp(argv[i], "--stats=", 8) == 0) {
+            stats = 1;
+            stats_path = argv[i] + 8;
+        } else {
+            argv[argn++] = argv[i];
+        }
+    }
+    argc = argn;
+    argv[argc] = NULL;
+    if (stats && stats_start(argc >= 2 ? argv[1] : NULL, stats_path) != 0) {
+        return 1;
+    }
+
+    TraceSpan span;
+    trace_begin(&span, "command", argc >= 2 ? argv[1] : "kpm");
+    int result = run_command(argc, argv);
+    trace_end(&span);
+    return result;
+}
@@ -0,0 +1,413 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <jansson.h>
+#include "manifest.h"
+#include "../json/writer.h"
+#include "../stats/stats.h"
+#include "../trace/trace.h"
+
+// The schema: every known string field, where it goes and whether a project can do without it.
+// dependencies is checked on its own
+static const struct {
+    const char *key;
+    size_t offset;
+    int required;
+} fields[] = {
+    {"name", offsetof(Manifest, name), 0},
+    {"version", offsetof(Manifest, version), 0},
+    {"description", offsetof(Manifest, description), 0},
+    {"author", offsetof(Manifest, author), 0},
+    {"license", offsetof(Manifest, license), 0},
+    {"language", offsetof(Manifest, language), 1},
+    {"install_cmd", offsetof(Manifest, install_cmd), 0},
+};
+#define FIELD_COUNT (sizeof(fields) / sizeof(fields[0]))
+#define FIELD(manifest, i) (*(const char **)((char *)(manifest) + fields[i].offset))
+
+static Manifest project;
+static int project_state = 0; // 1 loaded, -1 failed and reported
+
+static int compare_dependencies(const void *a, const void *b) {
+    return strcmp(((const ManifestDependency *)a)->name, ((const ManifestDependency *)b)->name);
+}
+
+typedef struct {
+    const char *key;
+    json_t *value;
+} ExtraField;
+
+static int compare_extra(const void *a, const void *b) {
+    return strcmp(((const ExtraField *)a)->key, ((const ExtraField *)b)->key);
+}
+
+// Drops a trailing newline, fgets leaves one on every kpm init answer
+static const char *copy_answer(Arena *arena, const char *answer) {
+    if (answer == NULL) {
+        return NULL;
+    }
+    size_t len = strlen(answer);
+    if (len > 0 && answer[len - 1] == '\n') {
+        len--;
+    }
+    char *copy = arena_alloc(arena, len + 1);
+    if (copy != NULL) {
+        memcpy(copy, answer, len);
+        copy[len] = '\0';
+    }
+    return copy;
+}
+
+// Splits "requests>=2.0" or "small@1.2" into name and version in the arena, "*" if there is none
+static int parse_spec(Arena *arena, const char *spec, size_t len, ManifestDependency *out) {
+    while (len > 0 && strchr(" \t\r\n", spec[0]) != NULL) {
+        spec++;
+        len--;
+    }
+    while (len > 0 && strchr(" \t\r\n", spec[len - 1]) != NULL) {
+        len--;
+    }
+    size_t name_len = 0;
+    while (name_len < len && strchr("@=<>~!", spec[name_len]) == NULL) {
+        name_len++;
+    }
+    size_t version_start = name_len < len && spec[name_len] == '@' ? name_len + 1 : name_len;
+    while (version_start < len && spec[version_start] == ' ') {
+        version_start++;
+    }
+    while (name_len > 0 && spec[name_len - 1] == ' ') {
+        name_len--;
+    }
+    if (name_len == 0) {
+        return -1;
+    }
+    char *name = arena_alloc(arena, name_len + 1);
+    char *version = arena_alloc(arena, version_start < len ? len - version_start + 1 : 2);
+    if (name == NULL || version == NULL) {
+        return -1;
+    }
+    memcpy(name, spec, name_len);
+    name[name_len] = '\0';
+    if (version_start < len) {
+        memcpy(version, spec + version_start, len - version_start);
+        version[len - version_start] = '\0';
+    } else {
+        strcpy(version, "*");
+    }
+    out->name = name;
+    out->version = version;
+    return 0;
+}
+
+// Sorts what was added to the end of dependencies, a name given twice keeps its last version
+static void sort_dependencies(Manifest *manifest) {
+    // Insertion sort keeps a name given twice in the order it was typed, the later one wins below
+    ManifestDependency *deps = manifest->dependencies;
+    size_t count = manifest->dependencies_count;
+    for (size_t i = 1; i < count; i++) {
+        ManifestDependency dep = deps[i];
+        size_t j = i;
+        while (j > 0 && compare_dependencies(&deps[j - 1], &dep) > 0) {
+            deps[j] = deps[j - 1];
+            j--;
+        }
+        deps[j] = dep;
+    }
+    size_t kept = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (kept > 0 && strcmp(deps[kept - 1].name, deps[i].name) == 0) {
+            deps[kept - 1] = deps[i];
+        } else {
+            deps[kept++] = deps[i];
+        }
+    }
+    manifest->dependencies_count = kept;
+}
+
+// "small, medium@1.2", the way kpm init takes them and older project.json files kept them
+static void parse_dependency_list(Manifest *manifest, const char *list) {
+    size_t max = 1;
+    for (const char *c = list; *c; c++) {
+        max += *c == ',';
+    }
+    manifest->dependencies = arena_alloc(&manifest->arena, max * sizeof(ManifestDependency));
+    manifest->dependencies_count = 0;
+    if (manifest->dependencies == NULL) {
+        return;
+    }
+    while (*list) {
+        size_t len = strcspn(list, ",");
+        if (parse_spec(&manifest->arena, list, len, &manifest->dependencies[manifest->dependencies_count]) == 0) {
+            manifest->dependencies_count++;
+        }
+        list += list[len] == ',' ? len + 1 : len;
+    }
+    sort_dependencies(manifest);
+}
+
+// Fills manifest from a parsed project.json, reporting everything that does not fit the schema
+static int read_manifest(Manifest *manifest, json_t *root, const char *path) {
+    if (!json_is_object(root)) {
+        fprintf(stderr, "Error: %s is not a JSON object\n", path);
+        return -1;
+    }
+    int errors = 0;
+    for (size_t i = 0; i < FIELD_COUNT; i++) {
+        json_t *value = json_object_get(root, fields[i].key);
+        if (value == NULL || json_is_null(value)) {
+            if (fields[i].required) {
+                fprintf(stderr, "Error: %s has no \"%s\" field\n", path, fields[i].key);
+                errors++;
+            }
+        } else if (!json_is_string(value)) {
+            fprintf(stderr, "Error: \"%s\" in %s is not a string\n", fields[i].key, path);
+            errors++;
+        } else {
+            FIELD(manifest, i) = arena_strdup(&manifest->arena, json_string_value(value));
+        }
+    }
+    // Written for languages without a package manager by kpm versions that printed a NULL
+    if (manifest->install_cmd != NULL && strcmp(manifest->install_cmd, "(null)") == 0) {
+        manifest->install_cmd = NULL;
+    }
+
+    json_t *dependencies = json_object_get(root, "dependencies");
+    if (json_is_string(dependencies)) {
+        parse_dependency_list(manifest, json_string_value(dependencies));
+    } else if (json_is_object(dependencies)) {
+        size_t size = json_object_size(dependencies);
+        manifest->dependencies = arena_alloc(&manifest->arena, (size ? size : 1) * sizeof(ManifestDependency));
+        const char *name;
+        json_t *version;
+        json_object_foreach(dependencies, name, version) {
+            if (!json_is_string(version)) {
+                fprintf(stderr, "Error: dependency \"%s\" in %s has no version string\n", name, path);
+                errors++;
+            } else if (manifest->dependencies != NULL) {
+                ManifestDependency *dep = &manifest->dependencies[manifest->dependencies_count++];
+                dep->name = arena_strdup(&manifest->arena, name);
+                dep->version = arena_strdup(&manifest->arena, json_string_value(version));
+            }
+        }
+        qsort(manifest->dependencies, manifest->dependencies_count, sizeof(ManifestDependency), compare_dependencies);
+    } else if (dependencies != NULL && !json_is_null(dependencies)) {
+        fprintf(stderr, "Error: \"dependencies\" in %s is not an object\n", path);
+        errors++;
+    }
+
+    const char *key;
+    json_t *value;
+    json_object_foreach(root, key, value) {
+        int known = strcmp(key, "dependencies") == 0;
+        for (size_t i = 0; i < FIELD_COUNT && !known; i++) {
+            known = strcmp(key, fields[i].key) == 0;
+        }
+        if (!known) {
+            if (manifest->extra == NULL) {
+                manifest->extra = json_object();
+            }
+            json_object_set(manifest->extra, key, value);
+        }
+    }
+    return errors ? -1 : 0;
+}
+
+// Read with one read() into a buffer its size, stdio would allocate 4K more than the file
+static char *read_small_file(const char *path, size_t *size) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return NULL;
+    }
+    struct stat st;
+    char *data = fstat(fd, &st) == 0 ? malloc((size_t)st.st_size + 1) : NULL;
+    size_t len = 0;
+    while (data != NULL && len < (size_t)st.st_size) {
+        ssize_t n = read(fd, data + len, (size_t)st.st_size - len);
+        if (n <= 0) {
+            break;
+        }
+        len += (size_t)n;
+    }
+    close(fd);
+    if (data != NULL) {
+        data[len] = '\0';
+        *size = len;
+    }
+    return data;
+}
+
+const Manifest *manifest_get() {
+    if (project_state == 0) {
+        TraceSpan span;
+        trace_begin(&span, "parse", MANIFEST_FILE);
+        arena_init(&project.arena, 1024);
+        json_error_t error;
+        json_t *root = NULL;
+        size_t size = 0;
+        char *data = read_small_file(MANIFEST_FILE, &size);
+        if (data == NULL) {
+            fprintf(stderr, "Error loading %s: %s\n", MANIFEST_FILE, strerror(errno));
+        } else {
+            STATS_ADD(STAT_JSON_BYTES_PARSED, size);
+            root = json_loadb(data, size, 0, &error);
+            free(data);
+            if (root == NULL) {
+                fprintf(stderr, "Error loading %s: %s\n", MANIFEST_FILE, error.text);
+            }
+        }
+        if (root == NULL) {
+            project_state = -1;
+        } else {
+            project_state = read_manifest(&project, root, MANIFEST_FILE) == 0 ? 1 : -1;
+            json_decref(root);
+        }
+        trace_end(&span);
+    }
+    return project_state == 1 ? &project : NULL;
+}
+
+void manifest_init(Manifest *manifest, const char *name, const char *version, const char *description,
+                   const char *author, const char *license, const char *language, const char *install_cmd,
+                   const char *dependencies) {
+    memset(manifest, 0, sizeof(*manifest));
+    arena_init(&manifest->arena, 1024);
+    manifest->name = copy_answer(&manifest->arena, name);
+    manifest->version = copy_answer(&manifest->arena, version);
+    manifest->description = copy_answer(&manifest->arena, description);
+    manifest->author = copy_answer(&manifest->arena, author);
+    manifest->license = copy_answer(&manifest->arena, license);
+    manifest->language = copy_answer(&manifest->arena, language);
+    if (install_cmd != NULL && strcmp(install_cmd, "(null)") != 0) {
+        manifest->install_cmd = copy_answer(&manifest->arena, install_cmd);
+    }
+    parse_dependency_list(manifest, dependencies ? dependencies : "");
+}
+
+void manifest_free(Manifest *manifest) {
+    if (manifest->extra != NULL) {
+        json_decref(manifest->extra);
+    }
+    arena_free(&manifest->arena);
+    memset(manifest, 0, sizeof(*manifest));
+}
+
+// Known fields in schema order, dependencies by name, then unknown fields by key: the same
+// bytes for the same content however the file was laid out
+static void write_manifest(FILE *out, const Manifest *manifest) {
+    fputc('{', out);
+    for (size_t i = 0; i < FIELD_COUNT; i++) {
+        if (FIELD(manifest, i) != NULL) {
+            fputs("\n    ", out);
+            json_write_string(out, fields[i].key);
+            fputs(": ", out);
+            json_write_string(out, FIELD(manifest, i));
+            fputc(',', out);
+        }
+    }
+    fputs("\n    \"dependencies\": {", out);
+    for (size_t i = 0; i < manifest->dependencies_count; i++) {
+        fputs(i ? ",\n        " : "\n        ", out);
+        json_write_string(out, manifest->dependencies[i].name);
+        fputs(": ", out);
+        json_write_string(out, manifest->dependencies[i].version);
+    }
+    fputs(manifest->dependencies_count ? "\n    }" : "}", out);
+
+    size_t count = manifest->extra ? json_object_size(manifest->extra) : 0;
+    ExtraField *extra = count ? malloc(count * sizeof(ExtraField)) : NULL;
+    if (extra != NULL) {
+        size_t n = 0;
+        const char *key;
+        json_t *value;
+        json_object_foreach(manifest->extra, key, value) {
+            extra[n].key = key;
+            extra[n++].value = value;
+        }
+        qsort(extra, n, sizeof(ExtraField), compare_extra);
+        for (size_t i = 0; i < n; i++) {
+            fputs(",\n    ", out);
+            json_write_string(out, extra[i].key);
+            fputs(": ", out);
+            json_dumpf(extra[i].value, out, JSON_ENCODE_ANY | JSON_SORT_KEYS);
+        }
+        free(extra);
+    }
+    fputs("\n}\n", out);
+}
+
+int manifest_write(const char *path, const Manifest *manifest) {
+    char tmp[4200];
+    snprintf(tmp, sizeof(tmp), "%s.tmp.%d", path, (int)getpid());
+    FILE *out = fopen(tmp, "w");
+    if (out == NULL) {
+        return -1;
+    }
+    // A project.json fits, install would otherwise pay for a stdio buffer to add one line
+    char buffer[4096];
+    setvbuf(out, buffer, _IOFBF, sizeof(buffer));
+    write_manifest(out, manifest);
+    int ret = ferror(out) ? -1 : 0;
+    if (fclose(out) != 0 || ret != 0 || rename(tmp, path) != 0) {
+        unlink(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+int manifest_add_dependency(const char *name, const char *version) {
+    if (manifest_get() == NULL) {
+        return -1;
+    }
+    ManifestDependency dep;
+    if (version != NULL) {
+        dep.name = arena_strdup(&project.arena, name);
+        dep.version = arena_strdup(&project.arena, version);
+    } else if (parse_spec(&project.arena, name, strlen(name), &dep) != 0) {
+        return -1;
+    }
+    if (dep.name == NULL || dep.version == NULL) {
+        return -1;
+    }
+    ManifestDependency *found = bsearch(&dep, project.dependencies, project.dependencies_count,
+                                        sizeof(ManifestDependency), compare_dependencies);
+    if (found != NULL && strcmp(found->version, dep.version) == 0) {
+        return 0;
+    }
+    if (found != NULL) {
+        found->version = dep.version;
+    } else {
+        // Arena memory cannot grow in place, the old array stays until the arena goes
+        ManifestDependency *grown = arena_alloc(&project.arena,
+                                                (project.dependencies_count + 1) * sizeof(ManifestDependency));
+        if (grown == NULL) {
+            return -1;
+        }
+        size_t at = 0;
+        while (at < project.dependencies_count && compare_dependencies(&project.dependencies[at], &dep) < 0) {
+            at++;
+        }
+        if (project.dependencies_count > 0) {
+            memcpy(grown, project.dependencies, at * sizeof(ManifestDependency));
+            memcpy(grown + at + 1, project.dependencies + at, (project.dependencies_count - at) * sizeof(ManifestDependency));
+        }
+        grown[at] = dep;
+        project.dependencies = grown;
+        project.dependencies_count++;
+    }
+
+    TraceSpan span;
+    trace_begin(&span, "write", MANIFEST_FILE);
+    int ret = manifest_write(MANIFEST_FILE, &project);
+    trace_end(&span);
+    if (ret != 0) {
+        fprintf(stderr, "Failed to write %s\n", MANIFEST_FILE);
+        return -1;
+    }
+    STATS_INC(STAT_FILES_WRITTEN);
+    return 0;
+}
@@ -0,0 +1,48 @@
+#ifndef __MANIFEST__H
+#define __MANIFEST__H
+#include <stddef.h>
+#include <jansson.h>
+#include "../memory/arena.h"
+
+// project.json, written by kpm init and read by install/update:
+//     {"name": "app", "version": "0.1", "description": "...", "author": "...", "license": "MIT",
+//      "language": "c", "install_cmd": "pip install", "dependencies": {"small": "1.2", "medium": "*"}}
+// language is the only required field, the rest are strings when present. Older
+// projects have dependencies as one comma separated string ("small, medium"), which is
+// read as the same thing and written back as an object. Fields kpm does not know are
+// kept and written back as they were.
+#define MANIFEST_FILE "project.json"
+
+typedef struct {
+    const char *name;
+    const char *version; // "*" when none was given
+} ManifestDependency;
+
+typedef struct {
+    const char *name;
+    const char *version;
+    const char *description;
+    const char *author;
+    const char *license;
+    const char *language;
+    const char *install_cmd;          // NULL when the language has no package manager of its own
+    ManifestDependency *dependencies; // Sorted by name
+    size_t dependencies_count;
+    json_t *extra;                    // Unknown fields, NULL if there are none
+    Arena arena;                      // Owns the strings and dependencies
+} Manifest;
+
+// project.json in the current directory, loaded and checked once and kept for the
+// rest of the run. NULL, reported the first time, if it is missing or does not fit
+const Manifest *manifest_get();
+// A manifest from kpm init's answers, trailing newlines dropped. dependencies is what was
+// typed ("small, medium@1.2, requests>=2.0"), split into names and versions
+void manifest_init(Manifest *manifest, const char *name, const char *version, const char *description,
+                   const char *author, const char *license, const char *language, const char *install_cmd,
+                   const char *dependencies);
+void manifest_free(Manifest *manifest);
+// Writes a temporary file next to path and renames it over path
+int manifest_write(const char *path, const Manifest *manifest);
+// Records name at version (NULL for "*") in project.json, rewriting it only if that changes it
+int manifest_add_dependency(const char *name, const char *version);
+#endif //__MANIFEST__H
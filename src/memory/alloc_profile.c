@@ -0,0 +1,456 @@
+#ifdef KPM_ALLOC_PROFILE
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dlfcn.h>
+#include <link.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "alloc_profile.h"
+
+// glibc's real allocator, the wrappers below forward to these
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void __libc_free(void *ptr);
+
+typedef struct {
+    unsigned long long allocations;
+    unsigned long long bytes;
+    unsigned long long live;
+    unsigned long long peak;
+} AllocTotals;
+
+typedef struct {
+    void *addr; // Return address of the malloc call
+    AllocPhase phase;
+    AllocTotals totals;
+} AllocSite;
+
+typedef struct {
+    void *ptr;
+    size_t size;
+    uint32_t site;
+} LiveAlloc;
+
+#define TOMBSTONE ((void *)1)
+
+static const char *phase_names[ALLOC_PHASE_COUNT] = {
+    [ALLOC_PHASE_OTHER] = "other",
+    [ALLOC_PHASE_FETCH] = "fetch",
+    [ALLOC_PHASE_PARSE] = "parse",
+    [ALLOC_PHASE_RENDER] = "render",
+    [ALLOC_PHASE_WRITE] = "write",
+    [ALLOC_PHASE_INSTALL] = "install",
+};
+
+static int profiling = 0;
+static __thread AllocPhase current_phase = ALLOC_PHASE_OTHER;
+static __thread int in_profiler = 0; // Set while the profiler itself may allocate
+static pthread_mutex_t profile_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static AllocTotals phases[ALLOC_PHASE_COUNT];
+static AllocTotals total;
+
+// Sites live in a dense array so LiveAlloc can refer to them by index
+static AllocSite *sites = NULL;
+static size_t site_count = 0;
+static size_t site_capacity = 0;
+static uint32_t *site_slots = NULL; // Hash of site index + 1, 0 is empty
+static size_t site_slot_count = 0;
+
+// Open addressing table of every tracked pointer that has not been freed yet
+static LiveAlloc *live = NULL;
+static size_t live_capacity = 0;
+static size_t live_used = 0; // Entries plus tombstones
+
+AllocPhase alloc_phase_enter(AllocPhase phase) {
+    AllocPhase previous = current_phase;
+    current_phase = phase;
+    return previous;
+}
+
+void alloc_phase_leave(AllocPhase previous) {
+    current_phase = previous;
+}
+
+static size_t hash_pointer(const void *ptr) {
+    uint64_t h = (uint64_t)(uintptr_t)ptr;
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return (size_t)h;
+}
+
+static void add_totals(AllocTotals *totals, size_t size) {
+    totals->allocations++;
+    totals->bytes += size;
+    totals->live += size;
+    if (totals->live > totals->peak) {
+        totals->peak = totals->live;
+    }
+}
+
+static int grow_sites() {
+    size_t capacity = site_capacity ? site_capacity * 2 : 256;
+    // Keep the slot table at most half full
+    size_t slot_count = capacity * 2;
+    uint32_t *slots = __libc_calloc(slot_count, sizeof(uint32_t));
+    if (slots == NULL) {
+        return -1;
+    }
+    AllocSite *grown = __libc_realloc(sites, capacity * sizeof(AllocSite));
+    if (grown == NULL) {
+        __libc_free(slots);
+        return -1;
+    }
+    sites = grown;
+    site_capacity = capacity;
+
+    for (size_t i = 0; i < site_count; i++) {
+        size_t slot = (hash_pointer(sites[i].addr) + sites[i].phase) & (slot_count - 1);
+        while (slots[slot] != 0) {
+            slot = (slot + 1) & (slot_count - 1);
+        }
+        slots[slot] = (uint32_t)(i + 1);
+    }
+    __libc_free(site_slots);
+    site_slots = slots;
+    site_slot_count = slot_count;
+    return 0;
+}
+
+// Returns the index of the (addr, phase) site, or -1 if the table cannot grow
+static long find_site(void *addr, AllocPhase phase) {
+    if (site_count == site_capacity && grow_sites() != 0) {
+        return -1;
+    }
+    size_t slot = (hash_pointer(addr) + phase) & (site_slot_count - 1);
+    while (site_slots[slot] != 0) {
+        AllocSite *site = &sites[site_slots[slot] - 1];
+        if (site->addr == addr && site->phase == phase) {
+            return site_slots[slot] - 1;
+        }
+        slot = (slot + 1) & (site_slot_count - 1);
+    }
+    AllocSite *site = &sites[site_count];
+    memset(site, 0, sizeof(*site));
+    site->addr = addr;
+    site->phase = phase;
+    site_slots[slot] = (uint32_t)(site_count + 1);
+    return (long)site_count++;
+}
+
+static int grow_live() {
+    size_t count = 0;
+    for (size_t i = 0; i < live_capacity; i++) {
+        if (live[i].ptr != NULL && live[i].ptr != TOMBSTONE) {
+            count++;
+        }
+    }
+    size_t capacity = 1024;
+    while (capacity < count * 4) {
+        capacity *= 2;
+    }
+    LiveAlloc *table = __libc_calloc(capacity, sizeof(LiveAlloc));
+    if (table == NULL) {
+        return -1;
+    }
+    for (size_t i = 0; i < live_capacity; i++) {
+        if (live[i].ptr == NULL || live[i].ptr == TOMBSTONE) {
+            continue;
+        }
+        size_t slot = hash_pointer(live[i].ptr) & (capacity - 1);
+        while (table[slot].ptr != NULL) {
+            slot = (slot + 1) & (capacity - 1);
+        }
+        table[slot] = live[i];
+    }
+    __libc_free(live);
+    live = table;
+    live_capacity = capacity;
+    live_used = count;
+    return 0;
+}
+
+static LiveAlloc *find_live(const void *ptr) {
+    if (live_capacity == 0) {
+        return NULL;
+    }
+    size_t slot = hash_pointer(ptr) & (live_capacity - 1);
+    while (live[slot].ptr != NULL) {
+        if (live[slot].ptr == ptr) {
+            return &live[slot];
+        }
+        slot = (slot + 1) & (live_capacity - 1);
+    }
+    return NULL;
+}
+
+// Callers hold profile_lock
+static void untrack_locked(void *ptr) {
+    LiveAlloc *entry = find_live(ptr);
+    if (entry == NULL) {
+        return; // Allocated before profiling started, or by memalign and friends
+    }
+    AllocSite *site = &sites[entry->site];
+    site->totals.live -= entry->size;
+    phases[site->phase].live -= entry->size;
+    total.live -= entry->size;
+    entry->ptr = TOMBSTONE;
+}
+
+static void track_locked(void *ptr, size_t size, void *addr) {
+    // A stale entry for a reused address is dropped first
+    untrack_locked(ptr);
+    if ((live_used + 1) * 2 > live_capacity && grow_live() != 0) {
+        return;
+    }
+    long index = find_site(addr, current_phase);
+    if (index < 0) {
+        return;
+    }
+    add_totals(&sites[index].totals, size);
+    add_totals(&phases[current_phase], size);
+    add_totals(&total, size);
+
+    size_t slot = hash_pointer(ptr) & (live_capacity - 1);
+    while (live[slot].ptr != NULL && live[slot].ptr != TOMBSTONE) {
+        slot = (slot + 1) & (live_capacity - 1);
+    }
+    if (live[slot].ptr == NULL) {
+        live_used++;
+    }
+    live[slot].ptr = ptr;
+    live[slot].size = size;
+    live[slot].site = (uint32_t)index;
+}
+
+static void track(void *ptr, size_t size, void *addr) {
+    in_profiler = 1;
+    pthread_mutex_lock(&profile_lock);
+    track_locked(ptr, size, addr);
+    pthread_mutex_unlock(&profile_lock);
+    in_profiler = 0;
+}
+
+void *malloc(size_t size) {
+    void *ptr = __libc_malloc(size);
+    if (profiling && ptr != NULL && !in_profiler) {
+        track(ptr, size, __builtin_return_address(0));
+    }
+    return ptr;
+}
+
+void *calloc(size_t nmemb, size_t size) {
+    void *ptr = __libc_calloc(nmemb, size);
+    if (profiling && ptr != NULL && !in_profiler) {
+        track(ptr, nmemb * size, __builtin_return_address(0));
+    }
+    return ptr;
+}
+
+void *realloc(void *ptr, size_t size) {
+    if (!profiling || in_profiler) {
+        return __libc_realloc(ptr, size);
+    }
+    // Held across the call so nobody can be handed ptr before it is untracked
+    in_profiler = 1;
+    pthread_mutex_lock(&profile_lock);
+    void *result = __libc_realloc(ptr, size);
+    if (result != NULL || size == 0) {
+        if (ptr != NULL) {
+            untrack_locked(ptr);
+        }
+        if (result != NULL) {
+            track_locked(result, size, __builtin_return_address(0));
+        }
+    }
+    pthread_mutex_unlock(&profile_lock);
+    in_profiler = 0;
+    return result;
+}
+
+void free(void *ptr) {
+    if (profiling && ptr != NULL && !in_profiler) {
+        in_profiler = 1;
+        pthread_mutex_lock(&profile_lock);
+        untrack_locked(ptr);
+        pthread_mutex_unlock(&profile_lock);
+        in_profiler = 0;
+    }
+    __libc_free(ptr);
+}
+
+// Our own functions are mostly static, which dladdr cannot name, so read .symtab
+typedef struct {
+    void *map;
+    size_t size;
+    const ElfW(Sym) *symbols;
+    size_t symbol_count;
+    const char *names;
+    int relative; // PIE, symbol values are offsets from the load address
+} ExeSymbols;
+
+static int load_exe_symbols(ExeSymbols *exe) {
+    memset(exe, 0, sizeof(*exe));
+    int fd = open("/proc/self/exe", O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(ElfW(Ehdr))) {
+        close(fd);
+        return -1;
+    }
+    exe->size = st.st_size;
+    exe->map = mmap(NULL, exe->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (exe->map == MAP_FAILED) {
+        exe->map = NULL;
+        return -1;
+    }
+    const char *base = exe->map;
+    const ElfW(Ehdr) *header = exe->map;
+    if (memcmp(header->e_ident, ELFMAG, SELFMAG) != 0 ||
+        header->e_shoff + (size_t)header->e_shnum * sizeof(ElfW(Shdr)) > exe->size) {
+        return -1;
+    }
+    exe->relative = header->e_type == ET_DYN;
+    const ElfW(Shdr) *sections = (const ElfW(Shdr) *)(base + header->e_shoff);
+    for (size_t i = 0; i < header->e_shnum; i++) {
+        if (sections[i].sh_type != SHT_SYMTAB || sections[i].sh_link >= header->e_shnum) {
+            continue;
+        }
+        const ElfW(Shdr) *strtab = &sections[sections[i].sh_link];
+        if (sections[i].sh_offset + sections[i].sh_size > exe->size ||
+            strtab->sh_offset + strtab->sh_size > exe->size) {
+            return -1;
+        }
+        exe->symbols = (const ElfW(Sym) *)(base + sections[i].sh_offset);
+        exe->symbol_count = sections[i].sh_size / sizeof(ElfW(Sym));
+        exe->names = base + strtab->sh_offset;
+        return 0;
+    }
+    return -1;
+}
+
+static const ElfW(Sym) *exe_symbol(const ExeSymbols *exe, uintptr_t value) {
+    for (size_t i = 0; i < exe->symbol_count; i++) {
+        const ElfW(Sym) *sym = &exe->symbols[i];
+        if (ELF64_ST_TYPE(sym->st_info) == STT_FUNC && value >= sym->st_value &&
+            value < sym->st_value + sym->st_size) {
+            return sym;
+        }
+    }
+    return NULL;
+}
+
+static void describe_site(const ExeSymbols *exe, void *exe_base, void *addr, char *out, size_t size) {
+    Dl_info info;
+    if (dladdr(addr, &info) == 0) {
+        snprintf(out, size, "%p", addr);
+        return;
+    }
+    const char *module = info.dli_fname ? strrchr(info.dli_fname, '/') : NULL;
+    module = module ? module + 1 : (info.dli_fname ? info.dli_fname : "?");
+    uintptr_t offset = (uintptr_t)addr - (uintptr_t)info.dli_fbase;
+
+    if (info.dli_fbase == exe_base && exe->symbols != NULL) {
+        uintptr_t value = exe->relative ? offset : (uintptr_t)addr;
+        const ElfW(Sym) *sym = exe_symbol(exe, value);
+        if (sym != NULL) {
+            snprintf(out, size, "%s+0x%lx (kpm+0x%lx)", exe->names + sym->st_name,
+                     (unsigned long)(value - sym->st_value), (unsigned long)offset);
+            return;
+        }
+    }
+    if (info.dli_sname != NULL) {
+        snprintf(out, size, "%s+0x%lx (%s)", info.dli_sname,
+                 (unsigned long)((uintptr_t)addr - (uintptr_t)info.dli_saddr), module);
+    } else {
+        snprintf(out, size, "%s+0x%lx", module, (unsigned long)offset);
+    }
+}
+
+static int compare_sites(const void *a, const void *b) {
+    const AllocSite *x = &sites[*(const size_t *)a];
+    const AllocSite *y = &sites[*(const size_t *)b];
+    if (x->totals.bytes != y->totals.bytes) {
+        return x->totals.bytes < y->totals.bytes ? 1 : -1;
+    }
+    return x->totals.allocations < y->totals.allocations ? 1 : (x->totals.allocations > y->totals.allocations ? -1 : 0);
+}
+
+static void report() {
+    in_profiler = 1;
+    pthread_mutex_lock(&profile_lock);
+    profiling = 0;
+
+    fprintf(stderr, "\nkpm allocation profile\n");
+    fprintf(stderr, "%-8s %12s %14s %14s %14s\n", "phase", "allocations", "bytes", "peak live", "leaked");
+    for (int i = 0; i < ALLOC_PHASE_COUNT; i++) {
+        fprintf(stderr, "%-8s %12llu %14llu %14llu %14llu\n", phase_names[i], phases[i].allocations,
+                phases[i].bytes, phases[i].peak, phases[i].live);
+    }
+    fprintf(stderr, "%-8s %12llu %14llu %14llu %14llu\n", "total", total.allocations, total.bytes, total.peak, total.live);
+
+    size_t top = ALLOC_PROFILE_TOP_SITES;
+    const char *env = getenv("KPM_ALLOC_PROFILE_TOP");
+    if (env != NULL && atoi(env) > 0) {
+        top = atoi(env);
+    }
+    size_t *order = __libc_malloc((site_count ? site_count : 1) * sizeof(size_t));
+    if (order != NULL) {
+        for (size_t i = 0; i < site_count; i++) {
+            order[i] = i;
+        }
+        qsort(order, site_count, sizeof(size_t), compare_sites);
+
+        ExeSymbols exe;
+        int have_symbols = load_exe_symbols(&exe) == 0;
+        Dl_info self;
+        void *exe_base = dladdr((void *)alloc_phase_enter, &self) ? self.dli_fbase : NULL;
+
+        fprintf(stderr, "\ntop %zu call sites by bytes\n", top < site_count ? top : site_count);
+        fprintf(stderr, "%14s %12s %14s %-8s %s\n", "bytes", "allocations", "peak live", "phase", "site");
+        for (size_t i = 0; i < site_count && i < top; i++) {
+            AllocSite *site = &sites[order[i]];
+            char name[512];
+            describe_site(have_symbols ? &exe : &(ExeSymbols){0}, exe_base, site->addr, name, sizeof(name));
+            fprintf(stderr, "%14llu %12llu %14llu %-8s %s\n", site->totals.bytes, site->totals.allocations,
+                    site->totals.peak, phase_names[site->phase], name);
+        }
+        if (exe.map != NULL) {
+            munmap(exe.map, exe.size);
+        }
+        __libc_free(order);
+    }
+    // One line for scripts, see bench/e2e.py
+    fprintf(stderr, "alloc-profile: allocations=%llu bytes=%llu peak=%llu\n", total.allocations, total.bytes, total.peak);
+    pthread_mutex_unlock(&profile_lock);
+}
+
+__attribute__((constructor)) static void alloc_profile_init() {
+    const char *env = getenv("KPM_ALLOC_PROFILE");
+    if (env != NULL && env[0] != '\0' && strcmp(env, "0") != 0) {
+        // Registered first so it runs after the other exit handlers have cleaned up
+        atexit(report);
+        profiling = 1;
+    }
+}
+#else
+#include <stdio.h>
+#include <stdlib.h>
+
+__attribute__((constructor)) static void alloc_profile_init() {
+    if (getenv("KPM_ALLOC_PROFILE") != NULL) {
+        fprintf(stderr, "KPM_ALLOC_PROFILE is ignored, kpm was built with ALLOC_PROFILE=0\n");
+    }
+}
+#endif
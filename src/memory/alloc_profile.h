@@ -0,0 +1,28 @@
+#ifndef __ALLOC_PROFILE__H
+#define __ALLOC_PROFILE__H
+
+// Allocation profiler. Built in with -DKPM_ALLOC_PROFILE (make ALLOC_PROFILE=1, off by
+// default) and switched on at run time with KPM_ALLOC_PROFILE=1. malloc/calloc/
+// realloc/free are wrapped so every allocation, including curl's and jansson's, is
+// charged to the innermost phase and to its call site; a report goes to stderr at exit.
+typedef enum {
+    ALLOC_PHASE_OTHER,
+    ALLOC_PHASE_FETCH,
+    ALLOC_PHASE_PARSE,
+    ALLOC_PHASE_RENDER,
+    ALLOC_PHASE_WRITE,
+    ALLOC_PHASE_INSTALL,
+    ALLOC_PHASE_COUNT
+} AllocPhase;
+
+#define ALLOC_PROFILE_TOP_SITES 15 // Override with KPM_ALLOC_PROFILE_TOP
+
+#ifdef KPM_ALLOC_PROFILE
+// Returns the phase to hand back to alloc_phase_leave
+AllocPhase alloc_phase_enter(AllocPhase phase);
+void alloc_phase_leave(AllocPhase previous);
+#else
+#define alloc_phase_enter(phase) ((void)(phase), ALLOC_PHASE_OTHER)
+#define alloc_phase_leave(previous) ((void)(previous))
+#endif
+#endif //__ALLOC_PROFILE__H
@@ -0,0 +1,71 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "arena.h"
+
+#define ARENA_ALIGN sizeof(void *)
+
+void arena_init(Arena *arena, size_t block_size) {
+    memset(arena, 0, sizeof(*arena));
+    arena->block_size = block_size ? block_size : ARENA_DEFAULT_BLOCK_SIZE;
+}
+
+void *arena_alloc(Arena *arena, size_t size) {
+    if (arena->block_size == 0) {
+        arena->block_size = ARENA_DEFAULT_BLOCK_SIZE;
+    }
+    size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+
+    ArenaBlock *block = arena->head;
+    if (block == NULL || block->size - block->used < size) {
+        // Oversized requests get a block of their own
+        size_t block_size = size > arena->block_size ? size : arena->block_size;
+        block = malloc(sizeof(ArenaBlock) + block_size);
+        if (block == NULL) {
+            fprintf(stderr, "Arena allocation of %zu bytes failed\n", block_size);
+            return NULL;
+        }
+        block->size = block_size;
+        block->used = 0;
+        if (arena->head != NULL && size > arena->block_size) {
+            // Keep bump-allocating from the current block
+            block->next = arena->head->next;
+            arena->head->next = block;
+        } else {
+            block->next = arena->head;
+            arena->head = block;
+        }
+        arena->blocks++;
+    }
+
+    void *ptr = block->data + block->used;
+    block->used += size;
+    arena->allocations++;
+    arena->bytes += size;
+    return ptr;
+}
+
+char *arena_strdup(Arena *arena, const char *str) {
+    if (str == NULL) {
+        return NULL;
+    }
+    size_t len = strlen(str) + 1;
+    char *copy = arena_alloc(arena, len);
+    if (copy) {
+        memcpy(copy, str, len);
+    }
+    return copy;
+}
+
+void arena_free(Arena *arena) {
+    ArenaBlock *block = arena->head;
+    while (block) {
+        ArenaBlock *next = block->next;
+        free(block);
+        block = next;
+    }
+    arena->head = NULL;
+    arena->blocks = 0;
+    arena->allocations = 0;
+    arena->bytes = 0;
+}
@@ -0,0 +1,27 @@
+#ifndef __ARENA__H
+#define __ARENA__H
+#include <stddef.h>
+
+#define ARENA_DEFAULT_BLOCK_SIZE 4096
+
+typedef struct ArenaBlock {
+    struct ArenaBlock *next;
+    size_t size;
+    size_t used;
+    char data[];
+} ArenaBlock;
+
+// Bump allocator, everything handed out is released together by arena_free
+typedef struct {
+    ArenaBlock *head;
+    size_t block_size;
+    size_t allocations; // Calls to arena_alloc
+    size_t blocks;      // Calls to malloc
+    size_t bytes;
+} Arena;
+
+void arena_init(Arena *arena, size_t block_size);
+void *arena_alloc(Arena *arena, size_t size);
+char *arena_strdup(Arena *arena, const char *str);
+void arena_free(Arena *arena);
+#endif //__ARENA__H
@@ -5,102 +5,34 @@
 #include <curl/curl.h>
 #include "jansson.h"
 #include "fetch.h"
+#include "../json/scanner.h"
+#include "../trace/trace.h"
+#include "../stats/stats.h"
+#include "../memory/alloc_profile.h"
 #include <libgen.h>
 #include <dirent.h>
 #include "errno.h"
-#define INDEX_URL "https://raw.githubusercontent.com/KingVentrix007/CodeStarterFiles/main/libs"
+#include "../registry/registry.h"
+#include "../registry/transfer.h"
+#include "../cache/cache.h"
+#include "cpkg_main.h"
+#include "installed.h"
+#include "../manifest/manifest.h"
+#define INDEX_URL registry_libs_url()
 #define INDEX_NAME "index.json"
 
-// Structure to store the response data
-struct MemoryStruct {
-    char *memory;
-    size_t size;
-};
-
-// Callback function to handle data received from cURL
-static size_t WriteMemoryCallback(void *contents, size_t size, size_t nmemb, void *userp) {
-    size_t realsize = size * nmemb;
-    struct MemoryStruct *mem = (struct MemoryStruct *)userp;
-
-    char *ptr = realloc(mem->memory, mem->size + realsize + 1);
-    if(ptr == NULL) {
-        // Out of memory
-        printf("Not enough memory (realloc returned NULL)\n");
-        return 0;
+char *fetch_json_data(const char *url) {
+    RegistryResponse response;
+    if (registry_get(url, &response) != 0) {
+        return NULL;
     }
-
-    mem->memory = ptr;
-    memcpy(&(mem->memory[mem->size]), contents, realsize);
-    mem->size += realsize;
-    mem->memory[mem->size] = 0;
-
-    return realsize;
+    return response.data;
 }
-
 // Function to fetch the index.json from the URL
 char *fetch_index_json() {
-    CURL *curl_handle;
-    CURLcode res;
-    struct MemoryStruct chunk;
-
-    chunk.memory = malloc(1);  // will be grown as needed by the realloc above
-    chunk.size = 0;            // no data at this point
-
-    curl_global_init(CURL_GLOBAL_ALL);
-
-    curl_handle = curl_easy_init();
-    char *url = malloc(strlen(INDEX_URL) + strlen("index.json")+100);
-    int ret = snprintf(url, strlen(INDEX_URL) + strlen("index.json")+100, "%s/%s", INDEX_URL,INDEX_NAME);
-    if(ret)
-    {
-
-    }
-    curl_easy_setopt(curl_handle, CURLOPT_URL, url);
-    curl_easy_setopt(curl_handle, CURLOPT_WRITEFUNCTION, WriteMemoryCallback);
-    curl_easy_setopt(curl_handle, CURLOPT_WRITEDATA, (void *)&chunk);
-    curl_easy_setopt(curl_handle, CURLOPT_USERAGENT, "libcurl-agent/1.0");
-
-    res = curl_easy_perform(curl_handle);
-
-    if(res != CURLE_OK) {
-        fprintf(stderr, "curl_easy_perform() failed: %s\n", curl_easy_strerror(res));
-        free(chunk.memory);
-        chunk.memory = NULL;
-    }
-
-    curl_easy_cleanup(curl_handle);
-    curl_global_cleanup();
-
-    return chunk.memory;
-}
-char *fetch_json_data(const char *url) {
-    CURL *curl_handle;
-    CURLcode res;
-    struct MemoryStruct chunk;
-
-    chunk.memory = malloc(1);
-    chunk.size = 0;
-
-    curl_global_init(CURL_GLOBAL_ALL);
-    curl_handle = curl_easy_init();
-
-    curl_easy_setopt(curl_handle, CURLOPT_URL, url);
-    curl_easy_setopt(curl_handle, CURLOPT_WRITEFUNCTION, WriteMemoryCallback);
-    curl_easy_setopt(curl_handle, CURLOPT_WRITEDATA, (void *)&chunk);
-    curl_easy_setopt(curl_handle, CURLOPT_USERAGENT, "libcurl-agent/1.0");
-
-    res = curl_easy_perform(curl_handle);
-
-    if(res != CURLE_OK) {
-        fprintf(stderr, "curl_easy_perform() failed: %s\n", curl_easy_strerror(res));
-        free(chunk.memory);
-        chunk.memory = NULL;
-    }
-
-    curl_easy_cleanup(curl_handle);
-    curl_global_cleanup();
-
-    return chunk.memory;
+    char url[2048];
+    snprintf(url, sizeof(url), "%s/%s", INDEX_URL, INDEX_NAME);
+    return fetch_json_data(url);
 }
 // Function to get the path for a specific library name and language
 char *get_lib_path(const char *lib_name, const char *language) {
@@ -110,75 +42,42 @@ char *get_lib_path(const char *lib_name, const char *language) {
         return NULL;
     }
 
-    json_error_t error;
-    json_t *root = json_loads(json_data, 0, &error);
-    free(json_data);
-
-    if (!root) {
-        fprintf(stderr, "Error parsing JSON data: %s\n", error.text);
+    // Only <lib_name>.lang and <lib_name>.path are read, the rest of the index is skipped
+    JsonScanner scanner;
+    AllocPhase phase = alloc_phase_enter(ALLOC_PHASE_PARSE);
+    if (json_scanner_init(&scanner, json_data, strlen(json_data)) != 0) {
+        fprintf(stderr, "Error indexing index.json\n");
+        alloc_phase_leave(phase);
+        free(json_data);
         return NULL;
     }
+    const char *lang_key[] = {lib_name, "lang"};
+    const char *path_key[] = {lib_name, "path"};
+    char *lib_lang = json_scanner_find_string(&scanner, lang_key, 2);
+    char *path = json_scanner_find_string(&scanner, path_key, 2);
+    json_scanner_free(&scanner);
+    alloc_phase_leave(phase);
+    free(json_data);
 
-    json_t *lib_info = json_object_get(root, lib_name);
-    if (!lib_info) {
+    if (!lib_lang && !path) {
         printf("Library %s not found in index.json\n", lib_name);
-        json_decref(root);
         return NULL;
     }
 
-    const char *lib_lang = json_string_value(json_object_get(lib_info, "lang"));
     if (!lib_lang || strcmp(lib_lang, language) != 0) {
         printf("Language mismatch for library %s. Expected: %s, Found: %s\n", lib_name, language, lib_lang ? lib_lang : "N/A");
-        json_decref(root);
+        free(lib_lang);
+        free(path);
         return NULL;
     }
+    free(lib_lang);
 
-    const char *path = json_string_value(json_object_get(lib_info, "path"));
     if (!path) {
         printf("Path not found for library %s\n", lib_name);
-        json_decref(root);
         return NULL;
     }
-
-    char *result = strdup(path);
-    json_decref(root);
-    return result;
-}
-// Function to fetch a file from a URL and save it to a local path
-int fetch_and_save_file(const char *url, const char *local_path) {
-    CURL *curl_handle;
-    FILE *fp;
-    CURLcode res;
-
-    curl_global_init(CURL_GLOBAL_DEFAULT);
-    curl_handle = curl_easy_init();
-
-    if (curl_handle) {
-        fp = fopen(local_path, "wb");
-        if (fp == NULL) {
-            curl_easy_cleanup(curl_handle);
-            return -1;
-        }
-
-        curl_easy_setopt(curl_handle, CURLOPT_URL, url);
-        curl_easy_setopt(curl_handle, CURLOPT_WRITEFUNCTION, NULL);
-        curl_easy_setopt(curl_handle, CURLOPT_WRITEDATA, fp);
-
-        res = curl_easy_perform(curl_handle);
-        fclose(fp);
-
-        if (res != CURLE_OK) {
-            fprintf(stderr, "curl_easy_perform() failed: %s\n", curl_easy_strerror(res));
-            return -1;
-        }
-
-        curl_easy_cleanup(curl_handle);
-    }
-
-    curl_global_cleanup();
-    return 0;
+    return path;
 }
-
 // Function to create directories if they don't exist
 void create_dir(const char *path) {
     struct stat st = {0};
@@ -198,8 +97,9 @@ void create_dirs_recursively(const char *path) {
 
     // Remove the filename from the path, keeping only the directory part
     if (tmp[len - 1] != '/') {
-        char *dir = dirname(tmp);
-        snprintf(tmp, sizeof(tmp), "%s", dir);
+        char path_copy[512];
+        snprintf(path_copy, sizeof(path_copy), "%s", path);
+        snprintf(tmp, sizeof(tmp), "%s", dirname(path_copy));
     }
 
     for (p = tmp + 1; *p; p++) {
@@ -211,64 +111,102 @@ void create_dirs_recursively(const char *path) {
     }
     mkdir(tmp, 0700);
 }
-void save_header_files(LibraryInfo *lib_info) {
-    char base_dir[256];
-    snprintf(base_dir, sizeof(base_dir), "libs/%s", lib_info->name);
-
-    for (size_t i = 0; i < lib_info->header_count; i++) {
+// Sources and headers are fetched together, as many at once as scheduler.h lets each host take,
+// then recorded for kpm update (see installed.h). Paths from the library json are checked as
+// kpm update checks them: an unsafe name saves nothing and returns -1, unsafe files are skipped
+int save_library_files(LibraryInfo *lib_info, const char *json_url, const char *json_validator) {
+    if (lib_info->name == NULL || strchr(lib_info->name, '/') != NULL || !safe_relative_path(lib_info->name)) {
+        fprintf(stderr, "Refusing to install library with unsafe name '%s'\n", lib_info->name ? lib_info->name : "");
+        return -1;
+    }
+    TraceSpan span;
+    trace_begin(&span, "write", "save_library_files");
+    AllocPhase phase = alloc_phase_enter(ALLOC_PHASE_WRITE);
+    size_t count = lib_info->src_count + lib_info->header_count;
+    RegistryRequest *requests = calloc(count ? count : 1, sizeof(RegistryRequest));
+    if (requests == NULL) {
+        fprintf(stderr, "Failed to allocate memory\n");
+        alloc_phase_leave(phase);
+        trace_end(&span);
+        return -1;
+    }
+    InstalledFile *installed = calloc(count ? count : 1, sizeof(InstalledFile));
+    size_t installed_count = 0;
+    Arena arena;
+    arena_init(&arena, ARENA_DEFAULT_BLOCK_SIZE);
+    // Sources first, then headers, as the library json lists them
+    const char **files = arena_alloc(&arena, (count ? count : 1) * sizeof(char *));
+    size_t fetch_count = 0;
+    size_t src_fetched = 0;
+    for (size_t i = 0; i < count; i++) {
+        int header = i >= lib_info->src_count;
+        const char *file = header ? lib_info->header_paths[i - lib_info->src_count] : lib_info->src_paths[i];
         char local_path[512];
-        snprintf(local_path, sizeof(local_path), "%s/%s", base_dir, lib_info->header_paths[i]);
-
-        // Extract the directory path from local_path
-        char local_dir[512];
-        snprintf(local_dir, sizeof(local_dir), "%s", local_path);
-        char *dir_name = dirname(local_dir);
+        int len = snprintf(local_path, sizeof(local_path), "libs/%s/%s", lib_info->name, file ? file : "");
+        if (!safe_relative_path(file) || len < 0 || (size_t)len >= sizeof(local_path)) {
+            fprintf(stderr, "Refusing to save %s: unsafe path '%s'\n", lib_info->name, file ? file : "");
+            continue;
+        }
 
         // Create necessary directories for the file path, excluding the file itself
-        create_dirs_recursively(dir_name);
+        create_dirs_recursively(local_path);
 
         char file_url[512];
-        snprintf(file_url, sizeof(file_url), "%s%s", lib_info->raw_path, lib_info->header_paths[i]);
-
-        printf("Fetching header file from %s\n", file_url);
-        printf("Saving header file to %s\n", local_path);
-
-        if (fetch_and_save_file(file_url, local_path) == 0) {
-            printf("Header file saved successfully.\n");
+        snprintf(file_url, sizeof(file_url), "%s%s", lib_info->raw_path, file);
+
+        printf("Fetching %s from %s\n", header ? "header file" : "file", file_url);
+        printf("Saving %s to %s\n", header ? "header file" : "file", local_path);
+        files[fetch_count] = file;
+        requests[fetch_count].url = arena_strdup(&arena, file_url);
+        requests[fetch_count].path = arena_strdup(&arena, local_path);
+        requests[fetch_count].priority = REQUEST_NORMAL;
+        fetch_count++;
+        src_fetched += !header;
+    }
+    registry_fetch_all(requests, fetch_count);
+    for (size_t i = 0; i < fetch_count; i++) {
+        int header = i >= src_fetched;
+        if (requests[i].result == 0 && requests[i].response.status >= 400) {
+            requests[i].result = -1;
+        }
+        if (requests[i].result == 0) {
+            STATS_INC(STAT_FILES_WRITTEN);
+            printf("%s saved successfully.\n", header ? "Header file" : "File");
         } else {
-            printf("Failed to save header file.\n");
+            printf("Failed to save %s.\n", header ? "header file" : "file");
         }
+        // Failed files are left out of the record
+        InstalledFile *file = installed != NULL ? &installed[installed_count] : NULL;
+        if (file != NULL && requests[i].result == 0 && hash_file(requests[i].path, &file->hash, &file->size) == 0) {
+            file->path = files[i];
+            file->validator = requests[i].response.validator;
+            installed_count++;
+        }
+    }
+    // Without the json's validator kpm update gets the library json back in full rather than a 304,
+    // so it lists the files left out and fetches them as new
+    if (installed_count < count) {
+        json_validator = NULL;
+    }
+    if (installed != NULL &&
+        installed_save(lib_info->name, json_url, json_validator, lib_info->raw_path, installed, installed_count) != 0) {
+        fprintf(stderr, "Failed to record %s for kpm update\n", lib_info->name);
     }
+    free(installed);
+    free(requests);
+    arena_free(&arena);
+    alloc_phase_leave(phase);
+    trace_end_detail(&span, "library", lib_info->name);
+    return 0;
 }
-// Function to save files from src_paths to the specified directory
-void save_source_files(LibraryInfo *lib_info) {
-    char base_dir[256];
-    snprintf(base_dir, sizeof(base_dir), "libs/%s", lib_info->name);
-
-    for (size_t i = 0; i < lib_info->src_count; i++) {
-        char local_path[512];
-        snprintf(local_path, sizeof(local_path), "%s/%s", base_dir, lib_info->src_paths[i]);
-
-        // Extract the directory path from local_path
-        char local_dir[512];
-        snprintf(local_dir, sizeof(local_dir), "%s", local_path);
-        char *dir_name = dirname(local_dir);
-
-        // Create necessary directories for the file path, excluding the file itself
-        create_dirs_recursively(dir_name);
-
-        char file_url[512];
-        snprintf(file_url, sizeof(file_url), "%s%s", lib_info->raw_path, lib_info->src_paths[i]);
-
-        printf("Fetching file from %s\n", file_url);
-        printf("Saving file to %s\n", local_path);
-
-        if (fetch_and_save_file(file_url, local_path) == 0) {
-            printf("File saved successfully.\n");
-        } else {
-            printf("Failed to save file.\n");
-        }
+// kpm mirror stores raw_path relative to the library json
+const char *resolve_raw_path(const LibraryInfo *lib_info, const char *json_url, char *out, size_t size) {
+    const char *slash = strrchr(json_url, '/');
+    if (lib_info->raw_path && strstr(lib_info->raw_path, "://") == NULL && lib_info->raw_path[0] != '/' && slash) {
+        snprintf(out, size, "%.*s/%s", (int)(slash - json_url), json_url, lib_info->raw_path);
+        return out;
     }
+    return lib_info->raw_path;
 }
 int directory_exists(const char *path) {
     DIR *dir = opendir(path);
@@ -338,10 +276,18 @@ int directory_exists(const char *path) {
 //     free(lib_name_buffer_file);
 //     return 0;
 // }
-int cpkg_main(char *lib_name,char *language)
+int cpkg_main(char *lib_name,const char *language)
 {
     printf("Installing package\n");
+    AllocPhase phase = alloc_phase_enter(ALLOC_PHASE_INSTALL);
     char *path = get_lib_path(lib_name, language);
+    if (path) {
+        printf("Path for library '%s' with language '%s': %s\n", lib_name, language, path);
+    } else {
+        printf("Library '%s' not found or language mismatch.\n", lib_name);
+        alloc_phase_leave(phase);
+        return 1;
+    }
     if(directory_exists("libs") != 1)
     {
         mkdir("libs",0700);
@@ -352,21 +298,25 @@ int cpkg_main(char *lib_name,char *language)
     {
         mkdir(lib_dir_path,0700);
     }
-    if (path) {
-        printf("Path for library '%s' with language '%s': %s\n", lib_name, language, path);
-    } else {
-        printf("Library '%s' not found or language mismatch.\n", lib_name);
-    }
+    free(lib_dir_path);
 
     char *lib_name_buffer_file = malloc(strlen(INDEX_URL) + strlen(path) + 100);
     printf("path == %s\n", path);
     snprintf(lib_name_buffer_file, strlen(INDEX_URL) + strlen(path) + 100, "%s/%s", INDEX_URL, path);
     printf("lib_name_buffer_file: %s\n", lib_name_buffer_file);
+    free(path);
 
-    char *json_data = fetch_json_data(lib_name_buffer_file);
+    int ret = 1;
+    RegistryResponse response;
+    char *json_data = registry_get(lib_name_buffer_file, &response) == 0 ? response.data : NULL;
     if (json_data) {
         LibraryInfo *lib_info = parse_library_json(json_data);
 
+        char raw_path[2048];
+        if (lib_info) {
+            lib_info->raw_path = (char *)resolve_raw_path(lib_info, lib_name_buffer_file, raw_path, sizeof(raw_path));
+        }
+
         // Use lib_info as needed
         if (lib_info) {
             printf("Library Name: %s\n", lib_info->name);
@@ -381,21 +331,16 @@ int cpkg_main(char *lib_name,char *language)
                 printf("  %s\n", lib_info->header_paths[i]);
             }
 
-            // Save source files
-            save_source_files(lib_info);
-            save_header_files(lib_info);
-            free(json_data);
-            free(lib_name_buffer_file);
-            return 0;
-
-
-            // Free allocated memory
-            // free_library_info(lib_info);
+            if (save_library_files(lib_info, lib_name_buffer_file, response.validator) == 0) {
+                ret = manifest_add_dependency(lib_name, lib_info->version ? lib_info->version : "*") == 0 ? 0 : 1;
+            }
+            free_library_info(lib_info);
         }
 
         free(json_data);
     }
 
     free(lib_name_buffer_file);
-    return 0;
-}
\ No newline at end of file
+    alloc_phase_leave(phase);
+    return ret;
+}
@@ -1,5 +1,13 @@
 #ifndef __CPKG_MAIN__H
 #define __CPKG_MAIN__H
 
-int cpkg_main(char *lib_name,char *language);
+#include <stddef.h>
+#include "fetch.h"
+
+int cpkg_main(char *lib_name,const char *language);
+// The library json's path from the index, NULL if it is missing or for another language
+char *get_lib_path(const char *lib_name, const char *language);
+void create_dirs_recursively(const char *path);
+// lib_info->raw_path, made absolute against json_url when kpm mirror stored it relative
+const char *resolve_raw_path(const LibraryInfo *lib_info, const char *json_url, char *out, size_t size);
 #endif
\ No newline at end of file
@@ -3,52 +3,74 @@
 #include <string.h>
 #include <jansson.h>
 #include "fetch.h"
+#include "../trace/trace.h"
+#include "../stats/stats.h"
+#include "../memory/alloc_profile.h"
 // Function to parse JSON and populate the LibraryInfo struct
 LibraryInfo *parse_library_json(const char *json_data) {
     json_error_t error;
+    TraceSpan span;
+    trace_begin(&span, "parse", "parse_library_json");
+    STATS_ADD(STAT_JSON_BYTES_PARSED, strlen(json_data));
+    AllocPhase phase = alloc_phase_enter(ALLOC_PHASE_PARSE);
     json_t *root = json_loads(json_data, 0, &error);
 
     if (!root) {
         fprintf(stderr, "Error parsing JSON data: %s\n", error.text);
+        trace_end(&span);
+        alloc_phase_leave(phase);
         return NULL;
     }
 
-    LibraryInfo *lib_info = malloc(sizeof(LibraryInfo));
+    // Every string and array lives in one arena, released by free_library_info
+    Arena arena;
+    arena_init(&arena, 0);
+    LibraryInfo *lib_info = arena_alloc(&arena, sizeof(LibraryInfo));
+    if (!lib_info) {
+        json_decref(root);
+        trace_end(&span);
+        alloc_phase_leave(phase);
+        return NULL;
+    }
 
     // Parse simple fields
-    lib_info->name = strdup(json_string_value(json_object_get(root, "name")));
-    lib_info->git_url = strdup(json_string_value(json_object_get(root, "git_url")));
-    lib_info->raw_path = strdup(json_string_value(json_object_get(root, "raw_path")));
+    lib_info->name = arena_strdup(&arena, json_string_value(json_object_get(root, "name")));
+    lib_info->version = arena_strdup(&arena, json_string_value(json_object_get(root, "version")));
+    lib_info->git_url = arena_strdup(&arena, json_string_value(json_object_get(root, "git_url")));
+    lib_info->raw_path = arena_strdup(&arena, json_string_value(json_object_get(root, "raw_path")));
     lib_info->has_headers = json_boolean_value(json_object_get(root, "has_headers"));
     lib_info->is_prebuilt = json_boolean_value(json_object_get(root, "is_prebuilt"));
-    lib_info->description = strdup(json_string_value(json_object_get(root, "description")));
-    lib_info->author = strdup(json_string_value(json_object_get(root, "author")));
-    lib_info->license = strdup(json_string_value(json_object_get(root, "license")));
-    lib_info->added_by = strdup(json_string_value(json_object_get(root, "added_by")));
+    lib_info->description = arena_strdup(&arena, json_string_value(json_object_get(root, "description")));
+    lib_info->author = arena_strdup(&arena, json_string_value(json_object_get(root, "author")));
+    lib_info->license = arena_strdup(&arena, json_string_value(json_object_get(root, "license")));
+    lib_info->added_by = arena_strdup(&arena, json_string_value(json_object_get(root, "added_by")));
 
     // Parse arrays
     json_t *src_paths_array = json_object_get(root, "src_paths");
     lib_info->src_count = json_array_size(src_paths_array);
-    lib_info->src_paths = malloc(lib_info->src_count * sizeof(char *));
+    lib_info->src_paths = arena_alloc(&arena, lib_info->src_count * sizeof(char *));
     for (size_t i = 0; i < lib_info->src_count; i++) {
-        lib_info->src_paths[i] = strdup(json_string_value(json_array_get(src_paths_array, i)));
+        lib_info->src_paths[i] = arena_strdup(&arena, json_string_value(json_array_get(src_paths_array, i)));
     }
 
     json_t *header_paths_array = json_object_get(root, "header_paths");
     lib_info->header_count = json_array_size(header_paths_array);
-    lib_info->header_paths = malloc(lib_info->header_count * sizeof(char *));
+    lib_info->header_paths = arena_alloc(&arena, lib_info->header_count * sizeof(char *));
     for (size_t i = 0; i < lib_info->header_count; i++) {
-        lib_info->header_paths[i] = strdup(json_string_value(json_array_get(header_paths_array, i)));
+        lib_info->header_paths[i] = arena_strdup(&arena, json_string_value(json_array_get(header_paths_array, i)));
     }
 
     json_t *keywords_array = json_object_get(root, "keywords");
     lib_info->keyword_count = json_array_size(keywords_array);
-    lib_info->keywords = malloc(lib_info->keyword_count * sizeof(char *));
+    lib_info->keywords = arena_alloc(&arena, lib_info->keyword_count * sizeof(char *));
     for (size_t i = 0; i < lib_info->keyword_count; i++) {
-        lib_info->keywords[i] = strdup(json_string_value(json_array_get(keywords_array, i)));
+        lib_info->keywords[i] = arena_strdup(&arena, json_string_value(json_array_get(keywords_array, i)));
     }
 
     json_decref(root);
+    lib_info->arena = arena;
+    trace_end(&span);
+    alloc_phase_leave(phase);
     return lib_info;
 }
 
@@ -56,28 +78,7 @@ LibraryInfo *parse_library_json(const char *json_data) {
 void free_library_info(LibraryInfo *lib_info) {
     if (!lib_info) return;
 
-    free(lib_info->name);
-    free(lib_info->git_url);
-    free(lib_info->raw_path);
-    free(lib_info->description);
-    free(lib_info->author);
-    free(lib_info->license);
-    free(lib_info->added_by);
-
-    for (size_t i = 0; i < lib_info->src_count; i++) {
-        free(lib_info->src_paths[i]);
-    }
-    free(lib_info->src_paths);
-
-    for (size_t i = 0; i < lib_info->header_count; i++) {
-        free(lib_info->header_paths[i]);
-    }
-    free(lib_info->header_paths);
-
-    for (size_t i = 0; i < lib_info->keyword_count; i++) {
-        free(lib_info->keywords[i]);
-    }
-    free(lib_info->keywords);
-
-    free(lib_info);
+    // lib_info lives inside its own arena, so copy the arena out first
+    Arena arena = lib_info->arena;
+    arena_free(&arena);
 }
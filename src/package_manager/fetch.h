@@ -4,9 +4,11 @@
 #include <stdlib.h>
 #include <string.h>
 #include <jansson.h>
+#include "../memory/arena.h"
 
 typedef struct {
     char *name;
+    char *version;  // NULL when the library json does not say
     char *git_url;
     char *raw_path;
     char **src_paths;
@@ -21,8 +23,10 @@ typedef struct {
     char **keywords;
     size_t keyword_count;
     char *added_by;
+    Arena arena; // Owns the struct itself and everything it points to
 } LibraryInfo;
 
 
 LibraryInfo *parse_library_json(const char *json_data);
+void free_library_info(LibraryInfo *lib_info);
 #endif
\ No newline at end of file
@@ -0,0 +1,453 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <jansson.h>
+#include "installed.h"
+#include "cpkg_main.h"
+#include "fetch.h"
+#include "../json/writer.h"
+#include "../cache/cache.h"
+#include "../registry/registry.h"
+#include "../registry/transfer.h"
+#include "../stats/stats.h"
+
+typedef struct {
+    const char *name;
+    json_t *record;            // NULL for libraries installed before records were kept
+    char *json_url;
+    LibraryInfo *info;         // Set when the library json changed
+    const char *raw_path;
+    char raw_path_buf[2048];
+    const char **paths;        // Every file it lists now
+    size_t path_count;
+    size_t first;              // Its files' slice of the file requests
+    int failed;
+} UpdateLib;
+
+typedef struct {
+    size_t updated;
+    size_t current;
+    size_t failed;
+    size_t fetched;
+    size_t not_modified;
+    size_t removed;
+    unsigned long long bytes;
+} UpdateTotals;
+
+static void record_path(const char *name, char *out, size_t size) {
+    snprintf(out, size, "%s/%s.json", INSTALLED_DIR, name);
+}
+
+static json_t *load_record(const char *name) {
+    char path[1024];
+    record_path(name, path, sizeof(path));
+    return json_load_file(path, 0, NULL);
+}
+
+// Streamed rather than built with jansson, a large library's record would otherwise
+// cost install more than its own json did
+int installed_save(const char *name, const char *json_url, const char *json_validator, const char *raw_path,
+                   const InstalledFile *files, size_t count) {
+    if (name == NULL || strchr(name, '/') != NULL || !safe_relative_path(name) || make_dirs(INSTALLED_DIR) != 0) {
+        return -1;
+    }
+    char path[1024];
+    char tmp[1100];
+    record_path(name, path, sizeof(path));
+    snprintf(tmp, sizeof(tmp), "%s.tmp.%d", path, (int)getpid());
+    FILE *out = fopen(tmp, "w");
+    if (out == NULL) {
+        return -1;
+    }
+    fputs("{\n    \"name\": ", out);
+    json_write_string(out, name);
+    fputs(",\n    \"url\": ", out);
+    json_write_string(out, json_url);
+    fputs(",\n    \"validator\": ", out);
+    json_write_string(out, json_validator);
+    if (raw_path != NULL) {
+        fputs(",\n    \"raw_path\": ", out);
+        json_write_string(out, raw_path);
+    }
+    fputs(",\n    \"files\": {", out);
+    for (size_t i = 0; i < count; i++) {
+        fputs(i ? ",\n        " : "\n        ", out);
+        json_write_string(out, files[i].path);
+        fprintf(out, ": {\"hash\": \"%016llx\", \"size\": %zu, \"validator\": ", (unsigned long long)files[i].hash,
+                files[i].size);
+        json_write_string(out, files[i].validator);
+        fputc('}', out);
+    }
+    fputs(count ? "\n    }\n}\n" : "}\n}\n", out);
+    int ret = ferror(out) ? -1 : 0;
+    if (fclose(out) != 0 || ret != 0 || rename(tmp, path) != 0) {
+        unlink(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+// The recorded hash of path, -1 if the record does not have a usable one
+static int recorded_hash(json_t *record, const char *path, uint64_t *hash) {
+    const char *hex = json_string_value(json_object_get(json_object_get(json_object_get(record, "files"), path), "hash"));
+    if (hex == NULL || strlen(hex) != 16 || strspn(hex, "0123456789abcdef") != 16) {
+        return -1;
+    }
+    *hash = strtoull(hex, NULL, 16);
+    return 0;
+}
+
+// Removes path and whatever directories it leaves empty, up to libs/<name>
+static void remove_file(const char *name, const char *path) {
+    char full[1024];
+    snprintf(full, sizeof(full), "libs/%s/%s", name, path);
+    if (unlink(full) != 0 && errno != ENOENT) {
+        perror(full);
+        return;
+    }
+    size_t root = strlen("libs/") + strlen(name);
+    char *slash;
+    while ((slash = strrchr(full, '/')) != NULL && (size_t)(slash - full) > root) {
+        *slash = '\0';
+        if (rmdir(full) != 0) {
+            break;
+        }
+    }
+}
+
+// Library json urls come from the record, or the index for libraries installed before records
+static int resolve_library(UpdateLib *lib, const char *language) {
+    const char *url = json_string_value(json_object_get(lib->record, "url"));
+    if (url != NULL) {
+        lib->json_url = strdup(url);
+        return lib->json_url ? 0 : -1;
+    }
+    char *path = get_lib_path(lib->name, language);
+    if (path == NULL) {
+        return -1;
+    }
+    lib->json_url = malloc(strlen(registry_libs_url()) + strlen(path) + 2);
+    if (lib->json_url != NULL) {
+        sprintf(lib->json_url, "%s/%s", registry_libs_url(), path);
+    }
+    free(path);
+    return lib->json_url ? 0 : -1;
+}
+
+// The file list from a changed library json, or the record's when it came back 304
+static int list_files(UpdateLib *lib, RegistryRequest *request) {
+    if (request->result != 0 || (request->response.status != 200 && request->response.status != 304)) {
+        fprintf(stderr, "Failed to fetch %s\n", request->url);
+        return -1;
+    }
+    if (request->response.status == 304) {
+        json_t *files = json_object_get(lib->record, "files");
+        lib->raw_path = json_string_value(json_object_get(lib->record, "raw_path"));
+        lib->paths = calloc(json_object_size(files) + 1, sizeof(char *));
+        if (lib->paths == NULL || lib->raw_path == NULL) {
+            return -1;
+        }
+        const char *key;
+        json_t *value;
+        json_object_foreach(files, key, value) {
+            (void)value;
+            lib->paths[lib->path_count++] = key;
+        }
+    } else {
+        lib->info = parse_library_json(request->response.data);
+        if (lib->info == NULL) {
+            return -1;
+        }
+        lib->raw_path = resolve_raw_path(lib->info, lib->json_url, lib->raw_path_buf, sizeof(lib->raw_path_buf));
+        lib->paths = calloc(lib->info->src_count + lib->info->header_count + 1, sizeof(char *));
+        if (lib->paths == NULL || lib->raw_path == NULL) {
+            return -1;
+        }
+        for (size_t i = 0; i < lib->info->src_count + lib->info->header_count; i++) {
+            const char *path = i < lib->info->src_count ? lib->info->src_paths[i] : lib->info->header_paths[i - lib->info->src_count];
+            int listed = 0;
+            for (size_t j = 0; j < lib->path_count && !listed; j++) {
+                listed = strcmp(lib->paths[j], path) == 0;
+            }
+            if (path != NULL && !listed) {
+                lib->paths[lib->path_count++] = path;
+            }
+        }
+    }
+    for (size_t i = 0; i < lib->path_count; i++) {
+        if (!safe_relative_path(lib->paths[i])) {
+            fprintf(stderr, "Refusing to update %s: unsafe path '%s'\n", lib->name, lib->paths[i]);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Writes what changed, drops what the library no longer lists and saves the new record
+static int apply_library(UpdateLib *lib, RegistryRequest *requests, const char *json_validator, UpdateTotals *totals) {
+    for (size_t i = 0; i < lib->path_count; i++) {
+        RegistryRequest *request = &requests[lib->first + i];
+        if (request->result != 0 || (request->response.status != 200 && request->response.status != 304)) {
+            // Nothing is touched, the next update tries the whole library again
+            fprintf(stderr, "Failed to fetch %s, not updating %s\n", request->url, lib->name);
+            return -1;
+        }
+    }
+    InstalledFile *files = calloc(lib->path_count + 1, sizeof(InstalledFile));
+    if (files == NULL) {
+        return -1;
+    }
+    size_t changed = 0;
+    size_t added = 0;
+    size_t removed = 0;
+    int ret = 0;
+    for (size_t i = 0; i < lib->path_count && ret == 0; i++) {
+        RegistryRequest *request = &requests[lib->first + i];
+        json_t *previous = json_object_get(json_object_get(lib->record, "files"), lib->paths[i]);
+        InstalledFile *file = &files[i];
+        file->path = lib->paths[i];
+        file->validator = request->response.validator;
+        if (request->response.status == 304) {
+            if (file->validator[0] == '\0') {
+                file->validator = json_string_value(json_object_get(previous, "validator"));
+            }
+            // Only asked conditionally when the local copy matched the record
+            recorded_hash(lib->record, file->path, &file->hash);
+            file->size = (size_t)json_integer_value(json_object_get(previous, "size"));
+            continue;
+        }
+        file->hash = hash_bytes(request->response.data, request->response.size);
+        file->size = request->response.size;
+        char local[1024];
+        snprintf(local, sizeof(local), "libs/%s/%s", lib->name, file->path);
+        size_t size = 0;
+        char *data = read_file_data(local, &size);
+        int same = data != NULL && size == file->size && memcmp(data, request->response.data, size) == 0;
+        free(data);
+        if (same) {
+            continue; // A new validator for the same bytes, or a registry without conditional requests
+        }
+        create_dirs_recursively(local);
+        if (write_file_atomic(local, request->response.data, request->response.size) != 0) {
+            fprintf(stderr, "Failed to write %s: %s\n", local, strerror(errno));
+            ret = -1;
+            break;
+        }
+        STATS_INC(STAT_FILES_WRITTEN);
+        previous != NULL ? changed++ : added++;
+    }
+    const char *key;
+    json_t *value;
+    json_object_foreach(json_object_get(lib->record, "files"), key, value) {
+        (void)value;
+        int listed = 0;
+        for (size_t i = 0; i < lib->path_count && !listed; i++) {
+            listed = strcmp(lib->paths[i], key) == 0;
+        }
+        if (ret == 0 && !listed && safe_relative_path(key)) {
+            remove_file(lib->name, key);
+            removed++;
+        }
+    }
+    if (ret == 0 && installed_save(lib->name, lib->json_url, json_validator, lib->raw_path, files, lib->path_count) != 0) {
+        fprintf(stderr, "Failed to record %s\n", lib->name);
+        ret = -1;
+    }
+    free(files);
+    if (ret == 0 && changed + added + removed == 0) {
+        printf("%s is up to date\n", lib->name);
+        totals->current++;
+    } else if (ret == 0) {
+        printf("%s updated: %zu changed, %zu added, %zu removed\n", lib->name, changed, added, removed);
+        totals->updated++;
+        totals->removed += removed;
+    }
+    return ret;
+}
+
+static void add_name(const char ***names, size_t *count, const char *name) {
+    const char **grown = realloc(*names, (*count + 1) * sizeof(char *));
+    if (grown != NULL) {
+        grown[(*count)++] = name;
+        *names = grown;
+    }
+}
+
+// Every library with a record, names are malloc'd into owned
+static void recorded_libraries(const char ***names, size_t *count, char ***owned, size_t *owned_count) {
+    DIR *dir = opendir(INSTALLED_DIR);
+    struct dirent *item;
+    while (dir != NULL && (item = readdir(dir)) != NULL) {
+        size_t len = strlen(item->d_name);
+        if (len <= 5 || item->d_name[0] == '.' || strcmp(item->d_name + len - 5, ".json") != 0) {
+            continue;
+        }
+        char **grown = realloc(*owned, (*owned_count + 1) * sizeof(char *));
+        if (grown == NULL) {
+            break;
+        }
+        *owned = grown;
+        grown[*owned_count] = strndup(item->d_name, len - 5);
+        if (grown[*owned_count] != NULL) {
+            add_name(names, count, grown[(*owned_count)++]);
+        }
+    }
+    if (dir != NULL) {
+        closedir(dir);
+    }
+}
+
+int update_main(int argc, char **argv, const char *language) {
+    const char **names = NULL;
+    size_t count = 0;
+    char **owned = NULL;
+    size_t owned_count = 0;
+    for (int i = 0; i < argc; i++) {
+        add_name(&names, &count, argv[i]);
+    }
+    if (argc == 0) {
+        recorded_libraries(&names, &count, &owned, &owned_count);
+    }
+    if (count == 0) {
+        fprintf(stderr, "No installed libraries to update, name them or install some with kpm install\n");
+        free(names);
+        return 1;
+    }
+
+    UpdateTotals totals;
+    memset(&totals, 0, sizeof(totals));
+    UpdateLib *libs = calloc(count, sizeof(UpdateLib));
+    RegistryRequest *json_requests = calloc(count, sizeof(RegistryRequest));
+    if (libs == NULL || json_requests == NULL) {
+        fprintf(stderr, "Failed to allocate memory\n");
+        free(libs);
+        free(json_requests);
+        free(names);
+        return 1;
+    }
+
+    // Every library json at once, conditional on what the record saw
+    for (size_t i = 0; i < count; i++) {
+        UpdateLib *lib = &libs[i];
+        lib->name = names[i];
+        if (strchr(lib->name, '/') != NULL || !safe_relative_path(lib->name)) {
+            fprintf(stderr, "Invalid library name '%s'\n", lib->name);
+            lib->failed = 1;
+            continue;
+        }
+        lib->record = load_record(lib->name);
+        if (resolve_library(lib, language) != 0) {
+            lib->failed = 1;
+            continue;
+        }
+        json_requests[i].url = lib->json_url;
+        json_requests[i].priority = REQUEST_CRITICAL;
+        json_requests[i].validator = json_string_value(json_object_get(lib->record, "validator"));
+    }
+    RegistryRequest *pending = calloc(count, sizeof(RegistryRequest));
+    size_t *slot = calloc(count, sizeof(size_t));
+    size_t requested = 0;
+    for (size_t i = 0; pending != NULL && slot != NULL && i < count; i++) {
+        if (!libs[i].failed) {
+            slot[requested] = i;
+            pending[requested++] = json_requests[i];
+        }
+    }
+    registry_fetch_all(pending, requested);
+    for (size_t r = 0; r < requested; r++) {
+        json_requests[slot[r]] = pending[r];
+    }
+    free(pending);
+    free(slot);
+
+    // Then every file of every library in one batch
+    size_t file_count = 0;
+    for (size_t i = 0; i < count; i++) {
+        UpdateLib *lib = &libs[i];
+        if (lib->failed) {
+            continue;
+        }
+        totals.bytes += json_requests[i].response.size;
+        if (list_files(lib, &json_requests[i]) != 0) {
+            lib->failed = 1;
+            continue;
+        }
+        lib->first = file_count;
+        file_count += lib->path_count;
+    }
+    RegistryRequest *requests = calloc(file_count + 1, sizeof(RegistryRequest));
+    char **urls = calloc(file_count + 1, sizeof(char *));
+    for (size_t i = 0; requests != NULL && urls != NULL && i < count; i++) {
+        UpdateLib *lib = &libs[i];
+        for (size_t f = 0; !lib->failed && f < lib->path_count; f++) {
+            RegistryRequest *request = &requests[lib->first + f];
+            const char *path = lib->paths[f];
+            char **url = &urls[lib->first + f];
+            *url = malloc(strlen(lib->raw_path) + strlen(path) + 1);
+            if (*url != NULL) {
+                sprintf(*url, "%s%s", lib->raw_path, path);
+            }
+            request->url = *url ? *url : "";
+            request->priority = REQUEST_NORMAL;
+            // Conditional only while the local copy is what the record says it is
+            uint64_t recorded;
+            uint64_t hash;
+            size_t size;
+            char local[1024];
+            snprintf(local, sizeof(local), "libs/%s/%s", lib->name, path);
+            if (recorded_hash(lib->record, path, &recorded) == 0 && hash_file(local, &hash, &size) == 0 && hash == recorded) {
+                request->validator = json_string_value(
+                    json_object_get(json_object_get(json_object_get(lib->record, "files"), path), "validator"));
+            }
+        }
+    }
+    if (requests == NULL || urls == NULL) {
+        fprintf(stderr, "Failed to allocate memory\n");
+        for (size_t i = 0; i < count; i++) {
+            libs[i].failed = 1;
+        }
+    } else {
+        registry_fetch_all(requests, file_count);
+    }
+    for (size_t i = 0; requests != NULL && i < file_count; i++) {
+        totals.bytes += requests[i].response.size;
+        if (requests[i].result == 0 && requests[i].response.status == 304) {
+            totals.not_modified++;
+        } else if (requests[i].result == 0 && requests[i].response.status == 200) {
+            totals.fetched++;
+        }
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        UpdateLib *lib = &libs[i];
+        if (lib->failed || apply_library(lib, requests, json_requests[i].response.validator, &totals) != 0) {
+            totals.failed++;
+        }
+        free(json_requests[i].response.data);
+        free(lib->json_url);
+        free(lib->paths);
+        free_library_info(lib->info);
+        json_decref(lib->record);
+    }
+    for (size_t i = 0; requests != NULL && urls != NULL && i < file_count; i++) {
+        free(requests[i].response.data);
+        free(urls[i]);
+    }
+    printf("%zu libraries: %zu updated, %zu up to date, %zu failed, %zu files fetched, %zu not modified, %zu removed, "
+           "%llu bytes downloaded\n", count, totals.updated, totals.current, totals.failed, totals.fetched,
+           totals.not_modified, totals.removed, totals.bytes);
+    int ret = totals.failed == 0 ? 0 : 1;
+    free(requests);
+    free(urls);
+    free(json_requests);
+    free(libs);
+    free(names);
+    for (size_t i = 0; i < owned_count; i++) {
+        free(owned[i]);
+    }
+    free(owned);
+    return ret;
+}
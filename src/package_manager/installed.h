@@ -0,0 +1,29 @@
+#ifndef __INSTALLED__H
+#define __INSTALLED__H
+#include <stddef.h>
+#include <stdint.h>
+
+// kpm install records what it put in libs/<name> in libs/.kpm/<name>.json:
+//     {"name": "small", "url": "<library json>", "validator": "<its ETag>", "raw_path": "<files base url>",
+//      "files": {"src/small_0.c": {"hash": "<FNV-1a, 16 hex digits>", "size": 1024, "validator": "<ETag>"}, ...}}
+// kpm update sends every library json and every file with its validator, so an
+// unchanged library costs a 304 per object and no bodies. Files whose local hash no
+// longer matches the record are fetched outright, and only files whose content
+// differs are rewritten, so unchanged files keep their mtimes. A library some files of
+// which failed to install is recorded without its json's validator, so the next update
+// lists them from the json again.
+#define INSTALLED_DIR "libs/.kpm"
+
+typedef struct {
+    const char *path;       // As listed in src_paths/header_paths
+    uint64_t hash;
+    size_t size;
+    const char *validator;  // ETag or Last-Modified it came with, may be empty
+} InstalledFile;
+
+int installed_save(const char *name, const char *json_url, const char *json_validator, const char *raw_path,
+                   const InstalledFile *files, size_t count);
+// kpm update [lib...], every recorded library when none are given. language is the
+// project's, used to look up libraries installed before records were kept
+int update_main(int argc, char **argv, const char *language);
+#endif //__INSTALLED__H
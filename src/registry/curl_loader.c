@@ -0,0 +1,212 @@
+// libcurl and everything under it (TLS, HTTP/2, IDN, GSSAPI, LDAP, about 30
+// libraries) cost every kpm run ~3.5 ms to map and relocate, even a usage error
+// or a local registry install that never makes a request. With -DKPM_LAZY_CURL
+// (make LAZY_CURL=1, the default) kpm is not linked against it: the curl_*
+// functions kpm calls are defined here, and the first call dlopen()s libcurl once
+// and forwards to it from then on.
+#ifdef KPM_LAZY_CURL
+// Our own definitions below, not the type-checking macros
+#define CURL_DISABLE_TYPECHECK
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <dlfcn.h>
+#include <pthread.h>
+#include <curl/curl.h>
+#include "../trace/trace.h"
+
+#ifdef __APPLE__
+#define LIBCURL_NAME "libcurl.4.dylib"
+#else
+#define LIBCURL_NAME "libcurl.so.4"
+#endif
+
+typedef void (*curl_function)(void);
+
+static struct {
+    CURLcode (*global_init)(long);
+    void (*global_cleanup)(void);
+    CURL *(*easy_init)(void);
+    CURLcode (*easy_setopt)(CURL *, CURLoption, ...);
+    CURLcode (*easy_getinfo)(CURL *, CURLINFO, ...);
+    CURLcode (*easy_perform)(CURL *);
+    void (*easy_reset)(CURL *);
+    void (*easy_cleanup)(CURL *);
+    const char *(*easy_strerror)(CURLcode);
+    struct curl_slist *(*slist_append)(struct curl_slist *, const char *);
+    void (*slist_free_all)(struct curl_slist *);
+    time_t (*getdate)(const char *, const time_t *);
+    CURLM *(*multi_init)(void);
+    CURLMcode (*multi_add_handle)(CURLM *, CURL *);
+    CURLMcode (*multi_remove_handle)(CURLM *, CURL *);
+    CURLMcode (*multi_perform)(CURLM *, int *);
+    CURLMcode (*multi_poll)(CURLM *, struct curl_waitfd[], unsigned int, int, int *);
+    CURLMsg *(*multi_info_read)(CURLM *, int *);
+    CURLMcode (*multi_cleanup)(CURLM *);
+} lib;
+
+static const struct {
+    const char *name;
+    void **slot;
+} symbols[] = {
+    {"curl_global_init", (void **)&lib.global_init},
+    {"curl_global_cleanup", (void **)&lib.global_cleanup},
+    {"curl_easy_init", (void **)&lib.easy_init},
+    {"curl_easy_setopt", (void **)&lib.easy_setopt},
+    {"curl_easy_getinfo", (void **)&lib.easy_getinfo},
+    {"curl_easy_perform", (void **)&lib.easy_perform},
+    {"curl_easy_reset", (void **)&lib.easy_reset},
+    {"curl_easy_cleanup", (void **)&lib.easy_cleanup},
+    {"curl_easy_strerror", (void **)&lib.easy_strerror},
+    {"curl_slist_append", (void **)&lib.slist_append},
+    {"curl_slist_free_all", (void **)&lib.slist_free_all},
+    {"curl_getdate", (void **)&lib.getdate},
+    {"curl_multi_init", (void **)&lib.multi_init},
+    {"curl_multi_add_handle", (void **)&lib.multi_add_handle},
+    {"curl_multi_remove_handle", (void **)&lib.multi_remove_handle},
+    {"curl_multi_perform", (void **)&lib.multi_perform},
+    {"curl_multi_poll", (void **)&lib.multi_poll},
+    {"curl_multi_info_read", (void **)&lib.multi_info_read},
+    {"curl_multi_cleanup", (void **)&lib.multi_cleanup},
+};
+
+static pthread_once_t load_once = PTHREAD_ONCE_INIT;
+
+static void load_curl() {
+    TraceSpan span;
+    trace_begin(&span, "startup", "dlopen " LIBCURL_NAME);
+    void *handle = dlopen(LIBCURL_NAME, RTLD_NOW | RTLD_LOCAL);
+    for (size_t i = 0; handle != NULL && i < sizeof(symbols) / sizeof(symbols[0]); i++) {
+        // Looked up in libcurl itself, not the definitions in this file
+        *symbols[i].slot = dlsym(handle, symbols[i].name);
+        if (*symbols[i].slot == NULL) {
+            handle = NULL;
+        }
+    }
+    trace_end(&span);
+    if (handle == NULL) {
+        // Nothing that needs the network can go on without it
+        fprintf(stderr, "kpm needs %s: %s\n", LIBCURL_NAME, dlerror());
+        exit(1);
+    }
+}
+
+#define LOAD() pthread_once(&load_once, load_curl)
+
+CURLcode curl_global_init(long flags) {
+    LOAD();
+    return lib.global_init(flags);
+}
+
+void curl_global_cleanup(void) {
+    LOAD();
+    lib.global_cleanup();
+}
+
+CURL *curl_easy_init(void) {
+    LOAD();
+    return lib.easy_init();
+}
+
+CURLcode curl_easy_setopt(CURL *curl, CURLoption option, ...) {
+    LOAD();
+    va_list args;
+    va_start(args, option);
+    CURLcode result;
+    // The argument's type follows from the option's range, the same way libcurl reads it
+    if (option < CURLOPTTYPE_OBJECTPOINT) {
+        result = lib.easy_setopt(curl, option, va_arg(args, long));
+    } else if (option < CURLOPTTYPE_FUNCTIONPOINT) {
+        result = lib.easy_setopt(curl, option, va_arg(args, void *));
+    } else if (option < CURLOPTTYPE_OFF_T) {
+        result = lib.easy_setopt(curl, option, va_arg(args, curl_function));
+    } else if (option < CURLOPTTYPE_BLOB) {
+        result = lib.easy_setopt(curl, option, va_arg(args, curl_off_t));
+    } else {
+        result = lib.easy_setopt(curl, option, va_arg(args, void *));
+    }
+    va_end(args);
+    return result;
+}
+
+CURLcode curl_easy_getinfo(CURL *curl, CURLINFO info, ...) {
+    LOAD();
+    va_list args;
+    va_start(args, info);
+    // Every CURLINFO takes a pointer to where the answer goes
+    CURLcode result = lib.easy_getinfo(curl, info, va_arg(args, void *));
+    va_end(args);
+    return result;
+}
+
+CURLcode curl_easy_perform(CURL *curl) {
+    LOAD();
+    return lib.easy_perform(curl);
+}
+
+void curl_easy_reset(CURL *curl) {
+    LOAD();
+    lib.easy_reset(curl);
+}
+
+void curl_easy_cleanup(CURL *curl) {
+    LOAD();
+    lib.easy_cleanup(curl);
+}
+
+const char *curl_easy_strerror(CURLcode code) {
+    LOAD();
+    return lib.easy_strerror(code);
+}
+
+struct curl_slist *curl_slist_append(struct curl_slist *list, const char *data) {
+    LOAD();
+    return lib.slist_append(list, data);
+}
+
+void curl_slist_free_all(struct curl_slist *list) {
+    LOAD();
+    lib.slist_free_all(list);
+}
+
+time_t curl_getdate(const char *p, const time_t *unused) {
+    LOAD();
+    return lib.getdate(p, unused);
+}
+
+CURLM *curl_multi_init(void) {
+    LOAD();
+    return lib.multi_init();
+}
+
+CURLMcode curl_multi_add_handle(CURLM *multi, CURL *curl) {
+    LOAD();
+    return lib.multi_add_handle(multi, curl);
+}
+
+CURLMcode curl_multi_remove_handle(CURLM *multi, CURL *curl) {
+    LOAD();
+    return lib.multi_remove_handle(multi, curl);
+}
+
+CURLMcode curl_multi_perform(CURLM *multi, int *running) {
+    LOAD();
+    return lib.multi_perform(multi, running);
+}
+
+CURLMcode curl_multi_poll(CURLM *multi, struct curl_waitfd extra_fds[], unsigned int extra_nfds, int timeout_ms,
+                          int *ret) {
+    LOAD();
+    return lib.multi_poll(multi, extra_fds, extra_nfds, timeout_ms, ret);
+}
+
+CURLMsg *curl_multi_info_read(CURLM *multi, int *msgs_in_queue) {
+    LOAD();
+    return lib.multi_info_read(multi, msgs_in_queue);
+}
+
+CURLMcode curl_multi_cleanup(CURLM *multi) {
+    LOAD();
+    return lib.multi_cleanup(multi);
+}
+#endif
@@ -0,0 +1,592 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include "httpd.h"
+
+#define HTTPD_MAX_WATCHES 8
+
+struct HttpConnection {
+    int fd;                 // -1 once the client went away while parked
+    char in[HTTPD_REQUEST_MAX];
+    size_t in_len;
+    size_t consumed;        // Length of the request being answered
+    HttpRequest request;
+    char *out;              // Status line, headers and any in-memory body
+    size_t out_len;
+    size_t out_sent;
+    size_t out_capacity;
+    int file_fd;            // -1 when there is no file body
+    off_t file_offset;
+    size_t file_left;
+    int keep_alive;
+    int responded;
+    int sending;
+    int parked;
+    time_t last_active;
+};
+
+typedef struct {
+    int fd;
+    HttpCallback callback;
+    void *userdata;
+} HttpWatch;
+
+static HttpConnection **connections = NULL;
+static int connection_slots = 0;
+static int epoll_fd = -1;
+static HttpWatch watches[HTTPD_MAX_WATCHES];
+static int watch_count = 0;
+static HttpHandler handler = NULL;
+static void *handler_data = NULL;
+static volatile sig_atomic_t stopping = 0;
+static unsigned long long served_requests = 0;
+static unsigned long long served_bytes = 0;
+
+static void on_signal(int sig) {
+    (void)sig;
+    stopping = 1;
+}
+
+static const char *http_date() {
+    static char date[64];
+    static time_t cached = 0;
+    time_t now = time(NULL);
+    if (now != cached) {
+        struct tm tm;
+        gmtime_r(&now, &tm);
+        strftime(date, sizeof(date), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+        cached = now;
+    }
+    return date;
+}
+
+static void free_connection(HttpConnection *conn) {
+    if (conn->file_fd != -1) {
+        close(conn->file_fd);
+    }
+    free(conn->out);
+    free(conn);
+}
+
+static void close_connection(HttpConnection *conn) {
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+    close(conn->fd);
+    connections[conn->fd] = NULL;
+    conn->fd = -1;
+    if (!conn->parked) {
+        free_connection(conn); // A parked connection is freed by httpd_resume
+    }
+}
+
+static void watch(HttpConnection *conn, unsigned int events) {
+    struct epoll_event event = {.events = events, .data.fd = conn->fd};
+    epoll_ctl(epoll_fd, EPOLL_CTL_MOD, conn->fd, &event);
+}
+
+static int append(HttpConnection *conn, const char *data, size_t len) {
+    if (conn->out_len + len > conn->out_capacity) {
+        size_t capacity = conn->out_capacity ? conn->out_capacity : 1024;
+        while (capacity < conn->out_len + len) {
+            capacity *= 2;
+        }
+        char *out = realloc(conn->out, capacity);
+        if (out == NULL) {
+            return -1;
+        }
+        conn->out = out;
+        conn->out_capacity = capacity;
+    }
+    memcpy(conn->out + conn->out_len, data, len);
+    conn->out_len += len;
+    return 0;
+}
+
+static void appendf(HttpConnection *conn, const char *format, ...) {
+    char line[1024];
+    va_list args;
+    va_start(args, format);
+    int len = vsnprintf(line, sizeof(line), format, args);
+    va_end(args);
+    if (len > 0) {
+        append(conn, line, (size_t)len < sizeof(line) ? (size_t)len : sizeof(line) - 1);
+    }
+}
+
+static void start_headers(HttpConnection *conn, int status, const char *reason) {
+    conn->out_len = 0;
+    conn->responded = 1;
+    appendf(conn, "HTTP/1.1 %d %s\r\nDate: %s\r\n", status, reason, http_date());
+}
+
+static void end_headers(HttpConnection *conn, const char *extra_headers) {
+    if (extra_headers) {
+        append(conn, extra_headers, strlen(extra_headers));
+    }
+    appendf(conn, "Connection: %s\r\n\r\n", conn->keep_alive ? "keep-alive" : "close");
+}
+
+int httpd_header(const HttpRequest *request, const char *name, char *out, size_t size) {
+    size_t name_len = strlen(name);
+    const char *line = strstr(request->raw, "\r\n");
+    while (line != NULL && line[2] != '\r' && line[2] != '\0') {
+        line += 2;
+        const char *end = strstr(line, "\r\n");
+        if (end == NULL) {
+            break;
+        }
+        if ((size_t)(end - line) > name_len && strncasecmp(line, name, name_len) == 0 && line[name_len] == ':') {
+            const char *value = line + name_len + 1;
+            while (value < end && (*value == ' ' || *value == '\t')) {
+                value++;
+            }
+            size_t len = (size_t)(end - value);
+            if (len >= size) {
+                len = size - 1;
+            }
+            memcpy(out, value, len);
+            out[len] = '\0';
+            return 1;
+        }
+        line = end;
+    }
+    return 0;
+}
+
+void httpd_respond(HttpConnection *conn, const HttpRequest *request, int status, const char *reason,
+                   const char *body, size_t size, const char *extra_headers) {
+    start_headers(conn, status, reason);
+    appendf(conn, "Content-Type: text/plain; charset=utf-8\r\nContent-Length: %zu\r\n", size);
+    end_headers(conn, extra_headers);
+    if (body != NULL && !(request && request->head_only)) {
+        append(conn, body, size);
+    }
+}
+
+void httpd_respond_error(HttpConnection *conn, int status, const char *reason, const char *extra_headers) {
+    char body[96];
+    int len = snprintf(body, sizeof(body), "%d: %s", status, reason);
+    httpd_respond(conn, NULL, status, reason, body, (size_t)len, extra_headers);
+}
+
+void httpd_file_etag(const struct stat *st, char *out, size_t size) {
+    snprintf(out, size, "\"%lx-%lx-%lx\"", (unsigned long)st->st_ino, (unsigned long)st->st_size,
+             (unsigned long)(st->st_mtim.tv_sec * 1000000000LL + st->st_mtim.tv_nsec));
+}
+
+// bytes=a-b, bytes=a- or bytes=-n. 1 for a satisfiable range, 0 to send the whole
+// file (no or multiple ranges), -1 if unsatisfiable
+static int parse_range(const char *value, size_t size, size_t *start, size_t *end) {
+    if (strncmp(value, "bytes=", 6) != 0 || strchr(value, ',') != NULL) {
+        return 0;
+    }
+    const char *spec = value + 6;
+    char *rest;
+    if (*spec == '-') {
+        unsigned long long suffix = strtoull(spec + 1, &rest, 10);
+        if (rest == spec + 1 || *rest != '\0') {
+            return 0;
+        }
+        if (suffix == 0 || size == 0) {
+            return -1;
+        }
+        *start = suffix >= size ? 0 : size - (size_t)suffix;
+        *end = size - 1;
+        return 1;
+    }
+    unsigned long long first = strtoull(spec, &rest, 10);
+    if (rest == spec || *rest != '-') {
+        return 0;
+    }
+    const char *last_spec = rest + 1;
+    unsigned long long last = size ? size - 1 : 0;
+    if (*last_spec != '\0') {
+        last = strtoull(last_spec, &rest, 10);
+        if (*rest != '\0' || last < first) {
+            return 0;
+        }
+    }
+    if (first >= size) {
+        return -1;
+    }
+    *start = (size_t)first;
+    *end = last >= size ? size - 1 : (size_t)last;
+    return 1;
+}
+
+void httpd_respond_file(HttpConnection *conn, const HttpRequest *request, int fd, const struct stat *st,
+                        const char *etag, const char *extra_headers) {
+    httpd_respond_file_at(conn, request, fd, 0, (size_t)st->st_size, etag, extra_headers);
+}
+
+void httpd_respond_file_at(HttpConnection *conn, const HttpRequest *request, int fd, off_t offset, size_t size,
+                           const char *etag, const char *extra_headers) {
+    char value[512];
+    if (httpd_header(request, "If-None-Match", value, sizeof(value)) && (strstr(value, etag) || strcmp(value, "*") == 0)) {
+        close(fd);
+        start_headers(conn, 304, "Not Modified");
+        appendf(conn, "ETag: %s\r\n", etag);
+        end_headers(conn, extra_headers);
+        return;
+    }
+
+    size_t start = 0;
+    size_t end = size ? size - 1 : 0;
+    int range = 0;
+    if (httpd_header(request, "Range", value, sizeof(value))) {
+        char if_range[128];
+        if (!httpd_header(request, "If-Range", if_range, sizeof(if_range)) || strcmp(if_range, etag) == 0) {
+            range = parse_range(value, size, &start, &end);
+        }
+    }
+    if (range < 0) {
+        close(fd);
+        char extra[64];
+        snprintf(extra, sizeof(extra), "Content-Range: bytes */%zu\r\n", size);
+        httpd_respond_error(conn, 416, "Range Not Satisfiable", extra);
+        return;
+    }
+
+    size_t length = size ? end - start + 1 : 0;
+    start_headers(conn, range ? 206 : 200, range ? "Partial Content" : "OK");
+    appendf(conn, "Content-Type: text/plain; charset=utf-8\r\nContent-Length: %zu\r\nETag: %s\r\nAccept-Ranges: bytes\r\n",
+            length, etag);
+    if (range) {
+        appendf(conn, "Content-Range: bytes %zu-%zu/%zu\r\n", start, end, size);
+    }
+    end_headers(conn, extra_headers);
+    if (request->head_only || length == 0) {
+        close(fd);
+        return;
+    }
+    conn->file_fd = fd;
+    conn->file_offset = offset + (off_t)start;
+    conn->file_left = length;
+}
+
+// 1 when the response is out, 0 if the socket is full, -1 on error
+static int send_response(HttpConnection *conn) {
+    while (conn->out_sent < conn->out_len) {
+        // MSG_MORE keeps the headers and the start of the body in one segment
+        ssize_t n = send(conn->fd, conn->out + conn->out_sent, conn->out_len - conn->out_sent,
+                         MSG_NOSIGNAL | (conn->file_left ? MSG_MORE : 0));
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+        }
+        conn->out_sent += (size_t)n;
+        served_bytes += (unsigned long long)n;
+    }
+    while (conn->file_left > 0) {
+        ssize_t n = sendfile(conn->fd, conn->file_fd, &conn->file_offset, conn->file_left);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+        }
+        if (n == 0) {
+            return -1; // File shrank under us, the client would wait forever
+        }
+        conn->file_left -= (size_t)n;
+        served_bytes += (unsigned long long)n;
+    }
+    if (conn->file_fd != -1) {
+        close(conn->file_fd);
+        conn->file_fd = -1;
+    }
+    return 1;
+}
+
+// Fills conn->request from the request line, 0 if it is malformed
+static int parse_request(HttpConnection *conn) {
+    HttpRequest *request = &conn->request;
+    memset(request, 0, sizeof(*request));
+    request->raw = conn->in;
+    const char *method_end = strchr(conn->in, ' ');
+    const char *line_end = strstr(conn->in, "\r\n");
+    const char *target = method_end ? method_end + 1 : NULL;
+    const char *target_end = target ? strchr(target, ' ') : NULL;
+    if (target_end == NULL || target_end > line_end || (size_t)(method_end - conn->in) >= sizeof(request->method) ||
+        (size_t)(target_end - target) >= sizeof(request->target)) {
+        return 0;
+    }
+    memcpy(request->method, conn->in, (size_t)(method_end - conn->in));
+    memcpy(request->target, target, (size_t)(target_end - target));
+    request->head_only = strcmp(request->method, "HEAD") == 0;
+
+    int http10 = strncmp(target_end + 1, "HTTP/1.0", 8) == 0;
+    char connection[64] = "";
+    httpd_header(request, "Connection", connection, sizeof(connection));
+    conn->keep_alive = http10 ? strcasecmp(connection, "keep-alive") == 0 : strcasecmp(connection, "close") != 0;
+    return 1;
+}
+
+// The answer is ready, drop the request from the input and start sending
+static void finish_request(HttpConnection *conn) {
+    if (!conn->responded) {
+        httpd_respond_error(conn, 500, "Internal Server Error", NULL);
+    }
+    memmove(conn->in, conn->in + conn->consumed, conn->in_len - conn->consumed);
+    conn->in_len -= conn->consumed;
+    conn->consumed = 0;
+    conn->responded = 0;
+    conn->out_sent = 0;
+    conn->sending = 1;
+}
+
+// Answers every complete request in the input buffer, stopping when the socket
+// fills or a handler parks the connection
+static void process(HttpConnection *conn) {
+    while (1) {
+        if (conn->sending) {
+            int sent = send_response(conn);
+            if (sent < 0) {
+                close_connection(conn);
+                return;
+            }
+            if (sent == 0) {
+                watch(conn, EPOLLOUT);
+                return;
+            }
+            conn->sending = 0;
+            if (!conn->keep_alive) {
+                close_connection(conn);
+                return;
+            }
+        }
+        char *end = memmem(conn->in, conn->in_len, "\r\n\r\n", 4);
+        if (end == NULL) {
+            if (conn->in_len == sizeof(conn->in)) {
+                conn->keep_alive = 0;
+                conn->consumed = conn->in_len;
+                httpd_respond_error(conn, 431, "Request Header Fields Too Large", NULL);
+                finish_request(conn);
+                continue;
+            }
+            watch(conn, EPOLLIN);
+            return;
+        }
+        end[2] = '\0'; // Keep the last header's CRLF for httpd_header
+        conn->consumed = (size_t)(end - conn->in) + 4;
+        served_requests++;
+        if (!parse_request(conn)) {
+            conn->keep_alive = 0;
+            httpd_respond_error(conn, 400, "Bad Request", NULL);
+        } else {
+            handler(conn, &conn->request, handler_data);
+        }
+        if (conn->parked) {
+            watch(conn, 0); // No reads until httpd_resume, hangups still come through
+            return;
+        }
+        finish_request(conn);
+    }
+}
+
+void httpd_defer(HttpConnection *conn) {
+    conn->parked = 1;
+}
+
+void httpd_resume(HttpConnection *conn) {
+    conn->parked = 0;
+    if (conn->fd == -1) {
+        free_connection(conn);
+        return;
+    }
+    conn->last_active = time(NULL);
+    finish_request(conn);
+    process(conn);
+}
+
+int httpd_watch(int fd, HttpCallback callback, void *userdata) {
+    if (watch_count == HTTPD_MAX_WATCHES) {
+        return -1;
+    }
+    watches[watch_count++] = (HttpWatch){fd, callback, userdata};
+    return 0;
+}
+
+static void accept_connections(int listen_fd) {
+    while (1) {
+        int fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd == -1) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                perror("accept");
+            }
+            return;
+        }
+        if (fd >= connection_slots) {
+            int slots = connection_slots ? connection_slots : 64;
+            while (slots <= fd) {
+                slots *= 2;
+            }
+            HttpConnection **grown = realloc(connections, sizeof(*connections) * (size_t)slots);
+            if (grown == NULL) {
+                close(fd);
+                continue;
+            }
+            memset(grown + connection_slots, 0, sizeof(*grown) * (size_t)(slots - connection_slots));
+            connections = grown;
+            connection_slots = slots;
+        }
+        HttpConnection *conn = calloc(1, sizeof(HttpConnection));
+        if (conn == NULL) {
+            close(fd);
+            continue;
+        }
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        conn->fd = fd;
+        conn->file_fd = -1;
+        conn->last_active = time(NULL);
+        connections[fd] = conn;
+        struct epoll_event event = {.events = EPOLLIN, .data.fd = fd};
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event);
+    }
+}
+
+static void read_connection(HttpConnection *conn) {
+    while (conn->in_len < sizeof(conn->in)) {
+        ssize_t n = recv(conn->fd, conn->in + conn->in_len, sizeof(conn->in) - conn->in_len, 0);
+        if (n > 0) {
+            conn->in_len += (size_t)n;
+            continue;
+        }
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        }
+        close_connection(conn); // Closed by the client or reset
+        return;
+    }
+    process(conn);
+}
+
+static void close_idle(time_t now) {
+    for (int fd = 0; fd < connection_slots; fd++) {
+        HttpConnection *conn = connections[fd];
+        if (conn && !conn->parked && now - conn->last_active > HTTPD_IDLE_TIMEOUT) {
+            close_connection(conn);
+        }
+    }
+}
+
+int httpd_run(const char *bind_addr, int port, const char *banner, HttpHandler request_handler, void *userdata) {
+    struct sockaddr_in addr = {.sin_family = AF_INET, .sin_port = htons((unsigned short)port)};
+    if (inet_pton(AF_INET, bind_addr, &addr.sin_addr) != 1) {
+        fprintf(stderr, "Invalid bind address %s\n", bind_addr);
+        return 1;
+    }
+    int listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    int one = 1;
+    setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (listen_fd == -1 || bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(listen_fd, SOMAXCONN) != 0) {
+        fprintf(stderr, "Error listening on %s:%d: %s\n", bind_addr, port, strerror(errno));
+        if (listen_fd != -1) {
+            close(listen_fd);
+        }
+        return 1;
+    }
+    socklen_t addr_len = sizeof(addr);
+    getsockname(listen_fd, (struct sockaddr *)&addr, &addr_len);
+    handler = request_handler;
+    handler_data = userdata;
+
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    struct epoll_event event = {.events = EPOLLIN, .data.fd = listen_fd};
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &event);
+    for (int i = 0; i < watch_count; i++) {
+        struct epoll_event watched = {.events = EPOLLIN, .data.fd = watches[i].fd};
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, watches[i].fd, &watched);
+    }
+
+    // No SA_RESTART so epoll_wait returns and the loop can finish cleanly
+    struct sigaction action = {.sa_handler = on_signal};
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    printf("%s on http://%s:%d\n", banner, bind_addr, ntohs(addr.sin_port));
+    fflush(stdout);
+
+    struct epoll_event events[HTTPD_MAX_EVENTS];
+    time_t last_sweep = time(NULL);
+    while (!stopping) {
+        int count = epoll_wait(epoll_fd, events, HTTPD_MAX_EVENTS, 1000);
+        if (count < 0 && errno != EINTR) {
+            perror("epoll_wait");
+            break;
+        }
+        time_t now = time(NULL);
+        for (int i = 0; i < count; i++) {
+            int fd = events[i].data.fd;
+            if (fd == listen_fd) {
+                accept_connections(listen_fd);
+                continue;
+            }
+            int watched = 0;
+            for (int w = 0; w < watch_count; w++) {
+                if (watches[w].fd == fd) {
+                    watches[w].callback(watches[w].userdata);
+                    watched = 1;
+                }
+            }
+            HttpConnection *conn = !watched && fd < connection_slots ? connections[fd] : NULL;
+            if (conn == NULL) {
+                continue;
+            }
+            conn->last_active = now;
+            if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+                close_connection(conn);
+            } else if (conn->parked) {
+                continue;
+            } else if (conn->sending) {
+                process(conn);
+            } else {
+                read_connection(conn);
+            }
+        }
+        if (now != last_sweep) {
+            close_idle(now);
+            last_sweep = now;
+        }
+    }
+
+    for (int fd = 0; fd < connection_slots; fd++) {
+        if (connections[fd]) {
+            close_connection(connections[fd]);
+        }
+    }
+    free(connections);
+    connections = NULL;
+    connection_slots = 0;
+    close(epoll_fd);
+    close(listen_fd);
+    return 0;
+}
+
+unsigned long long httpd_requests() {
+    return served_requests;
+}
+
+unsigned long long httpd_bytes() {
+    return served_bytes;
+}
@@ -0,0 +1,53 @@
+#ifndef __HTTPD__H
+#define __HTTPD__H
+#include <stddef.h>
+#include <sys/stat.h>
+
+// The small HTTP/1.1 server behind kpm registry serve and kpm proxy. One epoll
+// loop, keep-alive and pipelining, bodies sent with sendfile. A handler answers
+// each request with one of the httpd_respond_* calls, or parks the connection
+// with httpd_defer and answers it later (e.g. when an upstream fetch is done).
+#define HTTPD_MAX_EVENTS 256
+#define HTTPD_REQUEST_MAX 8192     // Request line plus headers
+#define HTTPD_IDLE_TIMEOUT 60      // Seconds before an idle keep-alive connection is closed
+
+typedef struct HttpConnection HttpConnection;
+
+typedef struct {
+    const char *raw;        // Request line and headers, each ending in CRLF
+    char method[16];
+    char target[4096];      // As sent, origin-form (/path) or absolute-form (http://host/path)
+    int head_only;
+} HttpRequest;
+
+typedef void (*HttpHandler)(HttpConnection *conn, const HttpRequest *request, void *userdata);
+typedef void (*HttpCallback)(void *userdata);
+
+// Copies the value of header name into out, 0 if the request doesn't have it
+int httpd_header(const HttpRequest *request, const char *name, char *out, size_t size);
+void httpd_respond_error(HttpConnection *conn, int status, const char *reason, const char *extra_headers);
+// Sends fd (which the connection takes over) honouring If-None-Match, Range and If-Range
+// against etag, a quoted strong validator. extra_headers may be NULL
+void httpd_respond_file(HttpConnection *conn, const HttpRequest *request, int fd, const struct stat *st,
+                        const char *etag, const char *extra_headers);
+// Same for the size bytes at offset in fd, e.g. one object in a pack file
+void httpd_respond_file_at(HttpConnection *conn, const HttpRequest *request, int fd, off_t offset, size_t size,
+                           const char *etag, const char *extra_headers);
+// Status line, headers and body from memory
+void httpd_respond(HttpConnection *conn, const HttpRequest *request, int status, const char *reason,
+                   const char *body, size_t size, const char *extra_headers);
+// Parks the connection without an answer. It is owned by the caller until
+// httpd_resume, which must follow one of the httpd_respond_* calls
+void httpd_defer(HttpConnection *conn);
+void httpd_resume(HttpConnection *conn);
+// A strong ETag built from inode, size and mtime
+void httpd_file_etag(const struct stat *st, char *out, size_t size);
+
+// Calls callback whenever fd becomes readable, e.g. an eventfd signalled by a worker thread
+int httpd_watch(int fd, HttpCallback callback, void *userdata);
+// Binds, prints "<banner> on http://<bind>:<port>" and runs until SIGINT/SIGTERM
+int httpd_run(const char *bind_addr, int port, const char *banner, HttpHandler handler, void *userdata);
+// Requests answered and bytes sent since httpd_run started
+unsigned long long httpd_requests();
+unsigned long long httpd_bytes();
+#endif //__HTTPD__H
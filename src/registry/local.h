@@ -0,0 +1,16 @@
+#ifndef __LOCAL__H
+#define __LOCAL__H
+#include <stddef.h>
+#include "transfer.h"
+
+// A directory laid out like KickStartFiles (langs/, libs/, LICENCE/) can stand in
+// for the registry, as file:///srv/kpm or just /srv/kpm. These are read straight off
+// disk without going through curl.
+
+// The filesystem path for a file:// or absolute url, NULL for anything else
+const char *local_registry_path(const char *url);
+// Reads the whole file into response->data, -1 if it can't be read
+int local_registry_get(const char *path, RegistryResponse *response);
+// Copies the file to dest with copy_file_range, falling back to sendfile and then read/write
+int local_registry_copy(const char *path, const char *dest, size_t *size);
+#endif //__LOCAL__H
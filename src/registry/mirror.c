@@ -0,0 +1,731 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <ftw.h>
+#include <libgen.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <curl/curl.h>
+#include <jansson.h>
+#include "mirror.h"
+#include "registry.h"
+#include "local.h"
+#include "scheduler.h"
+#include "transfer.h"
+#include "../cache/cache.h"
+#include "../licence.h"
+
+typedef enum {
+    OBJECT_FILE,
+    OBJECT_LANG_INDEX,
+    OBJECT_LANG,
+    OBJECT_LIB_INDEX,
+    OBJECT_LIB,
+    OBJECT_LICENCE_INDEX
+} ObjectKind;
+
+// One line of <generation>.state, what upstream sent for path last time
+typedef struct MirrorRecord {
+    char *path;
+    char *url;
+    uint64_t hash;
+    size_t size;
+    char etag[128];
+    char last_modified[64];
+    struct MirrorRecord *bucket_next;
+} MirrorRecord;
+
+typedef struct MirrorObject {
+    ObjectKind kind;
+    char *path;                 // Relative to the mirror root
+    char *url;
+    char *lang;                 // files_to_include are relative to langs/<lang>/
+    int optional;               // Missing upstream is not worth a warning
+    int throttled;              // Times it went back in the queue after a 429
+    struct MirrorObject *next;
+    struct MirrorObject *bucket_next;
+} MirrorObject;
+
+typedef struct {
+    CURL *easy;
+    MirrorObject *object;
+    const MirrorRecord *previous;
+    struct curl_slist *headers;
+    RegistryBody body;
+    RegistryHeaders response;
+    SchedHost *host;            // NULL for local sources, which nothing throttles
+} MirrorTransfer;
+
+typedef struct {
+    unsigned long long objects;
+    unsigned long long fetched;
+    unsigned long long not_modified;
+    unsigned long long unchanged;
+    unsigned long long missing;
+    unsigned long long failed;
+    unsigned long long bytes;
+} MirrorStats;
+
+static char generation_dir[4096];
+static char previous_dir[4096];
+static MirrorRecord *previous_records[MIRROR_HASH_BUCKETS];
+static MirrorObject *objects[MIRROR_HASH_BUCKETS];
+static MirrorObject *queue_head = NULL;
+static MirrorObject *queue_tail = NULL;
+static MirrorRecord *records = NULL;
+static size_t record_count = 0;
+static size_t record_capacity = 0;
+static MirrorStats stats;
+
+static size_t bucket_of(const char *path) {
+    return hash_bytes(path, strlen(path)) % MIRROR_HASH_BUCKETS;
+}
+
+static const MirrorRecord *previous_record(const char *path) {
+    for (MirrorRecord *record = previous_records[bucket_of(path)]; record != NULL; record = record->bucket_next) {
+        if (strcmp(record->path, path) == 0) {
+            return record;
+        }
+    }
+    return NULL;
+}
+
+// Joins a base url and a path from an index with exactly one '/' between them
+static char *join_url(const char *base, const char *path) {
+    while (*path == '/') {
+        path++;
+    }
+    size_t base_len = strlen(base);
+    while (base_len > 0 && base[base_len - 1] == '/') {
+        base_len--;
+    }
+    size_t size = base_len + strlen(path) + 16;
+    char *url = malloc(size);
+    // Plain directories go through curl as file:// urls
+    const char *scheme = base[0] == '/' ? "file://" : "";
+    snprintf(url, size, "%s%.*s/%s", scheme, (int)base_len, base, path);
+    return url;
+}
+
+static void queue_push(MirrorObject *object) {
+    object->next = NULL;
+    if (queue_tail) {
+        queue_tail->next = object;
+    } else {
+        queue_head = object;
+    }
+    queue_tail = object;
+}
+
+static void enqueue(ObjectKind kind, const char *dir, const char *relative, char *url, const char *lang, int optional) {
+    while (*relative == '/') {
+        relative++;
+    }
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/%s", dir, relative);
+    // Upstream json decides these paths, anything that could leave the mirror is refused
+    if (!safe_relative_path(path)) {
+        fprintf(stderr, "Skipping %s, it points outside the mirror\n", path);
+        free(url);
+        return;
+    }
+    size_t bucket = bucket_of(path);
+    for (MirrorObject *object = objects[bucket]; object != NULL; object = object->bucket_next) {
+        if (strcmp(object->path, path) == 0) {
+            free(url); // Shared by several templates, e.g. a common makefile
+            return;
+        }
+    }
+    MirrorObject *object = calloc(1, sizeof(MirrorObject));
+    object->kind = kind;
+    object->path = strdup(path);
+    object->url = url;
+    object->lang = lang ? strdup(lang) : NULL;
+    object->optional = optional;
+    object->bucket_next = objects[bucket];
+    objects[bucket] = object;
+    queue_push(object);
+    stats.objects++;
+}
+
+static long long now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static SchedHost *object_host(const MirrorObject *object) {
+    int http = strncmp(object->url, "http://", 7) == 0 || strncmp(object->url, "https://", 8) == 0;
+    return http ? sched_host(object->url) : NULL;
+}
+
+static void add_record(const MirrorObject *object, uint64_t hash, size_t size, const char *etag, const char *last_modified) {
+    if (record_count == record_capacity) {
+        record_capacity = record_capacity ? record_capacity * 2 : 256;
+        records = realloc(records, record_capacity * sizeof(MirrorRecord));
+    }
+    MirrorRecord *record = &records[record_count++];
+    memset(record, 0, sizeof(*record));
+    record->path = object->path;
+    record->url = object->url;
+    record->hash = hash;
+    record->size = size;
+    snprintf(record->etag, sizeof(record->etag), "%s", etag);
+    snprintf(record->last_modified, sizeof(record->last_modified), "%s", last_modified);
+}
+
+static char *next_field(char **cursor) {
+    char *field = *cursor;
+    char *end = field ? strchr(field, '\t') : NULL;
+    if (end) {
+        *end = '\0';
+        *cursor = end + 1;
+    } else {
+        *cursor = NULL;
+    }
+    return field;
+}
+
+// hash size path url etag last-modified, tab separated
+static void load_state(const char *state_path) {
+    FILE *fp = fopen(state_path, "r");
+    if (fp == NULL) {
+        return;
+    }
+    char line[10240];
+    while (fgets(line, sizeof(line), fp)) {
+        line[strcspn(line, "\r\n")] = '\0';
+        char *cursor = line;
+        char *hash = next_field(&cursor);
+        char *size = next_field(&cursor);
+        char *path = next_field(&cursor);
+        char *url = next_field(&cursor);
+        char *etag = next_field(&cursor);
+        char *last_modified = next_field(&cursor);
+        if (last_modified == NULL) {
+            continue;
+        }
+        MirrorRecord *record = calloc(1, sizeof(MirrorRecord));
+        record->hash = strtoull(hash, NULL, 16);
+        record->size = strtoull(size, NULL, 10);
+        record->path = strdup(path);
+        record->url = strdup(url);
+        snprintf(record->etag, sizeof(record->etag), "%s", etag);
+        snprintf(record->last_modified, sizeof(record->last_modified), "%s", last_modified);
+        size_t bucket = bucket_of(record->path);
+        record->bucket_next = previous_records[bucket];
+        previous_records[bucket] = record;
+    }
+    fclose(fp);
+}
+
+static int save_state(const char *state_path) {
+    char tmp_path[4200];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", state_path);
+    FILE *fp = fopen(tmp_path, "w");
+    if (fp == NULL) {
+        return -1;
+    }
+    for (size_t i = 0; i < record_count; i++) {
+        const MirrorRecord *record = &records[i];
+        fprintf(fp, "%016llx\t%zu\t%s\t%s\t%s\t%s\n", (unsigned long long)record->hash, record->size,
+                record->path, record->url, record->etag, record->last_modified);
+    }
+    if (fclose(fp) != 0 || rename(tmp_path, state_path) != 0) {
+        unlink(tmp_path);
+        return -1;
+    }
+    return 0;
+}
+
+static int write_object(const char *path, const char *data, size_t size) {
+    char full[8300];
+    snprintf(full, sizeof(full), "%s/%s", generation_dir, path);
+    char dir[8300];
+    snprintf(dir, sizeof(dir), "%s", full);
+    if (make_dirs(dirname(dir)) != 0) {
+        return -1;
+    }
+    FILE *fp = fopen(full, "wb");
+    if (fp == NULL) {
+        return -1;
+    }
+    size_t written = fwrite(data, 1, size, fp);
+    if (fclose(fp) != 0 || written != size) {
+        return -1;
+    }
+    return 0;
+}
+
+// Carries an unchanged object over from the previous generation without copying it
+static int link_previous(const char *path) {
+    char from[8300];
+    char to[8300];
+    snprintf(from, sizeof(from), "%s/%s", previous_dir, path);
+    snprintf(to, sizeof(to), "%s/%s", generation_dir, path);
+    char dir[8300];
+    snprintf(dir, sizeof(dir), "%s", to);
+    if (make_dirs(dirname(dir)) != 0) {
+        return -1;
+    }
+    if (link(from, to) == 0) {
+        return 0;
+    }
+    size_t size;
+    return local_registry_copy(from, to, &size);
+}
+
+static char *read_previous(const char *path, size_t *size) {
+    char full[8300];
+    snprintf(full, sizeof(full), "%s/%s", previous_dir, path);
+    RegistryResponse response;
+    if (local_registry_get(full, &response) != 0) {
+        return NULL;
+    }
+    *size = response.size;
+    return response.data;
+}
+
+static void enqueue_string(json_t *value, const char *dir, const char *base_url) {
+    if (json_is_string(value)) {
+        enqueue(OBJECT_FILE, dir, json_string_value(value), join_url(base_url, json_string_value(value)), NULL, 0);
+    }
+}
+
+// Licences are referenced by name, the file is LICENCE/<name> and the url is encoded
+static void enqueue_licence(const char *name, int optional) {
+    if (strchr(name, '/') != NULL) {
+        return;
+    }
+    char *encoded = encode_url(name);
+    if (encoded == NULL) {
+        return;
+    }
+    char *url = join_url(registry_licence_url(), encoded);
+    free(encoded);
+    enqueue(OBJECT_FILE, "LICENCE", name, url, NULL, optional);
+}
+
+// Queues whatever an index, template or library json refers to. Library jsons are
+// rewritten in place to point at the mirror (returns 1), everything else is stored as sent
+static int walk(const MirrorObject *object, json_t *root) {
+    const char *key;
+    json_t *value;
+    switch (object->kind) {
+        case OBJECT_LANG_INDEX:
+            json_object_foreach(json_object_get(root, "langs"), key, value) {
+                json_t *path = json_object_get(value, "path");
+                if (json_is_string(path)) {
+                    enqueue(OBJECT_LANG, "langs", json_string_value(path),
+                            join_url(registry_langs_url(), json_string_value(path)), key, 0);
+                }
+                enqueue_string(json_object_get(value, "bundle"), "langs", registry_langs_url());
+                enqueue_string(json_object_get(value, "manifest"), "langs", registry_langs_url());
+            }
+            break;
+        case OBJECT_LANG: {
+            json_object_foreach(json_object_get(root, "build_file_path"), key, value) {
+                enqueue_string(value, "langs", registry_langs_url());
+            }
+            enqueue_string(json_object_get(root, "git_ignore_path"), "langs", registry_langs_url());
+            enqueue_string(json_object_get(root, "main_file_template"), "langs", registry_langs_url());
+            char lang_dir[512];
+            char lang_url[1024];
+            snprintf(lang_dir, sizeof(lang_dir), "langs/%s", object->lang);
+            snprintf(lang_url, sizeof(lang_url), "%s/%s", registry_langs_url(), object->lang);
+            json_t *files = json_object_get(root, "files_to_include");
+            for (size_t i = 0; json_is_array(files) && i < json_array_size(files); i++) {
+                enqueue_string(json_array_get(files, i), lang_dir, lang_url);
+            }
+            break;
+        }
+        case OBJECT_LIB_INDEX:
+            json_object_foreach(root, key, value) {
+                json_t *path = json_object_get(value, "path");
+                if (json_is_string(path)) {
+                    enqueue(OBJECT_LIB, "libs", json_string_value(path),
+                            join_url(registry_libs_url(), json_string_value(path)), NULL, 0);
+                }
+            }
+            break;
+        case OBJECT_LIB: {
+            // A mirror of a mirror keeps the original raw_path around
+            json_t *raw = json_object_get(root, "upstream_raw_path");
+            if (!json_is_string(raw)) {
+                raw = json_object_get(root, "raw_path");
+            }
+            if (!json_is_string(raw)) {
+                break;
+            }
+            char raw_url[2048];
+            const char *raw_path = json_string_value(raw);
+            if (strstr(raw_path, "://") == NULL && raw_path[0] != '/') {
+                const char *slash = strrchr(object->url, '/');
+                snprintf(raw_url, sizeof(raw_url), "%.*s/%s", (int)(slash - object->url), object->url, raw_path);
+            } else {
+                snprintf(raw_url, sizeof(raw_url), "%s", raw_path);
+            }
+            char files_dir[4200];
+            const char *slash = strrchr(object->path, '/');
+            snprintf(files_dir, sizeof(files_dir), "%.*s/files", (int)(slash - object->path), object->path);
+            const char *lists[] = {"src_paths", "header_paths"};
+            for (size_t l = 0; l < 2; l++) {
+                json_t *paths = json_object_get(root, lists[l]);
+                for (size_t i = 0; json_is_array(paths) && i < json_array_size(paths); i++) {
+                    json_t *path = json_array_get(paths, i);
+                    if (json_is_string(path)) {
+                        size_t size = strlen(raw_url) + json_string_length(path) + 1;
+                        char *url = malloc(size);
+                        snprintf(url, size, "%s%s", raw_url, json_string_value(path)); // As cpkg builds it
+                        enqueue(OBJECT_FILE, files_dir, json_string_value(path), url, NULL, 0);
+                    }
+                }
+            }
+            json_t *licence = json_object_get(root, "license");
+            if (json_is_string(licence)) {
+                enqueue_licence(json_string_value(licence), 1);
+            }
+            json_object_set_new(root, "upstream_raw_path", json_string(raw_url));
+            json_object_set_new(root, "raw_path", json_string("files/"));
+            return 1;
+        }
+        case OBJECT_LICENCE_INDEX:
+            if (json_is_array(root)) {
+                for (size_t i = 0; i < json_array_size(root); i++) {
+                    if (json_is_string(json_array_get(root, i))) {
+                        enqueue_licence(json_string_value(json_array_get(root, i)), 0);
+                    }
+                }
+            } else {
+                json_object_foreach(root, key, value) {
+                    enqueue_licence(key, 0);
+                }
+            }
+            break;
+        case OBJECT_FILE:
+            break;
+    }
+    return 0;
+}
+
+static void start_transfer(CURLM *multi, MirrorTransfer *transfer, MirrorObject *object, SchedHost *host) {
+    transfer->object = object;
+    transfer->host = host;
+    transfer->body.size = 0;
+    registry_headers_reset(&transfer->response);
+    transfer->headers = NULL;
+    // Only worth asking conditionally if the object is still where it was last time
+    transfer->previous = previous_record(object->path);
+    if (transfer->previous && strcmp(transfer->previous->url, object->url) != 0) {
+        transfer->previous = NULL;
+    }
+    char header[256];
+    if (transfer->previous && transfer->previous->etag[0]) {
+        snprintf(header, sizeof(header), "If-None-Match: %s", transfer->previous->etag);
+        transfer->headers = curl_slist_append(transfer->headers, header);
+    }
+    if (transfer->previous && transfer->previous->last_modified[0]) {
+        snprintf(header, sizeof(header), "If-Modified-Since: %s", transfer->previous->last_modified);
+        transfer->headers = curl_slist_append(transfer->headers, header);
+    }
+    CURL *easy = transfer->easy;
+    curl_easy_reset(easy);
+    const char *proxy = registry_config()->proxy;
+    if (proxy[0] != '\0' && (strncmp(object->url, "http://", 7) == 0 || strncmp(object->url, "https://", 8) == 0)) {
+        curl_easy_setopt(easy, CURLOPT_URL, proxy);
+        curl_easy_setopt(easy, CURLOPT_REQUEST_TARGET, object->url);
+    } else {
+        curl_easy_setopt(easy, CURLOPT_URL, object->url);
+    }
+    curl_easy_setopt(easy, CURLOPT_WRITEFUNCTION, registry_write_body);
+    curl_easy_setopt(easy, CURLOPT_WRITEDATA, &transfer->body);
+    curl_easy_setopt(easy, CURLOPT_HEADERFUNCTION, registry_read_header);
+    curl_easy_setopt(easy, CURLOPT_HEADERDATA, &transfer->response);
+    curl_easy_setopt(easy, CURLOPT_HTTPHEADER, transfer->headers);
+    curl_easy_setopt(easy, CURLOPT_FOLLOWLOCATION, 1L);
+    curl_easy_setopt(easy, CURLOPT_USERAGENT, "kpm-mirror");
+    curl_easy_setopt(easy, CURLOPT_CONNECTTIMEOUT, 15L);
+    curl_easy_setopt(easy, CURLOPT_PRIVATE, transfer);
+    curl_multi_add_handle(multi, easy);
+}
+
+// Stores the object (or carries it over) and queues what it refers to
+static void finish_transfer(MirrorTransfer *transfer, CURLcode result) {
+    MirrorObject *object = transfer->object;
+    const MirrorRecord *previous = transfer->previous;
+    long status = 0;
+    curl_easy_getinfo(transfer->easy, CURLINFO_RESPONSE_CODE, &status);
+    curl_slist_free_all(transfer->headers);
+    transfer->headers = NULL;
+    if (transfer->host) {
+        sched_release(transfer->host, result == CURLE_OK ? status : 0, transfer->response.retry_after_ms, now_us());
+    }
+    // The host is closed for a while now, the object waits its turn again
+    if (result == CURLE_OK && (status == 429 || (status == 503 && transfer->response.retry_after_ms >= 0)) &&
+        object->throttled < RETRY_THROTTLED_COUNT) {
+        object->throttled++;
+        queue_push(object);
+        return;
+    }
+    if (result == CURLE_FILE_COULDNT_READ_FILE || (result == CURLE_OK && (status == 404 || status == 410))) {
+        if (!object->optional) {
+            fprintf(stderr, "Missing upstream: %s\n", object->url);
+            stats.missing++;
+        }
+        return;
+    }
+    if (result != CURLE_OK || (status != 0 && status != 200 && status != 304)) {
+        fprintf(stderr, "Failed to fetch %s: %s\n", object->url,
+                result != CURLE_OK ? curl_easy_strerror(result) : "unexpected HTTP status");
+        stats.failed++;
+        return;
+    }
+
+    char *data = transfer->body.data;
+    size_t size = transfer->body.size;
+    char *previous_data = NULL;
+    int carried = 0;
+    if (status == 304 && previous) {
+        stats.not_modified++;
+        carried = 1;
+        if (object->kind != OBJECT_FILE) {
+            // Still has to be walked, the previous copy is what upstream would have sent
+            previous_data = read_previous(object->path, &size);
+            data = previous_data;
+        }
+    } else if (status == 304) {
+        fprintf(stderr, "Unexpected 304 for %s\n", object->url);
+        stats.failed++;
+        return;
+    } else {
+        stats.bytes += size;
+        uint64_t hash = hash_bytes(data ? data : "", size);
+        carried = previous && previous->hash == hash && previous->size == size;
+        carried ? stats.unchanged++ : stats.fetched++;
+        add_record(object, hash, size, transfer->response.etag, transfer->response.last_modified);
+    }
+    if (carried && status == 304) {
+        add_record(object, previous->hash, previous->size, previous->etag, previous->last_modified);
+    }
+
+    json_t *root = NULL;
+    int rewritten = 0;
+    if (object->kind != OBJECT_FILE) {
+        json_error_t error;
+        root = data ? json_loads(data, 0, &error) : NULL;
+        if (root == NULL) {
+            fprintf(stderr, "Failed to parse %s\n", object->url);
+            stats.failed++;
+            free(previous_data);
+            return;
+        }
+        rewritten = walk(object, root);
+    }
+    int ret;
+    if (carried) {
+        ret = link_previous(object->path);
+    } else if (rewritten) {
+        char *dumped = json_dumps(root, JSON_INDENT(4));
+        ret = dumped ? write_object(object->path, dumped, strlen(dumped)) : -1;
+        free(dumped);
+    } else {
+        ret = write_object(object->path, data ? data : "", size);
+    }
+    if (ret != 0) {
+        fprintf(stderr, "Failed to write %s/%s: %s\n", generation_dir, object->path, strerror(errno));
+        stats.failed++;
+    }
+    json_decref(root);
+    free(previous_data);
+}
+
+static void run_transfers(int parallel) {
+    CURLM *multi = curl_multi_init();
+    MirrorTransfer *transfers = calloc(parallel, sizeof(MirrorTransfer));
+    MirrorTransfer **idle = malloc(parallel * sizeof(MirrorTransfer *));
+    int idle_count = parallel;
+    for (int i = 0; i < parallel; i++) {
+        transfers[i].easy = curl_easy_init();
+        idle[i] = &transfers[parallel - 1 - i];
+    }
+    int running = 0;
+    do {
+        long long wait_us = 0;
+        while (idle_count > 0 && queue_head != NULL) {
+            MirrorObject *object = queue_head;
+            SchedHost *host = object_host(object);
+            if (host && (wait_us = sched_acquire(host, now_us())) > 0) {
+                break; // The queue is mostly one host, nothing behind it would get in either
+            }
+            queue_head = object->next;
+            if (queue_head == NULL) {
+                queue_tail = NULL;
+            }
+            start_transfer(multi, idle[--idle_count], object, host);
+        }
+        curl_multi_perform(multi, &running);
+        CURLMsg *msg;
+        int left;
+        while ((msg = curl_multi_info_read(multi, &left)) != NULL) {
+            if (msg->msg != CURLMSG_DONE) {
+                continue;
+            }
+            MirrorTransfer *transfer;
+            curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char **)&transfer);
+            CURLcode result = msg->data.result;
+            curl_multi_remove_handle(multi, msg->easy_handle);
+            finish_transfer(transfer, result);
+            idle[idle_count++] = transfer;
+            wait_us = 0; // A slot came back, worth asking the host again straight away
+        }
+        if (wait_us > 0 || (idle_count < parallel && (running > 0 || queue_head == NULL))) {
+            int timeout_ms = wait_us > 0 && wait_us < 1000000 ? (int)(wait_us / 1000) + 1 : 1000;
+            curl_multi_poll(multi, NULL, 0, timeout_ms, NULL);
+        }
+    } while (idle_count < parallel || queue_head != NULL);
+    for (int i = 0; i < parallel; i++) {
+        curl_easy_cleanup(transfers[i].easy);
+        free(transfers[i].body.data);
+    }
+    free(transfers);
+    free(idle);
+    curl_multi_cleanup(multi);
+}
+
+static int remove_entry(const char *path, const struct stat *st, int flag, struct FTW *ftw) {
+    (void)st;
+    (void)flag;
+    (void)ftw;
+    return remove(path);
+}
+
+static void remove_tree(const char *path) {
+    nftw(path, remove_entry, 32, FTW_DEPTH | FTW_PHYS);
+}
+
+// Drops generations (and their state) older than the last MIRROR_KEEP_GENERATIONS
+static void remove_old_generations(const char *generations, long current) {
+    DIR *dir = opendir(generations);
+    if (dir == NULL) {
+        return;
+    }
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        char *end;
+        long number = strtol(entry->d_name, &end, 10);
+        if (end == entry->d_name || number > current - MIRROR_KEEP_GENERATIONS || (*end != '\0' && strcmp(end, ".state") != 0)) {
+            continue;
+        }
+        char path[8300];
+        snprintf(path, sizeof(path), "%s/%s", generations, entry->d_name);
+        remove_tree(path);
+    }
+    closedir(dir);
+}
+
+int mirror_main(int argc, char **argv) {
+    const char *target = NULL;
+    int parallel = MIRROR_DEFAULT_PARALLEL;
+    for (int i = 0; i < argc; i++) {
+        if (strcmp(argv[i], "--parallel") == 0 && i + 1 < argc) {
+            parallel = atoi(argv[++i]);
+        } else if (argv[i][0] != '-' && target == NULL) {
+            target = argv[i];
+        } else {
+            target = NULL;
+            break;
+        }
+    }
+    if (target == NULL || parallel <= 0) {
+        fprintf(stderr, "Usage: kpm mirror <dir> [--parallel <n>]\n");
+        return 1;
+    }
+
+    // <parent>/<name> -> <parent>/.<name>.mirror/<generation>
+    char dir[1024];
+    snprintf(dir, sizeof(dir), "%s", target);
+    size_t len = strlen(dir);
+    while (len > 1 && dir[len - 1] == '/') {
+        dir[--len] = '\0';
+    }
+    char parent_buf[1024];
+    char name_buf[1024];
+    snprintf(parent_buf, sizeof(parent_buf), "%s", dir);
+    snprintf(name_buf, sizeof(name_buf), "%s", dir);
+    const char *parent = dirname(parent_buf);
+    const char *name = basename(name_buf);
+    char link_prefix[1100];
+    char generations[2200];
+    snprintf(link_prefix, sizeof(link_prefix), ".%s.mirror/", name);
+    snprintf(generations, sizeof(generations), "%s/%s", parent, link_prefix);
+    if (make_dirs(generations) != 0) {
+        fprintf(stderr, "Failed to create %s: %s\n", generations, strerror(errno));
+        return 1;
+    }
+
+    long previous = 0;
+    struct stat st;
+    if (lstat(dir, &st) == 0) {
+        char link[1100];
+        ssize_t n = S_ISLNK(st.st_mode) ? readlink(dir, link, sizeof(link) - 1) : -1;
+        if (n > 0) {
+            link[n] = '\0';
+        }
+        if (n > 0 && strncmp(link, link_prefix, strlen(link_prefix)) == 0) {
+            previous = atol(link + strlen(link_prefix));
+        } else if (!S_ISDIR(st.st_mode) || rmdir(dir) != 0) {
+            fprintf(stderr, "%s already exists and is not a kpm mirror\n", dir);
+            return 1;
+        }
+    }
+    long generation = previous + 1;
+    char state_path[2300];
+    if (previous > 0) {
+        snprintf(previous_dir, sizeof(previous_dir), "%s%ld", generations, previous);
+        snprintf(state_path, sizeof(state_path), "%s%ld.state", generations, previous);
+        load_state(state_path);
+    }
+    snprintf(generation_dir, sizeof(generation_dir), "%s%ld", generations, generation);
+    remove_tree(generation_dir); // Left behind by an interrupted run
+    if (make_dirs(generation_dir) != 0) {
+        fprintf(stderr, "Failed to create %s: %s\n", generation_dir, strerror(errno));
+        return 1;
+    }
+
+    curl_global_init(CURL_GLOBAL_DEFAULT);
+    enqueue(OBJECT_LANG_INDEX, "langs", "index.json", join_url(registry_langs_url(), "index.json"), NULL, 0);
+    enqueue(OBJECT_LIB_INDEX, "libs", "index.json", join_url(registry_libs_url(), "index.json"), NULL, 0);
+    // Not every registry lists its licences, the ones libraries use are mirrored regardless
+    enqueue(OBJECT_LICENCE_INDEX, "LICENCE", "index.json", join_url(registry_licence_url(), "index.json"), NULL, 1);
+    run_transfers(parallel);
+
+    printf("%llu objects: %llu fetched, %llu not modified, %llu unchanged, %llu missing, %llu failed, %llu bytes downloaded\n",
+           stats.objects, stats.fetched, stats.not_modified, stats.unchanged, stats.missing, stats.failed, stats.bytes);
+    if (stats.failed > 0) {
+        fprintf(stderr, "Mirror not updated, %s is unchanged\n", dir);
+        remove_tree(generation_dir);
+        return 1;
+    }
+
+    // The state goes first, a crash before the swap leaves the old link and its state intact
+    snprintf(state_path, sizeof(state_path), "%s%ld.state", generations, generation);
+    char link_target[1200];
+    char tmp_link[1100];
+    snprintf(link_target, sizeof(link_target), "%s%ld", link_prefix, generation);
+    snprintf(tmp_link, sizeof(tmp_link), "%s.tmp", dir);
+    unlink(tmp_link);
+    if (save_state(state_path) != 0 || symlink(link_target, tmp_link) != 0 || rename(tmp_link, dir) != 0) {
+        fprintf(stderr, "Failed to update %s: %s\n", dir, strerror(errno));
+        unlink(tmp_link);
+        remove_tree(generation_dir);
+        return 1;
+    }
+    remove_old_generations(generations, generation);
+    printf("Mirrored the registry to %s (generation %ld)\n", dir, generation);
+    return 0;
+}
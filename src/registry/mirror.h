@@ -0,0 +1,20 @@
+#ifndef __MIRROR__H
+#define __MIRROR__H
+
+// kpm mirror <dir>: copies the whole registry (langs with their build scripts and
+// files_to_include, libs and the files they list, licences) to <dir>, laid out like
+// KickStartFiles so it works as KPM_REGISTRY_URL=<dir> or behind kpm registry serve.
+// Library jsons are rewritten with a relative raw_path so their files come from the
+// mirror too.
+//
+// <dir> is a symlink to a generation in .<dir>.mirror/ next to it. A refresh builds
+// the next generation with conditional requests against the ETag/Last-Modified it
+// saw last time, hardlinking objects that are unchanged (304, or the same content
+// hash), then renames a new symlink over <dir>. Readers see the old mirror or the
+// new one, never a mix.
+#define MIRROR_DEFAULT_PARALLEL 16
+#define MIRROR_HASH_BUCKETS 1024
+#define MIRROR_KEEP_GENERATIONS 2   // The current one and the one before, for readers still in it
+
+int mirror_main(int argc, char **argv);
+#endif //__MIRROR__H
@@ -0,0 +1,711 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <curl/curl.h>
+#include "proxy.h"
+#include "httpd.h"
+#include "transfer.h"
+#include "../cache/cache.h"
+#include "../cache/pack.h"
+
+typedef struct ProxyFetch ProxyFetch;
+
+typedef struct ProxyEntry {
+    uint64_t key;
+    char *url;
+    char etag[128];             // Upstream validators, empty if it sent none
+    char last_modified[64];
+    size_t size;
+    time_t fetched;             // When upstream last confirmed the object
+    time_t stored;              // When this copy was fetched, part of the ETag we make up
+    int cached;                 // 0 while the first fetch is in flight
+    ProxyFetch *fetch;          // Miss or revalidation in flight
+    struct ProxyEntry *prev;    // LRU list, most recently used first
+    struct ProxyEntry *next;
+    struct ProxyEntry *bucket_next;
+} ProxyEntry;
+
+typedef struct {
+    HttpConnection *conn;
+    const HttpRequest *request;
+} ProxyWaiter;
+
+struct ProxyFetch {
+    ProxyEntry *entry;
+    char *url;
+    char if_none_match[128];
+    char if_modified_since[64];
+    char tmp_path[4200];
+    // Filled in by the worker
+    CURLcode result;
+    long status;
+    RegistryHeaders response;
+    size_t size;
+    ProxyWaiter *waiters;       // Coalesced clients, answered when the fetch is done
+    size_t waiter_count;
+    size_t waiter_capacity;
+    ProxyFetch *next;
+};
+
+typedef struct {
+    unsigned long long requests;
+    unsigned long long hits;
+    unsigned long long stale_hits;
+    unsigned long long misses;
+    unsigned long long coalesced;
+    unsigned long long revalidations;
+    unsigned long long not_modified;
+    unsigned long long evictions;
+    unsigned long long upstream_errors;
+} ProxyStats;
+
+static char store_dir[4096];
+static PackStore *store = NULL;
+static long long max_size = PROXY_DEFAULT_MAX_SIZE;
+static long ttl = PROXY_DEFAULT_TTL;
+static ProxyEntry *buckets[PROXY_HASH_BUCKETS];
+static ProxyEntry *lru_head = NULL;
+static ProxyEntry *lru_tail = NULL;
+static long long total_size = 0;
+static unsigned long tmp_counter = 0;
+static ProxyStats stats;
+
+// Worker queue and finished fetches, the only state shared with the worker threads
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_ready = PTHREAD_COND_INITIALIZER;
+static ProxyFetch *queue_head = NULL;
+static ProxyFetch *queue_tail = NULL;
+static ProxyFetch *done = NULL;
+static int done_fd = -1;
+
+static ProxyEntry *lookup(uint64_t key, const char *url) {
+    for (ProxyEntry *entry = buckets[key % PROXY_HASH_BUCKETS]; entry; entry = entry->bucket_next) {
+        if (entry->key == key && strcmp(entry->url, url) == 0) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+static void lru_unlink(ProxyEntry *entry) {
+    if (entry->prev) {
+        entry->prev->next = entry->next;
+    } else if (lru_head == entry) {
+        lru_head = entry->next;
+    }
+    if (entry->next) {
+        entry->next->prev = entry->prev;
+    } else if (lru_tail == entry) {
+        lru_tail = entry->prev;
+    }
+    entry->prev = entry->next = NULL;
+}
+
+static void lru_touch(ProxyEntry *entry) {
+    lru_unlink(entry);
+    entry->next = lru_head;
+    if (lru_head) {
+        lru_head->prev = entry;
+    }
+    lru_head = entry;
+    if (lru_tail == NULL) {
+        lru_tail = entry;
+    }
+}
+
+static ProxyEntry *add_entry(uint64_t key, const char *url) {
+    ProxyEntry *entry = calloc(1, sizeof(ProxyEntry));
+    if (entry == NULL || (entry->url = strdup(url)) == NULL) {
+        free(entry);
+        return NULL;
+    }
+    entry->key = key;
+    entry->bucket_next = buckets[key % PROXY_HASH_BUCKETS];
+    buckets[key % PROXY_HASH_BUCKETS] = entry;
+    lru_touch(entry);
+    return entry;
+}
+
+static void remove_entry(ProxyEntry *entry) {
+    ProxyEntry **slot = &buckets[entry->key % PROXY_HASH_BUCKETS];
+    while (*slot != entry) {
+        slot = &(*slot)->bucket_next;
+    }
+    *slot = entry->bucket_next;
+    lru_unlink(entry);
+    if (entry->cached) {
+        pack_delete(store, entry->key);
+        total_size -= (long long)entry->size;
+    }
+    free(entry->url);
+    free(entry);
+}
+
+// Oldest first, skipping objects with a fetch in flight
+static void evict() {
+    ProxyEntry *entry = lru_tail;
+    while (total_size > max_size && entry != NULL) {
+        ProxyEntry *prev = entry->prev;
+        if (entry->fetch == NULL && entry->cached) {
+            remove_entry(entry);
+            stats.evictions++;
+        }
+        entry = prev;
+    }
+    pack_maybe_compact(store, 0);
+}
+
+// <url>\n<etag>\n<last modified>\n<size> <fetched> <stored>\n, the object's metadata in the pack
+static int format_meta(const ProxyEntry *entry, char *out, size_t size) {
+    return snprintf(out, size, "%s\n%s\n%s\n%zu %lld %lld\n", entry->url, entry->etag, entry->last_modified,
+                    entry->size, (long long)entry->fetched, (long long)entry->stored);
+}
+
+static void write_meta(const ProxyEntry *entry) {
+    char meta[4500];
+    int len = format_meta(entry, meta, sizeof(meta));
+    pack_set_meta(store, entry->key, meta, (size_t)len);
+}
+
+static int compare_fetched(const void *a, const void *b) {
+    const ProxyEntry *x = *(ProxyEntry *const *)a;
+    const ProxyEntry *y = *(ProxyEntry *const *)b;
+    return (x->fetched > y->fetched) - (x->fetched < y->fetched);
+}
+
+static void strip_newline(char *line) {
+    line[strcspn(line, "\r\n")] = '\0';
+}
+
+typedef struct {
+    ProxyEntry **loaded;
+    size_t count;
+    size_t capacity;
+} LoadedEntries;
+
+static int load_entry(uint64_t key, const char *meta, size_t meta_size, size_t size, void *userdata) {
+    (void)meta_size;
+    LoadedEntries *loaded = userdata;
+    char url[4096] = "";
+    char etag[128] = "";
+    char last_modified[64] = "";
+    size_t meta_object_size = 0;
+    long long fetched = 0;
+    long long stored = 0;
+    const char *line = meta;
+    char *fields[] = {url, etag, last_modified};
+    size_t sizes[] = {sizeof(url), sizeof(etag), sizeof(last_modified)};
+    for (int i = 0; i < 3; i++) {
+        const char *newline = strchr(line, '\n');
+        if (newline == NULL) {
+            return 0;
+        }
+        snprintf(fields[i], sizes[i], "%.*s", (int)(newline - line), line);
+        line = newline + 1;
+    }
+    if (sscanf(line, "%zu %lld %lld", &meta_object_size, &fetched, &stored) != 3 || meta_object_size != size ||
+        hash_bytes(url, strlen(url)) != key || lookup(key, url) != NULL) {
+        return 0;
+    }
+    ProxyEntry *entry = add_entry(key, url);
+    if (entry == NULL) {
+        return 0;
+    }
+    snprintf(entry->etag, sizeof(entry->etag), "%s", etag);
+    snprintf(entry->last_modified, sizeof(entry->last_modified), "%s", last_modified);
+    entry->size = size;
+    entry->fetched = (time_t)fetched;
+    entry->stored = (time_t)stored;
+    entry->cached = 1;
+    total_size += (long long)size;
+    if (loaded->count == loaded->capacity) {
+        loaded->capacity = loaded->capacity ? loaded->capacity * 2 : 64;
+        ProxyEntry **grown = realloc(loaded->loaded, loaded->capacity * sizeof(ProxyEntry *));
+        if (grown == NULL) {
+            return 1;
+        }
+        loaded->loaded = grown;
+    }
+    loaded->loaded[loaded->count++] = entry;
+    return 0;
+}
+
+// Stores from before the pack kept each object in <key> and <key>.meta, they move into it once
+static void import_loose_objects() {
+    DIR *dir = opendir(store_dir);
+    if (dir == NULL) {
+        return;
+    }
+    size_t imported = 0;
+    struct dirent *item;
+    while ((item = readdir(dir)) != NULL) {
+        char path[4400];
+        snprintf(path, sizeof(path), "%s/%s", store_dir, item->d_name);
+        if (strncmp(item->d_name, "tmp.", 4) == 0) {
+            unlink(path); // Left over from a fetch that never finished
+            continue;
+        }
+        size_t len = strlen(item->d_name);
+        if (len != 21 || strcmp(item->d_name + 16, ".meta") != 0) {
+            continue;
+        }
+        char object[4400];
+        snprintf(object, sizeof(object), "%.*s", (int)(strlen(path) - 5), path);
+        FILE *fp = fopen(path, "r");
+        ProxyEntry entry;
+        memset(&entry, 0, sizeof(entry));
+        char url[4096] = "";
+        long long fetched = 0;
+        int ok = fp && fgets(url, sizeof(url), fp) && fgets(entry.etag, sizeof(entry.etag), fp) &&
+                 fgets(entry.last_modified, sizeof(entry.last_modified), fp) &&
+                 fscanf(fp, "%zu %lld", &entry.size, &fetched) == 2;
+        if (fp) {
+            fclose(fp);
+        }
+        int fd = open(object, O_RDONLY | O_CLOEXEC);
+        struct stat st;
+        if (ok && fd != -1 && fstat(fd, &st) == 0 && (size_t)st.st_size == entry.size) {
+            strip_newline(url);
+            strip_newline(entry.etag);
+            strip_newline(entry.last_modified);
+            entry.url = url;
+            entry.key = hash_bytes(url, strlen(url));
+            entry.fetched = (time_t)fetched;
+            entry.stored = st.st_mtime;
+            char meta[4500];
+            int meta_len = format_meta(&entry, meta, sizeof(meta));
+            if (pack_put_fd(store, entry.key, meta, (size_t)meta_len, fd, entry.size) == 0) {
+                imported++;
+            }
+        }
+        if (fd != -1) {
+            close(fd);
+        }
+        unlink(path);
+        unlink(object);
+    }
+    closedir(dir);
+    if (imported > 0) {
+        printf("Moved %zu cached objects into the pack store\n", imported);
+    }
+}
+
+// Rebuilds the in-memory index from the pack store a previous run left behind
+static void load_store() {
+    import_loose_objects();
+    LoadedEntries loaded = {NULL, 0, 0};
+    pack_foreach(store, load_entry, &loaded);
+    // Access order is not kept on disk, fetch order is the next best thing
+    qsort(loaded.loaded, loaded.count, sizeof(ProxyEntry *), compare_fetched);
+    for (size_t i = 0; i < loaded.count; i++) {
+        lru_touch(loaded.loaded[i]);
+    }
+    free(loaded.loaded);
+    evict();
+    printf("Loaded %zu cached objects, %lld bytes\n", loaded.count, total_size);
+}
+
+static void run_fetch(CURL *curl, ProxyFetch *fetch) {
+    FILE *fp = fopen(fetch->tmp_path, "wb");
+    if (fp == NULL) {
+        fetch->result = CURLE_WRITE_ERROR;
+        return;
+    }
+    struct curl_slist *headers = NULL;
+    char header[256];
+    if (fetch->if_none_match[0]) {
+        snprintf(header, sizeof(header), "If-None-Match: %s", fetch->if_none_match);
+        headers = curl_slist_append(headers, header);
+    }
+    if (fetch->if_modified_since[0]) {
+        snprintf(header, sizeof(header), "If-Modified-Since: %s", fetch->if_modified_since);
+        headers = curl_slist_append(headers, header);
+    }
+    registry_headers_reset(&fetch->response);
+    curl_easy_reset(curl);
+    curl_easy_setopt(curl, CURLOPT_URL, fetch->url);
+    // curl's own write function fwrites to WRITEDATA
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, fp);
+    curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, registry_read_header);
+    curl_easy_setopt(curl, CURLOPT_HEADERDATA, &fetch->response);
+    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+    curl_easy_setopt(curl, CURLOPT_USERAGENT, "kpm-proxy");
+    curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT, 15L);
+    curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+    fetch->result = curl_easy_perform(curl);
+    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &fetch->status);
+    curl_slist_free_all(headers);
+    long end = ftell(fp);
+    fetch->size = end > 0 ? (size_t)end : 0;
+    if (fclose(fp) != 0 && fetch->result == CURLE_OK) {
+        fetch->result = CURLE_WRITE_ERROR;
+    }
+}
+
+// Each worker keeps one easy handle so upstream connections are reused
+static void *worker(void *unused) {
+    (void)unused;
+    CURL *curl = curl_easy_init();
+    while (1) {
+        pthread_mutex_lock(&queue_lock);
+        while (queue_head == NULL) {
+            pthread_cond_wait(&queue_ready, &queue_lock);
+        }
+        ProxyFetch *fetch = queue_head;
+        queue_head = fetch->next;
+        if (queue_head == NULL) {
+            queue_tail = NULL;
+        }
+        pthread_mutex_unlock(&queue_lock);
+
+        run_fetch(curl, fetch);
+
+        pthread_mutex_lock(&queue_lock);
+        fetch->next = done;
+        done = fetch;
+        pthread_mutex_unlock(&queue_lock);
+        uint64_t one = 1;
+        if (write(done_fd, &one, sizeof(one)) != sizeof(one)) {
+            perror("eventfd");
+        }
+    }
+    return NULL;
+}
+
+static ProxyFetch *start_fetch(ProxyEntry *entry) {
+    ProxyFetch *fetch = calloc(1, sizeof(ProxyFetch));
+    if (fetch == NULL || (fetch->url = strdup(entry->url)) == NULL) {
+        free(fetch);
+        return NULL;
+    }
+    fetch->entry = entry;
+    if (entry->cached) {
+        // Revalidation, a 304 just refreshes the object's age
+        snprintf(fetch->if_none_match, sizeof(fetch->if_none_match), "%s", entry->etag);
+        snprintf(fetch->if_modified_since, sizeof(fetch->if_modified_since), "%s", entry->last_modified);
+    }
+    snprintf(fetch->tmp_path, sizeof(fetch->tmp_path), "%s/tmp.%lu", store_dir, tmp_counter++);
+    entry->fetch = fetch;
+
+    pthread_mutex_lock(&queue_lock);
+    if (queue_tail) {
+        queue_tail->next = fetch;
+    } else {
+        queue_head = fetch;
+    }
+    queue_tail = fetch;
+    pthread_cond_signal(&queue_ready);
+    pthread_mutex_unlock(&queue_lock);
+    return fetch;
+}
+
+static int add_waiter(ProxyFetch *fetch, HttpConnection *conn, const HttpRequest *request) {
+    if (fetch->waiter_count == fetch->waiter_capacity) {
+        size_t capacity = fetch->waiter_capacity ? fetch->waiter_capacity * 2 : 4;
+        ProxyWaiter *grown = realloc(fetch->waiters, capacity * sizeof(ProxyWaiter));
+        if (grown == NULL) {
+            return -1;
+        }
+        fetch->waiters = grown;
+        fetch->waiter_capacity = capacity;
+    }
+    fetch->waiters[fetch->waiter_count++] = (ProxyWaiter){conn, request};
+    return 0;
+}
+
+static int serve_entry(HttpConnection *conn, const HttpRequest *request, const ProxyEntry *entry, const char *state) {
+    PackObject object;
+    if (pack_get(store, entry->key, &object, 0) != 0) {
+        return -1;
+    }
+    if (object.data != NULL) {
+        // Stored compressed, sent from an in-memory file so ranges work the same
+        int fd = memfd_create("kpm-proxy-object", MFD_CLOEXEC);
+        if (fd == -1 || write(fd, object.data, object.size) != (ssize_t)object.size) {
+            if (fd != -1) {
+                close(fd);
+            }
+            pack_object_free(&object);
+            return -1;
+        }
+        object.fd = fd;
+        object.offset = 0;
+    }
+    char etag[128];
+    if (entry->etag[0] == '"') {
+        snprintf(etag, sizeof(etag), "%s", entry->etag);
+    } else {
+        // Upstream sent none, or a weak one
+        snprintf(etag, sizeof(etag), "\"%016llx-%zx-%llx\"", (unsigned long long)entry->key, entry->size,
+                 (long long)entry->stored);
+    }
+    char extra[128];
+    snprintf(extra, sizeof(extra), "X-Cache: %s\r\n", state);
+    httpd_respond_file_at(conn, request, object.fd, object.offset, object.size, etag, extra);
+    object.fd = -1; // The connection closes it
+    pack_object_free(&object);
+    return 0;
+}
+
+static const char *status_reason(long status) {
+    switch (status) {
+        case 400: return "Bad Request";
+        case 401: return "Unauthorized";
+        case 403: return "Forbidden";
+        case 404: return "Not Found";
+        case 410: return "Gone";
+        case 429: return "Too Many Requests";
+        default: return "Upstream Error";
+    }
+}
+
+static void complete_fetch(ProxyFetch *fetch) {
+    ProxyEntry *entry = fetch->entry;
+    entry->fetch = NULL;
+    int transient = fetch->result != CURLE_OK || fetch->status >= 500 || fetch->status == 0;
+    if (!transient && fetch->status == 304 && entry->cached) {
+        entry->fetched = time(NULL);
+        write_meta(entry);
+        stats.not_modified++;
+    } else if (!transient && fetch->status == 200) {
+        // The metadata is written with the object, so it is built from a copy first
+        ProxyEntry updated = *entry;
+        snprintf(updated.etag, sizeof(updated.etag), "%s", fetch->response.etag);
+        snprintf(updated.last_modified, sizeof(updated.last_modified), "%s", fetch->response.last_modified);
+        updated.size = fetch->size;
+        updated.fetched = updated.stored = time(NULL);
+        char meta[4500];
+        int meta_len = format_meta(&updated, meta, sizeof(meta));
+        int fd = open(fetch->tmp_path, O_RDONLY | O_CLOEXEC);
+        if (fd != -1 && pack_put_fd(store, entry->key, meta, (size_t)meta_len, fd, fetch->size) == 0) {
+            if (entry->cached) {
+                total_size -= (long long)entry->size;
+            }
+            memcpy(entry->etag, updated.etag, sizeof(entry->etag));
+            memcpy(entry->last_modified, updated.last_modified, sizeof(entry->last_modified));
+            entry->size = updated.size;
+            entry->fetched = updated.fetched;
+            entry->stored = updated.stored;
+            entry->cached = 1;
+            total_size += (long long)entry->size;
+        } else {
+            transient = 1;
+        }
+        if (fd != -1) {
+            close(fd);
+        }
+    } else if (transient) {
+        stats.upstream_errors++;
+    }
+
+    // Anything else (404 and friends) is passed through and not cached
+    char *body = NULL;
+    size_t body_len = 0;
+    int pass_through = !transient && fetch->status != 200 && !(fetch->status == 304 && entry->cached);
+    if (pass_through) {
+        FILE *fp = fopen(fetch->tmp_path, "rb");
+        body = malloc(PROXY_ERROR_BODY_MAX);
+        if (fp && body) {
+            body_len = fread(body, 1, PROXY_ERROR_BODY_MAX, fp);
+        }
+        if (fp) {
+            fclose(fp);
+        }
+    }
+    unlink(fetch->tmp_path);
+
+    for (size_t i = 0; i < fetch->waiter_count; i++) {
+        ProxyWaiter *waiter = &fetch->waiters[i];
+        if (pass_through) {
+            httpd_respond(waiter->conn, waiter->request, (int)fetch->status, status_reason(fetch->status),
+                          body ? body : "", body_len, "X-Cache: MISS\r\n");
+        } else if (!entry->cached || serve_entry(waiter->conn, waiter->request, entry, i ? "COALESCED" : "MISS") != 0) {
+            httpd_respond_error(waiter->conn, 502, "Bad Gateway", NULL);
+        }
+        httpd_resume(waiter->conn);
+    }
+    free(body);
+    free(fetch->waiters);
+    free(fetch->url);
+    free(fetch);
+    if (!entry->cached || pass_through) {
+        remove_entry(entry); // Upstream said it is gone, or it never arrived
+    } else {
+        evict();
+    }
+}
+
+static void on_fetches_done(void *unused) {
+    (void)unused;
+    uint64_t count;
+    if (read(done_fd, &count, sizeof(count)) != sizeof(count)) {
+        return;
+    }
+    pthread_mutex_lock(&queue_lock);
+    ProxyFetch *list = done;
+    done = NULL;
+    pthread_mutex_unlock(&queue_lock);
+    while (list) {
+        ProxyFetch *next = list->next;
+        complete_fetch(list);
+        list = next;
+    }
+}
+
+static void respond_stats(HttpConnection *conn, const HttpRequest *request) {
+    PackStats pack;
+    pack_stats(store, &pack);
+    char body[1024];
+    int len = snprintf(body, sizeof(body),
+        "{\"requests\": %llu, \"hits\": %llu, \"stale_hits\": %llu, \"misses\": %llu, \"coalesced\": %llu, "
+        "\"revalidations\": %llu, \"not_modified\": %llu, \"evictions\": %llu, \"upstream_errors\": %llu, "
+        "\"objects_bytes\": %lld, \"pack_bytes\": %llu, \"packs\": %llu, \"compactions\": %llu}",
+        stats.requests, stats.hits, stats.stale_hits, stats.misses, stats.coalesced, stats.revalidations,
+        stats.not_modified, stats.evictions, stats.upstream_errors, total_size, pack.pack_bytes, pack.packs,
+        pack.compactions);
+    httpd_respond(conn, request, 200, "OK", body, (size_t)len, NULL);
+}
+
+static void handle_request(HttpConnection *conn, const HttpRequest *request, void *unused) {
+    (void)unused;
+    if (strcmp(request->target, "/__stats") == 0) {
+        respond_stats(conn, request);
+        return;
+    }
+    if (!request->head_only && strcmp(request->method, "GET") != 0) {
+        httpd_respond_error(conn, 405, "Method Not Allowed", "Allow: GET, HEAD\r\n");
+        return;
+    }
+    const char *url = request->target;
+    if (strncmp(url, "http://", 7) != 0 && strncmp(url, "https://", 8) != 0) {
+        httpd_respond_error(conn, 400, "Bad Request, expected an absolute url (set KPM_PROXY on the client)", NULL);
+        return;
+    }
+    stats.requests++;
+    uint64_t key = hash_bytes(url, strlen(url));
+    ProxyEntry *entry = lookup(key, url);
+    if (entry && entry->cached) {
+        int fresh = time(NULL) - entry->fetched < ttl;
+        if (!fresh && entry->fetch == NULL && start_fetch(entry) != NULL) {
+            stats.revalidations++; // Everyone gets the stale copy until it is back
+        }
+        if (serve_entry(conn, request, entry, fresh ? "HIT" : "STALE") == 0) {
+            if (fresh) {
+                stats.hits++;
+            } else {
+                stats.stale_hits++;
+            }
+            lru_touch(entry);
+            return;
+        }
+        if (entry->fetch == NULL) {
+            remove_entry(entry); // Object file went missing underneath us
+        }
+        httpd_respond_error(conn, 502, "Bad Gateway", NULL);
+        return;
+    }
+    if (entry == NULL) {
+        entry = add_entry(key, url);
+        if (entry == NULL || start_fetch(entry) == NULL) {
+            if (entry) {
+                remove_entry(entry);
+            }
+            httpd_respond_error(conn, 500, "Internal Server Error", NULL);
+            return;
+        }
+        stats.misses++;
+    } else {
+        stats.coalesced++;
+    }
+    if (add_waiter(entry->fetch, conn, request) != 0) {
+        httpd_respond_error(conn, 500, "Internal Server Error", NULL);
+        return;
+    }
+    httpd_defer(conn);
+}
+
+static long long parse_size(const char *text) {
+    char *end;
+    long long value = strtoll(text, &end, 10);
+    switch (*end) {
+        case 'k': case 'K': return value * 1024;
+        case 'm': case 'M': return value * 1024 * 1024;
+        case 'g': case 'G': return value * 1024 * 1024 * 1024;
+        default: return value;
+    }
+}
+
+int proxy_main(int argc, char **argv) {
+    const char *bind_addr = PROXY_DEFAULT_BIND;
+    int port = PROXY_DEFAULT_PORT;
+    int workers = PROXY_DEFAULT_WORKERS;
+    int compress = 0;
+    store_dir[0] = '\0';
+    for (int i = 0; i < argc; i++) {
+        if (strcmp(argv[i], "--port") == 0 && i + 1 < argc) {
+            port = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--bind") == 0 && i + 1 < argc) {
+            bind_addr = argv[++i];
+        } else if (strcmp(argv[i], "--dir") == 0 && i + 1 < argc) {
+            snprintf(store_dir, sizeof(store_dir), "%s", argv[++i]);
+        } else if (strcmp(argv[i], "--max-size") == 0 && i + 1 < argc) {
+            max_size = parse_size(argv[++i]);
+        } else if (strcmp(argv[i], "--ttl") == 0 && i + 1 < argc) {
+            ttl = atol(argv[++i]);
+        } else if (strcmp(argv[i], "--workers") == 0 && i + 1 < argc) {
+            workers = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--compress") == 0) {
+            compress = 1;
+        } else {
+            fprintf(stderr, "Usage: kpm proxy [--port <port>] [--bind <address>] [--dir <path>] [--max-size <bytes|K|M|G>] "
+                            "[--ttl <seconds>] [--workers <n>] [--compress]\n");
+            return 1;
+        }
+    }
+    if (port < 0 || port > 65535 || max_size <= 0 || workers <= 0) {
+        fprintf(stderr, "Invalid --port, --max-size or --workers\n");
+        return 1;
+    }
+    if (store_dir[0] == '\0') {
+        snprintf(store_dir, sizeof(store_dir), "%s/%s", get_cache_dir(), PROXY_CACHE_DIR);
+    }
+    store = pack_open(store_dir, compress);
+    if (store == NULL) {
+        return 1;
+    }
+    load_store();
+
+    curl_global_init(CURL_GLOBAL_DEFAULT);
+    done_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    httpd_watch(done_fd, on_fetches_done, NULL);
+    for (int i = 0; i < workers; i++) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, worker, NULL) != 0) {
+            perror("pthread_create");
+            return 1;
+        }
+        pthread_detach(thread);
+    }
+
+    char banner[4200];
+    snprintf(banner, sizeof(banner), "Proxying registry traffic, cache in %s,", store_dir);
+    int ret = httpd_run(bind_addr, port, banner, handle_request, NULL);
+    // Workers still fetching are simply abandoned, their tmp files are cleaned up next start
+    printf("%llu requests: %llu hits, %llu stale, %llu misses, %llu coalesced, %llu revalidated (%llu not modified), "
+           "%llu evictions, %llu upstream errors\n",
+           stats.requests, stats.hits, stats.stale_hits, stats.misses, stats.coalesced, stats.revalidations,
+           stats.not_modified, stats.evictions, stats.upstream_errors);
+    pack_close(store);
+    return ret;
+}
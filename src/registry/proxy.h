@@ -0,0 +1,21 @@
+#ifndef __PROXY__H
+#define __PROXY__H
+
+// kpm proxy: a caching forward proxy for registry traffic, shared by every kpm on
+// a team or CI fleet. Clients set KPM_PROXY=http://host:port (or "proxy" in
+// registry.json) and send absolute-form requests (GET https://... HTTP/1.1), so
+// HTTPS origins can be cached too. Identical in-flight misses share one upstream
+// fetch; expired objects are served stale while a conditional request revalidates
+// them in the background; the store is an LRU bounded by --max-size, kept in a
+// pack store (see cache/pack.h), zlib'd per object with --compress.
+#define PROXY_DEFAULT_PORT 8081
+#define PROXY_DEFAULT_BIND "127.0.0.1"
+#define PROXY_DEFAULT_MAX_SIZE (512LL * 1024 * 1024)
+#define PROXY_DEFAULT_TTL 300      // Seconds an object is served without revalidating
+#define PROXY_DEFAULT_WORKERS 8    // Upstream fetches in parallel
+#define PROXY_HASH_BUCKETS 4096
+#define PROXY_ERROR_BODY_MAX (64 * 1024)
+#define PROXY_CACHE_DIR "proxy"
+
+int proxy_main(int argc, char **argv);
+#endif //__PROXY__H
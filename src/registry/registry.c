@@ -0,0 +1,245 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <jansson.h>
+#include "registry.h"
+#include "scheduler.h"
+
+static const char *kind_dirs[REGISTRY_KIND_COUNT] = {
+    [REGISTRY_LANGS] = "langs",
+    [REGISTRY_LIBS] = "libs",
+    [REGISTRY_LICENCE] = "LICENCE",
+};
+
+static const char *kind_keys[REGISTRY_KIND_COUNT] = {
+    [REGISTRY_LANGS] = "langs",
+    [REGISTRY_LIBS] = "libs",
+    [REGISTRY_LICENCE] = "licence",
+};
+
+static void copy_base(char *out, size_t size, const char *url, size_t len) {
+    while (len > 0 && url[len - 1] == '/') {
+        len--;
+    }
+    snprintf(out, size, "%.*s", (int)len, url);
+}
+
+static void add_root(RegistryConfig *config, const char *name, const char *root, size_t len) {
+    if (config->mirror_count == REGISTRY_MAX_MIRRORS) {
+        fprintf(stderr, "Too many registry mirrors, ignoring %.*s\n", (int)len, root);
+        return;
+    }
+    RegistryMirror *mirror = &config->mirrors[config->mirror_count++];
+    char base[480];
+    copy_base(base, sizeof(base), root, len);
+    if (strstr(base, "://") == NULL && base[0] != '/') {
+        // A relative directory, the local backend wants absolute paths
+        char resolved[PATH_MAX];
+        if (realpath(base, resolved) != NULL) {
+            snprintf(base, sizeof(base), "%.479s", resolved);
+        }
+    }
+    snprintf(mirror->name, sizeof(mirror->name), "%.63s", name ? name : base);
+    for (int kind = 0; kind < REGISTRY_KIND_COUNT; kind++) {
+        snprintf(mirror->base[kind], sizeof(mirror->base[kind]), "%s/%s", base, kind_dirs[kind]);
+    }
+}
+
+static void add_defaults(RegistryConfig *config) {
+    RegistryMirror *mirror = &config->mirrors[config->mirror_count++];
+    snprintf(mirror->name, sizeof(mirror->name), "github");
+    snprintf(mirror->base[REGISTRY_LANGS], sizeof(mirror->base[0]), "%s", DEFAULT_LANGS_URL);
+    snprintf(mirror->base[REGISTRY_LIBS], sizeof(mirror->base[0]), "%s", DEFAULT_LIBS_URL);
+    snprintf(mirror->base[REGISTRY_LICENCE], sizeof(mirror->base[0]), "%s", DEFAULT_LICENCE_URL);
+}
+
+static int config_file_path(char *out, size_t size) {
+    const char *env = getenv("KPM_REGISTRY_CONFIG");
+    if (env && env[0] != '\0') {
+        snprintf(out, size, "%s", env);
+        return 0;
+    }
+    env = getenv("XDG_CONFIG_HOME");
+    if (env && env[0] != '\0') {
+        snprintf(out, size, "%s/kpm/%s", env, REGISTRY_CONFIG_NAME);
+        return 0;
+    }
+    env = getenv("HOME");
+    if (env == NULL) {
+        return -1;
+    }
+    snprintf(out, size, "%s/.config/kpm/%s", env, REGISTRY_CONFIG_NAME);
+    return 0;
+}
+
+static void load_config_file(RegistryConfig *config) {
+    char path[4096];
+    if (config_file_path(path, sizeof(path)) != 0) {
+        return;
+    }
+    if (access(path, R_OK) != 0) {
+        return; // No config is the normal case
+    }
+    json_error_t error;
+    json_t *root = json_load_file(path, 0, &error);
+    if (!root) {
+        fprintf(stderr, "Error parsing %s: %s\n", path, error.text);
+        return;
+    }
+
+    json_t *hedge = json_object_get(root, "hedge");
+    if (json_is_boolean(hedge)) {
+        config->hedge = json_is_true(hedge);
+    }
+    json_t *delay = json_object_get(root, "hedge_delay_ms");
+    if (json_is_integer(delay)) {
+        config->hedge_delay_ms = (long)json_integer_value(delay);
+    }
+    const char *raw_url = json_string_value(json_object_get(root, "raw_url"));
+    if (raw_url) {
+        snprintf(config->raw_url, sizeof(config->raw_url), "%s", raw_url);
+    }
+    const char *proxy = json_string_value(json_object_get(root, "proxy"));
+    if (proxy) {
+        snprintf(config->proxy, sizeof(config->proxy), "%s", proxy);
+    }
+    json_t *concurrency = json_object_get(root, "host_concurrency");
+    if (json_is_integer(concurrency) && json_integer_value(concurrency) > 0) {
+        config->host_concurrency = (int)json_integer_value(concurrency);
+    }
+    json_t *rate = json_object_get(root, "host_rate");
+    if (json_is_number(rate) && json_number_value(rate) >= 0) {
+        config->host_rate = json_number_value(rate);
+    }
+
+    json_t *mirrors = json_object_get(root, "mirrors");
+    size_t index;
+    json_t *entry;
+    json_array_foreach(mirrors, index, entry) {
+        const char *name = json_string_value(json_object_get(entry, "name"));
+        const char *mirror_root = json_string_value(json_object_get(entry, "root"));
+        if (mirror_root) {
+            add_root(config, name, mirror_root, strlen(mirror_root));
+        } else if (config->mirror_count < REGISTRY_MAX_MIRRORS) {
+            // Without a root every kind has to be spelled out
+            RegistryMirror mirror;
+            memset(&mirror, 0, sizeof(mirror));
+            int complete = 1;
+            for (int kind = 0; kind < REGISTRY_KIND_COUNT; kind++) {
+                const char *base = json_string_value(json_object_get(entry, kind_keys[kind]));
+                if (base == NULL) {
+                    complete = 0;
+                    break;
+                }
+                copy_base(mirror.base[kind], sizeof(mirror.base[kind]), base, strlen(base));
+            }
+            if (!complete) {
+                fprintf(stderr, "%s: mirror %zu needs \"root\" or \"langs\", \"libs\" and \"licence\"\n", path, index);
+                continue;
+            }
+            snprintf(mirror.name, sizeof(mirror.name), "%.63s", name ? name : mirror.base[REGISTRY_LANGS]);
+            config->mirrors[config->mirror_count++] = mirror;
+        }
+    }
+    json_decref(root);
+}
+
+const RegistryConfig *registry_config() {
+    static RegistryConfig config;
+    static int loaded = 0;
+    if (loaded) {
+        return &config;
+    }
+    loaded = 1;
+    config.hedge = 1;
+    config.host_concurrency = SCHED_DEFAULT_CONCURRENCY;
+    snprintf(config.raw_url, sizeof(config.raw_url), "%s", DEFAULT_RAW_URL);
+
+    // The config file is read even when the environment names the mirrors, for its other settings
+    RegistryConfig file = config;
+    load_config_file(&file);
+    config.hedge = file.hedge;
+    config.hedge_delay_ms = file.hedge_delay_ms;
+    memcpy(config.raw_url, file.raw_url, sizeof(config.raw_url));
+    memcpy(config.proxy, file.proxy, sizeof(config.proxy));
+    config.host_concurrency = file.host_concurrency;
+    config.host_rate = file.host_rate;
+
+    const char *env = getenv("KPM_REGISTRY_MIRRORS");
+    if (env && env[0] != '\0') {
+        while (*env) {
+            size_t len = strcspn(env, ",");
+            if (len > 0) {
+                add_root(&config, NULL, env, len);
+            }
+            env += len;
+            if (*env == ',') {
+                env++;
+            }
+        }
+    }
+    env = getenv("KPM_REGISTRY_URL");
+    if (config.mirror_count == 0 && env && env[0] != '\0') {
+        add_root(&config, NULL, env, strlen(env));
+    }
+    if (config.mirror_count == 0) {
+        memcpy(config.mirrors, file.mirrors, sizeof(config.mirrors));
+        config.mirror_count = file.mirror_count;
+    }
+    if (config.mirror_count == 0) {
+        add_defaults(&config);
+    }
+    env = getenv("KPM_PROXY");
+    if (env) {
+        snprintf(config.proxy, sizeof(config.proxy), "%s", env); // Empty turns a configured proxy off
+    }
+    env = getenv("KPM_REGISTRY_HEDGE");
+    if (env && env[0] != '\0') {
+        config.hedge = strcmp(env, "0") != 0;
+    }
+    env = getenv("KPM_HOST_CONCURRENCY");
+    if (env && atoi(env) > 0) {
+        config.host_concurrency = atoi(env);
+    }
+    env = getenv("KPM_HOST_RATE");
+    if (env && env[0] != '\0' && atof(env) >= 0) {
+        config.host_rate = atof(env);
+    }
+    return &config;
+}
+
+const char *registry_langs_url() {
+    return registry_config()->mirrors[0].base[REGISTRY_LANGS];
+}
+
+const char *registry_libs_url() {
+    return registry_config()->mirrors[0].base[REGISTRY_LIBS];
+}
+
+const char *registry_licence_url() {
+    return registry_config()->mirrors[0].base[REGISTRY_LICENCE];
+}
+
+const char *registry_raw_url() {
+    return registry_config()->raw_url;
+}
+
+const char *registry_match(const char *url, size_t *mirror, RegistryKind *kind) {
+    const RegistryConfig *config = registry_config();
+    size_t best_len = 0;
+    for (size_t i = 0; i < config->mirror_count; i++) {
+        for (int k = 0; k < REGISTRY_KIND_COUNT; k++) {
+            const char *base = config->mirrors[i].base[k];
+            size_t len = strlen(base);
+            // Longest match wins, langs/ and LICENCE/ usually share a repository
+            if (len > best_len && strncmp(url, base, len) == 0 && (url[len] == '/' || url[len] == '\0')) {
+                best_len = len;
+                *mirror = i;
+                *kind = k;
+            }
+        }
+    }
+    return best_len > 0 ? url + best_len : NULL;
+}
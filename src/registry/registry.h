@@ -0,0 +1,60 @@
+#ifndef __REGISTRY__H
+#define __REGISTRY__H
+#include <stddef.h>
+
+// Where templates, libraries and licences are fetched from. The mirror list comes
+// from, in order of precedence:
+//   KPM_REGISTRY_MIRRORS  comma separated KickStartFiles-style roots (langs/, libs/, LICENCE/)
+//   KPM_REGISTRY_URL      a single root, e.g. a local stand-in during benchmarks
+//   KPM_REGISTRY_CONFIG, $XDG_CONFIG_HOME/kpm/registry.json or ~/.config/kpm/registry.json:
+//     {"mirrors": [{"name": "github", "langs": "...", "libs": "...", "licence": "..."},
+//                  {"name": "local", "root": "http://mirror.example.com/kpm"}],
+//      "hedge": true, "hedge_delay_ms": 0, "raw_url": "https://raw.githubusercontent.com/{owner}/{repo}/main/{path}",
+//      "proxy": "http://kpm-proxy.internal:8081", "host_concurrency": 6, "host_rate": 0}
+//   the GitHub repositories below
+// A root can also be a local directory (file:///srv/kpm, /srv/kpm or a relative path),
+// which is read straight off disk, see local.h.
+// KPM_PROXY (or "proxy" above) sends every http(s) fetch through a kpm proxy, see proxy.h.
+// KPM_HOST_CONCURRENCY and KPM_HOST_RATE override the per-host limits, see scheduler.h.
+#define DEFAULT_LANGS_URL "https://raw.githubusercontent.com/KingVentrix007/KickStartFiles/main/langs"
+#define DEFAULT_LIBS_URL "https://raw.githubusercontent.com/KingVentrix007/CodeStarterFiles/main/libs"
+#define DEFAULT_LICENCE_URL "https://raw.githubusercontent.com/KingVentrix007/KickStartFiles/main/LICENCE"
+#define DEFAULT_RAW_URL "https://raw.githubusercontent.com/{owner}/{repo}/main/{path}"
+
+#define REGISTRY_MAX_MIRRORS 8
+#define REGISTRY_CONFIG_NAME "registry.json"
+
+typedef enum {
+    REGISTRY_LANGS,
+    REGISTRY_LIBS,
+    REGISTRY_LICENCE,
+    REGISTRY_KIND_COUNT
+} RegistryKind;
+
+typedef struct {
+    char name[64];
+    char base[REGISTRY_KIND_COUNT][512]; // No trailing slash
+} RegistryMirror;
+
+typedef struct {
+    RegistryMirror mirrors[REGISTRY_MAX_MIRRORS];
+    size_t mirror_count;
+    int hedge;               // Send a duplicate request to the next mirror when the first is slow
+    long hedge_delay_ms;     // Fixed hedge delay, 0 derives it from the p95 latency
+    char raw_url[512];
+    char proxy[512];         // kpm proxy base url, empty for direct fetches
+    int host_concurrency;    // Requests in flight per host, see scheduler.h
+    double host_rate;        // Requests per second per host, 0 for no limit
+} RegistryConfig;
+
+const RegistryConfig *registry_config();
+// The first configured mirror, callers build URLs from these and the transfer
+// layer moves them to whichever mirror is fastest
+const char *registry_langs_url();
+const char *registry_libs_url();
+const char *registry_licence_url();
+const char *registry_raw_url();
+// Finds the mirror and kind whose base url is a prefix of url and returns the
+// remainder (starting at '/'), or NULL if url is not a registry url
+const char *registry_match(const char *url, size_t *mirror, RegistryKind *kind);
+#endif //__REGISTRY__H
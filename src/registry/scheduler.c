@@ -0,0 +1,144 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+#include <curl/curl.h>
+#include "scheduler.h"
+#include "registry.h"
+#include "../stats/stats.h"
+
+struct SchedHost {
+    char name[256];
+    int cap;                 // Configured concurrency
+    int limit;               // Current concurrency, halved by throttling
+    int ceiling;             // Below the concurrency that was last throttled
+    int active;
+    int successes;           // Since limit or ceiling last changed
+    int probe_windows;       // Windows of successes before probing past the ceiling
+    double tokens;
+    long long refilled_us;
+    long long closed_until_us;
+};
+
+static SchedHost hosts[SCHED_MAX_HOSTS];
+static size_t host_count = 0;
+
+// scheme://authority, userinfo included since it is part of who we are to the server
+static void host_key(const char *url, char *out, size_t size) {
+    const char *start = strstr(url, "://");
+    start = start ? start + 3 : url;
+    size_t len = (size_t)(start - url) + strcspn(start, "/?#");
+    if (len >= size) {
+        len = size - 1;
+    }
+    for (size_t i = 0; i < len; i++) {
+        out[i] = (char)tolower((unsigned char)url[i]);
+    }
+    out[len] = '\0';
+}
+
+SchedHost *sched_host(const char *url) {
+    char key[256];
+    host_key(url, key, sizeof(key));
+    for (size_t i = 0; i < host_count; i++) {
+        if (strcmp(hosts[i].name, key) == 0) {
+            return &hosts[i];
+        }
+    }
+    if (host_count == SCHED_MAX_HOSTS) {
+        return &hosts[SCHED_MAX_HOSTS - 1]; // Past that the stragglers share one set of limits
+    }
+    const RegistryConfig *config = registry_config();
+    SchedHost *host = &hosts[host_count++];
+    memset(host, 0, sizeof(*host));
+    snprintf(host->name, sizeof(host->name), "%s", key);
+    host->cap = config->host_concurrency > 0 ? config->host_concurrency : SCHED_DEFAULT_CONCURRENCY;
+    host->limit = host->cap;
+    host->ceiling = host->cap;
+    host->probe_windows = SCHED_PROBE_WINDOWS;
+    host->tokens = config->host_rate > 1 ? config->host_rate : 1;
+    host->refilled_us = -1;
+    return host;
+}
+
+long long sched_acquire(SchedHost *host, long long now_us) {
+    if (now_us < host->closed_until_us) {
+        return host->closed_until_us - now_us;
+    }
+    if (host->active >= host->limit) {
+        return SCHED_SLOT_WAIT_US;
+    }
+    double rate = registry_config()->host_rate;
+    if (rate > 0) {
+        double burst = rate > 1 ? rate : 1;
+        if (host->refilled_us >= 0) {
+            host->tokens += (now_us - host->refilled_us) * rate / 1e6;
+        }
+        if (host->tokens > burst) {
+            host->tokens = burst;
+        }
+        host->refilled_us = now_us;
+        if (host->tokens < 1) {
+            return (long long)((1 - host->tokens) * 1e6 / rate) + 1;
+        }
+        host->tokens -= 1;
+    }
+    host->active++;
+    return 0;
+}
+
+void sched_release(SchedHost *host, long status, long retry_after_ms, long long now_us) {
+    if (host->active > 0) {
+        host->active--;
+    }
+    if (status == 429 || (status == 503 && retry_after_ms >= 0)) {
+        long wait_ms = retry_after_ms >= 0 ? retry_after_ms : SCHED_DEFAULT_RETRY_AFTER_MS;
+        if (wait_ms > SCHED_MAX_RETRY_AFTER_MS) {
+            wait_ms = SCHED_MAX_RETRY_AFTER_MS;
+        }
+        // Requests in flight together tend to be throttled together, only the first one counts
+        if (now_us >= host->closed_until_us) {
+            if (host->ceiling < host->cap && host->probe_windows < SCHED_MAX_PROBE_WINDOWS) {
+                host->probe_windows *= 2; // Throttled again, the limit is not moving
+            }
+            host->ceiling = host->active > 1 ? host->active : 1;
+            host->limit = host->limit > 1 ? host->limit / 2 : 1;
+            fprintf(stderr, "%s throttled us, pausing it for %ld ms\n", host->name, wait_ms);
+        }
+        long long until = now_us + wait_ms * 1000LL;
+        if (until > host->closed_until_us) {
+            host->closed_until_us = until;
+        }
+        host->successes = 0;
+        STATS_INC(STAT_THROTTLED);
+    } else if (status >= 200 && status < 400 && host->limit < host->cap) {
+        // Back up to the ceiling one step per window of successes, past it only every probe_windows
+        host->successes++;
+        if (host->limit < host->ceiling && host->successes >= host->limit) {
+            host->limit++;
+            host->successes = 0;
+        } else if (host->limit == host->ceiling && host->successes >= host->limit * host->probe_windows) {
+            host->ceiling++;
+            host->limit++;
+            host->successes = 0;
+        }
+    }
+}
+
+long sched_parse_retry_after(const char *value) {
+    while (*value == ' ' || *value == '\t') {
+        value++;
+    }
+    if (isdigit((unsigned char)*value)) {
+        char *end;
+        long seconds = strtol(value, &end, 10);
+        return seconds > SCHED_MAX_RETRY_AFTER_MS / 1000 ? SCHED_MAX_RETRY_AFTER_MS : seconds * 1000;
+    }
+    time_t at = curl_getdate(value, NULL);
+    if (at == -1) {
+        return -1;
+    }
+    time_t now = time(NULL);
+    return at <= now ? 0 : (at - now > SCHED_MAX_RETRY_AFTER_MS / 1000 ? SCHED_MAX_RETRY_AFTER_MS : (long)(at - now) * 1000);
+}
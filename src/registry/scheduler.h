@@ -0,0 +1,40 @@
+#ifndef __SCHEDULER__H
+#define __SCHEDULER__H
+
+// Admission control for every request kpm sends, kept per host (scheme://host:port):
+//   - at most host_concurrency requests in flight (KPM_HOST_CONCURRENCY, default 6)
+//   - a token bucket of host_rate requests per second with a one second burst
+//     (KPM_HOST_RATE, off by default)
+//   - a 429, or a 503 with Retry-After, closes the host to every request until the
+//     time Retry-After names (SCHED_DEFAULT_RETRY_AFTER_MS without one) and halves
+//     its concurrency, which grows back by one per window of successful responses
+//     up to just under what was throttled, and only probes past that every
+//     SCHED_PROBE_WINDOWS windows, twice as long after each throttle
+// Requests waiting for the same host are admitted in priority order.
+#define SCHED_DEFAULT_CONCURRENCY 6
+#define SCHED_MAX_HOSTS 32
+#define SCHED_DEFAULT_RETRY_AFTER_MS 1000
+#define SCHED_MAX_RETRY_AFTER_MS (120 * 1000)
+#define SCHED_PROBE_WINDOWS 32
+#define SCHED_MAX_PROBE_WINDOWS 1024
+#define SCHED_SLOT_WAIT_US 1000000  // Host is full, a finishing request wakes the caller first
+
+typedef enum {
+    REQUEST_CRITICAL,  // Everything else waits on it, e.g. an index or language json
+    REQUEST_NORMAL,    // Library sources and headers
+    REQUEST_OPTIONAL,  // Nice to have, e.g. a template's files_to_include
+    REQUEST_PRIORITY_COUNT
+} RequestPriority;
+
+typedef struct SchedHost SchedHost;
+
+SchedHost *sched_host(const char *url);
+// 0 once a slot is taken for a request starting at now_us, otherwise the
+// microseconds to wait before asking again
+long long sched_acquire(SchedHost *host, long long now_us);
+// Returns the slot. status is the HTTP status (0 when there was no response) and
+// retry_after_ms what its Retry-After asked for, -1 without one
+void sched_release(SchedHost *host, long status, long retry_after_ms, long long now_us);
+// A Retry-After value, delay seconds or an HTTP date, in milliseconds from now, -1 if unparsable
+long sched_parse_retry_after(const char *value);
+#endif //__SCHEDULER__H
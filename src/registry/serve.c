@@ -0,0 +1,156 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#ifdef SYS_openat2
+#include <linux/openat2.h>
+#endif
+#include "serve.h"
+#include "httpd.h"
+
+// Decodes %XX and refuses anything that could leave the registry root
+static int request_path(const char *target, char *out, size_t size) {
+    size_t n = 0;
+    size_t len = strlen(target);
+    for (size_t i = 0; i < len && target[i] != '?' && target[i] != '#'; i++) {
+        char c = target[i];
+        if (c == '%' && i + 2 < len && isxdigit((unsigned char)target[i + 1]) && isxdigit((unsigned char)target[i + 2])) {
+            char hex[3] = {target[i + 1], target[i + 2], '\0'};
+            c = (char)strtol(hex, NULL, 16);
+            i += 2;
+        }
+        if (c == '\0' || n + 1 >= size) {
+            return -1;
+        }
+        out[n++] = c;
+    }
+    out[n] = '\0';
+    if (out[0] != '/') {
+        return -1;
+    }
+    for (char *segment = out; segment != NULL; segment = strchr(segment + 1, '/')) {
+        if (strncmp(segment, "/..", 3) == 0 && (segment[3] == '/' || segment[3] == '\0')) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Opens relative without leaving root_fd. openat2's RESOLVE_BENEATH where the kernel has
+// it, which still follows symlinks that stay inside the root; otherwise one component at
+// a time with O_NOFOLLOW, which refuses every symlink
+static int open_beneath(int root_fd, const char *relative) {
+#ifdef SYS_openat2
+    struct open_how how = {.flags = O_RDONLY | O_CLOEXEC, .resolve = RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS};
+    int fd = (int)syscall(SYS_openat2, root_fd, relative, &how, sizeof(how));
+    // Older kernels, and seccomp filters that do not know the call yet
+    if (fd != -1 || (errno != ENOSYS && errno != EPERM)) {
+        return fd;
+    }
+#endif
+    int dir = root_fd;
+    const char *p = relative;
+    for (;;) {
+        size_t len = strcspn(p, "/");
+        char name[256];
+        if (len == 0 || len >= sizeof(name)) {
+            break;
+        }
+        memcpy(name, p, len);
+        name[len] = '\0';
+        p += len + strspn(p + len, "/");
+        int last = *p == '\0';
+        int next = openat(dir, name, O_RDONLY | O_CLOEXEC | O_NOFOLLOW | (last ? 0 : O_DIRECTORY));
+        if (dir != root_fd) {
+            close(dir);
+        }
+        if (next == -1 || last) {
+            return next;
+        }
+        dir = next;
+    }
+    if (dir != root_fd) {
+        close(dir);
+    }
+    return -1;
+}
+
+static void serve_file(HttpConnection *conn, const HttpRequest *request, void *userdata) {
+    int root_fd = *(int *)userdata;
+    if (!request->head_only && strcmp(request->method, "GET") != 0) {
+        httpd_respond_error(conn, 405, "Method Not Allowed", "Allow: GET, HEAD\r\n");
+        return;
+    }
+    char path[4096];
+    if (request_path(request->target, path, sizeof(path)) != 0) {
+        httpd_respond_error(conn, 400, "Bad Request", NULL);
+        return;
+    }
+    const char *relative = path;
+    while (*relative == '/') {
+        relative++; // openat would take //etc/passwd as absolute
+    }
+    int fd = *relative ? open_beneath(root_fd, relative) : -1;
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        if (fd != -1) {
+            close(fd);
+        }
+        httpd_respond_error(conn, 404, "Not Found", NULL);
+        return;
+    }
+    // Strong validator, changes whenever the file is replaced or rewritten
+    char etag[96];
+    httpd_file_etag(&st, etag, sizeof(etag));
+    httpd_respond_file(conn, request, fd, &st, etag, NULL);
+}
+
+int registry_serve(const char *root, const char *bind_addr, int port) {
+    int root_fd = open(root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (root_fd == -1) {
+        fprintf(stderr, "Error opening %s: %s\n", root, strerror(errno));
+        return 1;
+    }
+    char banner[4200];
+    snprintf(banner, sizeof(banner), "Serving %s", root);
+    int ret = httpd_run(bind_addr, port, banner, serve_file, &root_fd);
+    close(root_fd);
+    if (ret == 0) {
+        printf("Served %llu requests, %llu bytes\n", httpd_requests(), httpd_bytes());
+    }
+    return ret;
+}
+
+int registry_serve_main(int argc, char **argv) {
+    const char *root = ".";
+    const char *bind_addr = SERVE_DEFAULT_BIND;
+    int port = SERVE_DEFAULT_PORT;
+    for (int i = 0; i < argc; i++) {
+        if (strcmp(argv[i], "--port") == 0 && i + 1 < argc) {
+            port = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--bind") == 0 && i + 1 < argc) {
+            bind_addr = argv[++i];
+        } else if (argv[i][0] != '-') {
+            root = argv[i];
+        } else {
+            fprintf(stderr, "Usage: kpm registry serve [dir] [--port <port>] [--bind <address>]\n");
+            return 1;
+        }
+    }
+    if (port < 0 || port > 65535) {
+        fprintf(stderr, "Invalid port %d\n", port);
+        return 1;
+    }
+    char langs[4096];
+    snprintf(langs, sizeof(langs), "%s/langs", root);
+    struct stat st;
+    if (stat(langs, &st) != 0 || !S_ISDIR(st.st_mode)) {
+        fprintf(stderr, "Warning: %s has no langs/ directory, is it a registry?\n", root);
+    }
+    return registry_serve(root, bind_addr, port);
+}
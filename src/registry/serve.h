@@ -0,0 +1,13 @@
+#ifndef __SERVE__H
+#define __SERVE__H
+
+// kpm registry serve: serves a KickStartFiles-style directory over HTTP/1.1 (see
+// httpd.h) so CI agents can point KPM_REGISTRY_URL at it instead of
+// raw.githubusercontent.com. Strong ETags and single byte ranges, GET and HEAD only.
+// Nothing outside the directory is served, symlinks included.
+#define SERVE_DEFAULT_PORT 8080
+#define SERVE_DEFAULT_BIND "127.0.0.1"
+
+int registry_serve(const char *root, const char *bind_addr, int port);
+int registry_serve_main(int argc, char **argv);
+#endif //__SERVE__H
@@ -0,0 +1,965 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include "transfer.h"
+#include "registry.h"
+#include "local.h"
+#include "scheduler.h"
+#include "../cache/cache.h"
+#include "../trace/trace.h"
+#include "../stats/stats.h"
+#include "../memory/alloc_profile.h"
+
+typedef struct {
+    double ewma_ms;
+    double samples[LATENCY_SAMPLES];
+    size_t sample_count;
+    size_t next_sample;
+    int failures;
+    long long down_until;
+} MirrorLatency;
+
+
+typedef struct Transfer Transfer;
+
+typedef struct Attempt {
+    CURL *easy;
+    Transfer *owner;
+    SchedHost *host;
+    size_t mirror;
+    char url[2048];
+    RegistryBody body; // Only size is kept when downloading to a file
+    FILE *fp;          // Set when downloading to a file, each attempt gets its own part file
+    char part_path[4200];
+    size_t offset;     // Bytes from an earlier try, resumed with Range. In memory they're part of size
+    int range_checked; // Whether the first response byte confirmed the range
+    RegistryHeaders response_headers; // The validator is sent with If-Range on the next try
+    struct curl_slist *headers;
+    long status;
+    long long start_us;
+    TraceSpan span;
+    int active;
+    struct Attempt *next_spare;
+} Attempt;
+
+// What a dropped transfer leaves for the next try, a part file or the buffered body
+typedef struct {
+    char *part_path;   // <path>.part, NULL when buffering in memory
+    char *data;
+    size_t capacity;
+    size_t offset;
+    char validator[128];
+} Resume;
+
+typedef enum {
+    TRANSFER_WAITING,  // For its first try, or backing off before the next one
+    TRANSFER_RUNNING,
+    TRANSFER_DONE
+} TransferState;
+
+// One url through mirror selection, hedging and retries, advanced by run_transfers()
+struct Transfer {
+    const char *url;
+    const char *path;  // NULL when buffering in memory
+    const char *validator; // For a conditional request, NULL for a plain one
+    RequestPriority priority;
+    RegistryResponse *response;
+    TransferState state;
+    int result;
+    int retry;
+    int retries;
+    int throttled;     // Tries a Retry-After asked to wait for, they do not use up retries
+    long long not_before;
+    Resume resume;
+    // The current try
+    const char *relative;
+    RegistryKind kind;
+    size_t order[REGISTRY_MAX_MIRRORS];
+    size_t candidates;
+    Attempt *attempts[REGISTRY_MAX_MIRRORS];
+    size_t started;
+    size_t active;
+    long long hedge_at;
+    Attempt *winner;
+    Attempt *fallback; // Answered, but with an error status
+    CURLcode last_error;
+    long retry_after_ms;
+    size_t try_offset; // resume.offset when the try began
+};
+
+static CURLM *multi = NULL;
+static Attempt *spare_attempts = NULL; // Finished attempts, reused rather than freed
+static MirrorLatency latency[REGISTRY_MAX_MIRRORS];
+static int latency_loaded = 0;
+static int latency_dirty = 0;
+
+static long long now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void transfer_cleanup();
+
+static CURLM *get_multi() {
+    if (multi == NULL) {
+        curl_global_init(CURL_GLOBAL_DEFAULT);
+        // One multi handle for the whole run keeps connections alive between requests
+        multi = curl_multi_init();
+        atexit(transfer_cleanup);
+    }
+    return multi;
+}
+
+static void latency_cache_path(char *out, size_t size) {
+    if (cache_path(out, size, LATENCY_CACHE_DIR, LATENCY_CACHE_NAME) != 0) {
+        out[0] = '\0';
+    }
+}
+
+// Latency survives between runs in <cache>/registry/latency, one mirror per line:
+// <langs url> <ewma ms> <failures> <down until> <sample count> <samples...>
+static void load_latency() {
+    latency_loaded = 1;
+    char path[4096];
+    latency_cache_path(path, sizeof(path));
+    FILE *fp = path[0] ? fopen(path, "r") : NULL;
+    if (fp == NULL) {
+        return;
+    }
+    const RegistryConfig *config = registry_config();
+    char url[1024];
+    MirrorLatency entry;
+    while (fscanf(fp, "%1023s %lf %d %lld %zu", url, &entry.ewma_ms, &entry.failures, &entry.down_until,
+                  &entry.sample_count) == 5) {
+        if (entry.sample_count > LATENCY_SAMPLES) {
+            break;
+        }
+        int ok = 1;
+        for (size_t i = 0; i < entry.sample_count && ok; i++) {
+            ok = fscanf(fp, "%lf", &entry.samples[i]) == 1;
+        }
+        if (!ok) {
+            break;
+        }
+        entry.next_sample = entry.sample_count % LATENCY_SAMPLES;
+        for (size_t i = 0; i < config->mirror_count; i++) {
+            if (strcmp(config->mirrors[i].base[REGISTRY_LANGS], url) == 0) {
+                latency[i] = entry;
+            }
+        }
+    }
+    fclose(fp);
+}
+
+static void save_latency() {
+    char path[4096];
+    char tmp_path[4200];
+    latency_cache_path(path, sizeof(path));
+    if (path[0] == '\0') {
+        return;
+    }
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp.%d", path, (int)getpid());
+    FILE *fp = fopen(tmp_path, "w");
+    if (fp == NULL) {
+        return;
+    }
+    const RegistryConfig *config = registry_config();
+    for (size_t i = 0; i < config->mirror_count; i++) {
+        MirrorLatency *entry = &latency[i];
+        fprintf(fp, "%s %.3f %d %lld %zu", config->mirrors[i].base[REGISTRY_LANGS], entry->ewma_ms,
+                entry->failures, entry->down_until, entry->sample_count);
+        for (size_t s = 0; s < entry->sample_count; s++) {
+            fprintf(fp, " %.3f", entry->samples[s]);
+        }
+        fputc('\n', fp);
+    }
+    if (fclose(fp) != 0 || rename(tmp_path, path) != 0) {
+        unlink(tmp_path);
+    }
+}
+
+static void transfer_cleanup() {
+    if (latency_dirty) {
+        save_latency();
+    }
+    while (spare_attempts != NULL) {
+        Attempt *attempt = spare_attempts;
+        spare_attempts = attempt->next_spare;
+        free(attempt);
+    }
+    curl_multi_cleanup(multi);
+    multi = NULL;
+    curl_global_cleanup();
+}
+
+static void record_latency(size_t mirror, double ms) {
+    MirrorLatency *entry = &latency[mirror];
+    entry->ewma_ms = entry->sample_count == 0 ? ms : LATENCY_EWMA_ALPHA * ms + (1 - LATENCY_EWMA_ALPHA) * entry->ewma_ms;
+    entry->samples[entry->next_sample] = ms;
+    entry->next_sample = (entry->next_sample + 1) % LATENCY_SAMPLES;
+    if (entry->sample_count < LATENCY_SAMPLES) {
+        entry->sample_count++;
+    }
+    entry->failures = 0;
+    entry->down_until = 0;
+    latency_dirty = 1;
+}
+
+static void record_failure(size_t mirror) {
+    MirrorLatency *entry = &latency[mirror];
+    if (++entry->failures >= MIRROR_FAILURE_LIMIT) {
+        entry->down_until = (long long)time(NULL) + MIRROR_COOLDOWN;
+    }
+    latency_dirty = 1;
+}
+
+static int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static long hedge_delay_ms(size_t mirror) {
+    const RegistryConfig *config = registry_config();
+    if (config->hedge_delay_ms > 0) {
+        return config->hedge_delay_ms;
+    }
+    MirrorLatency *entry = &latency[mirror];
+    if (entry->sample_count == 0) {
+        return HEDGE_DEFAULT_DELAY_MS;
+    }
+    double sorted[LATENCY_SAMPLES];
+    memcpy(sorted, entry->samples, entry->sample_count * sizeof(double));
+    qsort(sorted, entry->sample_count, sizeof(double), compare_doubles);
+    long p95 = (long)sorted[(entry->sample_count * 95 + 99) / 100 - 1];
+    if (p95 < HEDGE_MIN_DELAY_MS) {
+        return HEDGE_MIN_DELAY_MS;
+    }
+    return p95 > HEDGE_MAX_DELAY_MS ? HEDGE_MAX_DELAY_MS : p95;
+}
+
+// Healthy mirrors by EWMA latency, untried ones first so they get measured, then
+// mirrors that are cooling down as a last resort
+static size_t order_mirrors(size_t *order) {
+    const RegistryConfig *config = registry_config();
+    long long now = (long long)time(NULL);
+    size_t count = 0;
+    for (int pass = 0; pass < 2; pass++) {
+        size_t start = count;
+        for (size_t i = 0; i < config->mirror_count; i++) {
+            if (local_registry_path(config->mirrors[i].base[REGISTRY_LANGS]) != NULL) {
+                continue; // Read directly by transfer(), never raced
+            }
+            int down = latency[i].down_until > now;
+            if (down != pass) {
+                continue;
+            }
+            size_t j = count++;
+            while (j > start && latency[order[j - 1]].ewma_ms > latency[i].ewma_ms) {
+                order[j] = order[j - 1];
+                j--;
+            }
+            order[j] = i;
+        }
+    }
+    return count;
+}
+
+static size_t write_attempt(void *contents, size_t size, size_t nmemb, void *userp) {
+    size_t total_size = size * nmemb;
+    Attempt *attempt = userp;
+    if (attempt->offset > 0 && !attempt->range_checked) {
+        long status = 0;
+        curl_easy_getinfo(attempt->easy, CURLINFO_RESPONSE_CODE, &status);
+        attempt->range_checked = 1;
+        if (status != 206) {
+            // If-Range did not match (or no range support), this is the whole body again
+            if (attempt->fp != NULL && ftruncate(fileno(attempt->fp), 0) != 0) {
+                return 0;
+            }
+            attempt->body.size = 0;
+            attempt->offset = 0;
+        }
+    }
+    if (attempt->fp != NULL) {
+        size_t written = fwrite(contents, 1, total_size, attempt->fp);
+        attempt->body.size += written;
+        return written;
+    }
+    // Sized from Content-Length up front, doubling when the server did not send one
+    curl_off_t length = -1;
+    if (attempt->body.size + total_size + 1 > attempt->body.capacity) {
+        curl_easy_getinfo(attempt->easy, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &length);
+    }
+    if (registry_body_append(&attempt->body, contents, total_size, length > 0 ? (size_t)length : 0) != 0) {
+        fprintf(stderr, "Failed to realloc memory\n");
+        return 0;
+    }
+    return total_size;
+}
+
+// Body bytes an attempt holds, including any it resumed from
+static size_t received(const Attempt *attempt) {
+    return attempt->fp != NULL ? attempt->offset + attempt->body.size : attempt->body.size;
+}
+
+void registry_headers_reset(RegistryHeaders *headers) {
+    headers->etag[0] = '\0';
+    headers->last_modified[0] = '\0';
+    headers->retry_after_ms = -1;
+}
+
+size_t registry_read_header(char *buffer, size_t size, size_t nitems, void *userp) {
+    RegistryHeaders *headers = userp;
+    size_t len = size * nitems;
+    char line[256];
+    size_t copy = len < sizeof(line) - 1 ? len : sizeof(line) - 1;
+    memcpy(line, buffer, copy);
+    line[copy] = '\0';
+    line[strcspn(line, "\r\n")] = '\0';
+    if (strncmp(line, "HTTP/", 5) == 0) {
+        registry_headers_reset(headers);
+    } else if (strncasecmp(line, "ETag:", 5) == 0) {
+        snprintf(headers->etag, sizeof(headers->etag), "%s", line + 5 + strspn(line + 5, " \t"));
+    } else if (strncasecmp(line, "Last-Modified:", 14) == 0) {
+        snprintf(headers->last_modified, sizeof(headers->last_modified), "%s", line + 14 + strspn(line + 14, " \t"));
+    } else if (strncasecmp(line, "Retry-After:", 12) == 0) {
+        headers->retry_after_ms = sched_parse_retry_after(line + 12);
+    }
+    return len;
+}
+
+const char *registry_validator(const RegistryHeaders *headers) {
+    return headers->etag[0] ? headers->etag : headers->last_modified;
+}
+
+int registry_body_append(RegistryBody *body, const void *data, size_t len, size_t expected) {
+    if (body->size + len + 1 > body->capacity) {
+        size_t capacity = body->capacity * 2;
+        if (expected + 1 > capacity) {
+            capacity = expected + 1;
+        }
+        if (capacity < body->size + len + 1) {
+            capacity = body->size + len + 1;
+        }
+        char *grown = realloc(body->data, capacity);
+        if (grown == NULL) {
+            return -1;
+        }
+        body->data = grown;
+        body->capacity = capacity;
+    }
+    memcpy(body->data + body->size, data, len);
+    body->size += len;
+    body->data[body->size] = '\0';
+    return 0;
+}
+
+size_t registry_write_body(void *contents, size_t size, size_t nmemb, void *userp) {
+    return registry_body_append(userp, contents, size * nmemb, 0) == 0 ? size * nmemb : 0;
+}
+
+static Attempt *new_attempt() {
+    Attempt *attempt = spare_attempts;
+    if (attempt != NULL) {
+        spare_attempts = attempt->next_spare;
+        memset(attempt, 0, sizeof(*attempt));
+    } else {
+        attempt = calloc(1, sizeof(*attempt));
+    }
+    if (attempt != NULL) {
+        registry_headers_reset(&attempt->response_headers);
+    }
+    return attempt;
+}
+
+static void recycle_attempt(Attempt *attempt) {
+    attempt->next_spare = spare_attempts;
+    spare_attempts = attempt;
+}
+
+static int start_attempt(Attempt *attempt, const char *url, const char *path, size_t index, Resume *resume,
+                         const char *validator) {
+    CURLM *handle = get_multi();
+    if (path == NULL && index == 1 && resume->offset > 0) {
+        // The buffer moves to the attempt, finish_try() hands it back if this try drops too
+        attempt->body.data = resume->data;
+        attempt->body.capacity = resume->capacity;
+        attempt->body.size = resume->offset;
+        attempt->offset = resume->offset;
+        resume->data = NULL;
+    } else if (path != NULL && index == 1 && resume->offset > 0) {
+        // Only the first attempt resumes, hedged ones start from zero in their own part file
+        snprintf(attempt->part_path, sizeof(attempt->part_path), "%s", resume->part_path);
+        attempt->fp = fopen(attempt->part_path, "ab");
+        attempt->offset = resume->offset;
+        if (attempt->fp == NULL) {
+            perror(attempt->part_path);
+            return -1;
+        }
+    } else if (path != NULL) {
+        snprintf(attempt->part_path, sizeof(attempt->part_path), "%s.part%zu", path, index);
+        attempt->fp = fopen(attempt->part_path, "wb");
+        if (attempt->fp == NULL) {
+            perror(attempt->part_path);
+            return -1;
+        }
+    }
+    attempt->easy = curl_easy_init();
+    if (attempt->easy == NULL) {
+        return -1;
+    }
+    snprintf(attempt->url, sizeof(attempt->url), "%s", url);
+    const char *proxy = registry_config()->proxy;
+    if (proxy[0] != '\0' && (strncmp(url, "http://", 7) == 0 || strncmp(url, "https://", 8) == 0)) {
+        // Absolute-form request to the kpm proxy, unlike CURLOPT_PROXY this doesn't
+        // tunnel https so the proxy can cache it
+        curl_easy_setopt(attempt->easy, CURLOPT_URL, proxy);
+        curl_easy_setopt(attempt->easy, CURLOPT_REQUEST_TARGET, attempt->url);
+    } else {
+        curl_easy_setopt(attempt->easy, CURLOPT_URL, attempt->url);
+    }
+    curl_easy_setopt(attempt->easy, CURLOPT_WRITEFUNCTION, write_attempt);
+    curl_easy_setopt(attempt->easy, CURLOPT_WRITEDATA, attempt);
+    curl_easy_setopt(attempt->easy, CURLOPT_PRIVATE, attempt);
+    curl_easy_setopt(attempt->easy, CURLOPT_HEADERFUNCTION, registry_read_header);
+    curl_easy_setopt(attempt->easy, CURLOPT_HEADERDATA, &attempt->response_headers);
+    if (attempt->offset > 0) {
+        // CURLOPT_RANGE rather than RESUME_FROM, which fails outright on a 200
+        char range[64];
+        char if_range[160];
+        snprintf(range, sizeof(range), "%zu-", attempt->offset);
+        snprintf(if_range, sizeof(if_range), "If-Range: %s", resume->validator);
+        attempt->headers = curl_slist_append(NULL, if_range);
+        curl_easy_setopt(attempt->easy, CURLOPT_RANGE, range);
+        curl_easy_setopt(attempt->easy, CURLOPT_HTTPHEADER, attempt->headers);
+    } else if (validator != NULL && validator[0] != '\0') {
+        // Resumed tries skip this, they already know the object changed
+        char condition[200];
+        int etag = validator[0] == '"' || strncmp(validator, "W/", 2) == 0;
+        snprintf(condition, sizeof(condition), "%s: %s", etag ? "If-None-Match" : "If-Modified-Since", validator);
+        attempt->headers = curl_slist_append(NULL, condition);
+        curl_easy_setopt(attempt->easy, CURLOPT_HTTPHEADER, attempt->headers);
+    }
+    trace_begin(&attempt->span, "fetch", attempt->url);
+    attempt->start_us = now_us();
+    attempt->active = 1;
+    curl_multi_add_handle(handle, attempt->easy);
+    return 0;
+}
+
+static void finish_attempt(Attempt *attempt) {
+    if (attempt->easy == NULL) {
+        return;
+    }
+    curl_multi_remove_handle(multi, attempt->easy);
+    curl_easy_cleanup(attempt->easy);
+    curl_slist_free_all(attempt->headers);
+    attempt->headers = NULL;
+    attempt->easy = NULL;
+    attempt->active = 0;
+}
+
+static int local_transfer(const char *source, RegistryResponse *response, const char *path) {
+    TraceSpan span;
+    trace_begin(&span, "fetch", source);
+    int ret;
+    if (path != NULL) {
+        ret = local_registry_copy(source, path, &response->size);
+        response->status = ret == 0 ? 200 : 0;
+    } else {
+        ret = local_registry_get(source, response);
+    }
+    STATS_INC(STAT_REQUESTS);
+    if (ret == 0) {
+        STATS_ADD(STAT_BYTES_DOWNLOADED, response->size);
+    } else {
+        STATS_INC(STAT_REQUEST_ERRORS);
+    }
+    trace_end_detail(&span, "backend", "local");
+    return ret;
+}
+
+// Picks the answer of a try that has ended and releases everything else it started,
+// 0 when some mirror answered (status may still be >= 400)
+static int finish_try(Transfer *transfer, long long now) {
+    RegistryResponse *response = transfer->response;
+    Resume *resume = &transfer->resume;
+    Attempt *used = transfer->winner ? transfer->winner : transfer->fallback;
+    // Nobody finished: the longest body that can be validated is kept for the next try
+    Attempt *keep = NULL;
+    for (size_t i = 0; used == NULL && i < transfer->started; i++) {
+        Attempt *attempt = transfer->attempts[i];
+        int partial = (attempt->fp != NULL || attempt->body.size > 0) &&
+                      registry_validator(&attempt->response_headers)[0] &&
+                      (attempt->status == 200 || attempt->status == 206);
+        if (partial && (keep == NULL || received(attempt) > received(keep))) {
+            keep = attempt;
+        }
+    }
+    for (size_t i = 0; i < transfer->started; i++) {
+        Attempt *attempt = transfer->attempts[i];
+        if (attempt->active) {
+            // Lost the race, a slow mirror is charged what it has taken so far
+            long long elapsed_ms = (now - attempt->start_us) / 1000;
+            if (transfer->relative != NULL && elapsed_ms > latency[attempt->mirror].ewma_ms) {
+                record_latency(attempt->mirror, (double)elapsed_ms);
+            }
+            trace_end_detail(&attempt->span, "hedge", "cancelled");
+            finish_attempt(attempt);
+            sched_release(attempt->host, 0, -1, now);
+        }
+        if (attempt == keep && attempt->fp == NULL) {
+            free(resume->data);
+            resume->data = attempt->body.data;
+            resume->capacity = attempt->body.capacity;
+            resume->offset = attempt->body.size;
+            snprintf(resume->validator, sizeof(resume->validator), "%s", registry_validator(&attempt->response_headers));
+        } else if (attempt == keep) {
+            fclose(attempt->fp);
+            if (strcmp(attempt->part_path, resume->part_path) == 0 || rename(attempt->part_path, resume->part_path) == 0) {
+                resume->offset = attempt->offset + attempt->body.size;
+                snprintf(resume->validator, sizeof(resume->validator), "%s", registry_validator(&attempt->response_headers));
+            } else {
+                unlink(attempt->part_path);
+                resume->offset = 0;
+            }
+        } else if (attempt != used) {
+            free(attempt->body.data);
+            if (attempt->fp != NULL) {
+                fclose(attempt->fp);
+                unlink(attempt->part_path);
+                if (strcmp(attempt->part_path, resume->part_path) == 0) {
+                    resume->offset = 0;
+                }
+            }
+        }
+    }
+    if (transfer->path == NULL && resume->data == NULL) {
+        resume->offset = 0; // The buffer went to the response or was dropped with its attempt
+    }
+
+    int ret = 0;
+    if (used == NULL) {
+        if (transfer->last_error != CURLE_OK) {
+            fprintf(stderr, "curl_easy_perform() failed: %s\n", curl_easy_strerror(transfer->last_error));
+        }
+        ret = -1;
+    } else if (used->fp != NULL && (used->status == 304 || used->status >= 400)) {
+        // Not modified, or an error page that must not replace what path has
+        fclose(used->fp);
+        unlink(used->part_path);
+        if (strcmp(used->part_path, resume->part_path) == 0) {
+            resume->offset = 0;
+        }
+    } else if (used->fp != NULL) {
+        int failed = fclose(used->fp) != 0;
+        if (failed || rename(used->part_path, transfer->path) != 0) {
+            perror(transfer->path);
+            unlink(used->part_path);
+            ret = -1;
+        } else {
+            response->size = used->offset + used->body.size;
+        }
+    } else {
+        response->data = used->body.data ? used->body.data : calloc(1, 1);
+        response->size = used->body.size;
+    }
+    if (ret == 0) {
+        if (used->status == 206) {
+            STATS_ADD(STAT_BYTES_RESUMED, used->offset);
+        }
+        response->status = used->status == 206 ? 200 : used->status;
+        snprintf(response->validator, sizeof(response->validator), "%s", registry_validator(&used->response_headers));
+    }
+    for (size_t i = 0; i < transfer->started; i++) {
+        recycle_attempt(transfer->attempts[i]);
+    }
+    transfer->started = 0;
+    return ret;
+}
+
+// Dropped connections and overloaded servers are worth another try, anything else is not
+static int retryable(int ret, long status, CURLcode error) {
+    if (ret == 0) {
+        return status == 429 || status >= 500;
+    }
+    switch (error) {
+        case CURLE_COULDNT_RESOLVE_HOST:
+        case CURLE_COULDNT_CONNECT:
+        case CURLE_OPERATION_TIMEDOUT:
+        case CURLE_SEND_ERROR:
+        case CURLE_RECV_ERROR:
+        case CURLE_PARTIAL_FILE:
+        case CURLE_GOT_NOTHING:
+        case CURLE_HTTP2:
+        case CURLE_HTTP2_STREAM:
+        case CURLE_SSL_CONNECT_ERROR:
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+// Full jitter: anywhere from 0 to base * 2^retry, so clients that failed together spread out
+static long backoff_ms(int retry) {
+    static unsigned int seed = 0;
+    if (seed == 0) {
+        seed = (unsigned int)now_us() ^ (unsigned int)getpid();
+    }
+    long cap = RETRY_BASE_DELAY_MS << (retry < 16 ? retry : 16);
+    if (cap > RETRY_MAX_DELAY_MS) {
+        cap = RETRY_MAX_DELAY_MS;
+    }
+    return rand_r(&seed) % (cap + 1);
+}
+
+// Done, or back to waiting with a backoff that is at least what Retry-After asked for
+static void settle(Transfer *transfer, int ret, long long now) {
+    RegistryResponse *response = transfer->response;
+    Resume *resume = &transfer->resume;
+    int restart = ret == 0 && response->status == 416 && transfer->try_offset > 0;
+    if (restart) {
+        resume->offset = 0; // What we had no longer fits the object, start over
+    }
+    // The server said when to come back, which is not the same as failing
+    int throttled = ret == 0 && (response->status == 429 || (response->status == 503 && transfer->retry_after_ms >= 0));
+    int exhausted = throttled ? transfer->retries == 0 || transfer->throttled >= RETRY_THROTTLED_COUNT
+                              : transfer->retry >= transfer->retries;
+    if (exhausted || (!restart && !retryable(ret, response->status, transfer->last_error))) {
+        if (resume->part_path != NULL && resume->offset > 0 && ret != 0) {
+            unlink(resume->part_path); // Given up, nothing will resume it
+        }
+        free(resume->data);
+        free(resume->part_path);
+        memset(resume, 0, sizeof(*resume));
+        transfer->result = ret;
+        transfer->state = TRANSFER_DONE;
+        return;
+    }
+    if (ret == 0) {
+        free(response->data);
+    }
+    long delay = backoff_ms(transfer->retry);
+    if (transfer->retry_after_ms > delay) {
+        delay = transfer->retry_after_ms > SCHED_MAX_RETRY_AFTER_MS ? SCHED_MAX_RETRY_AFTER_MS : transfer->retry_after_ms;
+    }
+    fprintf(stderr, "Retrying %s in %ld ms\n", transfer->url, delay);
+    STATS_INC(STAT_RETRIES);
+    throttled ? transfer->throttled++ : transfer->retry++;
+    transfer->not_before = now + delay * 1000;
+    transfer->state = TRANSFER_WAITING;
+}
+
+static void begin_try(Transfer *transfer, long long now) {
+    RegistryResponse *response = transfer->response;
+    memset(response, 0, sizeof(*response));
+    const RegistryConfig *config = registry_config();
+
+    size_t matched_mirror = 0;
+    transfer->kind = REGISTRY_LANGS;
+    transfer->relative = config->mirror_count > 1 ? registry_match(transfer->url, &matched_mirror, &transfer->kind) : NULL;
+    const char *source = transfer->relative == NULL ? local_registry_path(transfer->url) : NULL;
+    char mirror_path[2048];
+    for (size_t i = 0; transfer->relative != NULL && source == NULL && i < config->mirror_count; i++) {
+        // A local mirror beats any network one, the others only cover files it lacks
+        const char *base = local_registry_path(config->mirrors[i].base[transfer->kind]);
+        if (base != NULL) {
+            snprintf(mirror_path, sizeof(mirror_path), "%s%s", base, transfer->relative);
+            if (access(mirror_path, R_OK) == 0) {
+                source = mirror_path;
+            }
+        }
+    }
+    transfer->last_error = CURLE_OK;
+    transfer->retry_after_ms = -1;
+    transfer->try_offset = transfer->resume.offset;
+    if (source != NULL) {
+        settle(transfer, local_transfer(source, response, transfer->path), now);
+        return;
+    }
+    transfer->candidates = 1;
+    if (transfer->relative != NULL) {
+        if (!latency_loaded) {
+            load_latency();
+        }
+        transfer->candidates = order_mirrors(transfer->order);
+    }
+    transfer->started = 0;
+    transfer->active = 0;
+    transfer->hedge_at = 0;
+    transfer->winner = NULL;
+    transfer->fallback = NULL;
+    transfer->state = TRANSFER_RUNNING;
+}
+
+// Starts whatever attempts are due, returns when it next needs looking at
+static long long advance(Transfer *transfer, long long now) {
+    const RegistryConfig *config = registry_config();
+    while (transfer->state == TRANSFER_RUNNING) {
+        int hedge_due = config->hedge && transfer->active > 0 && now >= transfer->hedge_at;
+        if (transfer->started < transfer->candidates && (transfer->active == 0 || hedge_due)) {
+            char mirror_url[2048];
+            size_t mirror = 0;
+            if (transfer->relative != NULL) {
+                mirror = transfer->order[transfer->started];
+                snprintf(mirror_url, sizeof(mirror_url), "%s%s", config->mirrors[mirror].base[transfer->kind], transfer->relative);
+            } else {
+                snprintf(mirror_url, sizeof(mirror_url), "%s", transfer->url);
+            }
+            SchedHost *host = sched_host(mirror_url);
+            long long wait = sched_acquire(host, now);
+            if (wait > 0) {
+                return now + wait;
+            }
+            Attempt *attempt = new_attempt();
+            if (attempt == NULL) {
+                sched_release(host, 0, -1, now);
+                transfer->candidates = transfer->started; // Out of memory, no more mirrors
+                continue;
+            }
+            attempt->owner = transfer;
+            attempt->host = host;
+            attempt->mirror = mirror;
+            transfer->attempts[transfer->started++] = attempt;
+            if (transfer->active > 0) {
+                STATS_INC(STAT_HEDGED_REQUESTS);
+            }
+            if (start_attempt(attempt, mirror_url, transfer->path, transfer->started, &transfer->resume,
+                              transfer->validator) == 0) {
+                transfer->active++;
+                transfer->hedge_at = now + (transfer->relative != NULL ? hedge_delay_ms(mirror) : 0) * 1000;
+            } else {
+                sched_release(host, 0, -1, now);
+            }
+            continue;
+        }
+        if (transfer->active == 0) {
+            settle(transfer, finish_try(transfer, now), now);
+            break;
+        }
+        return config->hedge && transfer->started < transfer->candidates ? transfer->hedge_at : LLONG_MAX;
+    }
+    return transfer->state == TRANSFER_WAITING ? transfer->not_before : LLONG_MAX;
+}
+
+static void attempt_done(Attempt *attempt, CURLcode res, long long now) {
+    Transfer *transfer = attempt->owner;
+    long status = 0;
+    curl_easy_getinfo(attempt->easy, CURLINFO_RESPONSE_CODE, &status);
+    attempt->status = status;
+    trace_end_curl(&attempt->span, attempt->easy, res);
+    STATS_REQUEST(attempt->easy, res);
+    sched_release(attempt->host, res == CURLE_OK ? status : 0, attempt->response_headers.retry_after_ms, now);
+    if (attempt->response_headers.retry_after_ms > transfer->retry_after_ms) {
+        transfer->retry_after_ms = attempt->response_headers.retry_after_ms;
+    }
+    transfer->active--;
+
+    if (res == CURLE_OK && status < 500) {
+        if (transfer->relative != NULL) {
+            record_latency(attempt->mirror, (now - attempt->start_us) / 1000.0);
+        }
+        if (status < 400) {
+            transfer->winner = attempt;
+        } else if (transfer->fallback == NULL) {
+            transfer->fallback = attempt; // Maybe another mirror has it
+        }
+    } else {
+        if (res != CURLE_OK) {
+            transfer->last_error = res; // Only reported if no other mirror answers
+        }
+        if (transfer->relative != NULL) {
+            record_failure(attempt->mirror);
+        }
+        if (transfer->fallback == NULL && res == CURLE_OK) {
+            transfer->fallback = attempt;
+        }
+    }
+    finish_attempt(attempt);
+    if (transfer->winner != NULL) {
+        settle(transfer, finish_try(transfer, now), now);
+    } else if (transfer->started < transfer->candidates) {
+        transfer->hedge_at = 0; // Fail over to the next mirror right away
+    }
+}
+
+// -1 if it could not be set up, the transfer is then already done
+static int init_transfer(Transfer *transfer, const RegistryRequest *request, RegistryResponse *response, int retries) {
+    const char *path = request->path;
+    memset(transfer, 0, sizeof(*transfer));
+    transfer->url = request->url;
+    transfer->path = path;
+    transfer->validator = request->validator;
+    transfer->priority = request->priority;
+    transfer->response = response;
+    transfer->retries = retries;
+    if (path != NULL) {
+        size_t size = strlen(path) + sizeof(".part");
+        transfer->resume.part_path = malloc(size);
+        if (transfer->resume.part_path == NULL) {
+            fprintf(stderr, "Failed to allocate memory\n");
+            transfer->result = -1;
+            transfer->state = TRANSFER_DONE;
+            return -1;
+        }
+        snprintf(transfer->resume.part_path, size, "%s.part", path);
+    }
+    return 0;
+}
+
+static int retry_count() {
+    const char *env = getenv("KPM_RETRIES");
+    return env && env[0] != '\0' ? atoi(env) : RETRY_DEFAULT_COUNT;
+}
+
+// Runs requests to completion on the shared multi handle, TRANSFER_WINDOW of them
+// at a time so a long list costs no more memory than a short one. Requests enter the
+// window in priority order and higher priorities get first pick of each host's slots
+static void run_transfers(RegistryRequest *requests, size_t count) {
+    AllocPhase phase = alloc_phase_enter(ALLOC_PHASE_FETCH);
+    size_t window = count < TRANSFER_WINDOW ? count : TRANSFER_WINDOW;
+    Transfer *transfers = calloc(window, sizeof(Transfer));
+    size_t *order = malloc(count * sizeof(size_t));
+    size_t *owner = malloc(window * sizeof(size_t)); // Request index of each slot
+    if (transfers == NULL || order == NULL || owner == NULL) {
+        fprintf(stderr, "Failed to allocate memory\n");
+        for (size_t i = 0; i < count; i++) {
+            requests[i].result = -1;
+        }
+        free(transfers);
+        free(order);
+        free(owner);
+        alloc_phase_leave(phase);
+        return;
+    }
+    size_t ordered = 0;
+    for (int priority = 0; priority < REQUEST_PRIORITY_COUNT; priority++) {
+        for (size_t i = 0; i < count; i++) {
+            if (requests[i].priority == (RequestPriority)priority) {
+                order[ordered++] = i;
+            }
+        }
+    }
+    for (size_t i = 0; i < count; i++) {
+        if (requests[i].priority >= REQUEST_PRIORITY_COUNT) {
+            order[ordered++] = i; // Out of range, treated as the lowest
+        }
+    }
+    int retries = retry_count();
+    size_t next = 0;
+    size_t busy = 0;
+    for (size_t i = 0; i < window; i++) {
+        owner[i] = SIZE_MAX;
+    }
+
+    while (1) {
+        long long now = now_us();
+        long long wake = now + 1000000;
+        for (size_t i = 0; i < window; i++) {
+            Transfer *transfer = &transfers[i];
+            if (owner[i] != SIZE_MAX && transfer->state == TRANSFER_DONE) {
+                requests[owner[i]].result = transfer->result;
+                owner[i] = SIZE_MAX;
+                busy--;
+            }
+            if (owner[i] == SIZE_MAX && next < count) {
+                RegistryRequest *request = &requests[order[next]];
+                owner[i] = order[next++];
+                busy++;
+                init_transfer(transfer, request, &request->response, retries);
+            }
+        }
+        if (busy == 0) {
+            break;
+        }
+        for (int priority = 0; priority <= REQUEST_PRIORITY_COUNT; priority++) {
+            for (size_t i = 0; i < window; i++) {
+                Transfer *transfer = &transfers[i];
+                int level = transfer->priority < REQUEST_PRIORITY_COUNT ? (int)transfer->priority : REQUEST_PRIORITY_COUNT;
+                if (owner[i] == SIZE_MAX || level != priority || transfer->state == TRANSFER_DONE) {
+                    continue;
+                }
+                if (transfer->state == TRANSFER_WAITING && now >= transfer->not_before) {
+                    begin_try(transfer, now);
+                }
+                long long at = transfer->state == TRANSFER_RUNNING ? advance(transfer, now) : transfer->not_before;
+                if (transfer->state == TRANSFER_DONE) {
+                    wake = now; // Its slot can take the next request
+                } else if (at < wake) {
+                    wake = at;
+                }
+            }
+        }
+
+        if (multi == NULL) {
+            // Only local sources so far, which finish as they start, nothing to wait on but retries
+            long long wait_us = wake - now_us();
+            if (wait_us > 0) {
+                struct timespec ts = {wait_us / 1000000, (wait_us % 1000000) * 1000};
+                nanosleep(&ts, NULL);
+            }
+            continue;
+        }
+        int running;
+        curl_multi_perform(multi, &running);
+        CURLMsg *msg;
+        int queued;
+        int finished = 0;
+        while ((msg = curl_multi_info_read(multi, &queued)) != NULL) {
+            if (msg->msg != CURLMSG_DONE) {
+                continue;
+            }
+            Attempt *attempt;
+            curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char **)&attempt);
+            attempt_done(attempt, msg->data.result, now_us());
+            finished = 1;
+        }
+        if (finished) {
+            continue; // Freed slots can go to the next transfer straight away
+        }
+        long long wait_ms = (wake - now_us()) / 1000;
+        if (wait_ms > 0) {
+            curl_multi_poll(multi, NULL, 0, wait_ms > 1000 ? 1000 : (int)wait_ms, NULL);
+        }
+    }
+    free(transfers);
+    free(order);
+    free(owner);
+    alloc_phase_leave(phase);
+}
+
+int registry_fetch_all(RegistryRequest *requests, size_t count) {
+    if (count == 0) {
+        return 0;
+    }
+    run_transfers(requests, count);
+    for (size_t i = 0; i < count; i++) {
+        if (requests[i].result != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int registry_get(const char *url, RegistryResponse *response) {
+    RegistryRequest request = {.url = url, .priority = REQUEST_CRITICAL};
+    run_transfers(&request, 1);
+    *response = request.response;
+    return request.result;
+}
+
+int registry_get_file(const char *url, const char *path, long *status) {
+    RegistryRequest request = {.url = url, .path = path, .priority = REQUEST_CRITICAL};
+    run_transfers(&request, 1);
+    if (status != NULL) {
+        *status = request.response.status;
+    }
+    return request.result;
+}
@@ -0,0 +1,83 @@
+#ifndef __TRANSFER__H
+#define __TRANSFER__H
+#include <stddef.h>
+#include <curl/curl.h>
+#include "scheduler.h"
+
+// Registry urls (see registry.h) are sent to the fastest healthy mirror by EWMA
+// latency. If it has not answered after its p95 latency, a hedged duplicate goes to
+// the next mirror and whichever answers first wins. Other urls are fetched as is.
+// Connection failures, 429 and 5xx are retried with exponential backoff and jitter,
+// never sooner than a Retry-After asks. Being throttled does not use up the retries. Every request goes through the per-host
+// limits in scheduler.h, registry_fetch_all() runs many at once.
+#define LATENCY_SAMPLES 32
+#define LATENCY_EWMA_ALPHA 0.2
+#define MIRROR_FAILURE_LIMIT 3          // Consecutive failures before a mirror is skipped
+#define MIRROR_COOLDOWN (5 * 60)        // Seconds a failing mirror is skipped for
+#define HEDGE_DEFAULT_DELAY_MS 250      // Until a mirror has latency samples
+#define HEDGE_MIN_DELAY_MS 20
+#define HEDGE_MAX_DELAY_MS 2000
+#define RETRY_DEFAULT_COUNT 4         // Retries after the first try, KPM_RETRIES overrides it
+#define RETRY_BASE_DELAY_MS 250       // Backoff doubles from here, with full jitter
+#define RETRY_MAX_DELAY_MS 8000
+#define RETRY_THROTTLED_COUNT 16      // 429s and 503s with Retry-After, on top of the retries above
+#define TRANSFER_WINDOW 64            // Requests registry_fetch_all() has set up at once
+#define LATENCY_CACHE_DIR "registry"
+#define LATENCY_CACHE_NAME "latency"
+
+typedef struct {
+    char *data;   // NUL terminated, owned by the caller
+    size_t size;
+    long status;  // HTTP status of the response that was used
+    char validator[128]; // Its ETag, or failing that Last-Modified, empty without either
+} RegistryResponse;
+
+// 0 when some mirror answered (status may still be >= 400), -1 if none could be reached
+int registry_get(const char *url, RegistryResponse *response);
+// Streams the body to path instead, hedged attempts write to their own part files and
+// the winner is renamed into place. An error response (status >= 400) leaves path as it
+// was. A retry picks up where a dropped transfer stopped
+// with Range/If-Range, appending to <path>.part. status may be NULL
+int registry_get_file(const char *url, const char *path, long *status);
+
+typedef struct {
+    const char *url;
+    const char *path;            // Streams to this file when set, otherwise buffers into response
+    RequestPriority priority;
+    RegistryResponse response;   // data stays NULL for file requests
+    int result;                  // As registry_get's return value
+    const char *validator;       // From an earlier response, sent as If-None-Match (or If-Modified-Since for
+                                 // a date). Unchanged objects then come back 304 with no body, and a file
+                                 // request leaves path alone. Local registries always answer 200
+} RegistryRequest;
+
+// Fetches all of requests concurrently, as registry_get/registry_get_file would one by
+// one, and fills in each response and result. -1 if any of them failed
+int registry_fetch_all(RegistryRequest *requests, size_t count);
+
+// curl callbacks for the transfer layer and for kpm mirror and kpm proxy, which drive
+// their own handles. Each status line (a redirect's, a 100's) clears the headers, so
+// they end up the final response's
+typedef struct {
+    char etag[128];       // Empty without one
+    char last_modified[64];
+    long retry_after_ms;  // From Retry-After, -1 without one
+} RegistryHeaders;
+
+// A body buffered in memory, NUL terminated
+typedef struct {
+    char *data;
+    size_t size;
+    size_t capacity;
+} RegistryBody;
+
+void registry_headers_reset(RegistryHeaders *headers);
+// CURLOPT_HEADERFUNCTION, with a RegistryHeaders as CURLOPT_HEADERDATA
+size_t registry_read_header(char *buffer, size_t size, size_t nitems, void *userp);
+// The ETag, or failing that Last-Modified, empty without either
+const char *registry_validator(const RegistryHeaders *headers);
+// Grows to expected + 1 (the Content-Length, 0 when unknown) or by doubling. -1 if out of memory
+int registry_body_append(RegistryBody *body, const void *data, size_t len, size_t expected);
+// CURLOPT_WRITEFUNCTION, with a RegistryBody as CURLOPT_WRITEDATA
+size_t registry_write_body(void *contents, size_t size, size_t nmemb, void *userp);
+#endif //__TRANSFER__H
@@ -8,8 +8,8 @@
 #include <libgen.h>
 #include <dirent.h>
 #include "errno.h"
+#include "../trace/trace.h"
 
-char* get_lang();
 int try_make()
 {
     FILE *makefile_fp = fopen("makefile","r");
@@ -34,15 +34,17 @@ int run_project()
 {
    if(try_make() == 0)
    {
-    if(system("make") == 0)
+    if(trace_system("make") == 0)
     {
-        system("make run");
+        return trace_system("make run") == 0 ? 0 : 1;
     }
     else
     {
-        printf("Error running with make");
+        printf("Error running with make\n");
+        return 1;
     }
     
    }
-   return 0;
+   fprintf(stderr, "No makefile in this directory\n");
+   return 1;
 }
\ No newline at end of file
@@ -0,0 +1,267 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include "stats.h"
+
+typedef struct {
+    const char *name; // Prometheus metric name, the same for the TYPE line and the samples
+    const char *label; // Text summary
+    const char *help;
+} StatInfo;
+
+static const StatInfo stat_info[STAT_COUNT] = {
+    [STAT_REQUESTS] = {"kpm_requests_total", "requests", "HTTP requests made"},
+    [STAT_REQUEST_ERRORS] = {"kpm_request_errors_total", "request errors", "HTTP requests that failed or returned >= 400"},
+    [STAT_HEDGED_REQUESTS] = {"kpm_hedged_requests_total", "hedged requests", "Duplicate requests sent to another mirror"},
+    [STAT_RETRIES] = {"kpm_retries_total", "retries", "Requests tried again after a transient failure"},
+    [STAT_BYTES_RESUMED] = {"kpm_resumed_bytes_total", "bytes resumed", "Bytes a Range request did not have to fetch again"},
+    [STAT_THROTTLED] = {"kpm_throttled_total", "throttled", "429 or 503 responses that closed a host for a while"},
+    [STAT_BYTES_DOWNLOADED] = {"kpm_downloaded_bytes_total", "bytes downloaded", "Response body bytes received"},
+    [STAT_CACHE_HITS] = {"kpm_cache_hits_total", "cache hits", "Lookups served from the local cache"},
+    [STAT_CACHE_MISSES] = {"kpm_cache_misses_total", "cache misses", "Lookups that had to go to the registry"},
+    [STAT_JSON_BYTES_PARSED] = {"kpm_json_parsed_bytes_total", "JSON bytes parsed", "Bytes of JSON parsed or indexed"},
+    [STAT_FILES_WRITTEN] = {"kpm_files_written_total", "files written", "Files created or overwritten"},
+    [STAT_PROCESSES_SPAWNED] = {"kpm_processes_spawned_total", "processes spawned", "Commands run through system()"},
+};
+
+#ifdef KPM_STATS
+_Atomic unsigned long long kpm_stats[STAT_COUNT];
+
+void stats_record_request(CURL *curl, CURLcode res) {
+    curl_off_t bytes = 0;
+    long status = 0;
+    curl_easy_getinfo(curl, CURLINFO_SIZE_DOWNLOAD_T, &bytes);
+    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &status);
+    STATS_INC(STAT_REQUESTS);
+    STATS_ADD(STAT_BYTES_DOWNLOADED, bytes);
+    if (res != CURLE_OK || status >= 400) {
+        STATS_INC(STAT_REQUEST_ERRORS);
+    }
+}
+#endif
+
+static char *stats_command = NULL;
+static char *stats_path = NULL;
+static int stats_active = 0;
+
+unsigned long long stats_get(StatCounter counter) {
+#ifdef KPM_STATS
+    return atomic_load_explicit(&kpm_stats[counter], memory_order_relaxed);
+#else
+    (void)counter;
+    return 0;
+#endif
+}
+
+int stats_start(const char *command, const char *path) {
+#ifndef KPM_STATS
+    (void)command;
+    (void)path;
+    fprintf(stderr, "--stats is not available, kpm was built with STATS=0\n");
+    return -1;
+#else
+    if (path != NULL && path[0] == '\0') {
+        fprintf(stderr, "--stats= needs a file name, e.g. --stats=kpm.prom\n");
+        return -1;
+    }
+    stats_command = strdup(command ? command : "none");
+    if (stats_command == NULL) {
+        return -1;
+    }
+    stats_path = path ? strdup(path) : NULL;
+    stats_active = 1;
+    atexit(stats_finish);
+    return 0;
+#endif
+}
+
+typedef struct {
+    int stat;
+    char *command;
+    unsigned long long value;
+} StatsSample;
+
+static void write_label_value(FILE *out, const char *value) {
+    for (const char *p = value; *p; p++) {
+        if (*p == '\\' || *p == '"') {
+            fprintf(out, "\\%c", *p);
+        } else if (*p == '\n') {
+            fputs("\\n", out);
+        } else {
+            fputc(*p, out);
+        }
+    }
+}
+
+static int write_samples(FILE *out, const StatsSample *samples, size_t count) {
+    for (int i = 0; i < STAT_COUNT; i++) {
+        fprintf(out, "# HELP %s %s\n", stat_info[i].name, stat_info[i].help);
+        fprintf(out, "# TYPE %s counter\n", stat_info[i].name);
+        for (size_t j = 0; j < count; j++) {
+            if (samples[j].stat == i) {
+                fprintf(out, "%s{command=\"", stat_info[i].name);
+                write_label_value(out, samples[j].command);
+                fprintf(out, "\"} %llu\n", samples[j].value);
+            }
+        }
+    }
+    return ferror(out) ? -1 : 0;
+}
+
+int stats_write(FILE *out, StatsFormat format) {
+    if (format == STATS_TEXT) {
+        for (int i = 0; i < STAT_COUNT; i++) {
+            fprintf(out, "%-20s %llu\n", stat_info[i].label, stats_get(i));
+        }
+        return ferror(out) ? -1 : 0;
+    }
+    StatsSample samples[STAT_COUNT];
+    for (int i = 0; i < STAT_COUNT; i++) {
+        samples[i].stat = i;
+        samples[i].command = stats_command ? stats_command : "none";
+        samples[i].value = stats_get(i);
+    }
+    return write_samples(out, samples, STAT_COUNT);
+}
+
+// One sample line as write_samples writes it, -1 for comments and anything else
+static int parse_sample(char *line, StatsSample *sample) {
+    char *brace = strstr(line, "{command=\"");
+    if (brace == NULL) {
+        return -1;
+    }
+    sample->stat = -1;
+    for (int i = 0; i < STAT_COUNT; i++) {
+        if ((size_t)(brace - line) == strlen(stat_info[i].name) && strncmp(line, stat_info[i].name, brace - line) == 0) {
+            sample->stat = i;
+        }
+    }
+    // Unescaped in place, the value is never longer than its escaped form
+    char *in = brace + strlen("{command=\"");
+    char *value = in;
+    char *out = in;
+    while (*in != '\0' && *in != '"') {
+        if (*in == '\\' && in[1] != '\0') {
+            in++;
+            *out++ = *in == 'n' ? '\n' : *in;
+        } else {
+            *out++ = *in;
+        }
+        in++;
+    }
+    if (sample->stat < 0 || strncmp(in, "\"} ", 3) != 0) {
+        return -1;
+    }
+    *out = '\0';
+    sample->command = value;
+    sample->value = strtoull(in + 3, NULL, 10);
+    return 0;
+}
+
+// Every run adds to the file's samples for its command, so a node_exporter textfile
+// collector scraping between CI jobs sees counters that only go up. Runs that finish
+// at the same time take turns on <path>.lock, the file itself is replaced by rename
+// so a collector never reads half of it
+static int write_prometheus(const char *path) {
+    char lock_path[4096];
+    char tmp_path[4096];
+    snprintf(lock_path, sizeof(lock_path), "%s.lock", path);
+    snprintf(tmp_path, sizeof(tmp_path), "%s.%d.tmp", path, (int)getpid());
+    int lock = open(lock_path, O_RDWR | O_CREAT, 0644);
+    if (lock == -1 || flock(lock, LOCK_EX) != 0) {
+        perror("Error locking stats");
+        if (lock != -1) {
+            close(lock);
+        }
+        return -1;
+    }
+
+    StatsSample *samples = NULL;
+    size_t count = 0;
+    char *lines = NULL;
+    size_t lines_size = 0;
+    FILE *in = fopen(path, "r");
+    if (in != NULL) {
+        // Kept whole, the samples' command strings point into it
+        FILE *all = open_memstream(&lines, &lines_size);
+        char chunk[4096];
+        size_t n;
+        while (all != NULL && (n = fread(chunk, 1, sizeof(chunk), in)) > 0) {
+            fwrite(chunk, 1, n, all);
+        }
+        if (all != NULL) {
+            fclose(all);
+        }
+        fclose(in);
+    }
+    char *saveptr = NULL;
+    for (char *line = lines ? strtok_r(lines, "\n", &saveptr) : NULL; line; line = strtok_r(NULL, "\n", &saveptr)) {
+        StatsSample sample;
+        if (parse_sample(line, &sample) != 0) {
+            continue;
+        }
+        StatsSample *grown = realloc(samples, (count + 1) * sizeof(StatsSample));
+        if (grown == NULL) {
+            break;
+        }
+        samples = grown;
+        samples[count++] = sample;
+    }
+    const char *command = stats_command ? stats_command : "none";
+    for (int i = 0; i < STAT_COUNT; i++) {
+        StatsSample *sample = NULL;
+        for (size_t j = 0; j < count && sample == NULL; j++) {
+            if (samples[j].stat == i && strcmp(samples[j].command, command) == 0) {
+                sample = &samples[j];
+            }
+        }
+        if (sample == NULL) {
+            StatsSample *grown = realloc(samples, (count + 1) * sizeof(StatsSample));
+            if (grown == NULL) {
+                continue;
+            }
+            samples = grown;
+            sample = &samples[count++];
+            sample->stat = i;
+            sample->command = (char *)command;
+            sample->value = 0;
+        }
+        sample->value += stats_get(i);
+    }
+
+    int result = -1;
+    FILE *out = fopen(tmp_path, "w");
+    if (out != NULL) {
+        result = write_samples(out, samples, count);
+        if (fclose(out) != 0 || result != 0 || rename(tmp_path, path) != 0) {
+            unlink(tmp_path);
+            result = -1;
+        }
+    }
+    if (result != 0) {
+        perror("Error writing stats");
+    }
+    free(samples);
+    free(lines);
+    close(lock);
+    return result;
+}
+
+void stats_finish() {
+    if (!stats_active) {
+        return;
+    }
+    stats_active = 0;
+    if (stats_path == NULL) {
+        fprintf(stderr, "\nkpm %s stats:\n", stats_command);
+        stats_write(stderr, STATS_TEXT);
+    } else {
+        write_prometheus(stats_path);
+    }
+    free(stats_command);
+    free(stats_path);
+    stats_command = stats_path = NULL;
+}
@@ -0,0 +1,53 @@
+#ifndef __STATS__H
+#define __STATS__H
+#include <stdio.h>
+#include <curl/curl.h>
+
+// Process-wide counters dumped by --stats. Built in with -DKPM_STATS (make STATS=1,
+// the default); with STATS=0 every STATS_* macro compiles to nothing.
+typedef enum {
+    STAT_REQUESTS,
+    STAT_REQUEST_ERRORS,
+    STAT_HEDGED_REQUESTS,
+    STAT_RETRIES,
+    STAT_BYTES_RESUMED,
+    STAT_THROTTLED,
+    STAT_BYTES_DOWNLOADED,
+    STAT_CACHE_HITS,
+    STAT_CACHE_MISSES,
+    STAT_JSON_BYTES_PARSED,
+    STAT_FILES_WRITTEN,
+    STAT_PROCESSES_SPAWNED,
+    STAT_COUNT
+} StatCounter;
+
+#ifdef KPM_STATS
+#include <stdatomic.h>
+
+extern _Atomic unsigned long long kpm_stats[STAT_COUNT];
+
+// Counters are independent totals, nothing is ordered against them
+#define STATS_ADD(counter, n) \
+    atomic_fetch_add_explicit(&kpm_stats[(counter)], (unsigned long long)(n), memory_order_relaxed)
+#define STATS_INC(counter) STATS_ADD(counter, 1)
+#define STATS_REQUEST(curl, res) stats_record_request((curl), (res))
+
+void stats_record_request(CURL *curl, CURLcode res);
+#else
+#define STATS_ADD(counter, n) ((void)0)
+#define STATS_INC(counter) ((void)0)
+#define STATS_REQUEST(curl, res) ((void)0)
+#endif
+
+typedef enum {
+    STATS_TEXT,
+    STATS_PROMETHEUS // Text exposition format, as node_exporter's textfile collector reads it
+} StatsFormat;
+
+// path NULL prints text to stderr at exit, otherwise the counts are added to the Prometheus
+// textfile there, one sample per command
+int stats_start(const char *command, const char *path);
+unsigned long long stats_get(StatCounter counter);
+int stats_write(FILE *out, StatsFormat format);
+void stats_finish();
+#endif //__STATS__H
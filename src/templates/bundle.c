@@ -0,0 +1,464 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <ctype.h>
+#include <zlib.h>
+#include <jansson.h>
+#include "bundle.h"
+#include "../cache/cache.h"
+#include "../registry/transfer.h"
+#include "../trace/trace.h"
+
+static uint32_t get_u32(const unsigned char *p) {
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static uint64_t get_u64(const unsigned char *p) {
+    return (uint64_t)get_u32(p) | (uint64_t)get_u32(p + 4) << 32;
+}
+
+static void put_u32(unsigned char *p, uint32_t value) {
+    for (int i = 0; i < 4; i++) {
+        p[i] = (unsigned char)(value >> (8 * i));
+    }
+}
+
+static void put_u64(unsigned char *p, uint64_t value) {
+    put_u32(p, (uint32_t)value);
+    put_u32(p + 4, (uint32_t)(value >> 32));
+}
+
+// gzip or zlib, whichever the bundle was written with
+static int inflate_all(const char *data, size_t size, char **out, size_t *out_size) {
+    z_stream stream;
+    memset(&stream, 0, sizeof(stream));
+    if (inflateInit2(&stream, 15 + 32) != Z_OK) {
+        return -1;
+    }
+    size_t capacity = size * 4 + 4096;
+    if (capacity > BUNDLE_MAX_SIZE) {
+        capacity = BUNDLE_MAX_SIZE;
+    }
+    char *buffer = malloc(capacity);
+    stream.next_in = (Bytef *)data;
+    stream.avail_in = (uInt)size;
+    int ret = Z_OK;
+    while (buffer != NULL && ret == Z_OK) {
+        if (stream.total_out == capacity) {
+            if (capacity == BUNDLE_MAX_SIZE) {
+                break;
+            }
+            capacity = capacity * 2 > BUNDLE_MAX_SIZE ? BUNDLE_MAX_SIZE : capacity * 2;
+            char *grown = realloc(buffer, capacity);
+            if (grown == NULL) {
+                break;
+            }
+            buffer = grown;
+        }
+        stream.next_out = (Bytef *)buffer + stream.total_out;
+        stream.avail_out = (uInt)(capacity - stream.total_out);
+        ret = inflate(&stream, Z_NO_FLUSH);
+    }
+    size_t total = stream.total_out;
+    inflateEnd(&stream);
+    if (ret != Z_STREAM_END) {
+        free(buffer);
+        return -1;
+    }
+    *out = buffer;
+    *out_size = total;
+    return 0;
+}
+
+static int index_pack(TemplateBundle *bundle) {
+    const unsigned char *pack = (const unsigned char *)bundle->pack;
+    size_t size = bundle->size;
+    if (size < BUNDLE_HEADER_SIZE || memcmp(pack, BUNDLE_MAGIC, 4) != 0 || get_u32(pack + 4) != BUNDLE_FORMAT_VERSION) {
+        return -1;
+    }
+    size_t count = get_u32(pack + 8);
+    if (count > (size - BUNDLE_HEADER_SIZE) / BUNDLE_ENTRY_SIZE) {
+        return -1;
+    }
+    bundle->entries = calloc(count ? count : 1, sizeof(BundleEntry));
+    if (bundle->entries == NULL) {
+        return -1;
+    }
+    for (size_t i = 0; i < count; i++) {
+        const unsigned char *entry = pack + BUNDLE_HEADER_SIZE + i * BUNDLE_ENTRY_SIZE;
+        uint64_t path_offset = get_u32(entry);
+        uint64_t path_len = get_u32(entry + 4);
+        uint64_t data_offset = get_u64(entry + 8);
+        uint64_t data_size = get_u64(entry + 16);
+        // Both have to fit with their NUL, which is what lets them be used in place
+        if (path_offset >= size || path_len >= size - path_offset || pack[path_offset + path_len] != '\0' ||
+            data_offset >= size || data_size >= size - data_offset || pack[data_offset + data_size] != '\0') {
+            return -1;
+        }
+        BundleEntry *e = &bundle->entries[i];
+        e->path = bundle->pack + path_offset;
+        e->data = bundle->pack + data_offset;
+        e->size = data_size;
+        e->hash = get_u64(entry + 24);
+        if (i > 0 && strcmp(bundle->entries[i - 1].path, e->path) >= 0) {
+            return -1; // Unsorted, lookups would miss
+        }
+        if (hash_bytes(e->data, e->size) != e->hash) {
+            return -1;
+        }
+    }
+    bundle->count = count;
+    return 0;
+}
+
+int bundle_open(const char *data, size_t size, TemplateBundle *bundle) {
+    memset(bundle, 0, sizeof(*bundle));
+    if (inflate_all(data, size, &bundle->pack, &bundle->size) != 0 || index_pack(bundle) != 0) {
+        bundle_free(bundle);
+        return -1;
+    }
+    return 0;
+}
+
+int bundle_load(const char *url, TemplateBundle *bundle) {
+    memset(bundle, 0, sizeof(*bundle));
+    RegistryResponse response;
+    if (registry_get(url, &response) != 0) {
+        return -1;
+    }
+    int ret = -1;
+    if (response.status == 200) {
+        TraceSpan span;
+        trace_begin(&span, "parse", url);
+        ret = bundle_open(response.data, response.size, bundle);
+        trace_end(&span);
+        if (ret != 0) {
+            fprintf(stderr, "Template bundle %s is damaged, fetching its files one by one\n", url);
+        }
+    }
+    free(response.data);
+    return ret;
+}
+
+const BundleEntry *bundle_find(const TemplateBundle *bundle, const char *path) {
+    while (*path == '/') {
+        path++;
+    }
+    size_t low = 0;
+    size_t high = bundle->count;
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        int cmp = strcmp(bundle->entries[mid].path, path);
+        if (cmp == 0) {
+            return &bundle->entries[mid];
+        }
+        if (cmp < 0) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return NULL;
+}
+
+char *bundle_read(const TemplateBundle *bundle, const char *path) {
+    const BundleEntry *entry = bundle_find(bundle, path);
+    if (entry == NULL) {
+        return NULL;
+    }
+    char *copy = malloc(entry->size + 1);
+    if (copy != NULL) {
+        memcpy(copy, entry->data, entry->size + 1);
+    }
+    return copy;
+}
+
+void bundle_free(TemplateBundle *bundle) {
+    free(bundle->pack);
+    free(bundle->entries);
+    memset(bundle, 0, sizeof(*bundle));
+}
+
+// Adds langs_dir/path unless it is already there, -1 only if a required file is missing
+static int add_file(BundleFile *files, size_t *count, const char *langs_dir, const char *path, int required) {
+    if (path == NULL) {
+        return required ? -1 : 0;
+    }
+    while (*path == '/') {
+        path++;
+    }
+    for (size_t i = 0; i < *count; i++) {
+        if (strcmp(files[i].path, path) == 0) {
+            return 0;
+        }
+    }
+    char full[4096];
+    snprintf(full, sizeof(full), "%s/%s", langs_dir, path);
+    size_t size = 0;
+    char *data = read_file_data(full, &size);
+    if (data == NULL) {
+        fprintf(stderr, "%s %s: %s\n", required ? "Cannot bundle" : "Skipping", full, strerror(errno));
+        return required ? -1 : 0;
+    }
+    files[*count].path = strdup(path);
+    files[*count].data = data;
+    files[*count].size = size;
+    (*count)++;
+    return 0;
+}
+
+static int compare_files(const void *a, const void *b) {
+    return strcmp(((const BundleFile *)a)->path, ((const BundleFile *)b)->path);
+}
+
+static unsigned char *build_pack(BundleFile *files, size_t count, size_t *pack_size) {
+    size_t size = BUNDLE_HEADER_SIZE + count * BUNDLE_ENTRY_SIZE;
+    for (size_t i = 0; i < count; i++) {
+        size += strlen(files[i].path) + 1 + files[i].size + 1;
+    }
+    unsigned char *pack = calloc(1, size);
+    if (pack == NULL) {
+        return NULL;
+    }
+    memcpy(pack, BUNDLE_MAGIC, 4);
+    put_u32(pack + 4, BUNDLE_FORMAT_VERSION);
+    put_u32(pack + 8, (uint32_t)count);
+    size_t offset = BUNDLE_HEADER_SIZE + count * BUNDLE_ENTRY_SIZE;
+    for (size_t i = 0; i < count; i++) {
+        unsigned char *entry = pack + BUNDLE_HEADER_SIZE + i * BUNDLE_ENTRY_SIZE;
+        size_t path_len = strlen(files[i].path);
+        put_u32(entry, (uint32_t)offset);
+        put_u32(entry + 4, (uint32_t)path_len);
+        memcpy(pack + offset, files[i].path, path_len + 1);
+        offset += path_len + 1;
+        put_u64(entry + 8, offset);
+        put_u64(entry + 16, files[i].size);
+        put_u64(entry + 24, hash_bytes(files[i].data, files[i].size));
+        memcpy(pack + offset, files[i].data, files[i].size);
+        offset += files[i].size + 1;
+    }
+    *pack_size = size;
+    return pack;
+}
+
+int bundle_build(BundleFile *files, size_t count, TemplateBundle *bundle) {
+    memset(bundle, 0, sizeof(*bundle));
+    qsort(files, count, sizeof(BundleFile), compare_files);
+    bundle->pack = (char *)build_pack(files, count, &bundle->size);
+    if (bundle->pack == NULL || index_pack(bundle) != 0) {
+        bundle_free(bundle);
+        return -1;
+    }
+    return 0;
+}
+
+static unsigned char *gzip(const unsigned char *data, size_t size, size_t *out_size) {
+    z_stream stream;
+    memset(&stream, 0, sizeof(stream));
+    if (deflateInit2(&stream, Z_BEST_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        return NULL;
+    }
+    size_t capacity = deflateBound(&stream, (uLong)size) + 32;
+    unsigned char *out = malloc(capacity);
+    stream.next_in = (Bytef *)data;
+    stream.avail_in = (uInt)size;
+    stream.next_out = out;
+    stream.avail_out = (uInt)capacity;
+    int ret = out ? deflate(&stream, Z_FINISH) : Z_MEM_ERROR;
+    *out_size = stream.total_out;
+    deflateEnd(&stream);
+    if (ret != Z_STREAM_END) {
+        free(out);
+        return NULL;
+    }
+    return out;
+}
+
+// <dir of rel>/<lang>[-<version>]<suffix>, with anything odd in the name replaced
+static void sibling_path(const char *rel, const char *lang, const char *version, const char *suffix, char *out, size_t size) {
+    char name[512];
+    snprintf(name, sizeof(name), "%s%s%s%s", lang, version ? "-" : "", version ? version : "", suffix);
+    for (char *c = name; *c; c++) {
+        if (!isalnum((unsigned char)*c) && *c != '.' && *c != '-' && *c != '_') {
+            *c = '_';
+        }
+    }
+    while (*rel == '/') {
+        rel++;
+    }
+    const char *slash = strrchr(rel, '/');
+    snprintf(out, size, "%.*s%s%s", slash ? (int)(slash - rel) : 0, rel, slash ? "/" : "", name);
+}
+
+static json_t *build_manifest(const char *lang, const char *version, const char *lang_path, const char *bundle_ref,
+                              const BundleFile *files, size_t count) {
+    json_t *manifest = json_object();
+    json_t *listed = json_object();
+    json_object_set_new(manifest, "name", json_string(lang));
+    if (version != NULL) {
+        json_object_set_new(manifest, "template_version", json_string(version));
+    }
+    json_object_set_new(manifest, "path", json_string(lang_path));
+    json_object_set_new(manifest, "bundle", json_string(bundle_ref));
+    for (size_t i = 0; i < count; i++) {
+        char hash[17];
+        snprintf(hash, sizeof(hash), "%016llx", (unsigned long long)hash_bytes(files[i].data, files[i].size));
+        json_t *file = json_object();
+        json_object_set_new(file, "hash", json_string(hash));
+        json_object_set_new(file, "size", json_integer((json_int_t)files[i].size));
+        json_object_set_new(listed, files[i].path, file);
+    }
+    json_object_set_new(manifest, "files", listed);
+    return manifest;
+}
+
+static int write_json(const char *path, const json_t *json) {
+    char *dumped = json_dumps(json, JSON_INDENT(4));
+    char *text = dumped ? malloc(strlen(dumped) + 2) : NULL;
+    if (text != NULL) {
+        sprintf(text, "%s\n", dumped);
+    }
+    int ret = text ? write_file_atomic(path, text, strlen(text)) : -1;
+    free(text);
+    free(dumped);
+    return ret;
+}
+
+int bundle_main(int argc, char **argv) {
+    const char *langs_dir = NULL;
+    const char *lang = NULL;
+    int update_index = 0;
+    for (int i = 0; i < argc; i++) {
+        if (strcmp(argv[i], "--index") == 0) {
+            update_index = 1;
+        } else if (langs_dir == NULL) {
+            langs_dir = argv[i];
+        } else if (lang == NULL) {
+            lang = argv[i];
+        } else {
+            lang = NULL;
+            break;
+        }
+    }
+    if (langs_dir == NULL || lang == NULL) {
+        fprintf(stderr, "Usage: kpm template bundle <langs dir> <language> [--index]\n");
+        return 1;
+    }
+
+    char index_path[4096];
+    snprintf(index_path, sizeof(index_path), "%s/index.json", langs_dir);
+    json_error_t error;
+    json_t *index = json_load_file(index_path, 0, &error);
+    json_t *entry = json_object_get(json_object_get(index, "langs"), lang);
+    const char *lang_path = json_string_value(json_object_get(entry, "path"));
+    if (lang_path == NULL) {
+        fprintf(stderr, "Language '%s' is not in %s\n", lang, index_path);
+        json_decref(index);
+        return 1;
+    }
+
+    char lang_file[4096];
+    snprintf(lang_file, sizeof(lang_file), "%s/%s", langs_dir, lang_path);
+    json_t *root = json_load_file(lang_file, 0, &error);
+    if (root == NULL) {
+        fprintf(stderr, "Failed to parse %s: %s\n", lang_file, error.text);
+        json_decref(index);
+        return 1;
+    }
+    json_t *build_files = json_object_get(root, "build_file_path");
+    json_t *includes = json_object_get(root, "files_to_include");
+    size_t capacity = 3 + json_object_size(build_files) + json_array_size(includes);
+    BundleFile *files = calloc(capacity, sizeof(BundleFile));
+    if (files == NULL) {
+        fprintf(stderr, "Failed to allocate memory\n");
+        json_decref(root);
+        json_decref(index);
+        return 1;
+    }
+    size_t count = 0;
+    // The same paths create_project asks for
+    int ret = add_file(files, &count, langs_dir, lang_path, 1);
+    ret |= add_file(files, &count, langs_dir, json_string_value(json_object_get(root, "main_file_template")), 1);
+    ret |= add_file(files, &count, langs_dir, json_string_value(json_object_get(root, "git_ignore_path")), 0);
+    const char *key;
+    json_t *value;
+    json_object_foreach(build_files, key, value) {
+        (void)key;
+        ret |= add_file(files, &count, langs_dir, json_string_value(value), 0);
+    }
+    for (size_t i = 0; i < json_array_size(includes); i++) {
+        const char *include = json_string_value(json_array_get(includes, i));
+        if (include != NULL) {
+            char path[2048];
+            snprintf(path, sizeof(path), "%s/%s", lang, include);
+            ret |= add_file(files, &count, langs_dir, path, 0);
+        }
+    }
+
+    // <dir of the language json>/<lang>-<template_version>.kpmb and <lang>.manifest.json
+    const char *version = json_string_value(json_object_get(root, "template_version"));
+    char bundle_rel[2048];
+    char manifest_rel[2048];
+    sibling_path(lang_path, lang, version, BUNDLE_EXTENSION, bundle_rel, sizeof(bundle_rel));
+    sibling_path(lang_path, lang, NULL, BUNDLE_MANIFEST_SUFFIX, manifest_rel, sizeof(manifest_rel));
+    char bundle_path[4096];
+    char manifest_path[4096];
+    snprintf(bundle_path, sizeof(bundle_path), "%s/%s", langs_dir, bundle_rel);
+    snprintf(manifest_path, sizeof(manifest_path), "%s/%s", langs_dir, manifest_rel);
+    char bundle_ref[2100];
+    char manifest_ref[2100];
+    snprintf(bundle_ref, sizeof(bundle_ref), "/%s", bundle_rel);
+    snprintf(manifest_ref, sizeof(manifest_ref), "/%s", manifest_rel);
+
+    size_t pack_size = 0;
+    size_t gz_size = 0;
+    unsigned char *pack = NULL;
+    unsigned char *gz = NULL;
+    if (ret == 0) {
+        qsort(files, count, sizeof(BundleFile), compare_files);
+        pack = build_pack(files, count, &pack_size);
+        gz = pack ? gzip(pack, pack_size, &gz_size) : NULL;
+        ret = gz ? write_file_atomic(bundle_path, gz, gz_size) : -1;
+        if (ret != 0) {
+            fprintf(stderr, "Failed to write %s\n", bundle_path);
+        }
+    }
+    if (ret == 0) {
+        json_t *manifest = build_manifest(lang, version, lang_path, bundle_ref, files, count);
+        ret = write_json(manifest_path, manifest);
+        json_decref(manifest);
+        if (ret != 0) {
+            fprintf(stderr, "Failed to write %s\n", manifest_path);
+        }
+    }
+    if (ret == 0) {
+        printf("Bundled %zu files of %s (%zu bytes, %zu compressed) into %s\n", count, lang, pack_size, gz_size, bundle_path);
+        if (update_index) {
+            json_object_set_new(entry, "bundle", json_string(bundle_ref));
+            json_object_set_new(entry, "manifest", json_string(manifest_ref));
+            if (version != NULL) {
+                json_object_set_new(entry, "version", json_string(version));
+            } else {
+                json_object_del(entry, "version");
+            }
+            ret = write_json(index_path, index);
+            if (ret != 0) {
+                fprintf(stderr, "Failed to update %s\n", index_path);
+            }
+        } else {
+            printf("Add \"bundle\": \"%s\", \"manifest\": \"%s\" and \"version\" to langs.%s in %s, or rerun with --index\n",
+                   bundle_ref, manifest_ref, lang, index_path);
+        }
+    }
+    for (size_t i = 0; i < count; i++) {
+        free(files[i].path);
+        free(files[i].data);
+    }
+    free(files);
+    free(pack);
+    free(gz);
+    json_decref(root);
+    json_decref(index);
+    return ret == 0 ? 0 : 1;
+}
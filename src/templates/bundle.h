@@ -0,0 +1,66 @@
+#ifndef __BUNDLE__H
+#define __BUNDLE__H
+#include <stddef.h>
+#include <stdint.h>
+
+// A template bundle is every file a language template needs (its json, main
+// template, gitignore, build scripts and files_to_include) in one gzip'd pack, so
+// kpm init costs the index and one more request. langs/index.json points at it:
+//     {"langs": {"c": {"path": "/c/c.json", "bundle": "/c/c-1.0.0.kpmb"}}}
+// Inflated, all little endian:
+//     "KPMB", u32 format version, u32 entry count, u32 reserved
+//     per entry, sorted by path: u32 path offset, u32 path length,
+//                                u64 data offset, u64 size, u64 FNV-1a hash of the data
+//     paths and data, every path and file followed by a NUL
+// Offsets are from the start of the inflated pack, paths are relative to the
+// langs base url ("c/main.c"). Anything the bundle lacks is fetched on its own.
+// Next to the bundle goes <lang>.manifest.json, what kpm template update diffs
+// its cached copy against (see update.h):
+//     {"name": "c", "template_version": "1.0.0", "path": "/c/c.json", "bundle": "/c/c-1.0.0.kpmb",
+//      "files": {"c/c.json": {"hash": "<16 hex digits>", "size": 1234}, ...}}
+// and the index entry gains "version" and "manifest" so an unchanged template
+// costs nothing beyond the index.
+#define BUNDLE_MAGIC "KPMB"
+#define BUNDLE_FORMAT_VERSION 1
+#define BUNDLE_HEADER_SIZE 16
+#define BUNDLE_ENTRY_SIZE 32
+#define BUNDLE_EXTENSION ".kpmb"
+#define BUNDLE_MANIFEST_SUFFIX ".manifest.json"
+#define BUNDLE_MAX_SIZE (64 * 1024 * 1024) // Inflated, anything bigger is not a template
+
+typedef struct {
+    const char *path;
+    const char *data;  // NUL terminated, points into the bundle
+    size_t size;
+    uint64_t hash;
+} BundleEntry;
+
+typedef struct {
+    char *path;
+    char *data;
+    size_t size;
+} BundleFile;
+
+typedef struct {
+    char *pack;        // The inflated pack, NULL when no bundle is loaded
+    size_t size;
+    BundleEntry *entries;
+    size_t count;
+} TemplateBundle;
+
+// Fetches and inflates the bundle at url, -1 (and an empty bundle) if it is unusable
+int bundle_load(const char *url, TemplateBundle *bundle);
+// Inflates and indexes a gzip'd bundle already in memory
+int bundle_open(const char *data, size_t size, TemplateBundle *bundle);
+// An uncompressed bundle of files (sorted in place, paths must be unique), for
+// templates kept on disk rather than downloaded. files are copied
+int bundle_build(BundleFile *files, size_t count, TemplateBundle *bundle);
+const BundleEntry *bundle_find(const TemplateBundle *bundle, const char *path);
+// A malloc'd copy of path's contents, NULL if the bundle does not have it
+char *bundle_read(const TemplateBundle *bundle, const char *path);
+void bundle_free(TemplateBundle *bundle);
+// kpm template bundle <langs dir> <lang> [--index]: writes <lang dir>/<lang>-<template_version>.kpmb
+// and <lang>.manifest.json next to the language json, and with --index records them in
+// <langs dir>/index.json
+int bundle_main(int argc, char **argv);
+#endif //__BUNDLE__H
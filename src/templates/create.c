@@ -130,8 +130,17 @@ int create_template() {
     get_input("Builtin lib support true/false" ,lib_support,10);
     //TODO 
     // char *version_template_path =  "NULL";
-    char build_file_name[1024][1024];
-    char build_file_paths[1024][1024];
+    // 1 MB each, too much for the stack
+    char (*build_file_name)[1024] = calloc(1024, sizeof(*build_file_name));
+    char (*build_file_paths)[1024] = calloc(1024, sizeof(*build_file_paths));
+    char (*compiler_urls)[1024] = calloc(1024, sizeof(*compiler_urls));
+    if (!build_file_name || !build_file_paths || !compiler_urls) {
+        fprintf(stderr, "Memory allocation failed\n");
+        free(build_file_name);
+        free(build_file_paths);
+        free(compiler_urls);
+        return 0;
+    }
     // build_file_path = 
     // {    
     //      build_file_name[x]:build_file_paths[x]
@@ -153,7 +162,6 @@ int create_template() {
         build_file_count++;
 
     }
-    char compiler_urls[1024][1024];
     size_t compiler_urls_count = 0;
     for (size_t i = 0; i < 1024; i++)
     {
@@ -173,6 +181,9 @@ int create_template() {
     get_input("Please enter the template author: ",template_author,1024);
     //TODO 
     // char *git_repo = "https://github.com/KingVentrix007/CodeStarterFiles/tree/main/langs/";
+    free(build_file_name);
+    free(build_file_paths);
+    free(compiler_urls);
     
     return 1;
 }
@@ -4,6 +4,16 @@
 #include <curl/curl.h>
 #include <jansson.h>
 #include "custom.h"
+#include "snapshot.h"
+#include "bundle.h"
+#include "update.h"
+#include "../json/scanner.h"
+#include "../trace/trace.h"
+#include "../toolchain/toolchain.h"
+#include "../stats/stats.h"
+#include "../manifest/manifest.h"
+#include "../memory/alloc_profile.h"
+#include "../registry/transfer.h"
 // #include "config.h"
 #include "../curlhelp.h"
 #include <sys/stat.h>
@@ -13,10 +23,6 @@
 #include "../licence.h"
 #include "limits.h"
 #include "stdbool.h"
-struct MemoryStruct {
-    char *memory;
-    size_t size;
-};
 // Function to replace ${project_name} with the actual project name
 char *replace_placeholder(const char *path, const char *project_name) {
     const char *placeholder = "${project_name}";
@@ -25,13 +31,17 @@ char *replace_placeholder(const char *path, const char *project_name) {
 
     // Find the position of the placeholder in the path
     pos = strstr(path, placeholder);
+    AllocPhase phase = alloc_phase_enter(ALLOC_PHASE_RENDER);
     if (pos == NULL) {
         // If the placeholder is not found, return a copy of the original path
-        return strdup(path);
+        result = strdup(path);
+        alloc_phase_leave(phase);
+        return result;
     }
 
     // Allocate memory for the new path
     result = malloc(strlen(path) - strlen(placeholder) + strlen(project_name) + 1);
+    alloc_phase_leave(phase);
     if (!result) {
         perror("Error allocating memory");
         return NULL;
@@ -75,108 +85,53 @@ int create_directories(const char *full_path) {
 
     return 0;
 }
-// Callback function to write data from curl to a buffer
-static size_t WriteMemoryCallback(void *contents, size_t size, size_t nmemb, void *userp) {
-    size_t realsize = size * nmemb;
-    struct MemoryStruct *mem = (struct MemoryStruct *)userp;
-
-    char *ptr = realloc(mem->memory, mem->size + realsize + 1);
-    if(ptr == NULL) {
-        // Out of memory!
-        printf("Not enough memory (realloc returned NULL)\n");
-        return 0;
-    }
-
-    mem->memory = ptr;
-    memcpy(&(mem->memory[mem->size]), contents, realsize);
-    mem->size += realsize;
-    mem->memory[mem->size] = 0;
-
-    return realsize;
-}
-
 // Function to fetch JSON data from a URL
 char *fetch_json(const char *url) {
-    CURL *curl;
-    CURLcode res;
-    char *buffer = NULL;
-    long http_code = 0;
-    curl_global_init(CURL_GLOBAL_DEFAULT);
-    curl = curl_easy_init();
-
-    if (curl) {
-        curl_easy_setopt(curl, CURLOPT_URL, url);
-        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, WriteMemoryCallback);
-        curl_easy_setopt(curl, CURLOPT_WRITEDATA, &buffer);
-
-        res = curl_easy_perform(curl);
-        // printf("URL: %s\n", url);
-        if (res != CURLE_OK) {
-            fprintf(stderr, "curl_easy_perform() failed: %s\n", curl_easy_strerror(res));
-            free(buffer);
-            buffer = NULL;
-        }
-        curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &http_code);
-        if (http_code != 200) {
-            fprintf(stderr, "Failed to fetch data. HTTP response code: %ld\n", http_code);
-        }
-        
-        curl_easy_cleanup(curl);
+    RegistryResponse response;
+    if (registry_get(url, &response) != 0) {
+        return NULL;
+    }
+    if (response.status != 200) {
+        fprintf(stderr, "Failed to fetch data. HTTP response code: %ld\n", response.status);
     }
-
-    curl_global_cleanup();
     // printf("buffer == [%s]\n",buffer);
-    return buffer;
+    return response.data;
 }
 
-// Function to parse JSON and find the path for the given language
-const char *find_language_path(const char *lang, const char *json_data) {
-    json_error_t error;
-    json_t *root;
-    json_t *langs;
-    json_t *lang_obj;
-    json_t *path_obj;
-
-    root = json_loads(json_data, 0, &error);
-    if (!root) {
-        fprintf(stderr, "Error parsing JSON: %s\n", error.text);
+// Function to find the path for the given language without parsing the whole index,
+// and its bundle (see bundle.h) in *bundle_path when the index lists one
+char *find_language_path(const char *lang, const char *json_data, char **bundle_path) {
+    JsonScanner scanner;
+    AllocPhase phase = alloc_phase_enter(ALLOC_PHASE_PARSE);
+    if (json_scanner_init(&scanner, json_data, strlen(json_data)) != 0) {
+        fprintf(stderr, "Error indexing language index\n");
+        alloc_phase_leave(phase);
         return NULL;
     }
 
-    langs = json_object_get(root, "langs");
-    if (!json_is_object(langs)) {
-        json_decref(root);
-        fprintf(stderr, "Error: 'langs' is not an object\n");
-        return NULL;
+    const char *key_path[] = {"langs", lang, "path"};
+    char *path = json_scanner_find_string(&scanner, key_path, 3);
+    if (bundle_path != NULL) {
+        const char *bundle_key[] = {"langs", lang, "bundle"};
+        *bundle_path = path ? json_scanner_find_string(&scanner, bundle_key, 3) : NULL;
     }
-
-    lang_obj = json_object_get(langs, lang);
-    if (!json_is_object(lang_obj)) {
-        json_decref(root);
+    json_scanner_free(&scanner);
+    alloc_phase_leave(phase);
+    if (path == NULL) {
         fprintf(stderr, "Error: Language '%s' not found\n", lang);
-        return NULL;
-    }
-
-    path_obj = json_object_get(lang_obj, "path");
-    if (!json_is_string(path_obj)) {
-        json_decref(root);
-        fprintf(stderr, "Error: 'path' is not a string\n");
-        return NULL;
     }
-
-    const char *path = json_string_value(path_obj);
-    const char *ret_path = strdup(path);
-    json_decref(root);
-
-    return ret_path;
+    return path;
 }
 
 // #define LANG_BASE_URL "https://raw.githubusercontent.com/KingVentrix007/KickStartFiles/main/langs"
 
-char *get_lang_path(const char *lang) {
+char *get_lang_path(const char *lang, char **bundle_path) {
     char url[1024];
     snprintf(url, sizeof(url), "%s/index.json", LANG_BASE_URL);
 
+    if (bundle_path != NULL) {
+        *bundle_path = NULL;
+    }
     char *json_data = fetch_json(url);
     // printf("json_data == %s\n",json_data);
     if (!json_data) {
@@ -184,76 +139,22 @@ char *get_lang_path(const char *lang) {
         return NULL;
     }
 
-    const char *path = find_language_path(lang, json_data);
+    char *path = find_language_path(lang, json_data, bundle_path);
     free(json_data);  // Free the JSON data after use
 
-    if (path) {
-        // printf("Path for language '%s': %s\n", lang, path);
-        return strdup(path);  // Return a copy of the path
-    }
-    return NULL;
+    // printf("Path for language '%s': %s\n", lang, path);
+    return path;
 }
 
-// Helper macro to free allocated memory
-#define FREE_STRING_ARRAY(array, count) \
-    do { \
-        for (size_t i = 0; i < count; i++) { \
-            free(array[i]); \
-        } \
-        free(array); \
-    } while (0)
-typedef struct {
-    char *makefile_path;
-    char *bash_path;
-} BuildFilePaths;
-
-typedef struct{
-    char *name;
-    char *path;
-}BuildSystem;
-// Structure to hold project information
-typedef struct {
-    char *name;
-    int version;
-    char **system_support;
-    size_t system_support_count;
-    char **build_type;
-    // size_t build_type_count; 
-    int lib_support;
-    bool special_build; // Only present in version 2
-    BuildFilePaths build_file_paths;  //Might not be present in version 2
-    BuildSystem *build_systems;
-    size_t build_systems_count;
-    char *git_ignore_path;            
-    char *version_template_path;
-    char *description;
-    char *template_author;
-    char *git_repo;
-    char *lang_license_type;
-    char *lang_license_url;
-    char *default_main_file;
-    char **extensions;
-    size_t extensions_count;
-    char **dependencies;
-    size_t dependencies_count;
-    char *instructions;
-    char *template_version;
-    char *update_url;
-    char **folders_to_create;
-    size_t folders_to_create_count;
-    char **commands_to_run;
-    size_t commands_to_run_count;
-    char *main_file_path;
-    char *main_file_template;
-    char *comment;
-     char **compiler_urls;
-    size_t compiler_urls_count;
-    char **files_to_include; // Only in version 2
-    size_t files_to_include_count; // Only in version 2
-    char *compiler_cmd; 
-    char *package_install_command;
-} ProjectInfo;
-
+// Releases everything parse_json or load_template_snapshot filled in
+void free_project_info(ProjectInfo *info) {
+    if (info->snapshot) {
+        release_template_snapshot(info);
+        return;
+    }
+    arena_free(&info->arena);
+    memset(info, 0, sizeof(*info));
+}
 
 // Function to parse JSON data into ProjectInfo structure
 //! Check this function for Segmentation fault, might be deref error
@@ -261,41 +162,24 @@ typedef struct {
 #define LOG_LOCATION //printf("%s:%d\n", __FILE__, __LINE__);
 void parse_json(const char *json_data, ProjectInfo *info) {
     json_error_t error;
+    TraceSpan span;
+    trace_begin(&span, "parse", "parse_json");
+    STATS_ADD(STAT_JSON_BYTES_PARSED, strlen(json_data));
+    AllocPhase phase = alloc_phase_enter(ALLOC_PHASE_PARSE);
 
     // Load JSON data from the char* into a json_t object
     json_t *root = json_loads(json_data, 0, &error);
     if (!root) {
         fprintf(stderr, "Error loading JSON data: %s\n", error.text);
+        trace_end(&span);
+        alloc_phase_leave(phase);
         return;
     }
 
     // Free previous values if they exist
-    if (info->name) free(info->name);
-    if (info->version_template_path) free(info->version_template_path);
-    if (info->build_file_paths.makefile_path) free(info->build_file_paths.makefile_path);
-    if (info->build_file_paths.bash_path) free(info->build_file_paths.bash_path);
-    if (info->git_ignore_path) free(info->git_ignore_path);
-    if (info->description) free(info->description);
-    if (info->template_author) free(info->template_author);
-    if (info->git_repo) free(info->git_repo);
-    if (info->lang_license_type) free(info->lang_license_type);
-    if (info->lang_license_url) free(info->lang_license_url);
-    if (info->default_main_file) free(info->default_main_file);
-    if (info->instructions) free(info->instructions);
-    if (info->template_version) free(info->template_version);
-    if (info->update_url) free(info->update_url);
-    if (info->main_file_path) free(info->main_file_path);
-    if (info->main_file_template) free(info->main_file_template);
-    if (info->comment) free(info->comment);
-
-    FREE_STRING_ARRAY(info->system_support, info->system_support_count);
-    // FREE_STRING_ARRAY(info->build_type, info->build_type_count);
-    FREE_STRING_ARRAY(info->extensions, info->extensions_count);
-    FREE_STRING_ARRAY(info->dependencies, info->dependencies_count);
-    FREE_STRING_ARRAY(info->folders_to_create, info->folders_to_create_count);
-    FREE_STRING_ARRAY(info->commands_to_run, info->commands_to_run_count);
-    FREE_STRING_ARRAY(info->compiler_urls, info->compiler_urls_count);
-    FREE_STRING_ARRAY(info->files_to_include, info->files_to_include_count); // Only free in version 2
+    free_project_info(info);
+    arena_init(&info->arena, 0);
+    Arena *arena = &info->arena;
 
     // Parsing the JSON data into the ProjectInfo structure
     json_t *project_name = json_object_get(root, "name");
@@ -330,24 +214,24 @@ void parse_json(const char *json_data, ProjectInfo *info) {
     // json_t *build_systems = json_object_get(root, "build_file_path"); // Only for version 2
     // Set default values or parse the values from JSON
     info->version = json_is_integer(version) ? json_integer_value(version) : 1;
-    info->name = project_name && json_is_string(project_name) ? strdup(json_string_value(project_name)) : NULL;
+    info->name = project_name && json_is_string(project_name) ? arena_strdup(arena, json_string_value(project_name)) : NULL;
     info->lib_support = json_is_integer(lib_support) ? json_integer_value(lib_support) : 0;
-    info->git_ignore_path = git_ignore_path && json_is_string(git_ignore_path) ? strdup(json_string_value(git_ignore_path)) : NULL;
-    info->version_template_path = version_template_path && json_is_string(version_template_path) ? strdup(json_string_value(version_template_path)) : NULL;
-    info->description = description && json_is_string(description) ? strdup(json_string_value(description)) : NULL;
-    info->template_author = template_author && json_is_string(template_author) ? strdup(json_string_value(template_author)) : NULL;
-    info->git_repo = git_repo && json_is_string(git_repo) ? strdup(json_string_value(git_repo)) : NULL;
-    info->lang_license_type = lang_license_type && json_is_string(lang_license_type) ? strdup(json_string_value(lang_license_type)) : NULL;
-    info->lang_license_url = lang_license_url && json_is_string(lang_license_url) ? strdup(json_string_value(lang_license_url)) : NULL;
-    info->default_main_file = default_main_file && json_is_string(default_main_file) ? strdup(json_string_value(default_main_file)) : NULL;
-    info->instructions = instructions && json_is_string(instructions) ? strdup(json_string_value(instructions)) : NULL;
-    info->template_version = template_version && json_is_string(template_version) ? strdup(json_string_value(template_version)) : NULL;
-    info->update_url = update_url && json_is_string(update_url) ? strdup(json_string_value(update_url)) : NULL;
-    info->main_file_path = main_file_path && json_is_string(main_file_path) ? strdup(json_string_value(main_file_path)) : NULL;
-    info->main_file_template = main_file_template && json_is_string(main_file_template) ? strdup(json_string_value(main_file_template)) : NULL;
-    info->comment = comment && json_is_string(comment) ? strdup(json_string_value(comment)) : NULL;
-    info->compiler_cmd = compiler_cmd && json_is_string(compiler_cmd) ? strdup(json_string_value(compiler_cmd)) : NULL;
-    info->package_install_command = package_install_command && json_is_string(package_install_command) ? strdup(json_string_value(package_install_command)) : NULL;
+    info->git_ignore_path = git_ignore_path && json_is_string(git_ignore_path) ? arena_strdup(arena, json_string_value(git_ignore_path)) : NULL;
+    info->version_template_path = version_template_path && json_is_string(version_template_path) ? arena_strdup(arena, json_string_value(version_template_path)) : NULL;
+    info->description = description && json_is_string(description) ? arena_strdup(arena, json_string_value(description)) : NULL;
+    info->template_author = template_author && json_is_string(template_author) ? arena_strdup(arena, json_string_value(template_author)) : NULL;
+    info->git_repo = git_repo && json_is_string(git_repo) ? arena_strdup(arena, json_string_value(git_repo)) : NULL;
+    info->lang_license_type = lang_license_type && json_is_string(lang_license_type) ? arena_strdup(arena, json_string_value(lang_license_type)) : NULL;
+    info->lang_license_url = lang_license_url && json_is_string(lang_license_url) ? arena_strdup(arena, json_string_value(lang_license_url)) : NULL;
+    info->default_main_file = default_main_file && json_is_string(default_main_file) ? arena_strdup(arena, json_string_value(default_main_file)) : NULL;
+    info->instructions = instructions && json_is_string(instructions) ? arena_strdup(arena, json_string_value(instructions)) : NULL;
+    info->template_version = template_version && json_is_string(template_version) ? arena_strdup(arena, json_string_value(template_version)) : NULL;
+    info->update_url = update_url && json_is_string(update_url) ? arena_strdup(arena, json_string_value(update_url)) : NULL;
+    info->main_file_path = main_file_path && json_is_string(main_file_path) ? arena_strdup(arena, json_string_value(main_file_path)) : NULL;
+    info->main_file_template = main_file_template && json_is_string(main_file_template) ? arena_strdup(arena, json_string_value(main_file_template)) : NULL;
+    info->comment = comment && json_is_string(comment) ? arena_strdup(arena, json_string_value(comment)) : NULL;
+    info->compiler_cmd = compiler_cmd && json_is_string(compiler_cmd) ? arena_strdup(arena, json_string_value(compiler_cmd)) : NULL;
+    info->package_install_command = package_install_command && json_is_string(package_install_command) ? arena_strdup(arena, json_string_value(package_install_command)) : NULL;
     // json_string_value(compiler_cmd);
     if(info->version >= 2)
     {
@@ -360,25 +244,28 @@ void parse_json(const char *json_data, ProjectInfo *info) {
     if (info->special_build == false) {
         // Updated Build File Paths
         json_t *build_file_path = json_object_get(root, "build_file_path");
-        info->build_file_paths.makefile_path = strdup(json_string_value(json_object_get(build_file_path, "makefile")));
-        info->build_file_paths.bash_path = strdup(json_string_value(json_object_get(build_file_path, "bash")));
+        info->build_file_paths.makefile_path = arena_strdup(arena, json_string_value(json_object_get(build_file_path, "makefile")));
+        info->build_file_paths.bash_path = arena_strdup(arena, json_string_value(json_object_get(build_file_path, "bash")));
         if(info->version >= 2)
         {
             size_t index;
             const char *key;
             json_t *value;
             info->build_systems_count = json_object_size(build_file_path);
-            info->build_systems = malloc(sizeof(BuildSystem) * (info->build_systems_count));
+            info->build_systems = arena_alloc(arena, sizeof(BuildSystem) * (info->build_systems_count));
             if (!info->build_systems) {
                 fprintf(stderr, "Error: Unable to allocate memory for build systems\n");
+                json_decref(root);
+                trace_end(&span);
+                alloc_phase_leave(phase);
                 return;
             }
             index = 0;
             json_object_foreach(build_file_path, key, value)
             {
                 if (json_is_string(value)) {
-                    info->build_systems[index].name = strdup(key);
-                    info->build_systems[index].path = strdup(json_string_value(value));
+                    info->build_systems[index].name = arena_strdup(arena, key);
+                    info->build_systems[index].path = arena_strdup(arena, json_string_value(value));
                     index++;
         }
             }
@@ -387,55 +274,58 @@ void parse_json(const char *json_data, ProjectInfo *info) {
 
     // Parse arrays for system_support, build_type, extensions, dependencies, folders_to_create, commands_to_run, compiler_urls
     info->system_support_count = json_is_array(system_support) ? json_array_size(system_support) : 0;
-    info->system_support = info->system_support_count > 0 ? malloc(info->system_support_count * sizeof(char *)) : NULL;
+    info->system_support = info->system_support_count > 0 ? arena_alloc(arena, info->system_support_count * sizeof(char *)) : NULL;
     for (size_t i = 0; i < info->system_support_count; i++) {
-        info->system_support[i] = strdup(json_string_value(json_array_get(system_support, i)));
+        info->system_support[i] = arena_strdup(arena, json_string_value(json_array_get(system_support, i)));
     }
 
     // info->build_type_count = json_is_array(build_type) ? json_array_size(build_type) : 0;
-    // info->build_type = info->build_type_count > 0 ? malloc(info->build_type_count * sizeof(char *)) : NULL;
+    // info->build_type = info->build_type_count > 0 ? arena_alloc(arena, info->build_type_count * sizeof(char *)) : NULL;
     // for (size_t i = 0; i < info->build_type_count; i++) {
-    //     info->build_type[i] = strdup(json_string_value(json_array_get(build_type, i)));
+    //     info->build_type[i] = arena_strdup(arena, json_string_value(json_array_get(build_type, i)));
     // }
 
     info->extensions_count = json_is_array(extensions) ? json_array_size(extensions) : 0;
-    info->extensions = info->extensions_count > 0 ? malloc(info->extensions_count * sizeof(char *)) : NULL;
+    info->extensions = info->extensions_count > 0 ? arena_alloc(arena, info->extensions_count * sizeof(char *)) : NULL;
     for (size_t i = 0; i < info->extensions_count; i++) {
-        info->extensions[i] = strdup(json_string_value(json_array_get(extensions, i)));
+        info->extensions[i] = arena_strdup(arena, json_string_value(json_array_get(extensions, i)));
     }
 
     info->dependencies_count = json_is_array(dependencies) ? json_array_size(dependencies) : 0;
-    info->dependencies = info->dependencies_count > 0 ? malloc(info->dependencies_count * sizeof(char *)) : NULL;
+    info->dependencies = info->dependencies_count > 0 ? arena_alloc(arena, info->dependencies_count * sizeof(char *)) : NULL;
     for (size_t i = 0; i < info->dependencies_count; i++) {
-        info->dependencies[i] = strdup(json_string_value(json_array_get(dependencies, i)));
+        info->dependencies[i] = arena_strdup(arena, json_string_value(json_array_get(dependencies, i)));
     }
 
     info->folders_to_create_count = json_is_array(folders_to_create) ? json_array_size(folders_to_create) : 0;
-    info->folders_to_create = info->folders_to_create_count > 0 ? malloc(info->folders_to_create_count * sizeof(char *)) : NULL;
+    info->folders_to_create = info->folders_to_create_count > 0 ? arena_alloc(arena, info->folders_to_create_count * sizeof(char *)) : NULL;
     for (size_t i = 0; i < info->folders_to_create_count; i++) {
-        info->folders_to_create[i] = strdup(json_string_value(json_array_get(folders_to_create, i)));
+        info->folders_to_create[i] = arena_strdup(arena, json_string_value(json_array_get(folders_to_create, i)));
     }
 
     info->commands_to_run_count = json_is_array(commands_to_run) ? json_array_size(commands_to_run) : 0;
-    info->commands_to_run = info->commands_to_run_count > 0 ? malloc(info->commands_to_run_count * sizeof(char *)) : NULL;
+    info->commands_to_run = info->commands_to_run_count > 0 ? arena_alloc(arena, info->commands_to_run_count * sizeof(char *)) : NULL;
     for (size_t i = 0; i < info->commands_to_run_count; i++) {
-        info->commands_to_run[i] = strdup(json_string_value(json_array_get(commands_to_run, i)));
+        info->commands_to_run[i] = arena_strdup(arena, json_string_value(json_array_get(commands_to_run, i)));
     }
 
     info->compiler_urls_count = json_is_array(compiler_urls) ? json_array_size(compiler_urls) : 0;
-    info->compiler_urls = info->compiler_urls_count > 0 ? malloc(info->compiler_urls_count * sizeof(char *)) : NULL;
+    info->compiler_urls = info->compiler_urls_count > 0 ? arena_alloc(arena, info->compiler_urls_count * sizeof(char *)) : NULL;
     for (size_t i = 0; i < info->compiler_urls_count; i++) {
-        info->compiler_urls[i] = strdup(json_string_value(json_array_get(compiler_urls, i)));
+        info->compiler_urls[i] = arena_strdup(arena, json_string_value(json_array_get(compiler_urls, i)));
     }
 
     if (info->version == 2) {
         info->files_to_include_count = json_is_array(files_to_include) ? json_array_size(files_to_include) : 0;
-        info->files_to_include = info->files_to_include_count > 0 ? malloc(info->files_to_include_count * sizeof(char *)) : NULL;
+        info->files_to_include = info->files_to_include_count > 0 ? arena_alloc(arena, info->files_to_include_count * sizeof(char *)) : NULL;
         for (size_t i = 0; i < info->files_to_include_count; i++) {
-            info->files_to_include[i] = strdup(json_string_value(json_array_get(files_to_include, i)));
+            info->files_to_include[i] = arena_strdup(arena, json_string_value(json_array_get(files_to_include, i)));
         }
     }
 
+    json_decref(root);
+    trace_end(&span);
+    alloc_phase_leave(phase);
     // Return the parsed information
     // return info;
 }
@@ -453,6 +343,12 @@ void clean_url(char *url) {
         url[len - 2] = '\0';
     }
 }
+// A file of the template from the bundle, or fetched from url when the bundle lacks it
+static char *fetch_template_file(const TemplateBundle *bundle, const char *url, const char *path) {
+    char *data = bundle_read(bundle, path);
+    return data != NULL ? data : fetch_data(url);
+}
+
 // Function to create a project
 int create_project(char *project_name, char *project_description, char *project_author, char *project_licence, char *project_version, char *project_language, char *project_dependencies, char *generate_readme, char *initialize_git, char *create_license_file) {
     const char *base_dir = ".";
@@ -465,34 +361,70 @@ int create_project(char *project_name, char *project_description, char *project_
         // system("mkdir -p tests");
     // }
     // system("mkdir -p tests/tests");
-    char *lang_path = get_lang_path(project_language);
-    if (lang_path == NULL) {
-        fprintf(stderr, "Failed to get path for language '%s'\n", project_language);
-        return 1;
+    // Initialize ProjectInfo structure
+    ProjectInfo info;
+    memset(&info, 0, sizeof(info));
+    // Every file of the template in one request when the index lists a bundle
+    TemplateBundle bundle;
+    memset(&bundle, 0, sizeof(bundle));
+    char bundle_url[1024];
+    // A compiled snapshot (kpm template compile) skips the index lookup and JSON parse
+    if (load_template_snapshot(project_language, &info) == 0) {
+        // Files kept by kpm template update, when they are the version the snapshot was compiled from
+        int cached = template_cache_open(project_language, info.template_version, &bundle);
+        if (cached == TEMPLATE_CACHE_OTHER_VERSION) {
+            // kpm template update has seen a newer template than the snapshot's
+            release_template_snapshot(&info);
+        } else if (cached != 0 && info.bundle_path != NULL) {
+            snprintf(bundle_url, sizeof(bundle_url), "%s%s", LANG_BASE_URL, info.bundle_path);
+            bundle_load(bundle_url, &bundle);
+        }
     }
-    // printf("Language path: %s\n", lang_path);
+    if (info.snapshot != NULL) {
+        STATS_INC(STAT_CACHE_HITS);
+    } else {
+        STATS_INC(STAT_CACHE_MISSES);
+        char *bundle_path = NULL;
+        char *lang_path = get_lang_path(project_language, &bundle_path);
+        if (lang_path == NULL) {
+            fprintf(stderr, "Failed to get path for language '%s'\n", project_language);
+            return 1;
+        }
+        // printf("Language path: %s\n", lang_path);
+        if (bundle_path != NULL) {
+            snprintf(bundle_url, sizeof(bundle_url), "%s%s", LANG_BASE_URL, bundle_path);
+            bundle_load(bundle_url, &bundle);
+            free(bundle_path);
+        }
 
-    char lang_json[1024];
-    snprintf(lang_json, sizeof(lang_json), "%s%s", LANG_BASE_URL, lang_path);
-    free(lang_path);  // Free lang_path after use
+        char lang_json[1024];
+        snprintf(lang_json, sizeof(lang_json), "%s%s", LANG_BASE_URL, lang_path);
+        char *lang_json_data = bundle_read(&bundle, lang_path);
+        free(lang_path);  // Free lang_path after use
 
-    char *lang_json_data = fetch_json(lang_json);
-    if (!lang_json_data) {
-        fprintf(stderr, "Failed to fetch language JSON data\n");
-        return 1;
-    }
+        if (lang_json_data == NULL) {
+            lang_json_data = fetch_json(lang_json);
+        }
+        if (!lang_json_data) {
+            bundle_free(&bundle);
+            fprintf(stderr, "Failed to fetch language JSON data\n");
+            return 1;
+        }
 
-    // Initialize ProjectInfo structure
-    ProjectInfo info;
-    // printf("lang_json_data == [%s]\n",lang_json_data);
-    memset(&info, 0, sizeof(info));
-    parse_json(lang_json_data, &info);
-    free(lang_json_data);  // Free lang_json_data after use
+        // printf("lang_json_data == [%s]\n",lang_json_data);
+        parse_json(lang_json_data, &info);
+        free(lang_json_data);  // Free lang_json_data after use
+    }
+    // Everything from here on materializes the project, fetches and renders inside it count as their own phases
+    AllocPhase phase = alloc_phase_enter(ALLOC_PHASE_WRITE);
     // Create project directorys
     for (size_t i = 0; i < info.folders_to_create_count; i++) {
         char *folder_path = replace_placeholder(info.folders_to_create[i], project_name);
         if (!folder_path) {
             fprintf(stderr, "Failed to create folder path\n");
+            alloc_phase_leave(phase);
+            free_project_info(&info);
+            bundle_free(&bundle);
             return 1;
         }
 
@@ -500,15 +432,25 @@ int create_project(char *project_name, char *project_description, char *project_
         if (!full_path) {
             perror("Error allocating memory for full path");
             free(folder_path);
+            alloc_phase_leave(phase);
+            free_project_info(&info);
+            bundle_free(&bundle);
             return 1;
         }
 
         sprintf(full_path, "%s/%s", base_dir, folder_path);
         printf("Creating folder: %s\n", full_path);
 
-        if (create_directories(full_path) != 0) {
+        TraceSpan span;
+        trace_begin(&span, "write", full_path);
+        int created = create_directories(full_path);
+        trace_end(&span);
+        if (created != 0) {
             free(folder_path);
             free(full_path);
+            alloc_phase_leave(phase);
+            free_project_info(&info);
+            bundle_free(&bundle);
             return 1;
         }
 
@@ -537,16 +479,23 @@ int create_project(char *project_name, char *project_description, char *project_
         char *build_script_path = info.build_systems[choice].path;
         char *build_script_url = malloc(strlen(LANG_BASE_URL)+strlen(build_script_path)+100);
         snprintf(build_script_url,strlen(LANG_BASE_URL)+strlen(build_script_path)+100,"%s/%s",LANG_BASE_URL,build_script_path);
-        char *build_script_contents = fetch_data(build_script_url);
+        char *build_script_contents = fetch_template_file(&bundle, build_script_url, build_script_path);
         char *build_script_contents_formatted = replace_string(build_script_contents,"${project_name}",project_name);
         if(build_script_contents == NULL)
         {
             printf("Build option not available\n");
+            alloc_phase_leave(phase);
+            free_project_info(&info);
+            bundle_free(&bundle);
             return 0;
         }
+        TraceSpan span;
+        trace_begin(&span, "write", info.build_systems[choice].name);
         FILE *build_script = fopen(info.build_systems[choice].name,"w");
         fprintf(build_script,"%s",build_script_contents_formatted);
         fclose(build_script);
+        trace_end(&span);
+        STATS_INC(STAT_FILES_WRITTEN);
         free(build_script_contents);
         free(build_script_url);
         free(build_script_contents_formatted);
@@ -557,16 +506,21 @@ int create_project(char *project_name, char *project_description, char *project_
     char *main_file_path = malloc(strlen(LANG_BASE_URL) + strlen(info.main_file_template) + 10);
     if (main_file_path == NULL) {
         fprintf(stderr, "Memory allocation failed!\n");
+        alloc_phase_leave(phase);
+        free_project_info(&info);
+        bundle_free(&bundle);
         return 1;
     }
     // Format the string safely using snprintf
     snprintf(main_file_path, strlen(LANG_BASE_URL) + strlen(info.main_file_template) + 10, "%s/%s", LANG_BASE_URL, info.main_file_template);
     // printf("main_file_path == %s\n",main_file_path);
-    char *main_file_data = fetch_data(main_file_path);
+    char *main_file_data = fetch_template_file(&bundle, main_file_path, info.main_file_template);
     char main_file_create_path[1024];
     snprintf(main_file_create_path, sizeof(main_file_create_path), "%s/%s", base_dir,info.main_file_path);
     char *formatted_main_file_path = replace_string(main_file_create_path, "${project_name}", project_name);
     // printf("main_file_create_path == %s\n",formatted_main_file_path);
+    TraceSpan main_span;
+    trace_begin(&main_span, "write", formatted_main_file_path);
     FILE *fp2 = fopen(formatted_main_file_path,"w");
     fprintf(fp2, "%s File: %s\n",info.comment,info.default_main_file);
     fprintf(fp2, "%s Author: %s\n",info.comment, project_author);
@@ -575,6 +529,8 @@ int create_project(char *project_name, char *project_description, char *project_
     fprintf(fp2, "%s Description: %s\n\n", info.comment,project_description);
     fwrite(main_file_data, 1, strlen(main_file_data), fp2);
     fclose(fp2);
+    trace_end(&main_span);
+    STATS_INC(STAT_FILES_WRITTEN);
     free(main_file_path);
     free(main_file_data);
     // chdir(base_dir);
@@ -582,7 +538,7 @@ int create_project(char *project_name, char *project_description, char *project_
     for (size_t i = 0; i < info.commands_to_run_count; i++) {
         char *command = replace_string(info.commands_to_run[i], "${project_name}", project_name);
         // printf("Running command: %s\n", command);
-        int result = system(command);
+        int result = trace_system(command);
         free(command);
         if (result != 0) {
             fprintf(stderr, "Command execution failed\n");
@@ -600,6 +556,8 @@ int create_project(char *project_name, char *project_description, char *project_
     if (strcmp(create_license_file, "yes") == 0) {
         char license_file_path[1024];
         snprintf(license_file_path, sizeof(license_file_path), "%s/LICENSE", base_dir);
+        TraceSpan span;
+        trace_begin(&span, "write", license_file_path);
         FILE *license_file = fopen(license_file_path, "w");
         if (license_file == NULL) {
             perror("Error creating LICENSE");
@@ -609,10 +567,14 @@ int create_project(char *project_name, char *project_description, char *project_
         fprintf(license_file, "%s", license_file_content);
         free(license_file_content);
         fclose(license_file);
+        trace_end(&span);
+        STATS_INC(STAT_FILES_WRITTEN);
     }
     if (strcmp(generate_readme, "yes") == 0) {
         char readme_file_path[1024];
         snprintf(readme_file_path, sizeof(readme_file_path), "%s/README.md", base_dir);
+        TraceSpan span;
+        trace_begin(&span, "write", readme_file_path);
         FILE *readme_file = fopen(readme_file_path, "w");
         if (readme_file == NULL) {
             perror("Error creating README.md");
@@ -621,119 +583,150 @@ int create_project(char *project_name, char *project_description, char *project_
         fprintf(readme_file, "# %s\n\n", project_name);
         fprintf(readme_file, "%s\n\n", project_description);
         fclose(readme_file);
+        trace_end(&span);
+        STATS_INC(STAT_FILES_WRITTEN);
     }
     if (strcmp(initialize_git, "yes") == 0) {
-        if (system("git --version") != 0) {
+        if (toolchain_find("git", NULL) != 0) {
             printf("Git is not installed. Download Git from https://git-scm.com/downloads\n");
         } else {
             char git_init_cmd[1024];
             snprintf(git_init_cmd, sizeof(git_init_cmd), "cd %s && git init", base_dir);
-            system(git_init_cmd);
-            system("git add .");
-            system("git commit -m \"Initial commit\"");
+            trace_system(git_init_cmd);
+            trace_system("git add .");
+            trace_system("git commit -m \"Initial commit\"");
         }
-        char *gitignore_path = malloc(strlen(info.git_ignore_path)+10);
-        if (gitignore_path == NULL) {
-            fprintf(stderr, "Memory allocation failed!\n");
-            return 1;
+        if (info.git_ignore_path != NULL) {
+            char *gitignore_path = malloc(strlen(LANG_BASE_URL) + strlen(info.git_ignore_path)+10);
+            if (gitignore_path == NULL) {
+                fprintf(stderr, "Memory allocation failed!\n");
+                alloc_phase_leave(phase);
+                free_project_info(&info);
+                bundle_free(&bundle);
+                return 1;
+            }
+            snprintf(gitignore_path, strlen(LANG_BASE_URL) + strlen(info.git_ignore_path)+10, "%s/%s", LANG_BASE_URL, info.git_ignore_path);
+            char *gitignore_data = fetch_template_file(&bundle, gitignore_path, info.git_ignore_path);
+            free(gitignore_path);
+            if (gitignore_data != NULL) {
+                char gitignore_create_path[1024];
+                snprintf(gitignore_create_path, sizeof(gitignore_create_path), "%s/%s", base_dir, ".gitignore");
+                // char *config_mk_create_path_formatted = replace_string(config_mk_create_path, "${project_name}", project_name);
+                char *gitignore_data_formatted = replace_string(gitignore_data, "${project_name}", project_name);
+                TraceSpan span;
+                trace_begin(&span, "write", gitignore_create_path);
+                FILE *fp4 = fopen(gitignore_create_path,"w");
+                fwrite(gitignore_data_formatted, 1, strlen(gitignore_data_formatted), fp4);
+                fclose(fp4);
+                trace_end(&span);
+                STATS_INC(STAT_FILES_WRITTEN);
+                free(gitignore_data_formatted);
+                free(gitignore_data);
+            }
         }
-        char *gitignore_data = fetch_data(gitignore_path);
-        char gitignore_create_path[1024];
-        snprintf(gitignore_create_path, sizeof(gitignore_create_path), "%s/%s", base_dir, ".gitignore");
-        // char *config_mk_create_path_formatted = replace_string(config_mk_create_path, "${project_name}", project_name);
-        char *gitignore_data_formatted = replace_string(gitignore_data, "${project_name}", project_name);
-        FILE *fp4 = fopen(gitignore_create_path,"w");
-        fwrite(gitignore_data_formatted, 1, strlen(gitignore_data_formatted), fp4);
-        fclose(fp4);
         
     }
     char project_json_path[1024];
     snprintf(project_json_path, sizeof(project_json_path), "%s/project.json", base_dir);
-    FILE *project_json = fopen(project_json_path, "w");
-    if (project_json == NULL) {
+    TraceSpan project_json_span;
+    trace_begin(&project_json_span, "write", project_json_path);
+    Manifest manifest;
+    manifest_init(&manifest, project_name, project_version, project_description, project_author, project_licence,
+                  project_language, info.package_install_command, project_dependencies);
+    if (manifest_write(project_json_path, &manifest) != 0) {
         perror("Error creating project.json");
         exit(EXIT_FAILURE);
-        
     }
-    char project_name_copy[strlen(project_name) + 1];
-    strcpy(project_name_copy, project_name);
-
-    char project_version_copy[strlen(project_version) + 1];
-    strcpy(project_version_copy, project_version);
-
-    char project_description_copy[strlen(project_description) + 1];
-    strcpy(project_description_copy, project_description);
-
-    char project_author_copy[strlen(project_author) + 1];
-    strcpy(project_author_copy, project_author);
-
-    char project_license_copy[strlen(project_licence) + 1];
-    strcpy(project_license_copy, project_licence);
-
-    char project_dependencies_copy[strlen(project_dependencies) + 1];
-    strcpy(project_dependencies_copy, project_dependencies);
-
-    remove_trailing_newline(project_name_copy);
-    remove_trailing_newline(project_version_copy);
-    remove_trailing_newline(project_description_copy);
-    remove_trailing_newline(project_author_copy);
-    remove_trailing_newline(project_license_copy);
-    remove_trailing_newline(project_dependencies_copy);
-
-    fprintf(project_json, "{\n");
-    fprintf(project_json, "    \"name\": \"%s\",\n", project_name_copy);
-    fprintf(project_json, "    \"version\": \"%s\",\n", project_version_copy);
-    fprintf(project_json, "    \"description\": \"%s\",\n", project_description_copy);
-    fprintf(project_json, "    \"author\": \"%s\",\n", project_author_copy);
-    fprintf(project_json, "    \"license\": \"%s\",\n", project_license_copy);
-    fprintf(project_json, "    \"dependencies\": \"%s\",\n", project_dependencies_copy);
-    fprintf(project_json, "    \"language\": \"%s\",\n",project_language);
-    fprintf(project_json, "    \"install_cmd\": \"%s\"\n",info.package_install_command);
-
-    fprintf(project_json, "}\n");
-    fclose(project_json);
+    manifest_free(&manifest);
+    trace_end(&project_json_span);
+    STATS_INC(STAT_FILES_WRITTEN);
     if(info.version >= 2)
 {
+    // Optional extras, taken from the bundle or fetched together after everything the project needs
     char **files_to_include = info.files_to_include;
-    for (size_t i = 0; i < info.files_to_include_count; i++)
+    size_t count = info.files_to_include_count;
+    RegistryRequest *requests = count > 0 ? calloc(count, sizeof(RegistryRequest)) : NULL;
+    char **file_urls = count > 0 ? calloc(count, sizeof(char *)) : NULL;
+    size_t requested = 0;
+    for (size_t i = 0; i < count && requests != NULL && file_urls != NULL; i++)
     {
         char *file_path = files_to_include[i];
-        char *file_url = malloc(strlen(LANG_BASE_URL) + strlen(file_path) + 100);
-        if (file_url == NULL)
+        char bundled_path[1024];
+        snprintf(bundled_path, sizeof(bundled_path), "%s/%s", project_language, file_path);
+        if (bundle_find(&bundle, bundled_path) != NULL)
+        {
+            continue;
+        }
+        size_t url_size = strlen(LANG_BASE_URL) + strlen(project_language) + strlen(file_path) + 3;
+        file_urls[i] = malloc(url_size);
+        if (file_urls[i] == NULL)
         {
             fprintf(stderr, "Memory allocation failed for file_url\n");
             continue;
         }
-        
-        snprintf(file_url, strlen(LANG_BASE_URL) + strlen(file_path) + 100, "%s/%s/%s", LANG_BASE_URL, project_language, file_path);
+        snprintf(file_urls[i], url_size, "%s/%s/%s", LANG_BASE_URL, project_language, file_path);
+        requests[requested].url = file_urls[i];
+        requests[requested].priority = REQUEST_OPTIONAL;
+        requested++;
+    }
+    registry_fetch_all(requests, requested);
 
-        char *file_data = fetch_data(file_url);
-        if (file_data == NULL)
+    size_t next = 0;
+    for (size_t i = 0; i < count && requests != NULL && file_urls != NULL; i++)
+    {
+        char *file_path = files_to_include[i];
+        char bundled_path[1024];
+        snprintf(bundled_path, sizeof(bundled_path), "%s/%s", project_language, file_path);
+        const BundleEntry *entry = bundle_find(&bundle, bundled_path);
+        if (file_urls[i] == NULL && entry == NULL)
+        {
+            continue;
+        }
+        RegistryRequest *request = entry != NULL ? NULL : &requests[next++];
+        if (request != NULL && request->result != 0)
         {
-            fprintf(stderr, "Failed to fetch data from URL: %s\n", file_url);
-            free(file_url);
+            fprintf(stderr, "Failed to fetch data from URL: %s\n", file_urls[i]);
             FILE *blankfile = fopen(file_path,"w");
             fprintf(blankfile,"%s","# Template\n");
             fclose(blankfile);
+            STATS_INC(STAT_FILES_WRITTEN);
             continue;
         }
 
+        TraceSpan span;
+        trace_begin(&span, "write", file_path);
         FILE *custom_file = fopen(file_path, "w");
         if (custom_file == NULL)
         {
             // fprintf(stderr, "Failed to open file: %s\n", file_path);
-            free(file_url);
-            free(file_data);
+            trace_end(&span);
             continue;
         }
 
-        fprintf(custom_file, "%s", file_data);
-        free(file_url);
-        free(file_data);
+        if (entry != NULL)
+        {
+            fwrite(entry->data, 1, entry->size, custom_file);
+        }
+        else
+        {
+            fprintf(custom_file, "%s", request->response.data);
+        }
         fclose(custom_file);
+        trace_end(&span);
+        STATS_INC(STAT_FILES_WRITTEN);
+    }
+    for (size_t i = 0; i < requested; i++)
+    {
+        free(requests[i].response.data);
+    }
+    for (size_t i = 0; i < count && file_urls != NULL; i++)
+    {
+        free(file_urls[i]);
     }
+    free(requests);
+    free(file_urls);
 }
-    if(system(info.compiler_cmd) != 0)
+    if(toolchain_check_command(info.compiler_cmd) != 0)
     {
         printf("Compiler for language %s is not installed\n",project_language);
         for (size_t i = 0; i < info.compiler_urls_count; i++)
@@ -746,5 +739,8 @@ int create_project(char *project_name, char *project_description, char *project_
         // char *readme_data = fetch_data(readme_path);
     // Use the ProjectInfo structure for further project creation tasks...
 
+    alloc_phase_leave(phase);
+    free_project_info(&info);
+    bundle_free(&bundle);
     return 0;
 }
@@ -1,7 +1,72 @@
 #ifndef __CUSTOM__H
 #define __CUSTOM__H
+#include <stddef.h>
+#include <stdbool.h>
+#include "../memory/arena.h"
 
-#define LANG_BASE_URL "https://raw.githubusercontent.com/KingVentrix007/KickStartFiles/main/langs"
-#define HASH_URL "https://raw.githubusercontent.com/{owner}/{repo}/main/{path}"
+#include "../registry/registry.h"
 
-#endif// 
\ No newline at end of file
+#define LANG_BASE_URL registry_langs_url()
+#define HASH_URL registry_raw_url()
+
+typedef struct {
+    char *makefile_path;
+    char *bash_path;
+} BuildFilePaths;
+
+typedef struct{
+    char *name;
+    char *path;
+}BuildSystem;
+// Structure to hold project information
+typedef struct {
+    char *name;
+    int version;
+    char **system_support;
+    size_t system_support_count;
+    char **build_type;
+    // size_t build_type_count; 
+    int lib_support;
+    bool special_build; // Only present in version 2
+    BuildFilePaths build_file_paths;  //Might not be present in version 2
+    BuildSystem *build_systems;
+    size_t build_systems_count;
+    char *git_ignore_path;            
+    char *version_template_path;
+    char *description;
+    char *template_author;
+    char *git_repo;
+    char *lang_license_type;
+    char *lang_license_url;
+    char *default_main_file;
+    char **extensions;
+    size_t extensions_count;
+    char **dependencies;
+    size_t dependencies_count;
+    char *instructions;
+    char *template_version;
+    char *update_url;
+    char **folders_to_create;
+    size_t folders_to_create_count;
+    char **commands_to_run;
+    size_t commands_to_run_count;
+    char *main_file_path;
+    char *main_file_template;
+    char *comment;
+     char **compiler_urls;
+    size_t compiler_urls_count;
+    char **files_to_include; // Only in version 2
+    size_t files_to_include_count; // Only in version 2
+    char *compiler_cmd; 
+    char *package_install_command;
+    char *bundle_path; // From the index, only kept in snapshots
+    Arena arena; // Owns every string and array filled in by parse_json
+    void *snapshot; // Set when the fields point into a mapped template snapshot
+    size_t snapshot_size;
+} ProjectInfo;
+
+char *fetch_json(const char *url);
+char *get_lang_path(const char *lang, char **bundle_path);
+void parse_json(const char *json_data, ProjectInfo *info);
+void free_project_info(ProjectInfo *info);
+#endif
\ No newline at end of file
@@ -4,6 +4,9 @@
 #include "../licence.h"
 #include "config.h"
 #include "utils.h"
+#include "../trace/trace.h"
+#include "../toolchain/toolchain.h"
+#include "../manifest/manifest.h"
 
 
 
@@ -16,7 +19,7 @@ void create_project_py(const char *project_name, const char *project_description
 
     // Ensure base directory exists
     if (strcmp(base_dir, "tests") == 0) {
-        system("mkdir -p tests");
+        trace_system("mkdir -p tests");
     }
 
     // Create main.py file
@@ -64,17 +67,17 @@ void create_project_py(const char *project_name, const char *project_description
 
     // Initialize Git if initialize_git == "yes"
     if (strcmp(initialize_git, "yes") == 0) {
-        if (system("git --version") != 0) {
+        if (toolchain_find("git", NULL) != 0) {
             printf("Git is not installed. Download Git from https://git-scm.com/downloads\n");
         } else {
             char git_init_cmd[1024];
             snprintf(git_init_cmd, sizeof(git_init_cmd), "cd %s && git init", base_dir);
-            system(git_init_cmd);
-            system("git add .");
-            system("git commit -m \"Initial commit\"");
+            trace_system(git_init_cmd);
+            trace_system("git add .");
+            trace_system("git commit -m \"Initial commit\"");
         }
     }
-    if(system("python --version") == 0 || system("python --version") == 0)
+    if(toolchain_find("python3", NULL) == 0 || toolchain_find("python", NULL) == 0)
     {
         
     }
@@ -101,7 +104,7 @@ void create_project_py(const char *project_name, const char *project_description
     if (strcmp(generate_structure, "yes") == 0) {
         char mkdir_cmd[1024];
         snprintf(mkdir_cmd, sizeof(mkdir_cmd), "mkdir -p %s/src %s/tests %s/docs %s/examples %s/scripts %s/data", base_dir, base_dir, base_dir, base_dir, base_dir, base_dir);
-        system(mkdir_cmd);
+        trace_system(mkdir_cmd);
 
         // Create requirements.txt with dependencies
         char requirements_file_path[1024];
@@ -133,47 +136,14 @@ void create_project_py(const char *project_name, const char *project_description
         // Create project.json
         char project_json_path[1024];
         snprintf(project_json_path, sizeof(project_json_path), "%s/project.json", base_dir);
-        FILE *project_json = fopen(project_json_path, "w");
-        if (project_json == NULL) {
+        Manifest manifest;
+        manifest_init(&manifest, project_name, project_version, project_description, project_author, project_license,
+                      NULL, NULL, project_dependencies);
+        if (manifest_write(project_json_path, &manifest) != 0) {
             perror("Error creating project.json");
             exit(EXIT_FAILURE);
         }
-
-        char project_name_copy[strlen(project_name) + 1];
-        strcpy(project_name_copy, project_name);
-
-        char project_version_copy[strlen(project_version) + 1];
-        strcpy(project_version_copy, project_version);
-
-        char project_description_copy[strlen(project_description) + 1];
-        strcpy(project_description_copy, project_description);
-
-        char project_author_copy[strlen(project_author) + 1];
-        strcpy(project_author_copy, project_author);
-
-        char project_license_copy[strlen(project_license) + 1];
-        strcpy(project_license_copy, project_license);
-
-        char project_dependencies_copy[strlen(project_dependencies) + 1];
-        strcpy(project_dependencies_copy, project_dependencies);
-
-        // Call the function with mutable copies
-        remove_trailing_newline(project_name_copy);
-        remove_trailing_newline(project_version_copy);
-        remove_trailing_newline(project_description_copy);
-        remove_trailing_newline(project_author_copy);
-        remove_trailing_newline(project_license_copy);
-        remove_trailing_newline(project_dependencies_copy);
-
-        fprintf(project_json, "{\n");
-        fprintf(project_json, "    \"name\": \"%s\",\n", project_name_copy);
-        fprintf(project_json, "    \"version\": \"%s\",\n", project_version_copy);
-        fprintf(project_json, "    \"description\": \"%s\",\n", project_description_copy);
-        fprintf(project_json, "    \"author\": \"%s\",\n", project_author_copy);
-        fprintf(project_json, "    \"license\": \"%s\",\n", project_license_copy);
-        fprintf(project_json, "    \"dependencies\": \"%s\"\n", project_dependencies_copy);
-        fprintf(project_json, "}\n");
-        fclose(project_json);
+        manifest_free(&manifest);
         char new_main_path[1024];
         snprintf(new_main_path, sizeof(new_main_path), "%s/src/main.py", base_dir);
         rename(main_file_path,new_main_path);
@@ -0,0 +1,405 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "snapshot.h"
+#include "../cache/cache.h"
+#include "../registry/registry.h"
+#include "../stats/stats.h"
+
+// A snapshot is one contiguous blob: a fixed header followed by the string
+// data and the array slot tables. Every reference inside the blob is an offset
+// from the start of the blob (0 means NULL), so the file can be mapped at any
+// address. Loading maps it private+writable and rewrites the slot tables into
+// real pointers in place.
+// The header records the langs url it was compiled from, a snapshot from another
+// registry is stale whatever its age.
+
+static const size_t string_fields[] = {
+    offsetof(ProjectInfo, name),
+    offsetof(ProjectInfo, build_file_paths.makefile_path),
+    offsetof(ProjectInfo, build_file_paths.bash_path),
+    offsetof(ProjectInfo, git_ignore_path),
+    offsetof(ProjectInfo, version_template_path),
+    offsetof(ProjectInfo, description),
+    offsetof(ProjectInfo, template_author),
+    offsetof(ProjectInfo, git_repo),
+    offsetof(ProjectInfo, lang_license_type),
+    offsetof(ProjectInfo, lang_license_url),
+    offsetof(ProjectInfo, default_main_file),
+    offsetof(ProjectInfo, instructions),
+    offsetof(ProjectInfo, template_version),
+    offsetof(ProjectInfo, update_url),
+    offsetof(ProjectInfo, main_file_path),
+    offsetof(ProjectInfo, main_file_template),
+    offsetof(ProjectInfo, comment),
+    offsetof(ProjectInfo, compiler_cmd),
+    offsetof(ProjectInfo, package_install_command),
+    offsetof(ProjectInfo, bundle_path),
+};
+
+static const struct {
+    size_t items;
+    size_t count;
+} array_fields[] = {
+    {offsetof(ProjectInfo, system_support), offsetof(ProjectInfo, system_support_count)},
+    {offsetof(ProjectInfo, extensions), offsetof(ProjectInfo, extensions_count)},
+    {offsetof(ProjectInfo, dependencies), offsetof(ProjectInfo, dependencies_count)},
+    {offsetof(ProjectInfo, folders_to_create), offsetof(ProjectInfo, folders_to_create_count)},
+    {offsetof(ProjectInfo, commands_to_run), offsetof(ProjectInfo, commands_to_run_count)},
+    {offsetof(ProjectInfo, compiler_urls), offsetof(ProjectInfo, compiler_urls_count)},
+    {offsetof(ProjectInfo, files_to_include), offsetof(ProjectInfo, files_to_include_count)},
+};
+
+#define STRING_FIELD_COUNT (sizeof(string_fields) / sizeof(string_fields[0]))
+#define ARRAY_FIELD_COUNT (sizeof(array_fields) / sizeof(array_fields[0]))
+
+typedef struct {
+    uint64_t offset;
+    uint64_t count;
+} SnapshotArray;
+
+typedef struct {
+    char magic[4];
+    uint32_t format_version;
+    uint64_t blob_size;
+    uint64_t source_hash;
+    int64_t created_at;
+    uint64_t lang;
+    uint64_t registry;
+    int32_t version;
+    int32_t lib_support;
+    int32_t special_build;
+    int32_t pointer_size;
+    uint64_t strings[STRING_FIELD_COUNT];
+    SnapshotArray arrays[ARRAY_FIELD_COUNT];
+    SnapshotArray build_systems; // Pairs of name/path offsets, same layout as BuildSystem
+} SnapshotHeader;
+
+typedef struct {
+    char *data;
+    size_t size;
+    size_t capacity;
+} SnapshotBuffer;
+
+#define FIELD(info, offset, type) ((type *)((char *)(info) + (offset)))
+
+static int reserve(SnapshotBuffer *buf, size_t len, uint64_t *offset) {
+    size_t start = (buf->size + 7) & ~(size_t)7;
+    if (start + len > buf->capacity) {
+        size_t capacity = buf->capacity ? buf->capacity : 4096;
+        while (capacity < start + len) {
+            capacity *= 2;
+        }
+        char *data = realloc(buf->data, capacity);
+        if (data == NULL) {
+            return -1;
+        }
+        buf->data = data;
+        buf->capacity = capacity;
+    }
+    memset(buf->data + buf->size, 0, start + len - buf->size);
+    buf->size = start + len;
+    *offset = start;
+    return 0;
+}
+
+static int append_string(SnapshotBuffer *buf, const char *str, uint64_t *offset) {
+    if (str == NULL) {
+        *offset = 0;
+        return 0;
+    }
+    size_t len = strlen(str) + 1;
+    if (reserve(buf, len, offset) != 0) {
+        return -1;
+    }
+    memcpy(buf->data + *offset, str, len);
+    return 0;
+}
+
+static int append_array(SnapshotBuffer *buf, char **items, size_t count, SnapshotArray *out) {
+    out->offset = 0;
+    out->count = items ? count : 0;
+    if (out->count == 0) {
+        return 0;
+    }
+    if (reserve(buf, out->count * sizeof(uint64_t), &out->offset) != 0) {
+        return -1;
+    }
+    for (size_t i = 0; i < out->count; i++) {
+        uint64_t str_offset;
+        if (append_string(buf, items[i], &str_offset) != 0) {
+            return -1;
+        }
+        memcpy(buf->data + out->offset + i * sizeof(uint64_t), &str_offset, sizeof(uint64_t));
+    }
+    return 0;
+}
+
+static int snapshot_file_path(const char *lang, char *path, size_t size) {
+    char name[512];
+    snprintf(name, sizeof(name), "%s.kpmt", lang);
+    return cache_path(path, size, SNAPSHOT_DIR, name);
+}
+
+int write_template_snapshot(const char *lang, const char *json_data, const ProjectInfo *info) {
+    SnapshotBuffer buf = {0};
+    SnapshotHeader header;
+    memset(&header, 0, sizeof(header));
+    uint64_t header_offset;
+
+    if (reserve(&buf, sizeof(header), &header_offset) != 0) {
+        goto fail;
+    }
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+    header.format_version = SNAPSHOT_FORMAT_VERSION;
+    header.source_hash = hash_bytes(json_data, strlen(json_data));
+    header.created_at = (int64_t)time(NULL);
+    header.version = info->version;
+    header.lib_support = info->lib_support;
+    header.special_build = info->special_build;
+    header.pointer_size = sizeof(char *);
+
+    if (append_string(&buf, lang, &header.lang) != 0 ||
+        append_string(&buf, registry_langs_url(), &header.registry) != 0) {
+        goto fail;
+    }
+    for (size_t i = 0; i < STRING_FIELD_COUNT; i++) {
+        if (append_string(&buf, *FIELD(info, string_fields[i], char *), &header.strings[i]) != 0) {
+            goto fail;
+        }
+    }
+    for (size_t i = 0; i < ARRAY_FIELD_COUNT; i++) {
+        char **items = *FIELD(info, array_fields[i].items, char **);
+        size_t count = *FIELD(info, array_fields[i].count, size_t);
+        if (append_array(&buf, items, count, &header.arrays[i]) != 0) {
+            goto fail;
+        }
+    }
+
+    header.build_systems.count = info->build_systems ? info->build_systems_count : 0;
+    if (header.build_systems.count > 0) {
+        if (reserve(&buf, header.build_systems.count * 2 * sizeof(uint64_t), &header.build_systems.offset) != 0) {
+            goto fail;
+        }
+        for (size_t i = 0; i < header.build_systems.count; i++) {
+            uint64_t pair[2];
+            if (append_string(&buf, info->build_systems[i].name, &pair[0]) != 0 ||
+                append_string(&buf, info->build_systems[i].path, &pair[1]) != 0) {
+                goto fail;
+            }
+            memcpy(buf.data + header.build_systems.offset + i * sizeof(pair), pair, sizeof(pair));
+        }
+    }
+
+    header.blob_size = buf.size;
+    memcpy(buf.data, &header, sizeof(header));
+
+    char path[4096];
+    char tmp_path[4200];
+    if (snapshot_file_path(lang, path, sizeof(path)) != 0) {
+        goto fail;
+    }
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp.%d", path, (int)getpid());
+
+    FILE *fp = fopen(tmp_path, "wb");
+    if (fp == NULL) {
+        perror("Error creating template snapshot");
+        goto fail;
+    }
+    size_t written = fwrite(buf.data, 1, buf.size, fp);
+    if (fclose(fp) != 0 || written != buf.size || rename(tmp_path, path) != 0) {
+        perror("Error writing template snapshot");
+        unlink(tmp_path);
+        goto fail;
+    }
+    STATS_INC(STAT_FILES_WRITTEN);
+
+    free(buf.data);
+    return 0;
+
+fail:
+    free(buf.data);
+    return -1;
+}
+
+static int check_string(const char *base, size_t size, uint64_t offset) {
+    if (offset == 0) {
+        return 0;
+    }
+    if (offset >= size || memchr(base + offset, '\0', size - offset) == NULL) {
+        return -1;
+    }
+    return 0;
+}
+
+static int check_table(size_t size, const SnapshotArray *array, size_t slot_size) {
+    if (array->count == 0) {
+        return 0;
+    }
+    if (array->offset % sizeof(uint64_t) != 0 || array->offset >= size ||
+        array->count > (size - array->offset) / slot_size) {
+        return -1;
+    }
+    return 0;
+}
+
+// Turns a table of blob offsets into a table of pointers, in place
+static int fix_up_table(char *base, size_t size, uint64_t offset, size_t slots) {
+    for (size_t i = 0; i < slots; i++) {
+        uint64_t str_offset;
+        memcpy(&str_offset, base + offset + i * sizeof(uint64_t), sizeof(uint64_t));
+        if (check_string(base, size, str_offset) != 0) {
+            return -1;
+        }
+        char *ptr = str_offset ? base + str_offset : NULL;
+        memcpy(base + offset + i * sizeof(uint64_t), &ptr, sizeof(ptr));
+    }
+    return 0;
+}
+
+static long snapshot_max_age() {
+    const char *env = getenv("KPM_SNAPSHOT_MAX_AGE");
+    if (env && env[0] != '\0') {
+        return strtol(env, NULL, 10);
+    }
+    return SNAPSHOT_MAX_AGE;
+}
+
+// Returns 0 and fills info when a fresh snapshot of the current registry exists, -1 if the caller
+// should fall back to JSON
+int load_template_snapshot(const char *lang, ProjectInfo *info) {
+    char path[4096];
+    if (sizeof(char *) != sizeof(uint64_t) || snapshot_file_path(lang, path, sizeof(path)) != 0) {
+        return -1;
+    }
+
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(SnapshotHeader)) {
+        close(fd);
+        return -1;
+    }
+    size_t size = st.st_size;
+    char *base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        return -1;
+    }
+
+    SnapshotHeader header;
+    memcpy(&header, base, sizeof(header));
+    if (memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic)) != 0 ||
+        header.format_version != SNAPSHOT_FORMAT_VERSION ||
+        header.pointer_size != (int32_t)sizeof(char *) ||
+        header.blob_size != size ||
+        check_string(base, size, header.lang) != 0 || header.lang == 0 ||
+        strcmp(base + header.lang, lang) != 0 ||
+        check_string(base, size, header.registry) != 0 || header.registry == 0) {
+        goto invalid;
+    }
+
+    long max_age = snapshot_max_age();
+    if (strcmp(base + header.registry, registry_langs_url()) != 0 ||
+        (max_age >= 0 && (int64_t)time(NULL) - header.created_at > max_age)) {
+        munmap(base, size);
+        return -1;
+    }
+
+    ProjectInfo loaded;
+    memset(&loaded, 0, sizeof(loaded));
+    loaded.version = header.version;
+    loaded.lib_support = header.lib_support;
+    loaded.special_build = header.special_build != 0;
+
+    for (size_t i = 0; i < STRING_FIELD_COUNT; i++) {
+        if (check_string(base, size, header.strings[i]) != 0) {
+            goto invalid;
+        }
+        *FIELD(&loaded, string_fields[i], char *) = header.strings[i] ? base + header.strings[i] : NULL;
+    }
+    for (size_t i = 0; i < ARRAY_FIELD_COUNT; i++) {
+        const SnapshotArray *array = &header.arrays[i];
+        if (check_table(size, array, sizeof(uint64_t)) != 0 ||
+            fix_up_table(base, size, array->offset, array->count) != 0) {
+            goto invalid;
+        }
+        *FIELD(&loaded, array_fields[i].items, char **) = array->count ? (char **)(base + array->offset) : NULL;
+        *FIELD(&loaded, array_fields[i].count, size_t) = array->count;
+    }
+    if (check_table(size, &header.build_systems, 2 * sizeof(uint64_t)) != 0 ||
+        fix_up_table(base, size, header.build_systems.offset, header.build_systems.count * 2) != 0) {
+        goto invalid;
+    }
+    loaded.build_systems = header.build_systems.count ? (BuildSystem *)(base + header.build_systems.offset) : NULL;
+    loaded.build_systems_count = header.build_systems.count;
+
+    loaded.snapshot = base;
+    loaded.snapshot_size = size;
+    *info = loaded;
+    return 0;
+
+invalid:
+    fprintf(stderr, "Ignoring invalid template snapshot %s\n", path);
+    munmap(base, size);
+    return -1;
+}
+
+void release_template_snapshot(ProjectInfo *info) {
+    if (info->snapshot) {
+        munmap(info->snapshot, info->snapshot_size);
+        memset(info, 0, sizeof(*info));
+    }
+}
+
+int compile_template_snapshot(const char *lang) {
+    char *bundle_path = NULL;
+    char *lang_path = get_lang_path(lang, &bundle_path);
+    if (lang_path == NULL) {
+        fprintf(stderr, "Failed to get path for language '%s'\n", lang);
+        return 1;
+    }
+
+    char lang_json[1024];
+    snprintf(lang_json, sizeof(lang_json), "%s%s", LANG_BASE_URL, lang_path);
+    free(lang_path);
+
+    char *lang_json_data = fetch_json(lang_json);
+    if (!lang_json_data) {
+        fprintf(stderr, "Failed to fetch language JSON data\n");
+        free(bundle_path);
+        return 1;
+    }
+
+    ProjectInfo info;
+    memset(&info, 0, sizeof(info));
+    parse_json(lang_json_data, &info);
+    if (bundle_path != NULL) {
+        info.bundle_path = arena_strdup(&info.arena, bundle_path);
+        free(bundle_path);
+    }
+    if (info.main_file_template == NULL) {
+        fprintf(stderr, "Template for language '%s' is missing main_file_template\n", lang);
+        free(lang_json_data);
+        free_project_info(&info);
+        return 1;
+    }
+
+    int ret = write_template_snapshot(lang, lang_json_data, &info);
+    free(lang_json_data);
+    free_project_info(&info);
+    if (ret != 0) {
+        fprintf(stderr, "Failed to write template snapshot for '%s'\n", lang);
+        return 1;
+    }
+    printf("Compiled template snapshot for %s\n", lang);
+    return 0;
+}
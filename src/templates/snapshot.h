@@ -0,0 +1,14 @@
+#ifndef __SNAPSHOT__H
+#define __SNAPSHOT__H
+#include "custom.h"
+
+#define SNAPSHOT_MAGIC "KPMT"
+#define SNAPSHOT_FORMAT_VERSION 3
+#define SNAPSHOT_DIR "templates"
+#define SNAPSHOT_MAX_AGE (24 * 60 * 60) // Override with KPM_SNAPSHOT_MAX_AGE (seconds)
+
+int compile_template_snapshot(const char *lang);
+int write_template_snapshot(const char *lang, const char *json_data, const ProjectInfo *info);
+int load_template_snapshot(const char *lang, ProjectInfo *info);
+void release_template_snapshot(ProjectInfo *info);
+#endif //__SNAPSHOT__H
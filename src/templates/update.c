@@ -0,0 +1,545 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <jansson.h>
+#include "update.h"
+#include "custom.h"
+#include "snapshot.h"
+#include "../cache/cache.h"
+#include "../registry/transfer.h"
+#include "../stats/stats.h"
+
+typedef struct {
+    const char *path;   // Relative to the langs base url, points into the manifest
+    uint64_t hash;
+    size_t size;
+    char *data;         // The new contents once known
+    int changed;
+} UpdateFile;
+
+typedef struct {
+    size_t updated;
+    size_t current;
+    size_t failed;
+    size_t fetched;            // Files downloaded, a bundle counts as one
+    unsigned long long bytes;  // Everything downloaded, the index and manifests included
+} UpdateTotals;
+
+static int manifest_path(const char *lang, char *out, size_t size) {
+    char name[512];
+    snprintf(name, sizeof(name), "%s%s", lang, BUNDLE_MANIFEST_SUFFIX);
+    return cache_path(out, size, SNAPSHOT_DIR, name);
+}
+
+static int cached_file_path(const char *lang, const char *path, char *out, size_t size) {
+    char name[2048];
+    snprintf(name, sizeof(name), "%s/%s", lang, path);
+    return cache_path(out, size, SNAPSHOT_DIR, name);
+}
+
+static json_t *load_cached_manifest(const char *lang) {
+    char path[4096];
+    if (manifest_path(lang, path, sizeof(path)) != 0) {
+        return NULL;
+    }
+    return json_load_file(path, 0, NULL);
+}
+
+static int parse_hash(const char *hex, uint64_t *hash) {
+    if (hex == NULL || strlen(hex) != 16 || strspn(hex, "0123456789abcdef") != 16) {
+        return -1;
+    }
+    *hash = strtoull(hex, NULL, 16);
+    return 0;
+}
+
+// The manifest's files, -1 if any entry is malformed or unsafe
+static int manifest_files(json_t *manifest, UpdateFile **out, size_t *count) {
+    json_t *listed = json_object_get(manifest, "files");
+    *out = NULL;
+    *count = 0;
+    if (!json_is_object(listed)) {
+        return -1;
+    }
+    UpdateFile *files = calloc(json_object_size(listed) + 1, sizeof(UpdateFile));
+    if (files == NULL) {
+        return -1;
+    }
+    size_t n = 0;
+    const char *key;
+    json_t *value;
+    json_object_foreach(listed, key, value) {
+        json_t *size = json_object_get(value, "size");
+        if (!safe_relative_path(key) || parse_hash(json_string_value(json_object_get(value, "hash")), &files[n].hash) != 0 ||
+            !json_is_integer(size) || json_integer_value(size) < 0) {
+            fprintf(stderr, "Bad manifest entry '%s'\n", key);
+            free(files);
+            return -1;
+        }
+        files[n].path = key;
+        files[n].size = (size_t)json_integer_value(size);
+        n++;
+    }
+    *out = files;
+    *count = n;
+    return 0;
+}
+
+static void free_files(UpdateFile *files, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        free(files[i].data);
+    }
+    free(files);
+}
+
+// The cached copy of path if it still has hash
+static char *read_cached(const char *lang, const char *path, uint64_t hash, size_t *size) {
+    char full[4096];
+    if (cached_file_path(lang, path, full, sizeof(full)) != 0) {
+        return NULL;
+    }
+    char *data = read_file_data(full, size);
+    if (data != NULL && hash_bytes(data, *size) != hash) {
+        free(data);
+        return NULL;
+    }
+    return data;
+}
+
+static int same_version(const char *a, const char *b) {
+    return a == NULL ? b == NULL : b != NULL && strcmp(a, b) == 0;
+}
+
+int template_cache_open(const char *lang, const char *template_version, TemplateBundle *bundle) {
+    memset(bundle, 0, sizeof(*bundle));
+    json_t *manifest = load_cached_manifest(lang);
+    UpdateFile *listed = NULL;
+    size_t count = 0;
+    if (manifest != NULL && !same_version(json_string_value(json_object_get(manifest, "template_version")), template_version)) {
+        json_decref(manifest);
+        return TEMPLATE_CACHE_OTHER_VERSION;
+    }
+    if (manifest == NULL || manifest_files(manifest, &listed, &count) != 0) {
+        json_decref(manifest);
+        return -1;
+    }
+    BundleFile *files = calloc(count + 1, sizeof(BundleFile));
+    size_t found = 0;
+    for (size_t i = 0; i < count && files != NULL; i++) {
+        // Anything missing or damaged is left for create_project to fetch
+        size_t size = 0;
+        char *data = read_cached(lang, listed[i].path, listed[i].hash, &size);
+        if (data != NULL) {
+            files[found].path = (char *)listed[i].path;
+            files[found].data = data;
+            files[found].size = size;
+            found++;
+        }
+    }
+    int ret = found > 0 ? bundle_build(files, found, bundle) : -1;
+    for (size_t i = 0; i < found; i++) {
+        free(files[i].data);
+    }
+    free(files);
+    free(listed);
+    json_decref(manifest);
+    return ret;
+}
+
+static char *registry_url(const char *path) {
+    char *url = malloc(strlen(LANG_BASE_URL) + strlen(path) + 2);
+    if (url != NULL) {
+        while (*path == '/') {
+            path++;
+        }
+        sprintf(url, "%s/%s", LANG_BASE_URL, path);
+    }
+    return url;
+}
+
+// The template's own update_url when its cached json has one, else the index's manifest
+static char *find_manifest_url(const char *lang, json_t *cached, json_t *entry) {
+    const char *lang_path = json_string_value(json_object_get(cached, "path"));
+    if (lang_path != NULL && safe_relative_path(lang_path + strspn(lang_path, "/"))) {
+        char full[4096];
+        size_t size = 0;
+        char *data = cached_file_path(lang, lang_path + strspn(lang_path, "/"), full, sizeof(full)) == 0
+                         ? read_file_data(full, &size) : NULL;
+        json_t *root = data ? json_loads(data, 0, NULL) : NULL;
+        const char *update_url = json_string_value(json_object_get(root, "update_url"));
+        char *url = NULL;
+        if (update_url != NULL && update_url[0] != '\0') {
+            url = strstr(update_url, "://") != NULL ? strdup(update_url) : registry_url(update_url);
+        }
+        json_decref(root);
+        free(data);
+        if (url != NULL) {
+            return url;
+        }
+    }
+    const char *manifest = json_string_value(json_object_get(entry, "manifest"));
+    return manifest ? registry_url(manifest) : NULL;
+}
+
+// A manifest for a registry that only publishes bundles, the files already filled in
+static json_t *manifest_from_bundle(const char *lang, json_t *entry, const char *version, TemplateBundle *bundle) {
+    json_t *manifest = json_object();
+    json_t *listed = json_object();
+    json_object_set_new(manifest, "name", json_string(lang));
+    if (version != NULL) {
+        json_object_set_new(manifest, "template_version", json_string(version));
+    }
+    json_object_set(manifest, "path", json_object_get(entry, "path"));
+    json_object_set(manifest, "bundle", json_object_get(entry, "bundle"));
+    for (size_t i = 0; i < bundle->count; i++) {
+        char hash[17];
+        snprintf(hash, sizeof(hash), "%016llx", (unsigned long long)bundle->entries[i].hash);
+        json_t *file = json_object();
+        json_object_set_new(file, "hash", json_string(hash));
+        json_object_set_new(file, "size", json_integer((json_int_t)bundle->entries[i].size));
+        json_object_set_new(listed, bundle->entries[i].path, file);
+    }
+    json_object_set_new(manifest, "files", listed);
+    return manifest;
+}
+
+static int fetch_bundle(const char *ref, TemplateBundle *bundle, UpdateTotals *totals) {
+    char *url = registry_url(ref);
+    RegistryResponse response;
+    int ret = -1;
+    if (url != NULL && registry_get(url, &response) == 0) {
+        totals->bytes += response.size;
+        ret = response.status == 200 ? bundle_open(response.data, response.size, bundle) : -1;
+        if (ret == 0) {
+            totals->fetched++;
+        } else {
+            fprintf(stderr, "Template bundle %s is unusable\n", url);
+        }
+        free(response.data);
+    }
+    free(url);
+    return ret;
+}
+
+// Takes whatever changed files the bundle has with the hash the manifest expects
+static void fill_from_bundle(UpdateFile *files, size_t count, const TemplateBundle *bundle) {
+    for (size_t i = 0; i < count; i++) {
+        const BundleEntry *entry = files[i].changed && files[i].data == NULL ? bundle_find(bundle, files[i].path) : NULL;
+        if (entry != NULL && entry->hash == files[i].hash) {
+            files[i].data = bundle_read(bundle, files[i].path);
+            files[i].size = entry->size;
+        }
+    }
+}
+
+// Recompiles the snapshot from the cached json, no request needed
+static int compile_cached(const char *lang, json_t *manifest) {
+    const char *lang_path = json_string_value(json_object_get(manifest, "path"));
+    const char *bundle_path = json_string_value(json_object_get(manifest, "bundle"));
+    uint64_t hash = 0;
+    json_t *entry = NULL;
+    if (lang_path != NULL) {
+        lang_path += strspn(lang_path, "/");
+        entry = json_object_get(json_object_get(manifest, "files"), lang_path);
+    }
+    size_t size = 0;
+    char *json_data = entry && parse_hash(json_string_value(json_object_get(entry, "hash")), &hash) == 0
+                          ? read_cached(lang, lang_path, hash, &size) : NULL;
+    if (json_data == NULL) {
+        fprintf(stderr, "Cached template '%s' has no language json\n", lang);
+        return -1;
+    }
+    ProjectInfo info;
+    memset(&info, 0, sizeof(info));
+    parse_json(json_data, &info);
+    if (bundle_path != NULL) {
+        info.bundle_path = arena_strdup(&info.arena, bundle_path);
+    }
+    int ret = info.main_file_template != NULL ? write_template_snapshot(lang, json_data, &info) : -1;
+    if (ret != 0) {
+        fprintf(stderr, "Failed to write template snapshot for '%s'\n", lang);
+    }
+    free(json_data);
+    free_project_info(&info);
+    return ret;
+}
+
+static int update_template(const char *lang, json_t *entry, UpdateTotals *totals) {
+    if (entry == NULL) {
+        fprintf(stderr, "Language '%s' is not in the registry index\n", lang);
+        return -1;
+    }
+    const char *version = json_string_value(json_object_get(entry, "version"));
+    json_t *cached = load_cached_manifest(lang);
+    UpdateFile *files = NULL;
+    size_t count = 0;
+
+    // Same version as the index lists: only check the copy is whole and the snapshot fresh
+    if (cached != NULL && version != NULL &&
+        same_version(json_string_value(json_object_get(cached, "template_version")), version) &&
+        manifest_files(cached, &files, &count) == 0) {
+        size_t intact = 0;
+        for (size_t i = 0; i < count; i++) {
+            size_t size = 0;
+            char *data = read_cached(lang, files[i].path, files[i].hash, &size);
+            intact += data != NULL;
+            free(data);
+        }
+        free_files(files, count);
+        if (intact == count) {
+            int ret = compile_cached(lang, cached);
+            json_decref(cached);
+            if (ret == 0) {
+                printf("%s is up to date (%s)\n", lang, version);
+                totals->current++;
+            }
+            return ret;
+        }
+    }
+
+    json_t *manifest = NULL;
+    TemplateBundle bundle;
+    memset(&bundle, 0, sizeof(bundle));
+    char *manifest_url = find_manifest_url(lang, cached, entry);
+    const char *bundle_ref = json_string_value(json_object_get(entry, "bundle"));
+    if (manifest_url != NULL) {
+        RegistryResponse response;
+        if (registry_get(manifest_url, &response) == 0) {
+            totals->bytes += response.size;
+            manifest = response.status == 200 ? json_loads(response.data, 0, NULL) : NULL;
+            free(response.data);
+        }
+        if (manifest == NULL) {
+            fprintf(stderr, "Failed to fetch template manifest %s\n", manifest_url);
+        }
+    } else if (bundle_ref != NULL) {
+        if (fetch_bundle(bundle_ref, &bundle, totals) == 0) {
+            manifest = manifest_from_bundle(lang, entry, version, &bundle);
+        }
+    } else {
+        fprintf(stderr, "The registry publishes no manifest or bundle for '%s', use kpm template compile %s\n", lang, lang);
+    }
+    free(manifest_url);
+
+    int ret = manifest != NULL ? manifest_files(manifest, &files, &count) : -1;
+    const char *lang_path = json_string_value(json_object_get(manifest, "path"));
+    if (ret == 0 && (lang_path == NULL || json_object_get(json_object_get(manifest, "files"), lang_path + strspn(lang_path, "/")) == NULL)) {
+        fprintf(stderr, "Manifest for '%s' does not list its language json\n", lang);
+        ret = -1;
+    }
+    size_t changed = 0;
+    size_t changed_bytes = 0;
+    size_t total_bytes = 0;
+    for (size_t i = 0; ret == 0 && i < count; i++) {
+        size_t size = 0;
+        char *data = read_cached(lang, files[i].path, files[i].hash, &size);
+        files[i].changed = data == NULL;
+        free(data);
+        changed += files[i].changed;
+        changed_bytes += files[i].changed ? files[i].size : 0;
+        total_bytes += files[i].size;
+    }
+    if (ret == 0 && bundle.pack != NULL) {
+        fill_from_bundle(files, count, &bundle);
+    }
+
+    // Most of the template changed: one compressed request beats a request per file
+    bundle_ref = json_string_value(json_object_get(manifest, "bundle"));
+    if (ret == 0 && bundle.pack == NULL && bundle_ref != NULL && changed > 1 &&
+        changed > count * UPDATE_BUNDLE_SHARE && changed_bytes > total_bytes * UPDATE_BUNDLE_SHARE) {
+        if (fetch_bundle(bundle_ref, &bundle, totals) == 0) {
+            fill_from_bundle(files, count, &bundle);
+        }
+    }
+
+    // Whatever is left, in one batch
+    RegistryRequest *requests = ret == 0 ? calloc(count + 1, sizeof(RegistryRequest)) : NULL;
+    size_t *index = ret == 0 ? calloc(count + 1, sizeof(size_t)) : NULL;
+    size_t requested = 0;
+    if (ret == 0 && (requests == NULL || index == NULL)) {
+        fprintf(stderr, "Failed to allocate memory\n");
+        ret = -1;
+    }
+    for (size_t i = 0; ret == 0 && i < count; i++) {
+        if (files[i].changed && files[i].data == NULL) {
+            requests[requested].url = registry_url(files[i].path);
+            requests[requested].priority = REQUEST_NORMAL;
+            index[requested++] = i;
+        }
+    }
+    if (requested > 0) {
+        registry_fetch_all(requests, requested);
+    }
+    for (size_t r = 0; r < requested; r++) {
+        UpdateFile *file = &files[index[r]];
+        RegistryRequest *request = &requests[r];
+        totals->bytes += request->response.size;
+        if (request->result != 0 || request->response.status != 200) {
+            fprintf(stderr, "Failed to fetch %s\n", request->url);
+            ret = -1;
+        } else if (hash_bytes(request->response.data, request->response.size) != file->hash) {
+            // Published halfway through, the next update will see it whole
+            fprintf(stderr, "%s does not match its manifest, not updating '%s'\n", request->url, lang);
+            ret = -1;
+        } else {
+            totals->fetched++;
+            file->data = request->response.data;
+            file->size = request->response.size;
+            request->response.data = NULL;
+        }
+        free(request->response.data);
+        free((char *)request->url);
+    }
+    free(requests);
+    free(index);
+
+    // Nothing is written unless every file arrived, the manifest goes last
+    size_t written = 0;
+    for (size_t i = 0; ret == 0 && i < count; i++) {
+        if (!files[i].changed) {
+            continue;
+        }
+        char path[4096];
+        char dir[4096];
+        if (cached_file_path(lang, files[i].path, path, sizeof(path)) != 0) {
+            ret = -1;
+            break;
+        }
+        snprintf(dir, sizeof(dir), "%s", path);
+        *strrchr(dir, '/') = '\0';
+        if (make_dirs(dir) != 0 || write_file_atomic(path, files[i].data, files[i].size) != 0) {
+            fprintf(stderr, "Failed to write %s: %s\n", path, strerror(errno));
+            ret = -1;
+            break;
+        }
+        STATS_INC(STAT_FILES_WRITTEN);
+        written++;
+    }
+    if (ret == 0 && cached != NULL) {
+        // Files the template dropped
+        const char *key;
+        json_t *value;
+        json_object_foreach(json_object_get(cached, "files"), key, value) {
+            char path[4096];
+            (void)value;
+            if (safe_relative_path(key) && json_object_get(json_object_get(manifest, "files"), key) == NULL &&
+                cached_file_path(lang, key, path, sizeof(path)) == 0) {
+                unlink(path);
+            }
+        }
+    }
+    if (ret == 0) {
+        char path[4096];
+        char *text = json_dumps(manifest, JSON_INDENT(4));
+        if (text == NULL || manifest_path(lang, path, sizeof(path)) != 0 ||
+            write_file_atomic(path, text, strlen(text)) != 0) {
+            fprintf(stderr, "Failed to save the manifest of '%s'\n", lang);
+            ret = -1;
+        }
+        free(text);
+    }
+    if (ret == 0) {
+        ret = compile_cached(lang, manifest);
+    }
+    const char *old_version = json_string_value(json_object_get(cached, "template_version"));
+    const char *new_version = json_string_value(json_object_get(manifest, "template_version"));
+    if (ret == 0 && cached != NULL && written == 0 && same_version(old_version, new_version)) {
+        printf("%s is up to date (%s)\n", lang, new_version ? new_version : "unversioned");
+        totals->current++;
+    } else if (ret == 0) {
+        printf("%s updated %s -> %s, %zu of %zu files changed\n", lang, cached ? (old_version ? old_version : "unversioned") : "none",
+               new_version ? new_version : "unversioned", written, count);
+        totals->updated++;
+    }
+    free_files(files, count);
+    bundle_free(&bundle);
+    json_decref(manifest);
+    json_decref(cached);
+    return ret;
+}
+
+static int add_language(char ***langs, size_t *count, const char *lang, size_t len) {
+    for (size_t i = 0; i < *count; i++) {
+        if (strlen((*langs)[i]) == len && strncmp((*langs)[i], lang, len) == 0) {
+            return 0;
+        }
+    }
+    char **grown = realloc(*langs, (*count + 1) * sizeof(char *));
+    if (grown == NULL) {
+        return -1;
+    }
+    *langs = grown;
+    grown[*count] = strndup(lang, len);
+    return grown[(*count)++] == NULL ? -1 : 0;
+}
+
+// Every language with a snapshot or a cached copy
+static void cached_languages(char ***langs, size_t *count) {
+    char dir[4096];
+    if (cache_path(dir, sizeof(dir), SNAPSHOT_DIR, "") != 0) {
+        return;
+    }
+    DIR *d = opendir(dir);
+    struct dirent *item;
+    while (d != NULL && (item = readdir(d)) != NULL) {
+        const char *suffixes[] = {".kpmt", BUNDLE_MANIFEST_SUFFIX};
+        size_t len = strlen(item->d_name);
+        for (size_t i = 0; i < 2; i++) {
+            size_t suffix_len = strlen(suffixes[i]);
+            if (len > suffix_len && strcmp(item->d_name + len - suffix_len, suffixes[i]) == 0) {
+                add_language(langs, count, item->d_name, len - suffix_len);
+            }
+        }
+    }
+    if (d != NULL) {
+        closedir(d);
+    }
+}
+
+int template_update_main(int argc, char **argv) {
+    char **langs = NULL;
+    size_t count = 0;
+    for (int i = 0; i < argc; i++) {
+        add_language(&langs, &count, argv[i], strlen(argv[i]));
+    }
+    if (argc == 0) {
+        cached_languages(&langs, &count);
+    }
+    if (count == 0) {
+        fprintf(stderr, "No cached templates, run kpm template update <language>...\n");
+        return 1;
+    }
+
+    UpdateTotals totals;
+    memset(&totals, 0, sizeof(totals));
+    char url[1024];
+    snprintf(url, sizeof(url), "%s/index.json", LANG_BASE_URL);
+    RegistryResponse response;
+    json_t *index = NULL;
+    if (registry_get(url, &response) == 0) {
+        totals.bytes += response.size;
+        index = response.status == 200 ? json_loads(response.data, 0, NULL) : NULL;
+        free(response.data);
+    }
+    if (index == NULL) {
+        fprintf(stderr, "Failed to fetch %s\n", url);
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        if (strchr(langs[i], '/') != NULL || !safe_relative_path(langs[i])) {
+            fprintf(stderr, "Invalid language name '%s'\n", langs[i]);
+            totals.failed++;
+        } else if (index == NULL || update_template(langs[i], json_object_get(json_object_get(index, "langs"), langs[i]), &totals) != 0) {
+            totals.failed++;
+        }
+        free(langs[i]);
+    }
+    free(langs);
+    json_decref(index);
+    printf("%zu templates: %zu updated, %zu up to date, %zu failed, %zu files fetched, %llu bytes downloaded\n", count,
+           totals.updated, totals.current, totals.failed, totals.fetched, totals.bytes);
+    return totals.failed == 0 ? 0 : 1;
+}
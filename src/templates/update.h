@@ -0,0 +1,22 @@
+#ifndef __UPDATE__H
+#define __UPDATE__H
+#include "bundle.h"
+
+// kpm template update keeps every file of a template under <cache>/templates/<lang>/
+// (paths as in the bundle, "c/main.c") and the manifest they match in
+// <cache>/templates/<lang>.manifest.json (format in bundle.h). An update fetches
+// the index once, and a template whose "version" there is the cached one costs
+// nothing more. Otherwise its manifest is fetched (the template's update_url, or
+// the index's "manifest") and only files whose hash differs are downloaded, or
+// the bundle when most of them did. The snapshot (snapshot.h) is then recompiled
+// from the cached json, and kpm init takes its files from the cache.
+#define UPDATE_BUNDLE_SHARE 0.5 // Share of a template's files and bytes changed past which its bundle is fetched instead
+
+// kpm template update [language...], every template with a cached copy or snapshot when none are given
+int template_update_main(int argc, char **argv);
+#define TEMPLATE_CACHE_OTHER_VERSION -2
+
+// The cached files of lang as a bundle, -1 unless there are some and they are template_version,
+// TEMPLATE_CACHE_OTHER_VERSION when the cache holds a different version of the template
+int template_cache_open(const char *lang, const char *template_version, TemplateBundle *bundle);
+#endif //__UPDATE__H
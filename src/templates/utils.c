@@ -2,6 +2,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
+#include "../memory/alloc_profile.h"
 void remove_trailing_newline(char *str) {
     size_t len = strlen(str);
     if (len > 0 && str[len - 1] == '\n') {
@@ -30,7 +31,9 @@ char *replace_string(const char *str, const char *old_substr, const char *new_su
     }
 
     // Allocating memory for the new result string
+    AllocPhase phase = alloc_phase_enter(ALLOC_PHASE_RENDER);
     result = (char *)malloc(i + count * (new_len - old_len) + 1);
+    alloc_phase_leave(phase);
     if (!result) {
         printf("Memory allocation failed.\n");
         return NULL;
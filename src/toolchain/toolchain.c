@@ -0,0 +1,517 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <spawn.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include "toolchain.h"
+#include "../cache/cache.h"
+#include "../trace/trace.h"
+#include "../stats/stats.h"
+
+extern char **environ;
+
+#define TOOLCHAIN_HEADER "kpm-toolchains 1"
+#define MAX_WORDS 16
+
+typedef struct {
+    Toolchain toolchain;
+    dev_t dev;
+    ino_t ino;
+    long long mtime_ns;
+    long long size;
+} Entry;
+
+typedef struct {
+    const char *name;
+    const char *version_args;  // Appended to the name for its version command
+    const char *triple_args;   // Prints the target, NULL if there is no cheap way to ask
+    const char *triple_after;  // The target follows this in that output, NULL for its first line
+} KnownToolchain;
+
+// What kpm doctor probes, and the version command toolchain_find uses for these names
+static const KnownToolchain known[] = {
+    {"cc", "--version", "-dumpmachine", NULL},
+    {"gcc", "--version", "-dumpmachine", NULL},
+    {"g++", "--version", "-dumpmachine", NULL},
+    {"clang", "--version", "-dumpmachine", NULL},
+    {"clang++", "--version", "-dumpmachine", NULL},
+    {"rustc", "--version", "-vV", "host: "},
+    {"cargo", "--version", NULL, NULL},
+    {"go", "version", NULL, NULL},
+    {"python3", "--version", NULL, NULL},
+    {"python", "--version", NULL, NULL},
+    {"java", "-version", NULL, NULL},
+    {"javac", "-version", NULL, NULL},
+    {"swift", "--version", "-print-target-info", "\"triple\": \""},
+    {"node", "--version", NULL, NULL},
+    {"zig", "version", NULL, NULL},
+    {"make", "--version", NULL, NULL},
+    {"cmake", "--version", NULL, NULL},
+    {"git", "--version", NULL, NULL},
+};
+#define KNOWN_COUNT (sizeof(known) / sizeof(known[0]))
+
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static Entry *entries = NULL;
+static size_t entry_count = 0;
+static int loaded = 0;
+static int dirty = 0;
+
+static int cache_file(char *out, size_t size) {
+    if (make_dirs(get_cache_dir()) != 0) {
+        return -1;
+    }
+    int len = snprintf(out, size, "%s/toolchains", get_cache_dir());
+    return len < 0 || (size_t)len >= size ? -1 : 0;
+}
+
+static uint64_t path_hash() {
+    const char *path = getenv("PATH");
+    return hash_bytes(path ? path : "", path ? strlen(path) : 0);
+}
+
+// Splits at tabs in place, empty fields included
+static size_t split_fields(char *line, char **fields, size_t max) {
+    size_t count = 0;
+    while (count < max) {
+        fields[count++] = line;
+        char *tab = strchr(line, '\t');
+        if (tab == NULL) {
+            break;
+        }
+        *tab = '\0';
+        line = tab + 1;
+    }
+    return count;
+}
+
+// Called with cache_lock held. Entries recorded under another $PATH are dropped
+static void load_cache() {
+    if (loaded) {
+        return;
+    }
+    loaded = 1;
+    char path[4096];
+    if (cache_file(path, sizeof(path)) != 0) {
+        return;
+    }
+    size_t size = 0;
+    char *data = read_file_data(path, &size);
+    if (data == NULL) {
+        return;
+    }
+    char header[64];
+    snprintf(header, sizeof(header), "%s %016llx\n", TOOLCHAIN_HEADER, (unsigned long long)path_hash());
+    if (strncmp(data, header, strlen(header)) != 0) {
+        free(data);
+        return;
+    }
+    char *saveptr = NULL;
+    for (char *line = strtok_r(data + strlen(header), "\n", &saveptr); line; line = strtok_r(NULL, "\n", &saveptr)) {
+        char *fields[9];
+        if (split_fields(line, fields, 9) != 9) {
+            continue;
+        }
+        Entry *grown = realloc(entries, (entry_count + 1) * sizeof(Entry));
+        if (grown == NULL) {
+            break;
+        }
+        entries = grown;
+        Entry *entry = &entries[entry_count++];
+        memset(entry, 0, sizeof(*entry));
+        snprintf(entry->toolchain.command, sizeof(entry->toolchain.command), "%s", fields[0]);
+        snprintf(entry->toolchain.path, sizeof(entry->toolchain.path), "%s", fields[1]);
+        entry->dev = (dev_t)strtoull(fields[2], NULL, 10);
+        entry->ino = (ino_t)strtoull(fields[3], NULL, 10);
+        entry->mtime_ns = strtoll(fields[4], NULL, 10);
+        entry->size = strtoll(fields[5], NULL, 10);
+        entry->toolchain.status = atoi(fields[6]);
+        snprintf(entry->toolchain.version, sizeof(entry->toolchain.version), "%s", fields[7]);
+        snprintf(entry->toolchain.triple, sizeof(entry->toolchain.triple), "%s", fields[8]);
+    }
+    free(data);
+}
+
+// Called with cache_lock held
+static void save_cache() {
+    if (!dirty) {
+        return;
+    }
+    dirty = 0;
+    char path[4096];
+    if (cache_file(path, sizeof(path)) != 0) {
+        return;
+    }
+    size_t capacity = 64 + entry_count * (sizeof(Toolchain) + 128);
+    char *text = malloc(capacity);
+    if (text == NULL) {
+        return;
+    }
+    size_t len = (size_t)snprintf(text, capacity, "%s %016llx\n", TOOLCHAIN_HEADER, (unsigned long long)path_hash());
+    for (size_t i = 0; i < entry_count && len < capacity; i++) {
+        const Entry *entry = &entries[i];
+        len += (size_t)snprintf(text + len, capacity - len, "%s\t%s\t%llu\t%llu\t%lld\t%lld\t%d\t%s\t%s\n",
+                                entry->toolchain.command, entry->toolchain.path, (unsigned long long)entry->dev,
+                                (unsigned long long)entry->ino, entry->mtime_ns, entry->size, entry->toolchain.status,
+                                entry->toolchain.version, entry->toolchain.triple);
+    }
+    if (len >= capacity || write_file_atomic(path, text, len) != 0) {
+        fprintf(stderr, "Failed to write %s\n", path);
+    }
+    free(text);
+}
+
+// The file exec would run for name, the way the shell searches $PATH
+static int resolve(const char *name, char *out, size_t size, struct stat *st) {
+    if (strchr(name, '/') != NULL) {
+        snprintf(out, size, "%s", name);
+        return stat(out, st) == 0 && S_ISREG(st->st_mode) && access(out, X_OK) == 0 ? 0 : -1;
+    }
+    const char *dirs = getenv("PATH");
+    if (dirs == NULL) {
+        dirs = "/usr/local/bin:/usr/bin:/bin";
+    }
+    while (1) {
+        size_t len = strcspn(dirs, ":");
+        snprintf(out, size, "%.*s/%s", (int)(len ? len : 1), len ? dirs : ".", name);
+        if (stat(out, st) == 0 && S_ISREG(st->st_mode) && access(out, X_OK) == 0) {
+            return 0;
+        }
+        if (dirs[len] == '\0') {
+            return -1;
+        }
+        dirs += len + 1;
+    }
+}
+
+static long long mtime_ns(const struct stat *st) {
+    return (long long)st->st_mtim.tv_sec * 1000000000LL + st->st_mtim.tv_nsec;
+}
+
+// Keeps tabs and newlines out of the cache's fields
+static void clean_field(char *s) {
+    for (; *s; s++) {
+        if (*s == '\t' || *s == '\r' || *s == '\n') {
+            *s = ' ';
+        }
+    }
+}
+
+// Runs path with argv directly, no shell. Returns its exit status and what it printed
+// on stdout and stderr, truncated to size
+static int run_capture(const char *path, char **argv, char *out, size_t size) {
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC) != 0) {
+        return -1;
+    }
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_addopen(&actions, 0, "/dev/null", O_RDONLY, 0);
+    posix_spawn_file_actions_adddup2(&actions, fds[1], 1);
+    posix_spawn_file_actions_adddup2(&actions, fds[1], 2);
+
+    char joined[512] = "";
+    for (size_t i = 0; argv[i] != NULL; i++) {
+        size_t len = strlen(joined);
+        snprintf(joined + len, sizeof(joined) - len, "%s%s", i ? " " : "", argv[i]);
+    }
+    TraceSpan span;
+    trace_begin(&span, "spawn", joined);
+    STATS_INC(STAT_PROCESSES_SPAWNED);
+    pid_t pid;
+    int spawned = posix_spawn(&pid, path, &actions, NULL, argv, environ);
+    posix_spawn_file_actions_destroy(&actions);
+    close(fds[1]);
+    size_t len = 0;
+    char drain[4096];
+    while (spawned == 0) {
+        // Past size, the rest is read and dropped so the child never blocks on a full pipe
+        ssize_t n = len + 1 < size ? read(fds[0], out + len, size - len - 1) : read(fds[0], drain, sizeof(drain));
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        if (len + 1 < size) {
+            len += (size_t)n;
+        }
+    }
+    close(fds[0]);
+    out[len] = '\0';
+    int status = -1;
+    if (spawned == 0) {
+        while (waitpid(pid, &status, 0) < 0 && errno == EINTR) {
+        }
+        status = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + (WIFSIGNALED(status) ? WTERMSIG(status) : 0);
+    }
+    char detail[32];
+    snprintf(detail, sizeof(detail), "%d", status);
+    trace_end_detail(&span, "status", detail);
+    return status;
+}
+
+// The first non-blank line of output, or what follows after up to a quote or line end
+static void extract(const char *output, const char *after, char *out, size_t size) {
+    const char *start = output;
+    if (after != NULL) {
+        start = strstr(output, after);
+        if (start == NULL) {
+            out[0] = '\0';
+            return;
+        }
+        start += strlen(after);
+    } else {
+        start += strspn(start, " \t\r\n");
+    }
+    size_t len = strcspn(start, after != NULL ? "\"\r\n" : "\r\n");
+    snprintf(out, size, "%.*s", (int)len, start);
+    clean_field(out);
+}
+
+static const KnownToolchain *find_known(const char *name) {
+    for (size_t i = 0; i < KNOWN_COUNT; i++) {
+        if (strcmp(known[i].name, name) == 0) {
+            return &known[i];
+        }
+    }
+    return NULL;
+}
+
+// Splits a command into words, -1 if the shell would do anything with it beyond
+// running one program: quoting, expansion, pipes, lists. Output redirections are dropped
+static int split_command(const char *command, char *buffer, size_t size, char **words) {
+    if (strlen(command) >= size || strpbrk(command, "\"'`$\\;|()<*?[]{}~#!=%") != NULL) {
+        return -1;
+    }
+    snprintf(buffer, size, "%s", command);
+    size_t count = 0;
+    char *saveptr = NULL;
+    int redirect = 0;
+    for (char *word = strtok_r(buffer, " \t", &saveptr); word; word = strtok_r(NULL, " \t", &saveptr)) {
+        if (redirect) {
+            redirect = 0;
+            if (strcmp(word, "/dev/null") != 0) {
+                return -1;
+            }
+            continue;
+        }
+        if (strcmp(word, ">") == 0 || strcmp(word, "1>") == 0 || strcmp(word, "2>") == 0) {
+            redirect = 1;
+            continue;
+        }
+        if (strcmp(word, ">/dev/null") == 0 || strcmp(word, "2>/dev/null") == 0 || strcmp(word, "2>&1") == 0 ||
+            strcmp(word, "&>/dev/null") == 0) {
+            continue;
+        }
+        if (strchr(word, '&') != NULL || strchr(word, '>') != NULL || count + 1 >= MAX_WORDS) {
+            return -1;
+        }
+        words[count++] = word;
+    }
+    words[count] = NULL;
+    return redirect || count == 0 ? -1 : (int)count;
+}
+
+// Looks words up, running them unless the cache has an entry for the same file under the
+// same $PATH. triple, when set, also asks for the target. refresh ignores the cache
+static int probe(char **words, const KnownToolchain *triple, int refresh, Toolchain *result) {
+    char command[256] = "";
+    for (size_t i = 0; words[i] != NULL; i++) {
+        size_t len = strlen(command);
+        snprintf(command + len, sizeof(command) - len, "%s%s", i ? " " : "", words[i]);
+    }
+    Toolchain found;
+    memset(&found, 0, sizeof(found));
+    snprintf(found.command, sizeof(found.command), "%s", command);
+    struct stat st;
+    if (resolve(words[0], found.path, sizeof(found.path), &st) != 0) {
+        found.path[0] = '\0';
+        found.status = 127;
+        found.cached = 1;
+        if (result) {
+            *result = found;
+        }
+        return found.status;
+    }
+
+    pthread_mutex_lock(&cache_lock);
+    load_cache();
+    Entry *entry = NULL;
+    for (size_t i = 0; i < entry_count && entry == NULL; i++) {
+        if (strcmp(entries[i].toolchain.command, command) == 0) {
+            entry = &entries[i];
+        }
+    }
+    int hit = !refresh && entry != NULL && strcmp(entry->toolchain.path, found.path) == 0 && entry->dev == st.st_dev &&
+              entry->ino == st.st_ino && entry->mtime_ns == mtime_ns(&st) && entry->size == (long long)st.st_size &&
+              (triple == NULL || triple->triple_args == NULL || entry->toolchain.triple[0] != '\0' ||
+               entry->toolchain.status != 0);
+    if (hit) {
+        found = entry->toolchain;
+        found.cached = 1;
+    }
+    pthread_mutex_unlock(&cache_lock);
+    if (hit) {
+        STATS_INC(STAT_CACHE_HITS);
+        if (result) {
+            *result = found;
+        }
+        return found.status;
+    }
+
+    STATS_INC(STAT_CACHE_MISSES);
+    char output[4096];
+    found.status = run_capture(found.path, words, output, sizeof(output));
+    extract(output, NULL, found.version, sizeof(found.version));
+    if (triple != NULL && triple->triple_args != NULL && found.status == 0) {
+        char *args[] = {words[0], (char *)triple->triple_args, NULL};
+        if (run_capture(found.path, args, output, sizeof(output)) == 0) {
+            extract(output, triple->triple_after, found.triple, sizeof(found.triple));
+        }
+        if (found.triple[0] == '\0') {
+            // Asked and it did not say, so the next kpm doctor does not ask again
+            snprintf(found.triple, sizeof(found.triple), "-");
+        }
+    }
+    if (found.status < 0) {
+        // Could not be run at all, nothing worth remembering
+        found.status = 127;
+        if (result) {
+            *result = found;
+        }
+        return found.status;
+    }
+
+    pthread_mutex_lock(&cache_lock);
+    entry = NULL;
+    for (size_t i = 0; i < entry_count && entry == NULL; i++) {
+        if (strcmp(entries[i].toolchain.command, command) == 0) {
+            entry = &entries[i];
+        }
+    }
+    if (entry == NULL) {
+        Entry *grown = realloc(entries, (entry_count + 1) * sizeof(Entry));
+        if (grown != NULL) {
+            entries = grown;
+            entry = &entries[entry_count++];
+            memset(entry, 0, sizeof(*entry));
+        }
+    }
+    if (entry != NULL) {
+        if (found.triple[0] == '\0' && strcmp(entry->toolchain.path, found.path) == 0 && entry->ino == st.st_ino &&
+            entry->mtime_ns == mtime_ns(&st)) {
+            // A plain lookup keeps the target kpm doctor found for the same binary
+            memcpy(found.triple, entry->toolchain.triple, sizeof(found.triple));
+        }
+        entry->toolchain = found;
+        entry->dev = st.st_dev;
+        entry->ino = st.st_ino;
+        entry->mtime_ns = mtime_ns(&st);
+        entry->size = (long long)st.st_size;
+        dirty = 1;
+    }
+    pthread_mutex_unlock(&cache_lock);
+    if (result) {
+        *result = found;
+    }
+    return found.status;
+}
+
+static int find_toolchain(const char *name, int refresh, int with_triple, Toolchain *toolchain) {
+    const KnownToolchain *info = find_known(name);
+    char *words[] = {(char *)name, (char *)(info ? info->version_args : "--version"), NULL};
+    return probe(words, with_triple ? info : NULL, refresh, toolchain);
+}
+
+int toolchain_find(const char *name, Toolchain *toolchain) {
+    int status = find_toolchain(name, 0, 0, toolchain);
+    pthread_mutex_lock(&cache_lock);
+    save_cache();
+    pthread_mutex_unlock(&cache_lock);
+    return status == 0 ? 0 : -1;
+}
+
+int toolchain_check_command(const char *command) {
+    if (command == NULL) {
+        return -1;
+    }
+    char buffer[256];
+    char *words[MAX_WORDS];
+    if (split_command(command, buffer, sizeof(buffer), words) < 0) {
+        return trace_system(command);
+    }
+    int status = probe(words, NULL, 0, NULL);
+    pthread_mutex_lock(&cache_lock);
+    save_cache();
+    pthread_mutex_unlock(&cache_lock);
+    return status;
+}
+
+typedef struct {
+    const KnownToolchain *known;
+    int refresh;
+    Toolchain toolchain;
+    int status;
+    pthread_t thread;
+    int started;
+} DoctorJob;
+
+static void *doctor_thread(void *arg) {
+    DoctorJob *job = arg;
+    job->status = find_toolchain(job->known->name, job->refresh, 1, &job->toolchain);
+    return NULL;
+}
+
+int doctor_main(int argc, char **argv) {
+    int refresh = 0;
+    for (int i = 0; i < argc; i++) {
+        if (strcmp(argv[i], "--refresh") == 0) {
+            refresh = 1;
+        } else {
+            fprintf(stderr, "Usage: kpm doctor [--refresh]\n");
+            return 1;
+        }
+    }
+    // One thread per toolchain, a slow JVM startup only holds up its own line
+    DoctorJob jobs[KNOWN_COUNT];
+    memset(jobs, 0, sizeof(jobs));
+    for (size_t i = 0; i < KNOWN_COUNT; i++) {
+        jobs[i].known = &known[i];
+        jobs[i].refresh = refresh;
+        jobs[i].started = pthread_create(&jobs[i].thread, NULL, doctor_thread, &jobs[i]) == 0;
+        if (!jobs[i].started) {
+            doctor_thread(&jobs[i]);
+        }
+    }
+    size_t found = 0;
+    size_t probed = 0;
+    size_t cached = 0;
+    printf("%-9s %-8s %-40s %-28s %s\n", "toolchain", "status", "version", "target", "path");
+    for (size_t i = 0; i < KNOWN_COUNT; i++) {
+        if (jobs[i].started) {
+            pthread_join(jobs[i].thread, NULL);
+        }
+        const Toolchain *toolchain = &jobs[i].toolchain;
+        const char *status = toolchain->path[0] == '\0' ? "missing" : jobs[i].status == 0 ? "ok" : "broken";
+        printf("%-9s %-8s %-40.40s %-28s %s\n", jobs[i].known->name, status, toolchain->version,
+               toolchain->triple[0] ? toolchain->triple : "-", toolchain->path[0] ? toolchain->path : "-");
+        found += jobs[i].status == 0;
+        probed += toolchain->path[0] != '\0' && !toolchain->cached;
+        cached += toolchain->path[0] != '\0' && toolchain->cached;
+    }
+    pthread_mutex_lock(&cache_lock);
+    save_cache();
+    pthread_mutex_unlock(&cache_lock);
+    char path[4096];
+    cache_file(path, sizeof(path));
+    printf("%zu of %zu toolchains found, %zu probed, %zu from %s\n", found, KNOWN_COUNT, probed, cached, path);
+    return 0;
+}
@@ -0,0 +1,30 @@
+#ifndef __TOOLCHAIN__H
+#define __TOOLCHAIN__H
+
+// kpm init checks for a template's compiler and for git. Each check is a command
+// (its words without redirections, "gcc --version") whose result is kept in
+// <cache>/toolchains:
+//     kpm-toolchains 1 <hash of $PATH>
+//     <command>\t<path>\t<device>\t<inode>\t<mtime ns>\t<size>\t<exit status>\t<version>\t<triple>
+// The program is looked up on $PATH with stat alone, and an entry holds while $PATH
+// hashes the same and it finds the same file (path, device, inode, mtime, size).
+// Anything else runs the command again. A program that is not on $PATH is missing
+// without running anything. kpm doctor probes every known toolchain at once and
+// also records the target triple of the compilers that report one.
+typedef struct {
+    char command[256];
+    char path[1024];
+    char version[256];   // First line the command printed, stdout or stderr
+    char triple[128];    // Target it builds for, empty until kpm doctor asks and "-" if it does not say
+    int status;          // Exit status, 127 if the program is not on $PATH
+    int cached;          // 1 if nothing was run to get this
+} Toolchain;
+
+// 0 if name is on $PATH and its version command works, filling toolchain when it is not NULL
+int toolchain_find(const char *name, Toolchain *toolchain);
+// Exit status of a template's compiler_cmd ("gcc --version > /dev/null"), from the
+// cache when it is a plain command. Anything the shell has to interpret runs through system()
+int toolchain_check_command(const char *command);
+// kpm doctor [--refresh]
+int doctor_main(int argc, char **argv);
+#endif //__TOOLCHAIN__H
@@ -0,0 +1,203 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include "trace.h"
+#include "../stats/stats.h"
+#include "../json/writer.h"
+
+typedef struct {
+    const char *category;
+    char *name;
+    char *args; // Pre-rendered JSON object or NULL
+    long long ts;
+    long long dur;
+    int tid;
+} TraceEvent;
+
+static char *trace_path = NULL;
+static TraceEvent *events = NULL;
+static size_t event_count = 0;
+static size_t event_capacity = 0;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static long long now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+int trace_start(const char *path) {
+    if (path == NULL || path[0] == '\0') {
+        fprintf(stderr, "--trace needs a file name, e.g. --trace=out.json\n");
+        return -1;
+    }
+    free(trace_path);
+    trace_path = strdup(path);
+    if (trace_path == NULL) {
+        return -1;
+    }
+    atexit(trace_finish);
+    return 0;
+}
+
+int trace_enabled() {
+    return trace_path != NULL;
+}
+
+static void add_event(const char *category, const char *name, long long ts, long long dur, char *args) {
+    pthread_mutex_lock(&trace_lock);
+    if (event_count == event_capacity) {
+        size_t capacity = event_capacity ? event_capacity * 2 : 256;
+        TraceEvent *grown = realloc(events, capacity * sizeof(TraceEvent));
+        if (grown == NULL) {
+            pthread_mutex_unlock(&trace_lock);
+            free(args);
+            return;
+        }
+        events = grown;
+        event_capacity = capacity;
+    }
+    TraceEvent *event = &events[event_count++];
+    event->category = category;
+    event->name = strdup(name);
+    event->args = args;
+    event->ts = ts;
+    event->dur = dur < 0 ? 0 : dur;
+    event->tid = (int)syscall(SYS_gettid);
+    pthread_mutex_unlock(&trace_lock);
+}
+
+void trace_begin(TraceSpan *span, const char *category, const char *name) {
+    span->category = category;
+    span->start_us = 0;
+    if (!trace_enabled()) {
+        return;
+    }
+    snprintf(span->name, sizeof(span->name), "%s", name ? name : "(null)");
+    span->start_us = now_us();
+}
+
+void trace_end(TraceSpan *span) {
+    if (!trace_enabled() || span->start_us == 0) {
+        return;
+    }
+    add_event(span->category, span->name, span->start_us, now_us() - span->start_us, NULL);
+}
+
+// Builds {"key":"value"} on the heap
+static char *render_arg(const char *key, const char *value) {
+    char *args = NULL;
+    size_t size = 0;
+    FILE *out = open_memstream(&args, &size);
+    if (out == NULL) {
+        return NULL;
+    }
+    fputc('{', out);
+    json_write_string(out, key);
+    fputc(':', out);
+    json_write_string(out, value ? value : "(null)");
+    fputc('}', out);
+    fclose(out);
+    return args;
+}
+
+void trace_end_detail(TraceSpan *span, const char *key, const char *value) {
+    if (!trace_enabled() || span->start_us == 0) {
+        return;
+    }
+    add_event(span->category, span->name, span->start_us, now_us() - span->start_us, render_arg(key, value));
+}
+
+void trace_end_curl(TraceSpan *span, CURL *curl, CURLcode res) {
+    if (!trace_enabled() || span->start_us == 0) {
+        return;
+    }
+    long long end = now_us();
+    curl_off_t dns = 0, connect = 0, tls = 0, pretransfer = 0, first_byte = 0, total = 0, bytes = 0;
+    long status = 0;
+    curl_easy_getinfo(curl, CURLINFO_NAMELOOKUP_TIME_T, &dns);
+    curl_easy_getinfo(curl, CURLINFO_CONNECT_TIME_T, &connect);
+    curl_easy_getinfo(curl, CURLINFO_APPCONNECT_TIME_T, &tls);
+    curl_easy_getinfo(curl, CURLINFO_PRETRANSFER_TIME_T, &pretransfer);
+    curl_easy_getinfo(curl, CURLINFO_STARTTRANSFER_TIME_T, &first_byte);
+    curl_easy_getinfo(curl, CURLINFO_TOTAL_TIME_T, &total);
+    curl_easy_getinfo(curl, CURLINFO_SIZE_DOWNLOAD_T, &bytes);
+    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &status);
+
+    char *args = NULL;
+    size_t size = 0;
+    FILE *out = open_memstream(&args, &size);
+    if (out != NULL) {
+        fprintf(out, "{\"status\":%ld,\"result\":", status);
+        json_write_string(out, curl_easy_strerror(res));
+        fprintf(out, ",\"bytes\":%lld,\"dns_us\":%lld,\"connect_us\":%lld,\"tls_us\":%lld,"
+                "\"starttransfer_us\":%lld,\"total_us\":%lld}",
+                (long long)bytes, (long long)dns, (long long)connect, (long long)tls,
+                (long long)first_byte, (long long)total);
+        fclose(out);
+    }
+    add_event(span->category, span->name, span->start_us, end - span->start_us, args);
+
+    // curl's times are cumulative from the start of the transfer, lay them out as phases
+    long long start = span->start_us;
+    add_event("net", "dns", start, dns, NULL);
+    add_event("net", "connect", start + dns, connect - dns, NULL);
+    if (tls > 0) {
+        add_event("net", "tls", start + connect, tls - connect, NULL);
+    }
+    if (first_byte > 0) {
+        add_event("net", "wait", start + pretransfer, first_byte - pretransfer, NULL);
+        add_event("net", "transfer", start + first_byte, total - first_byte, NULL);
+    }
+}
+
+int trace_system(const char *command) {
+    TraceSpan span;
+    trace_begin(&span, "spawn", command);
+    STATS_INC(STAT_PROCESSES_SPAWNED);
+    int result = system(command);
+    char status[32];
+    snprintf(status, sizeof(status), "%d", result);
+    trace_end_detail(&span, "status", status);
+    return result;
+}
+
+void trace_finish() {
+    if (trace_path == NULL) {
+        return;
+    }
+    FILE *out = fopen(trace_path, "w");
+    if (out == NULL) {
+        fprintf(stderr, "Failed to write trace to %s\n", trace_path);
+    } else {
+        int pid = (int)getpid();
+        fprintf(out, "{\"traceEvents\":[\n");
+        fprintf(out, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"kpm\"}}", pid);
+        for (size_t i = 0; i < event_count; i++) {
+            TraceEvent *event = &events[i];
+            fprintf(out, ",\n{\"name\":");
+            json_write_string(out, event->name);
+            fprintf(out, ",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%lld,\"dur\":%lld,\"pid\":%d,\"tid\":%d",
+                    event->category, event->ts, event->dur, pid, event->tid);
+            if (event->args) {
+                fprintf(out, ",\"args\":%s", event->args);
+            }
+            fputc('}', out);
+        }
+        fprintf(out, "\n],\"displayTimeUnit\":\"ms\"}\n");
+        fclose(out);
+    }
+    for (size_t i = 0; i < event_count; i++) {
+        free(events[i].name);
+        free(events[i].args);
+    }
+    free(events);
+    events = NULL;
+    event_count = event_capacity = 0;
+    free(trace_path);
+    trace_path = NULL;
+}
@@ -0,0 +1,24 @@
+#ifndef __TRACE__H
+#define __TRACE__H
+#include <curl/curl.h>
+
+// Scoped timing spans written as Chrome trace events (chrome://tracing,
+// ui.perfetto.dev) when kpm runs with --trace=<file>. Spans cost a branch
+// when tracing is off.
+typedef struct {
+    const char *category;
+    char name[256];
+    long long start_us;
+} TraceSpan;
+
+int trace_start(const char *path);
+int trace_enabled();
+void trace_begin(TraceSpan *span, const char *category, const char *name);
+void trace_end(TraceSpan *span);
+void trace_end_detail(TraceSpan *span, const char *key, const char *value);
+// Ends a span around curl_easy_perform and adds dns/connect/tls/wait/transfer children
+void trace_end_curl(TraceSpan *span, CURL *curl, CURLcode res);
+// system() with a "spawn" span around it
+int trace_system(const char *command);
+void trace_finish();
+#endif //__TRACE__H